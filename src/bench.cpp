@@ -0,0 +1,1302 @@
+/*
+ *  Abuse - dark 2D side-scrolling platform game
+ *  Copyright (c) 1995 Crack dot Com
+ *  Copyright (c) 2005-2011 Sam Hocevar <sam@hocevar.net>
+ *
+ *  This software was released into the Public Domain. As with most public
+ *  domain software, no warranty is made or implied by Crack dot Com, by
+ *  Jonathan Clark, or by Sam Hocevar.
+ */
+
+#if defined HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+
+#include "bench.h"
+#include "lisp.h"
+#include "lisp_gc.h"
+#include "lisp_vm.h"
+#include "chars.h"
+#include "objects.h"
+#include "seq.h"
+#include "loader2.h"
+#include "transimage.h"
+#include "scale.h"
+#include "cache.h"
+#include "specache.h"
+#include "game.h"
+#include "level.h"
+#include "intsect.h"
+#if HAVE_NETWORK
+#   include <unistd.h>
+#   include <signal.h>
+#   include <poll.h>
+#   include <sys/wait.h>
+#   include <sys/stat.h>
+#   include "tcpip.h"
+#   include "fileman.h"
+#   include "nfserver.h"
+#endif
+
+//
+// lisp_calls: user and C function calls through the tree-walker, through
+// the VM without its call site caches, and through the VM. Each mode also
+// runs bench-check, which must give the same result as the tree-walker:
+// the old value of a parameter is saved before the argument sets it, and
+// an extra argument is never evaluated. Last, redefining a function must
+// free its compiled code.
+//
+
+static long bench_add(void *args)
+{
+    return lnumber_value(CAR(args)) + lnumber_value(CAR(CDR(args)));
+}
+
+static void bench_lisp_calls()
+{
+    // Each call of bench-calls makes four more: a user function, the
+    // table dispatched bench-add twice and random through c_caller()
+    static char const *program =
+        "(defun bench-leaf (a b) (+ a b))"
+        "(defun bench-calls (x)"
+        "  (bench-leaf (bench-add x (random 2)) (bench-add 1 x)))"
+        "(defun bench-set (bench-x) bench-x)"
+        "(defun bench-check ()"
+        "  (setq bench-x 'old)"
+        "  (setq bench-extra 'old)"
+        "  (let ((r (bench-set (setq bench-x 'new) (setq bench-extra 'new))))"
+        "    (cons (eq r 'new) (cons (eq bench-x 'old) (eq bench-extra 'old)))))";
+    int const calls_per_iteration = 5;
+    int const iterations = 200000;
+
+    static struct
+    {
+        char const *name;
+        int vm, cache;
+    }
+    const modes[] =
+    {
+        { "tree-walker", 0, 0 },
+        { "vm, no call cache", 1, 0 },
+        { "vm", 1, 1 },
+    };
+
+    LSpace *sp = LSpace::Current;
+    LSpace::Current = &LSpace::Perm;
+
+    if (!LSymbol::Find("bench-add"))
+        add_c_function("bench-add", 2, 2, bench_add);
+    for (char const *s = program; *s; )
+    {
+        while (*s == ' ')
+            s++;
+        LObject *form = LObject::Compile(s);
+        PtrRef r1(form);
+        form->Eval();
+    }
+
+    char const *s = "(bench-calls 3)";
+    LObject *call = LObject::Compile(s);
+    PtrRef r1(call);
+    s = "(bench-check)";
+    LObject *check = LObject::Compile(s);
+    PtrRef r2(check);
+    int expect[3];
+
+    int enabled = LispVM::Enabled, cache = LispVM::CallCache;
+    LSpace::Current = &LSpace::Tmp;
+
+    for (size_t m = 0; m < sizeof(modes) / sizeof(*modes); m++)
+    {
+        LispVM::Enabled = modes[m].vm;
+        LispVM::CallCache = modes[m].cache;
+
+        // Warm up, which also compiles the functions
+        for (int i = 0; i < 1000; i++)
+        {
+            call->Eval();
+            LSpace::Tmp.Clear();
+        }
+
+        Timer t;
+        for (int i = 0; i < iterations; i++)
+        {
+            call->Eval();
+            LSpace::Tmp.Clear();
+        }
+        float ms = t.PollMs();
+
+        LObject *r = check->Eval();
+        int got[3] = { CAR(r) != NULL, CAR(CDR(r)) != NULL,
+                       CDR(CDR(r)) != NULL };
+        LSpace::Tmp.Clear();
+        if (!m)
+            memcpy(expect, got, sizeof(expect));
+
+        printf("bench: lisp_calls, %-18s %8.1f ms  %6.2f M calls/s, "
+               "check %d%d%d %s\n",
+               modes[m].name, ms, ms > 0.0f ? 1e-3f * calls_per_iteration
+                                               * iterations / ms : 0.0f,
+               got[0], got[1], got[2],
+               memcmp(got, expect, sizeof(expect)) ? "MISMATCH" : "ok");
+    }
+
+    // The VM is still enabled from the last mode
+    int before = 0, after = 0;
+    for (LispCode *code = LispVM::List; code; code = code->m_next)
+        before++;
+    int32_t released = LispVM::Stats.released;
+    LSpace::Current = &LSpace::Perm;
+    s = "(defun bench-leaf (a b) (+ b a))";
+    LObject *redefine = LObject::Compile(s);
+    PtrRef r3(redefine);
+    redefine->Eval();
+    LSpace::Current = &LSpace::Tmp;
+    call->Eval();
+    LSpace::Tmp.Clear();
+    for (LispCode *code = LispVM::List; code; code = code->m_next)
+        after++;
+    printf("bench: lisp_calls, redefining bench-leaf: %d compiled functions "
+           "before, %d after, %d freed\n", before, after,
+           LispVM::Stats.released - released);
+
+    LispVM::Enabled = enabled;
+    LispVM::CallCache = cache;
+    LSpace::Current = sp;
+}
+
+//
+// transimage: every sprite of every object drawn in every mode, clipped
+// and unclipped, with each span kernel and with the scalar reference on
+// two copies of the same screen, which must stay identical. Then the
+// kernels are timed on the modes that use them.
+//
+
+static uint32_t bench_seed = 1;
+
+static int bench_rand()
+{
+    bench_seed = bench_seed * 1103515245 + 12345;
+    return (bench_seed >> 16) & 0x7fff;
+}
+
+static int pointer_sorter(void const *a, void const *b)
+{
+    uintptr_t x = (uintptr_t)*(void * const *)a;
+    uintptr_t y = (uintptr_t)*(void * const *)b;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+// The sprites of all object states, both directions, without duplicates
+static TransImage **bench_sprites(int &count)
+{
+    int size = 0;
+    TransImage **ret = NULL;
+
+    count = 0;
+    for (int t = 0; t < total_objects; t++)
+        for (int s = 0; s < figures[t]->ts; s++)
+        {
+            sequence *seq = figures[t]->seq[s];
+            if (!seq)
+                continue;
+            for (int i = 0; i < seq->length(); i++)
+                for (int dir = -1; dir <= 1; dir += 2)
+                {
+                    if (count == size)
+                    {
+                        size = size ? size * 2 : 1024;
+                        ret = (TransImage **)realloc(ret, sizeof(*ret) * size);
+                    }
+                    ret[count++] = seq->get_frame(i, dir);
+                }
+        }
+
+    qsort(ret, count, sizeof(*ret), pointer_sorter);
+    int unique = 0;
+    for (int i = 0; i < count; i++)
+        if (ret[i] && (!unique || ret[i] != ret[unique - 1]))
+            ret[unique++] = ret[i];
+    count = unique;
+
+    return ret;
+}
+
+struct BenchDraw
+{
+    uint8_t *map, *map2, *tint;
+    image *blend;
+    int amount;
+};
+
+static void bench_put(TransImage *im, image *screen, ivec2 pos, int mode,
+                      BenchDraw const &d)
+{
+    switch (mode)
+    {
+    case 0: im->PutImage(screen, pos); break;
+    case 1: im->PutRemap(screen, pos, d.map); break;
+    case 2: im->PutDoubleRemap(screen, pos, d.map, d.map2); break;
+    case 3: im->PutFade(screen, pos, d.amount, 16, color_table, pal); break;
+    case 4: im->PutFadeTint(screen, pos, d.amount, 16, d.tint,
+                            color_table, pal); break;
+    case 5: im->PutColor(screen, pos, d.amount); break;
+    case 6: im->PutFilled(screen, pos, d.amount); break;
+    case 7: im->PutPredator(screen, pos); break;
+    case 8: im->PutBlend(screen, pos, d.blend, ivec2(0), d.amount,
+                         color_table, pal); break;
+    case 9: im->PutScanLine(screen, pos, d.amount); break;
+    }
+}
+
+static void bench_transimage()
+{
+    static char const *mode_names[] =
+    {
+        "normal", "remap", "remap2", "fade", "fade_tint", "color", "filled",
+        "predator", "blend", "scanline"
+    };
+    int const modes = sizeof(mode_names) / sizeof(*mode_names);
+    int const timed[] = { 1, 2, 3, 4, 8 };
+    int const iterations = 20;
+
+    if (!pal || !color_table)
+    {
+        printf("bench: transimage, no palette or color table loaded\n");
+        return;
+    }
+
+    int count;
+    TransImage **sprites = bench_sprites(count);
+    if (!count)
+    {
+        printf("bench: transimage, no sprites loaded\n");
+        free(sprites);
+        return;
+    }
+
+    ivec2 size(640, 480);
+    image *a = new image(size), *b = new image(size), *blend = new image(size);
+    uint8_t map[256], map2[256], tint[256];
+    for (int i = 0; i < 256; i++)
+    {
+        map[i] = bench_rand();
+        map2[i] = bench_rand();
+        tint[i] = bench_rand();
+    }
+    for (int y = 0; y < size.y; y++)
+        for (int x = 0; x < size.x; x++)
+        {
+            a->scan_line(y)[x] = bench_rand();
+            blend->scan_line(y)[x] = bench_rand();
+        }
+
+    BenchDraw d = { map, map2, tint, blend, 0 };
+    int old = TransImage::GetKernel();
+    int scalar = TransImage::KernelCount() - 1;
+
+    size_t bytes = 0, index = 0;
+    for (int i = 0; i < count; i++)
+    {
+        bytes += sprites[i]->DiskUsage();
+        index += sprites[i]->IndexUsage();
+    }
+    printf("bench: transimage, %d sprites, %s kernel picked\n", count,
+           TransImage::KernelName(old));
+    printf("bench: transimage, %dk in sprites, line index %dk "
+           "(%.1f bytes per sprite)\n", (int)(bytes >> 10), (int)(index >> 10),
+           (float)index / count);
+
+    for (int k = 0; k < scalar; k++)
+    {
+        if (!TransImage::KernelName(k))
+            continue;
+
+        int checks = 0, mismatches = 0;
+        for (int y = 0; y < size.y; y++)
+            memcpy(b->scan_line(y), a->scan_line(y), size.x);
+
+        for (int i = 0; i < count; i++)
+        {
+            ivec2 s = sprites[i]->Size();
+            // Unclipped, then clipped on each side
+            ivec2 const where[] =
+            {
+                ivec2(bench_rand() % (size.x - s.x + 1),
+                      bench_rand() % (size.y - s.y + 1)),
+                ivec2(-s.x / 2, -s.y / 3),
+                ivec2(size.x - s.x / 3, size.y - s.y / 2),
+            };
+
+            for (int m = 0; m < modes; m++)
+                for (size_t w = 0; w < sizeof(where) / sizeof(*where); w++)
+                {
+                    d.amount = bench_rand() % 16;
+                    if (m == 9)
+                        d.amount %= Max(s.y, 1);
+
+                    TransImage::SetKernel(scalar);
+                    bench_put(sprites[i], a, where[w], m, d);
+                    TransImage::SetKernel(k);
+                    bench_put(sprites[i], b, where[w], m, d);
+                    checks++;
+
+                    int differ = 0;
+                    for (int y = 0; y < size.y; y++)
+                        if (memcmp(a->scan_line(y), b->scan_line(y), size.x))
+                        {
+                            memcpy(b->scan_line(y), a->scan_line(y), size.x);
+                            differ = 1;
+                        }
+                    if (differ && !mismatches++)
+                        printf("bench: transimage, %s differs from scalar "
+                               "in %s mode\n", TransImage::KernelName(k),
+                               mode_names[m]);
+                }
+        }
+
+        printf("bench: transimage, %-8s %d draws checked, %d mismatches\n",
+               TransImage::KernelName(k), checks, mismatches);
+    }
+
+    for (size_t m = 0; m < sizeof(timed) / sizeof(*timed); m++)
+        for (int k = 0; k <= scalar; k++)
+        {
+            if (!TransImage::KernelName(k))
+                continue;
+            TransImage::SetKernel(k);
+            d.amount = 7;
+
+            Timer t;
+            for (int n = 0; n < iterations; n++)
+                for (int i = 0; i < count; i++)
+                {
+                    ivec2 s = sprites[i]->Size();
+                    ivec2 pos(i * 37 % Max(size.x - s.x, 1),
+                              i * 23 % Max(size.y - s.y, 1));
+                    bench_put(sprites[i], a, pos, timed[m], d);
+                }
+            float ms = t.PollMs();
+
+            printf("bench: transimage, %-9s %-8s %8.1f ms  %7.1f sprites/ms\n",
+                   mode_names[timed[m]], TransImage::KernelName(k), ms,
+                   ms > 0.0f ? iterations * count / ms : 0.0f);
+        }
+
+    TransImage::SetKernel(old);
+    delete a;
+    delete b;
+    delete blend;
+    free(sprites);
+}
+
+//
+// dirty: a 640x480 screen with a few windows moving around, marking their
+// old and new positions dirty, and the frontmost one deleted as when it is
+// drawn straight to the screen. Reports the cost of a frame's dirty areas
+// and how much of the screen gets updated.
+//
+
+static void bench_dirty_put(ivec2 aa, ivec2 bb, void *data)
+{
+    *(int64_t *)data += (bb.x - aa.x) * (bb.y - aa.y);
+}
+
+static void bench_dirty()
+{
+    int const frames = 100000;
+    ivec2 const size(640, 480);
+    image_descriptor d(size, 1);
+    ivec2 pos[4], win[4];
+
+    bench_seed = 1;
+    for (int i = 0; i < 4; i++)
+    {
+        win[i] = ivec2(60 + bench_rand() % 200, 40 + bench_rand() % 150);
+        pos[i] = ivec2(bench_rand() % size.x, bench_rand() % size.y);
+    }
+
+    DirtyStats old = image_descriptor::Stats;
+    int64_t area = 0;
+    Timer t;
+    for (int n = 0; n < frames; n++)
+    {
+        for (int i = 0; i < 4; i++)
+        {
+            d.AddDirty(pos[i], pos[i] + win[i]);
+            pos[i] += ivec2(bench_rand() % 9 - 4, bench_rand() % 9 - 4);
+            pos[i] = Max(Min(pos[i], size), ivec2(-win[i].x, -win[i].y));
+            d.AddDirty(pos[i], pos[i] + win[i]);
+        }
+        // Mouse cursor, then the frontmost window drawn directly
+        ivec2 m(bench_rand() % size.x, bench_rand() % size.y);
+        d.AddDirty(m, m + ivec2(16));
+        d.DeleteDirty(pos[3], pos[3] + win[3]);
+        d.FlushDirties(bench_dirty_put, &area);
+    }
+    float ms = t.PollMs();
+
+    DirtyStats const &s = image_descriptor::Stats;
+    printf("bench: dirty, %d frames, %.0f ns/frame, %.1f rects/frame, "
+           "%.1f%% of screen area updated\n", frames,
+           1e6f * ms / frames, (float)(s.rects - old.rects) / frames,
+           100.0 * area / ((double)frames * size.x * size.y));
+}
+
+//
+// present: a 320x200 screen scaled to the window with the per-pixel loop
+// put_part_image() used to have and with the scaling kernels, to 8 bits
+// and, for the textured modes, to 32 bits with the palette lookup done in
+// the same pass instead of in a second conversion pass. Integer scales
+// must repeat every pixel exactly, other ones must match the old loop.
+//
+
+static void bench_present_ref(uint8_t *dst, int dpitch, ivec2 dsize,
+                              uint8_t const *src, int spitch, ivec2 ssize)
+{
+    int xstep = (ssize.x << 16) / dsize.x;
+    int ystep = (ssize.y << 16) / dsize.y;
+
+    for (int y = 0, sy = 0; y < dsize.y; y++, sy += ystep)
+        for (int x = 0, sx = 0; x < dsize.x; x++, sx += xstep)
+            memcpy(dst + y * dpitch + x,
+                   src + (sy >> 16) * spitch + (sx >> 16), 1);
+}
+
+static void bench_present()
+{
+    int const iterations = 200;
+    ivec2 const size(320, 200);
+    ivec2 const windows[] =
+    {
+        size * 2, size * 3, size * 4, ivec2(800, 500),
+    };
+
+    uint8_t *src = (uint8_t *)malloc(size.x * size.y);
+    uint32_t pal32[256];
+    bench_seed = 1;
+    for (int i = 0; i < size.x * size.y; i++)
+        src[i] = bench_rand();
+    for (int i = 0; i < 256; i++)
+        pal32[i] = 0xff000000 | (i * 0x010101);
+
+    for (size_t w = 0; w < sizeof(windows) / sizeof(*windows); w++)
+    {
+        ivec2 d = windows[w];
+        int k = scale_factor(size, d);
+        uint8_t *a = (uint8_t *)malloc(d.x * d.y);
+        uint8_t *b = (uint8_t *)malloc(d.x * d.y);
+        uint32_t *c = (uint32_t *)malloc(sizeof(uint32_t) * d.x * d.y);
+
+        scale_image8(a, d.x, d, src, size.x, size);
+        scale_image32(c, d.x, d, src, size.x, size, pal32);
+        if (k)
+            for (int y = 0; y < d.y; y++)
+                for (int x = 0; x < d.x; x++)
+                    b[y * d.x + x] = src[y / k * size.x + x / k];
+        else
+            bench_present_ref(b, d.x, d, src, size.x, size);
+
+        int mismatches = 0;
+        for (int i = 0; i < d.x * d.y; i++)
+            if (a[i] != b[i] || c[i] != pal32[b[i]])
+                mismatches++;
+
+        Timer t1;
+        for (int n = 0; n < iterations; n++)
+            bench_present_ref(b, d.x, d, src, size.x, size);
+        float ref_ms = t1.PollMs() / iterations;
+
+        Timer t2;
+        for (int n = 0; n < iterations; n++)
+            scale_image8(a, d.x, d, src, size.x, size);
+        float fast_ms = t2.PollMs() / iterations;
+
+        // The old textured path converted the whole scaled surface after
+        // scaling it
+        Timer t3;
+        for (int n = 0; n < iterations; n++)
+        {
+            bench_present_ref(b, d.x, d, src, size.x, size);
+            for (int i = 0; i < d.x * d.y; i++)
+                c[i] = pal32[b[i]];
+        }
+        float ref32_ms = t3.PollMs() / iterations;
+
+        Timer t4;
+        for (int n = 0; n < iterations; n++)
+            scale_image32(c, d.x, d, src, size.x, size, pal32);
+        float fast32_ms = t4.PollMs() / iterations;
+
+        printf("bench: present, %4dx%-4d %d mismatches, 8 bits %.3f ms -> "
+               "%.3f ms, 32 bits %.3f ms -> %.3f ms\n", d.x, d.y,
+               mismatches, ref_ms, fast_ms, ref32_ms, fast32_ms);
+
+        free(a);
+        free(b);
+        free(c);
+    }
+
+    free(src);
+}
+
+//
+// spec_index: the directories of every file registered at startup, read
+// from the files as on a first startup and then from an index saved from
+// them, as on the next ones. Those from the index must match the files.
+//
+
+static int bench_spec_same(spec_directory *a, spec_directory *b)
+{
+    if (!a || !b || a->total != b->total)
+        return a == b;
+    for (int i = 0; i < a->total; i++)
+    {
+        spec_entry *x = a->entries[i], *y = b->entries[i];
+        if (strcmp(x->name, y->name) || x->type != y->type
+             || x->size != y->size || x->offset != y->offset)
+            return 0;
+    }
+    return 1;
+}
+
+static void bench_spec_index()
+{
+    int count = crc_manager.total_filenames();
+    spec_directory **ref = (spec_directory **)malloc(sizeof(spec_directory *)
+                                                     * Max(count, 1));
+    for (int i = 0; i < count; i++)
+    {
+        bFILE *fp = open_file(crc_manager.get_filename(i), "rb");
+        ref[i] = fp->open_failure() ? NULL : new spec_directory(fp);
+        delete fp;
+    }
+
+    char *path = (char *)malloc(strlen(get_save_filename_prefix()) + 20 + 1);
+    sprintf(path, "%sspec_index_bench.bin", get_save_filename_prefix());
+    int enabled = sd_cache.index_enabled;
+
+    sd_cache.index_enabled = 0;
+    sd_cache.clear();
+    Timer t1;
+    for (int i = 0; i < count; i++)
+        sd_cache.get_spec_directory(crc_manager.get_filename(i));
+    float parse_ms = t1.PollMs();
+    sd_cache.save_index(path);
+
+    sd_cache.index_enabled = 1;
+    sd_cache.index_hits = sd_cache.index_misses = 0;
+    sd_cache.clear();
+    Timer t2;
+    sd_cache.load_index(path);
+    for (int i = 0; i < count; i++)
+        sd_cache.get_spec_directory(crc_manager.get_filename(i));
+    float index_ms = t2.PollMs();
+
+    int mismatches = 0;
+    for (int i = 0; i < count; i++)
+        mismatches += !bench_spec_same(ref[i],
+                           sd_cache.get_spec_directory(crc_manager.get_filename(i)));
+
+    printf("bench: spec_index, %d files, %d from the index, %d mismatches, "
+           "parse %.2f ms, index %.2f ms\n", count, sd_cache.index_hits,
+           mismatches, parse_ms, index_ms);
+
+    sd_cache.clear();
+    sd_cache.free_index();
+    sd_cache.index_enabled = enabled;
+    remove(path);
+    free(path);
+    for (int i = 0; i < count; i++)
+        delete ref[i];
+    free(ref);
+}
+
+//
+// rays: random lines on shipped levels, from a tile's length to half the
+// screen, like weapons, projectiles and line of sight checks cast, through
+// level::foreground_intersect() and through the scan of every map position
+// in the line's bounding box it used to do. Both must stop every line at
+// the same place.
+//
+
+extern int32_t last_tile_hit_x, last_tile_hit_y;
+
+static void bench_rays_ref(level *l, int32_t x1, int32_t y1,
+                           int32_t &x2, int32_t &y2)
+{
+    int32_t tl = the_game->ftile_width(), th = the_game->ftile_height();
+    ivec2 b1(Min(x1, x2), Min(y1, y2)), b2(Max(x1, x2), Max(y1, y2));
+    b1 = ivec2((b1.x - 2) / tl - 1, (b1.y - 2) / th - 1);
+    b2 = ivec2((b2.x + tl + 2) / tl + 1, (b2.y + th + 2) / th + 1);
+
+    if (b2.x >= l->foreground_width())
+        x2 = tl * l->foreground_width() - 1;
+    if (b2.y >= l->foreground_height())
+        y2 = th * l->foreground_height() - 1;
+    b1 = Max(b1, ivec2(0));
+
+    for (int bx = b1.x; bx <= b2.x; bx++)
+        for (int by = b1.y; by <= b2.y; by++)
+        {
+            int block = the_game->GetMapFg(ivec2(bx, by));
+            if (block <= BLACK)
+                continue;
+
+            boundary *points = the_game->get_fg(block)->points;
+            uint8_t *p = points->data;
+            for (int j = 0; j < points->tot - 1; j++, p += 2)
+            {
+                int32_t xp1 = p[0] == 0 ? -1 : p[0] == tl - 1 ? tl + 1 : p[0];
+                int32_t yp1 = p[1] == 0 ? -1 : p[1] == th - 1 ? th + 1 : p[1];
+                int32_t xp2 = p[2] == 0 ? -1 : p[2] == tl - 1 ? tl + 1 : p[2];
+                int32_t yp2 = p[3] == 0 ? -1 : p[3] == th - 1 ? th + 1 : p[3];
+                if (setback_intersect(x1, y1, x2, y2, bx * tl + xp1,
+                                      by * th + yp1, bx * tl + xp2,
+                                      by * th + yp2,
+                                      points->inside[j] ? 1 : -1))
+                {
+                    last_tile_hit_x = bx;
+                    last_tile_hit_y = by;
+                }
+            }
+        }
+}
+
+static void bench_rays()
+{
+    int const count = 20000;
+    int32_t *rays = (int32_t *)malloc(sizeof(int32_t) * 4 * count);
+    level *old_level = current_level;
+    int64_t total = 0;
+    float total_ref_ms = 0.0f, total_ms = 0.0f;
+
+    for (int n = 0; n < 22; n++)
+    {
+        char name[64];
+        sprintf(name, "levels/level%02d.spe", n);
+        bFILE *fp = open_file(name, "rb");
+        if (fp->open_failure())
+        {
+            delete fp;
+            continue;
+        }
+        spec_directory sd(fp);
+        current_level = new level(&sd, fp, name);
+        delete fp;
+
+        ivec2 size(current_level->foreground_width() * the_game->ftile_width(),
+                   current_level->foreground_height() * the_game->ftile_height());
+        bench_seed = n + 1;
+        for (int i = 0; i < count; i++)
+        {
+            int len = (i & 3) ? 30 + bench_rand() % 300 : bench_rand() % 30;
+            rays[i * 4] = bench_rand() % size.x;
+            rays[i * 4 + 1] = bench_rand() % size.y;
+            rays[i * 4 + 2] = rays[i * 4] + bench_rand() % (2 * len + 1) - len;
+            rays[i * 4 + 3] = rays[i * 4 + 1] + bench_rand() % (2 * len + 1) - len;
+        }
+
+        int mismatches = 0, hits = 0;
+        for (int i = 0; i < count; i++)
+        {
+            int32_t *r = rays + i * 4, x2 = r[2], y2 = r[3], rx2 = r[2], ry2 = r[3];
+            last_tile_hit_x = last_tile_hit_y = -1;
+            current_level->foreground_intersect(r[0], r[1], x2, y2);
+            ivec2 hit(last_tile_hit_x, last_tile_hit_y);
+            last_tile_hit_x = last_tile_hit_y = -1;
+            bench_rays_ref(current_level, r[0], r[1], rx2, ry2);
+            hits += x2 != r[2] || y2 != r[3];
+            mismatches += x2 != rx2 || y2 != ry2
+                           || hit != ivec2(last_tile_hit_x, last_tile_hit_y);
+        }
+
+        Timer t1;
+        for (int i = 0; i < count; i++)
+        {
+            int32_t *r = rays + i * 4, x2 = r[2], y2 = r[3];
+            bench_rays_ref(current_level, r[0], r[1], x2, y2);
+        }
+        float ref_ms = t1.PollMs();
+
+        Timer t2;
+        for (int i = 0; i < count; i++)
+        {
+            int32_t *r = rays + i * 4, x2 = r[2], y2 = r[3];
+            current_level->foreground_intersect(r[0], r[1], x2, y2);
+        }
+        float ms = t2.PollMs();
+
+        printf("bench: rays, %s, %d rays, %d hits, %d mismatches, "
+               "%.0fk -> %.0fk rays/s\n", name, count, hits, mismatches,
+               count / Max(ref_ms, 0.001f), count / Max(ms, 0.001f));
+        total += count;
+        total_ref_ms += ref_ms;
+        total_ms += ms;
+
+        delete current_level;
+    }
+    current_level = old_level;
+
+    printf("bench: rays, all levels, %.0fk -> %.0fk rays/s\n",
+           total / Max(total_ref_ms, 0.001f), total / Max(total_ms, 0.001f));
+    free(rays);
+}
+
+//
+// edges: random lines across every foreground tile, at random places on
+// the map, through setback_intersect() with each of the tile's segments
+// in turn and through setback_intersect_edges(). Both must leave every
+// line at the same place after the same number of hits.
+//
+
+static int bench_edges_ref(foretile *f, int32_t x1, int32_t y1,
+                           int32_t &x2, int32_t &y2, int32_t xo, int32_t yo)
+{
+    int32_t tl = the_game->ftile_width(), th = the_game->ftile_height();
+    uint8_t *p = f->points->data;
+    int hits = 0;
+    for (int j = 0; j < f->points->tot - 1; j++, p += 2)
+    {
+        int32_t ox2 = x2, oy2 = y2;
+        setback_intersect(x1, y1, x2, y2,
+            xo + (p[0] == 0 ? -1 : p[0] == tl - 1 ? tl + 1 : p[0]),
+            yo + (p[1] == 0 ? -1 : p[1] == th - 1 ? th + 1 : p[1]),
+            xo + (p[2] == 0 ? -1 : p[2] == tl - 1 ? tl + 1 : p[2]),
+            yo + (p[3] == 0 ? -1 : p[3] == th - 1 ? th + 1 : p[3]),
+            f->points->inside[j] ? 1 : -1);
+        hits += ox2 != x2 || oy2 != y2;
+    }
+    return hits;
+}
+
+static void bench_edges()
+{
+    int const count = 1000;
+    int32_t tl = the_game->ftile_width(), th = the_game->ftile_height();
+    int32_t *lines = (int32_t *)malloc(sizeof(int32_t) * 4 * count);
+    int tiles = 0, mismatches = 0, hits = 0;
+    float ref_ms = 0.0f, ms = 0.0f;
+
+    bench_seed = 1;
+    for (int n = 0; n < nforetiles; n++)
+    {
+        if (foretiles[n] < 0)
+            continue;
+        foretile *f = the_game->get_fg(n);
+        EdgeList *e = f->get_edges(tl, th);
+        int32_t xo = (bench_rand() % 200) * tl, yo = (bench_rand() % 200) * th;
+        tiles++;
+
+        // Mostly lines ending near or in the tile, some straight
+        for (int i = 0; i < count; i++)
+        {
+            int32_t *l = lines + i * 4;
+            l[0] = xo + bench_rand() % (tl + 20) - 10;
+            l[1] = yo + bench_rand() % (th + 20) - 10;
+            l[2] = (i % 5) ? xo + bench_rand() % (tl + 20) - 10 : l[0];
+            l[3] = (i % 7) ? yo + bench_rand() % (th + 20) - 10 : l[1];
+        }
+
+        for (int i = 0; i < count; i++)
+        {
+            int32_t *l = lines + i * 4, x2 = l[2], y2 = l[3], rx2 = l[2], ry2 = l[3];
+            int h = setback_intersect_edges(l[0], l[1], x2, y2, e, xo, yo);
+            int rh = bench_edges_ref(f, l[0], l[1], rx2, ry2, xo, yo);
+            mismatches += x2 != rx2 || y2 != ry2 || h != rh;
+            hits += rh > 0;
+        }
+
+        Timer t1;
+        for (int i = 0; i < count; i++)
+        {
+            int32_t *l = lines + i * 4, x2 = l[2], y2 = l[3];
+            bench_edges_ref(f, l[0], l[1], x2, y2, xo, yo);
+        }
+        ref_ms += t1.PollMs();
+
+        Timer t2;
+        for (int i = 0; i < count; i++)
+        {
+            int32_t *l = lines + i * 4, x2 = l[2], y2 = l[3];
+            setback_intersect_edges(l[0], l[1], x2, y2, e, xo, yo);
+        }
+        ms += t2.PollMs();
+    }
+
+    printf("bench: edges, %d tiles, %d lines, %d hit, %d mismatches, "
+           "%.1f ms -> %.1f ms\n", tiles, tiles * count, hits, mismatches,
+           ref_ms, ms);
+    free(lines);
+}
+
+#if HAVE_NETWORK
+//
+// net_reactor: a game server's sockets on loopback, with 8 and 32 clients
+// that each keep a connection open like player_client::comm and send one
+// datagram a tick to the game socket. A tick lasts until the server has
+// read them all, one per select() like game_server::process_net() does,
+// checking every client connection each time. Once with ::select and once
+// with epoll.
+//
+
+static void bench_net_reactor()
+{
+    static int const client_counts[] = { 8, 32 };
+    int const ticks = 2000;
+    int old_epoll = tcpip.use_epoll;
+
+    // The ports of the last run may still be in TIME_WAIT
+    net_socket *listener = NULL, *game = NULL;
+    int port;
+    for (port = 47650; port < 47700; port += 2)
+    {
+        listener = tcpip.create_listen_socket(port, net_socket::SOCKET_SECURE);
+        game = tcpip.create_listen_socket(port + 1, net_socket::SOCKET_FAST);
+        if (listener && game)
+            break;
+        delete listener;
+        delete game;
+        listener = game = NULL;
+    }
+    char const *name = "127.0.0.1";
+    net_address *addr = tcpip.get_node_address(name, port, 1);
+    if (!listener || !addr)
+    {
+        printf("bench: net_reactor, no free ports\n");
+        delete listener;
+        delete game;
+        delete addr;
+        return;
+    }
+    net_address *game_addr = addr->copy();
+    game_addr->set_port(port + 1);
+    listener->read_selectable();
+    game->read_selectable();
+
+    for (int n = 0; n < 2; n++)
+    {
+        int count = client_counts[n];
+        net_socket *comm[32], *client_comm[32], *data[32];
+        for (int i = 0; i < count; i++)
+        {
+            net_address *from;
+            client_comm[i] = tcpip.connect_to_server(addr);
+            data[i] = tcpip.connect_to_server(game_addr, net_socket::SOCKET_FAST);
+            comm[i] = listener->accept(from);
+            delete from;
+            comm[i]->read_selectable();
+        }
+
+        for (int mode = 0; mode < 2; mode++)
+        {
+            if (mode && !tcpip.has_epoll())
+                break;
+            tcpip.use_epoll = mode;
+
+            float total_ms = 0.0f, worst_ms = 0.0f;
+            int selects = 0, bad = 0;
+            for (int t = 0; t < ticks; t++)
+            {
+                Timer timer;
+                for (int i = 0; i < count; i++)
+                    data[i]->write(&t, sizeof(t));
+                for (int got = 0; got < count; )
+                {
+                    selects++;
+                    if (!tcpip.select(0))
+                        continue;
+                    if (game->ready_to_read())
+                    {
+                        int x;
+                        net_address *from;
+                        if (game->read(&x, sizeof(x), &from) == sizeof(x))
+                        {
+                            bad += x != t;
+                            got++;
+                        }
+                        delete from;
+                    }
+                    for (int i = 0; i < count; i++)
+                        bad += comm[i]->error() || comm[i]->ready_to_read();
+                }
+                float ms = timer.PollMs();
+                total_ms += ms;
+                worst_ms = Max(worst_ms, ms);
+            }
+
+            printf("bench: net_reactor, %d clients, %s: %.1f us/tick, "
+                   "worst %.1f us, %.1f selects/tick, %d errors\n", count,
+                   mode ? "epoll" : "select", total_ms * 1000.0f / ticks,
+                   worst_ms * 1000.0f, (float)selects / ticks, bad);
+        }
+
+        for (int i = 0; i < count; i++)
+        {
+            delete comm[i];
+            delete client_comm[i];
+            delete data[i];
+        }
+    }
+
+    tcpip.use_epoll = old_epoll;
+    delete game_addr;
+    delete addr;
+    delete game;
+    delete listener;
+}
+
+//
+// net_files: a joining client reading the first data files registered at
+// startup from a file server on loopback, the directory of each and then
+// every entry, like the cache loads them. The server is a child process
+// serving requests as often as it can, like while game_server waits for
+// players, or once a frame like in a game, and a proxy child holds the
+// data going either way for half the round trip. Once reading one buffer
+// at a time with NFCMD_READ and once reading ahead. What is read must
+// match the local files.
+//
+
+extern net_protocol *prot;
+
+struct bench_chunk
+{
+    float due;
+    int size;
+    char data[16384];
+};
+
+struct bench_pipe
+{
+    int from, to;
+    bench_chunk *chunks; // ring of 64
+    int first, count;
+};
+
+static net_socket *bench_listen(int &port)
+{
+    // The ports of the last run may still be in TIME_WAIT
+    for (port = 47700; port < 47750; port++)
+    {
+        net_socket *s = tcpip.create_listen_socket(port,
+                                                   net_socket::SOCKET_SECURE);
+        if (s)
+            return s;
+    }
+    return NULL;
+}
+
+static void bench_files_server(net_socket *listener, float frame_ms,
+                               char const *work)
+{
+    signal(SIGPIPE, SIG_IGN);
+    if (chdir(work) < 0) // where the server logs the files opened
+        _exit(1);
+    tcpip.use_epoll = 0; // the epoll set is shared with the parent
+    char a0[] = "abuse", a1[] = "-bastard"; // absolute names
+    char *argv[] = { a0, a1 };
+    file_manager fm(2, argv, &tcpip);
+    listener->read_selectable();
+
+    Timer frame;
+    for (;;)
+    {
+        if (tcpip.select(0))
+        {
+            if (listener->ready_to_read())
+            {
+                net_address *from;
+                net_socket *s = listener->accept(from);
+                delete from;
+                uint8_t type;
+                if (s && s->read(&type, 1) == 1 && type == CLIENT_NFS)
+                    fm.add_nfs_client(s);
+                else
+                    delete s;
+            }
+            fm.process_net();
+        }
+        if (frame_ms > 0.0f)
+        {
+            frame.WaitMs(frame_ms);
+            frame.GetMs();
+        }
+    }
+}
+
+static void bench_files_proxy(int listen_fd, int server_port, float delay_ms)
+{
+    signal(SIGPIPE, SIG_IGN);
+    bench_pipe pipes[8];
+    int npipes = 0;
+    Timer clock;
+
+    for (;;)
+    {
+        struct pollfd p[17];
+        p[0].fd = listen_fd;
+        p[0].events = POLLIN;
+        float wait = -1.0f, now = clock.PollMs();
+        for (int i = 0; i < npipes; i++)
+        {
+            p[i + 1].fd = pipes[i].from;
+            p[i + 1].events = pipes[i].count < 64 ? POLLIN : 0;
+            if (pipes[i].count)
+            {
+                float due = pipes[i].chunks[pipes[i].first].due - now;
+                wait = wait < 0.0f ? Max(due, 0.0f) : Min(wait, Max(due, 0.0f));
+            }
+        }
+        poll(p, npipes + 1, wait < 0.0f ? -1 : (int)(wait + 1.0f));
+        now = clock.PollMs();
+
+        int closed = -1;
+        for (int i = 0; i < npipes; i++)
+        {
+            bench_pipe &b = pipes[i];
+            if (p[i + 1].revents && b.count < 64)
+            {
+                bench_chunk &c = b.chunks[(b.first + b.count) % 64];
+                c.size = read(b.from, c.data, sizeof(c.data));
+                if (c.size <= 0)
+                    closed = i & ~1;
+                else
+                {
+                    c.due = now + delay_ms;
+                    b.count++;
+                }
+            }
+            while (b.count && b.chunks[b.first].due <= now)
+            {
+                bench_chunk &c = b.chunks[b.first];
+                for (int done = 0, n; done < c.size; done += n)
+                    if ((n = write(b.to, c.data + done, c.size - done)) <= 0)
+                        break;
+                b.first = (b.first + 1) % 64;
+                b.count--;
+            }
+        }
+
+        // Either side closing closes both
+        if (closed >= 0)
+        {
+            close(pipes[closed].from);
+            close(pipes[closed].to);
+            for (int i = closed; i < closed + 2; i++)
+                free(pipes[i].chunks);
+            for (int i = closed; i + 2 < npipes; i++)
+                pipes[i] = pipes[i + 2];
+            npipes -= 2;
+        }
+
+        if ((p[0].revents & POLLIN) && npipes + 2 <= 8)
+        {
+            int c = accept(listen_fd, NULL, NULL);
+            int s = socket(AF_INET, SOCK_STREAM, 0);
+            sockaddr_in addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(server_port);
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            if (c >= 0 && connect(s, (sockaddr *)&addr, sizeof(addr)) == 0)
+            {
+                int one = 1;
+                setsockopt(c, IPPROTO_TCP, TCP_NODELAY, (char *)&one, sizeof(one));
+                setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (char *)&one, sizeof(one));
+                for (int i = 0; i < 2; i++)
+                {
+                    bench_pipe &b = pipes[npipes++];
+                    b.from = i ? s : c;
+                    b.to = i ? c : s;
+                    b.chunks = (bench_chunk *)malloc(sizeof(bench_chunk) * 64);
+                    b.first = b.count = 0;
+                }
+            }
+            else
+            {
+                close(c);
+                close(s);
+            }
+        }
+    }
+}
+
+static uint32_t bench_files_read(bFILE *fp, uint8_t *buf, size_t size)
+{
+    if (fp->open_failure())
+        return 0;
+    spec_directory sd(fp);
+    uint32_t sum = sd.total;
+    for (int i = 0; i < sd.total; i++)
+    {
+        spec_entry *e = sd.entries[i];
+        size_t n = Min((size_t)e->size, size);
+        fp->seek(e->offset, SEEK_SET);
+        memset(buf, 0, n);
+        fp->read(buf, n);
+        for (size_t j = 0; j < n; j++)
+            sum = sum * 31 + buf[j];
+    }
+    return sum;
+}
+
+static void bench_net_files()
+{
+    static struct { float frame_ms, rtt_ms; } const runs[] =
+    {
+        { 0.0f, 0.0f }, { 0.0f, 50.0f }, { 1000.0f / 15.0f, 50.0f },
+    };
+    size_t const max_bytes = 256 << 10, buf_size = 1 << 20;
+
+    // Absolute names, the server runs somewhere else
+    char dir[256] = "", work[256];
+    char const *prefix = get_filename_prefix() ? get_filename_prefix() : "";
+    if (prefix[0] != '/' && getcwd(dir, sizeof(dir) - 2))
+        strcat(dir, "/");
+    strncat(dir, prefix, sizeof(dir) - strlen(dir) - 1);
+    snprintf(work, sizeof(work), "%snet_files_bench",
+             get_save_filename_prefix());
+    mkdir(work, S_IRWXU);
+
+    int count = 0, files[64];
+    size_t bytes = 0;
+    uint32_t sums[64];
+    uint8_t *buf = (uint8_t *)malloc(buf_size);
+    Timer local;
+    for (int i = 0; i < crc_manager.total_filenames() && count < 64
+                     && bytes < max_bytes; i++)
+    {
+        bFILE *fp = open_file(crc_manager.get_filename(i), "rb");
+        if (!fp->open_failure())
+        {
+            bytes += fp->file_size();
+            files[count] = i;
+            sums[count++] = bench_files_read(fp, buf, buf_size);
+        }
+        delete fp;
+    }
+    float local_ms = local.PollMs();
+
+    net_protocol *old_prot = prot;
+    file_manager *old_fman = fman;
+    int old_read_ahead = net_read_ahead;
+    prot = &tcpip;
+    fman = new file_manager(0, NULL, &tcpip);
+
+    for (size_t r = 0; r < sizeof(runs) / sizeof(*runs); r++)
+    {
+        float ms[2];
+        int mismatches = 0;
+        for (int mode = 0; mode < 2; mode++)
+        {
+            int server_port, proxy_port;
+            net_socket *server = bench_listen(server_port);
+            net_socket *proxy = server ? bench_listen(proxy_port) : NULL;
+            if (!proxy)
+            {
+                printf("bench: net_files, no free ports\n");
+                delete server;
+                r = sizeof(runs) / sizeof(*runs);
+                break;
+            }
+
+            fflush(stdout);
+            pid_t server_pid = fork();
+            if (!server_pid)
+                bench_files_server(server, runs[r].frame_ms, work);
+            pid_t proxy_pid = fork();
+            if (!proxy_pid)
+                bench_files_proxy(proxy->get_fd(), server_port,
+                                  runs[r].rtt_ms / 2.0f);
+            delete server;
+            delete proxy;
+
+            net_read_ahead = mode ? NF_CACHE_BLOCKS / 2 : 0;
+            Timer t;
+            for (int i = 0; i < count; i++)
+            {
+                char remote[512];
+                snprintf(remote, sizeof(remote), "//localhost:%d/%s%s",
+                         proxy_port, dir, crc_manager.get_filename(files[i]));
+                bFILE *fp = open_nfs_file(remote, "rb");
+                mismatches += bench_files_read(fp, buf, buf_size) != sums[i];
+                delete fp;
+            }
+            ms[mode] = t.PollMs();
+
+            kill(server_pid, SIGKILL);
+            kill(proxy_pid, SIGKILL);
+            waitpid(server_pid, NULL, 0);
+            waitpid(proxy_pid, NULL, 0);
+        }
+        if (r == sizeof(runs) / sizeof(*runs))
+            break;
+
+        printf("bench: net_files, %d files, %d KiB, server %s, %.0f ms round "
+               "trip: local %.1f ms, one read at a time %.0f ms, read ahead "
+               "%.0f ms, %d mismatches\n", count, (int)(bytes >> 10),
+               runs[r].frame_ms > 0.0f ? "in a game" : "waiting",
+               runs[r].rtt_ms, local_ms, ms[0], ms[1], mismatches);
+    }
+
+    delete fman;
+    fman = old_fman;
+    prot = old_prot;
+    net_read_ahead = old_read_ahead;
+    free(buf);
+    char log[300];
+    snprintf(log, sizeof(log), "%s/open.log", work);
+    remove(log);
+    rmdir(work);
+}
+#endif
+
+static struct
+{
+    char const *name;
+    void (*run)();
+}
+const benches[] =
+{
+    { "lisp_calls", bench_lisp_calls },
+    { "transimage", bench_transimage },
+    { "dirty", bench_dirty },
+    { "present", bench_present },
+    { "spec_index", bench_spec_index },
+    { "rays", bench_rays },
+    { "edges", bench_edges },
+#if HAVE_NETWORK
+    { "net_reactor", bench_net_reactor },
+    { "net_files", bench_net_files },
+#endif
+};
+
+int bench_run(char const *name)
+{
+    size_t count = sizeof(benches) / sizeof(*benches);
+    int found = 0;
+
+    for (size_t i = 0; i < count; i++)
+        if (!strcmp(name, "all") || !strcmp(name, benches[i].name))
+        {
+            benches[i].run();
+            found = 1;
+        }
+
+    if (!found)
+    {
+        printf("bench: no benchmark named %s, try all", name);
+        for (size_t i = 0; i < count; i++)
+            printf(", %s", benches[i].name);
+        printf("\n");
+    }
+    fflush(stdout);
+
+    return found;
+}
@@ -0,0 +1,25 @@
+/*
+ *  Abuse - dark 2D side-scrolling platform game
+ *  Copyright (c) 1995 Crack dot Com
+ *  Copyright (c) 2005-2011 Sam Hocevar <sam@hocevar.net>
+ *
+ *  This software was released into the Public Domain. As with most public
+ *  domain software, no warranty is made or implied by Crack dot Com, by
+ *  Jonathan Clark, or by Sam Hocevar.
+ */
+
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+/*  Microbenchmarks.
+ *
+ *  With -bench <name>, the game runs the named benchmark once the game data
+ *  and Lisp code are loaded, prints its results and quits. A benchmark
+ *  times the old and new versions of a code path against each other in
+ *  the same process. -bench all runs all of them.
+ */
+
+// Returns 0 if there is no such benchmark
+int bench_run(char const *name);
+
+#endif // __BENCH_H__
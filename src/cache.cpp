@@ -38,7 +38,8 @@
 #include "netface.h"
 
 #define touch(x) { (x)->last_access=last_access++; \
-           if ((x)->last_access<0) { normalize(); (x)->last_access=1; } }
+           if ((x)->last_access<0) { normalize(); (x)->last_access=1; } \
+           if ((x)->size>=0 && (x)->lru_prev>=0) { lru_unlink(x); lru_link(x,1); } }
 
 CrcManager crc_manager;
 
@@ -189,8 +190,138 @@ void CrcManager::set_crc(int filenumber, uint32_t crc)
   files[filenumber]->crc=crc;
 }
 
+// bytes held by a loaded item
+static size_t item_size(int type, void *data)
+{
+  if (!data)
+    return 0;
+
+  switch (type)
+  {
+    case SPEC_BACKTILE :
+    {
+      ivec2 s=((backtile *)data)->im->Size();
+      return sizeof(backtile)+sizeof(image)+s.x*s.y;
+    }
+    case SPEC_FORETILE :
+    {
+      foretile *f=(foretile *)data;
+      return sizeof(foretile)+f->im->DiskUsage()+f->points->size()
+             +sizeof(image)+AUTOTILE_WIDTH*AUTOTILE_HEIGHT
+             +f->edges->MemUsage();
+    }
+    case SPEC_CHARACTER :
+    case SPEC_CHARACTER2 : return ((figure *)data)->MemUsage();
+    case SPEC_IMAGE :
+    {
+      ivec2 s=((image *)data)->Size();
+      return sizeof(image)+s.x*s.y;
+    }
+    case SPEC_PARTICLE : return sizeof(part_frame)+((part_frame *)data)->t*sizeof(part);
+    case SPEC_PALETTE : return sizeof(char_tint);
+    // sounds are never evicted, so they stay out of the budget
+    case SPEC_EXTERN_SFX : return 0;
+    case SPEC_EXTERNAL_LCACHE : return block_size((LObject *)data);
+  }
+  return 0;
+}
+
+void CacheList::lru_link(CacheItem *i, int front)
+{
+  if (i->type==SPEC_EXTERN_SFX)
+    return;
+
+  int32_t id=i-list;
+  if (front)
+  {
+    i->lru_prev=-1;
+    i->lru_next=lru_first;
+    if (lru_first>=0)
+      list[lru_first].lru_prev=id;
+    else
+      lru_last=id;
+    lru_first=id;
+  }
+  else
+  {
+    i->lru_next=-1;
+    i->lru_prev=lru_last;
+    if (lru_last>=0)
+      list[lru_last].lru_next=id;
+    else
+      lru_first=id;
+    lru_last=id;
+  }
+}
+
+void CacheList::lru_unlink(CacheItem *i)
+{
+  if (i->type==SPEC_EXTERN_SFX)
+    return;
+
+  if (i->lru_prev>=0)
+    list[i->lru_prev].lru_next=i->lru_next;
+  else
+    lru_first=i->lru_next;
+  if (i->lru_next>=0)
+    list[i->lru_next].lru_prev=i->lru_prev;
+  else
+    lru_last=i->lru_prev;
+  i->lru_prev=i->lru_next=-1;
+}
+
+// account for an item that just got its data, recent ones go in front of the
+// LRU list and prefetched ones nobody used yet at the back
+void CacheList::loaded_item(CacheItem *i, int recent)
+{
+  i->size=item_size(i->type,i->data);
+  mem_used+=i->size;
+  lru_link(i,recent);
+  if (mem_budget && mem_used>mem_budget)
+    ful=1;
+}
+
+static int s_access_compare(const void *a, const void *b)
+{
+  return cache.access_compare(*(int *)a,*(int *)b);
+}
+
+int CacheList::access_compare(int a, int b)
+{
+  if (list[a].last_access!=list[b].last_access)
+    return list[a].last_access<list[b].last_access ? -1 : 1;
+  return 0;
+}
+
+// reorder the LRU list after last_access was rewritten from a cache profile
+void CacheList::lru_rebuild()
+{
+  int *ids=(int *)malloc(sizeof(int)*(total+1)),count=0;
+  for (int32_t id=lru_first; id>=0; id=list[id].lru_next)
+    ids[count++]=id;
+  qsort(ids,count,sizeof(int),s_access_compare);
+
+  lru_first=lru_last=-1;
+  for (int i=0; i<count; i++)
+    lru_link(list+ids[i],1);
+  free(ids);
+}
+
+void CacheList::trim()
+{
+  while (mem_budget && mem_used>mem_budget && lru_last>=0)
+    free_oldest();
+}
+
 void CacheList::unmalloc(CacheItem *i)
 {
+  if (i->size>=0)
+  {
+    lru_unlink(i);
+    mem_used-=i->size;
+    i->size=-1;
+  }
+
   switch (i->type)
   {
     case SPEC_CHARACTER2 :
@@ -367,11 +498,155 @@ static int load_chars()  // returns 0 if cache filled
 void CacheList::note_need(int id)
 {
   if (list[id].last_access<0)
+  {
     list[id].last_access=-2;
+    prefetch_item(id);
+  }
   else
     list[id].last_access=2;
 }
 
+void CacheList::cache_in(int id)
+{
+  switch (list[id].type)
+  {
+    case SPEC_BACKTILE : backt(id); break;
+    case SPEC_FORETILE : foret(id); break;
+    case SPEC_CHARACTER :
+    case SPEC_CHARACTER2 : fig(id); break;
+    case SPEC_IMAGE : img(id); break;
+    case SPEC_PARTICLE : part(id); break;
+    case SPEC_EXTERN_SFX : sfx(id); break;
+    case SPEC_EXTERNAL_LCACHE : lblock(id); break;
+    case SPEC_PALETTE : ctint(id); break;
+  }
+}
+
+static int s_file_offset_compare(const void *a, const void *b)
+{
+  return cache.file_offset_compare(*(int *)a,*(int *)b);
+}
+
+int CacheList::file_offset_compare(int a, int b)
+{
+  if (list[a].file_number!=list[b].file_number)
+    return list[a].file_number<list[b].file_number ? -1 : 1;
+  if (list[a].offset!=list[b].offset)
+    return list[a].offset<list[b].offset ? -1 : 1;
+  return 0;
+}
+
+// load everything marked as needed (last_access -2) until the cache is full,
+// handing it to the prefetch thread in file order when that is running
+void CacheList::load_marked()
+{
+  int *ids=(int *)malloc(sizeof(int)*(total+1)),count=0;
+  for (int j=0; j<total; j++)
+  {
+    if (list[j].file_number>=0 && list[j].last_access==-2)
+    {
+      list[j].last_access=-1;
+      ids[count++]=j;
+    }
+  }
+
+  if (prefetch.Running())
+    qsort(ids,count,sizeof(int),s_file_offset_compare);
+
+  for (int i=0; i<count && !ful; i++)
+    if (!prefetch_item(ids[i]))
+      cache_in(ids[i]);
+
+  free(ids);
+}
+
+void CacheList::set_prefetch(int on)
+{
+  if (on && !prefetch.Start())
+    dprintf("Unable to start the cache prefetch thread\n");
+  if (!on && prefetch.Running())
+  {
+    prefetch.Stop();
+    prefetch_collect();
+    for (int i=0; i<total; i++)   // whatever was still queued was dropped
+      list[i].pending=-1;
+  }
+}
+
+// queue an item that is not loaded yet for the prefetch thread, returns 0 if
+// the caller has to load it
+int CacheList::prefetch_item(int id)
+{
+  CacheItem *me=list+id;
+  if (me->pending>=0)
+    return 1;
+  if (me->last_access>=0 || !prefetch.Running() || me->type==SPEC_EXTERN_SFX)
+    return 0;
+
+  char const *fn=crc_manager.get_filename(me->file_number);
+  me->pending=prefetch.Queue(id,me->file_number,fn,me->offset,me->type);
+  if (me->pending<0 && prefetch_collect())   // make room and try again
+    me->pending=prefetch.Queue(id,me->file_number,fn,me->offset,me->type);
+  return me->pending>=0;
+}
+
+// adopt prefetched items nobody asked for yet, they count as loaded but
+// never accessed
+int CacheList::prefetch_collect()
+{
+  int id,n=0;
+  void *data;
+  while (prefetch.Finished(&id,&data))
+  {
+    list[id].pending=-1;
+    list[id].data=data;
+    list[id].last_access=0;
+    loaded_item(list+id,0);
+    n++;
+  }
+  return n;
+}
+
+void *CacheList::fetch(CacheItem *me)
+{
+  me->data=NULL;
+  if (me->pending>=0)
+  {
+    me->data=prefetch.Take(me->pending);
+    me->pending=-1;
+  }
+  else if (prefetch.Running())
+    prefetch.stats.misses++;
+
+  if (!me->data && me->type==SPEC_EXTERN_SFX)
+    me->data=cache_load_item(NULL,me->type,crc_manager.get_filename(me->file_number));
+  else if (!me->data)
+  {
+    locate(me);
+    me->data=cache_load_item(fp,me->type,NULL);
+    last_offset=fp->tell();
+  }
+
+  loaded_item(me,1);
+  return me->data;
+}
+
+void *cache_load_item(bFILE *fp, int type, char const *filename)
+{
+  switch (type)
+  {
+    case SPEC_BACKTILE : return new backtile(fp);
+    case SPEC_FORETILE : return new foretile(fp);
+    case SPEC_CHARACTER :
+    case SPEC_CHARACTER2 : return new figure(fp,type);
+    case SPEC_IMAGE : return new image(fp);
+    case SPEC_PARTICLE : return new part_frame(fp);
+    case SPEC_PALETTE : return new char_tint(fp);
+    case SPEC_EXTERN_SFX : return new sound_effect(filename);
+  }
+  return NULL;
+}
+
 void CacheList::preload_cache_object(int type)
 {
   if (type<0xffff)
@@ -476,6 +751,8 @@ void CacheList::preload_cache(level *lev)
 
 void CacheList::load_cache_prof_info(char *filename, level *lev)
 {
+  prefetch_collect();
+
   int j;
   for (j=0; j<this->total; j++)
     if (list[j].last_access>=0)      // reset all loaded cache items to 0, all non-load to -1
@@ -555,31 +832,7 @@ void CacheList::load_cache_prof_info(char *filename, level *lev)
 
 
     ful=0;
-    int tcached=0;
-    for (j=0; j<total; j++)    // now load all of the objects until full
-    {
-//      stat_man->update(j*70/total+25);
-      if (list[j].file_number>=0 && list[j].last_access==-2)
-      {
-        list[j].last_access=-1;
-        if (!ful)
-        {
-          switch (list[j].type)
-          {
-        case SPEC_BACKTILE : backt(j); break;
-        case SPEC_FORETILE : foret(j); break;
-        case SPEC_CHARACTER :
-        case SPEC_CHARACTER2 : fig(j); break;
-        case SPEC_IMAGE : img(j); break;
-        case SPEC_PARTICLE : part(j); break;
-        case SPEC_EXTERN_SFX : sfx(j); break;
-        case SPEC_EXTERNAL_LCACHE : lblock(j); break;
-        case SPEC_PALETTE : ctint(j); break;
-          }
-          tcached++;
-        }
-      }
-    }
+    load_marked();
     load_fail=0;
 //    if (full())
 //      dprintf("Cache filled while loading\n");
@@ -599,6 +852,7 @@ void CacheList::load_cache_prof_info(char *filename, level *lev)
 
     free(priority);
     free(fnum_remap);
+    lru_rebuild();
 
 
       }
@@ -607,31 +861,7 @@ void CacheList::load_cache_prof_info(char *filename, level *lev)
 
   if (load_fail) // no cache file, go solely on above gueses
   {
-    int j;
-    for (j=0; j<total; j++)    // now load all of the objects until full, don't free old stuff
-    {
-//      stat_man->update(j*70/total+25);
-
-      if (list[j].file_number>=0 && list[j].last_access==-2)
-      {
-    list[j].last_access=-1;
-    if (!ful)
-    {
-      switch (list[j].type)
-      {
-        case SPEC_BACKTILE : backt(j); break;
-        case SPEC_FORETILE : foret(j); break;
-        case SPEC_CHARACTER :
-        case SPEC_CHARACTER2 : fig(j); break;
-        case SPEC_IMAGE : img(j); break;
-        case SPEC_PARTICLE : part(j); break;
-        case SPEC_EXTERN_SFX : sfx(j); break;
-        case SPEC_EXTERNAL_LCACHE : lblock(j); break;
-        case SPEC_PALETTE : ctint(j); break;
-      }
-    }
-      }
-    }
+    load_marked();     // don't free old stuff
     if (full())
       dprintf("Cache filled while loading\n");
   }
@@ -661,6 +891,11 @@ void CacheList::unreg(int id)
 {
     if (list[id].file_number >= 0)
     {
+        if (list[id].pending >= 0)
+        {
+            list[id].data = prefetch.Cancel(list[id].pending);
+            list[id].pending = -1;
+        }
         unmalloc(&list[id]);
         list[id].file_number = -1;
     }
@@ -681,6 +916,9 @@ CacheList::CacheList()
     last_dir = NULL;
     last_file = -1;
     prof_data = NULL;
+    lru_first = lru_last = -1;
+    mem_used = mem_budget = 0;
+    evicted = 0;
 }
 
 CacheList::~CacheList()
@@ -689,6 +927,9 @@ CacheList::~CacheList()
 
 void CacheList::empty()
 {
+  prefetch.Stop();
+  prefetch_collect();
+
   for (int i=0; i<total; i++)
   {
     if (list[i].file_number>=0 && list[i].last_access!=-1)
@@ -714,6 +955,8 @@ void CacheList::empty()
   last_dir=NULL;
   last_file=-1;
   prof_data=NULL;
+  lru_first=lru_last=-1;
+  mem_used=0;
 }
 
 void CacheList::locate(CacheItem *i, int local_only)
@@ -723,10 +966,9 @@ void CacheList::locate(CacheItem *i, int local_only)
   {
     if (fp) delete fp;
     if (last_dir) delete last_dir;
-    if (local_only)
-      fp=new jFILE(crc_manager.get_filename(i->file_number),"rb");
-    else
-      fp=open_file(crc_manager.get_filename(i->file_number),"rb");
+    // Local files are memory mapped, so the loaders below read straight
+    // from the page cache instead of going through a read buffer.
+    fp=map_file(crc_manager.get_filename(i->file_number),local_only);
 
 
     if (fp->open_failure())
@@ -779,6 +1021,8 @@ int CacheList::AllocId()
                 list[total + i].file_number = -1; // mark new entries as new
                 list[total + i].last_access = -1;
                 list[total + i].data = NULL;
+                list[total + i].pending = -1;
+                list[total + i].size = -1;
             }
             ret = total;
             // If new id's have been added, old prof_data size won't work
@@ -883,6 +1127,8 @@ int CacheList::reg(char const *filename, char const *name, int type, int rm_dups
     list[id].data = NULL;
     list[id].offset = offset;
     list[id].type = type;
+    list[id].pending = -1;
+    list[id].size = -1;
 
     return id;
 }
@@ -916,9 +1162,7 @@ backtile *CacheList::backt(int id)
   else
   {
     touch(me);
-    locate(me);
-    me->data=(void *)new backtile(fp);
-    last_offset=fp->tell();
+    me->data=fetch(me);
     return (backtile *)me->data;
   }
 }
@@ -937,9 +1181,7 @@ foretile *CacheList::foret(int id)
   else
   {
     touch(me);
-    locate(me);
-    me->data=(void *)new foretile(fp);
-    last_offset=fp->tell();
+    me->data=fetch(me);
     return (foretile *)me->data;
   }
 }
@@ -956,9 +1198,7 @@ figure *CacheList::fig(int id)
   else
   {
     touch(me);
-    locate(me);
-    me->data=(void *)new figure(fp,me->type);
-     last_offset=fp->tell();
+    me->data=fetch(me);
     return (figure *)me->data;
   }
 }
@@ -975,11 +1215,7 @@ image *CacheList::img(int id)
   else
   {
     touch(me);                                           // hold me, feel me, be me!
-    locate(me);
-    image *im=new image(fp);
-    me->data=(void *)im;
-    last_offset=fp->tell();
-
+    me->data=fetch(me);
     return (image *)me->data;
   }
 }
@@ -996,8 +1232,7 @@ sound_effect *CacheList::sfx(int id)
   else
   {
     touch(me);                                           // hold me, feel me, be me!
-    char *fn=crc_manager.get_filename(me->file_number);
-    me->data=(void *)new sound_effect(fn);
+    me->data=fetch(me);
     return (sound_effect *)me->data;
   }
 }
@@ -1015,9 +1250,7 @@ part_frame *CacheList::part(int id)
   else
   {
     touch(me);
-    locate(me);
-    me->data=(void *)new part_frame(fp);
-    last_offset=fp->tell();
+    me->data=fetch(me);
     return (part_frame *)me->data;
   }
 }
@@ -1034,22 +1267,14 @@ CacheList cache;
 
 void CacheList::free_oldest()
 {
-  int32_t old_time = last_access;
-  CacheItem *ci=list,*oldest=NULL;
+  CacheItem *oldest=lru_last>=0 ? list+lru_last : NULL;
   ful=1;
 
-  for (int i = 0; i < total; i++, ci++)
-  {
-    if (ci->data && ci->last_access < old_time)
-    {
-      oldest = ci;
-      old_time = ci->last_access;
-    }
-  }
   if (oldest)
   {
     dprintf("mem_maker : freeing %s\n",spec_types[oldest->type]);
     unmalloc(oldest);
+    evicted++;
   }
   else
   {
@@ -1110,9 +1335,7 @@ char_tint *CacheList::ctint(int id)
   else
   {
     touch(me);
-    locate(me);
-    me->data=(void *)new char_tint(fp);
-    last_offset=fp->tell();
+    me->data=fetch(me);
     return (char_tint *)me->data;
   }
 }
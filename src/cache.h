@@ -19,6 +19,7 @@
 #include "specs.h"
 #include "items.h"
 #include "particle.h"
+#include "prefetch.h"
 
 class level;
 
@@ -74,6 +75,9 @@ protected:
     uint8_t type;
     int16_t file_number;
     int32_t offset;
+    int16_t pending; // prefetch slot, or -1
+    int32_t size;    // bytes held by data, -1 while not loaded
+    int32_t lru_prev, lru_next; // ids in the LRU list, -1 at the ends
 };
 
 class CacheList
@@ -94,15 +98,39 @@ private:
     void unmalloc(CacheItem *i);
     int used, // flag set when disk is accessed
         ful;  // set when stuff has to be thrown out
+
+    // Loaded items, most recently used first. Sounds are neither listed
+    // nor counted, as freeing one stops every playing sound.
+    int32_t lru_first, lru_last;
+    size_t mem_used, mem_budget;
+    int32_t evicted;
+    void lru_link(CacheItem *i, int front);
+    void lru_unlink(CacheItem *i);
+    void loaded_item(CacheItem *i, int recent);
+    void lru_rebuild();
     int *prof_data; // holds counts for each id
     void preload_cache_object(int type);
     void preload_cache(level *lev);
+    void load_marked();
+    void cache_in(int id);
+
+    CachePrefetch prefetch;
+    void *fetch(CacheItem *me); // load me, or get it from the prefetch thread
+    int prefetch_item(int id);
+    int prefetch_collect();
 
 public:
     CacheList();
     ~CacheList();
 
     void free_oldest();
+    // Free the least recently used items until the budget (in bytes, 0
+    // for no limit) is met. Only call this when no item pointers are held.
+    void set_budget(size_t bytes) { mem_budget = bytes; }
+    void trim();
+    size_t mem_usage() { return mem_used; }
+    size_t budget() { return mem_budget; }
+    int32_t evictions() { return evicted; }
     int in_use() { if (used) { used = 0; return 1; } else return 0; }
     int full() { if (ful) { ful = 0; return 1; } else return 0; }
     int reg_object(char const *filename, LObject *object, int type,
@@ -112,6 +140,9 @@ public:
     int loaded(int id);
     void unreg(int id);
     void note_need(int id);
+    void set_prefetch(int on);
+    PrefetchStats const &prefetch_stats() { return prefetch.stats; }
+    int prefetching() { return prefetch.Running(); }
 
     backtile *backt(int id);
     foretile *foret(int id);
@@ -131,6 +162,8 @@ public:
     int  prof_is_on() { return prof_data != NULL; }   // so level knows weither to save prof info or not
     int compare(int a, int b); // compares usage count (used by qsort)
     int offset_compare(int a, int b);
+    int file_offset_compare(int a, int b);
+    int access_compare(int a, int b);
 
     void load_cache_prof_info(char *filename, level *lev);
     // sarray is a index table sorted by offset/filenum
@@ -140,6 +173,9 @@ public:
     void empty();
 };
 
+// decode a cache item of the given type from fp (filename for sounds)
+void *cache_load_item(bFILE *fp, int type, char const *filename);
+
 extern CacheList cache;
 extern CrcManager crc_manager;
 
@@ -1175,12 +1175,14 @@ long c_caller(long number, void *args)
     { int32_t v=lnumber_value(CAR(args));
       current_object->x=v;
 //      current_object->last_x=v;
+      current_level->object_moved(current_object);
       return 1;
     } break;
     case 33 :
     { int32_t v=lnumber_value(CAR(args));
       current_object->y=v;
 //      current_object->last_y=v;
+      current_level->object_moved(current_object);
       return 1;
     } break;
 
@@ -1767,6 +1769,7 @@ long c_caller(long number, void *args)
       current_object->try_move(current_object->x,current_object->y,xv,yv,1|top);
       current_object->x+=xv;
       current_object->y+=yv;
+      current_level->object_moved(current_object);
       return (oxv==xv && oyv==yv);
     } break;
     case 201 :
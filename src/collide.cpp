@@ -12,10 +12,331 @@
 #   include "config.h"
 #endif
 
+#include <stdlib.h>
+#include <string.h>
+
 #include "common.h"
 
 #include "level.h"
 #include "intsect.h"
+#include "collide.h"
+#include "trace.h"
+
+BroadPhase::BroadPhase()
+{
+    m_valid = 0;
+    m_total = m_size = m_types = 0;
+    m_by_type = m_hurtable = m_retyped = m_found = NULL;
+    m_type_start = NULL;
+    m_hurtable_total = m_retyped_total = m_retyped_size = 0;
+    m_found_size = m_found_total = 0;
+
+    m_target_list = NULL;
+    m_targets = NULL;
+    m_found_targets = NULL;
+    m_target_total = m_target_size = m_targets_dirty = 0;
+    m_max_width = 0;
+
+    memset(&stats, 0, sizeof(stats));
+    memset(&last_stats, 0, sizeof(last_stats));
+}
+
+BroadPhase::~BroadPhase()
+{
+    free(m_by_type);
+    free(m_hurtable);
+    free(m_retyped);
+    free(m_found);
+    free(m_type_start);
+    free(m_targets);
+    free(m_found_targets);
+}
+
+void BroadPhase::Build(game_object *first_active)
+{
+    game_object *o;
+
+    m_total = 0;
+    for (o = first_active; o; o = o->next_active)
+        m_total++;
+
+    if (m_total > m_size)
+    {
+        m_size = m_total;
+        m_by_type = (Entry *)realloc(m_by_type, sizeof(Entry) * m_size);
+        m_hurtable = (Entry *)realloc(m_hurtable, sizeof(Entry) * m_size);
+    }
+    if (total_objects + 1 > m_types)
+    {
+        m_types = total_objects + 1;
+        m_type_start = (int *)realloc(m_type_start, sizeof(int) * (m_types + 1));
+    }
+
+    // Counting sort by type; objects with an unknown type share the last
+    // bucket. Walking the active list in order keeps each bucket sorted.
+    memset(m_type_start, 0, sizeof(int) * (m_types + 1));
+    for (o = first_active; o; o = o->next_active)
+        m_type_start[Min((int)o->otype, m_types - 1) + 1]++;
+    for (int i = 0; i < m_types; i++)
+        m_type_start[i + 1] += m_type_start[i];
+
+    int32_t order = 0;
+    m_hurtable_total = 0;
+    for (o = first_active; o; o = o->next_active, order++)
+    {
+        int t = Min((int)o->otype, m_types - 1);
+        Entry &e = m_by_type[m_type_start[t]++];
+        e.o = o;
+        e.order = order;
+        if (t < total_objects && o->hurtable())
+            m_hurtable[m_hurtable_total++] = e;
+    }
+
+    // m_type_start[t] now points at the end of bucket t, shift it back
+    for (int i = m_types; i > 0; i--)
+        m_type_start[i] = m_type_start[i - 1];
+    m_type_start[0] = 0;
+
+    m_retyped_total = 0;
+    m_valid = 1;
+}
+
+void BroadPhase::Clear()
+{
+    m_valid = 0;
+    m_target_total = 0;
+    last_stats = stats;
+    memset(&stats, 0, sizeof(stats));
+}
+
+void BroadPhase::Remove(game_object *o)
+{
+    if (!m_valid)
+        return;
+
+    for (int i = 0; i < m_total; i++)
+    {
+        if (m_by_type[i].o == o)
+            m_by_type[i].o = NULL;
+        if (i < m_hurtable_total && m_hurtable[i].o == o)
+            m_hurtable[i].o = NULL;
+    }
+    for (int i = 0; i < m_retyped_total; i++)
+        if (m_retyped[i].o == o)
+            m_retyped[i].o = NULL;
+}
+
+// The object keeps its old bucket entry, but queries always check the
+// current type; the extra entry makes it visible under its new type.
+void BroadPhase::Retype(game_object *o)
+{
+    if (!m_valid)
+        return;
+
+    for (int i = 0; i < m_total; i++)
+        if (m_by_type[i].o == o)
+        {
+            if (m_retyped_total >= m_retyped_size)
+            {
+                m_retyped_size = m_retyped_size * 2 + 16;
+                m_retyped = (Entry *)realloc(m_retyped, sizeof(Entry) * m_retyped_size);
+            }
+            m_retyped[m_retyped_total++] = m_by_type[i];
+            return;
+        }
+}
+
+void BroadPhase::AddFound(game_object *o, int32_t order)
+{
+    if (m_found_total >= m_found_size)
+    {
+        m_found_size = m_found_size * 2 + 64;
+        m_found = (Entry *)realloc(m_found, sizeof(Entry) * m_found_size);
+    }
+    m_found[m_found_total].o = o;
+    m_found[m_found_total].order = order;
+    m_found_total++;
+}
+
+void BroadPhase::Gather(int type)
+{
+    if (type >= 0 && type < m_types - 1)
+        for (int i = m_type_start[type]; i < m_type_start[type + 1]; i++)
+        {
+            Entry &e = m_by_type[i];
+            if (e.o && e.o->otype == type)
+                AddFound(e.o, e.order);
+        }
+
+    for (int i = 0; i < m_retyped_total; i++)
+    {
+        Entry &e = m_retyped[i];
+        if (e.o && e.o->otype == type)
+            AddFound(e.o, e.order);
+    }
+}
+
+int BroadPhase::OrderSorter(void const *a, void const *b)
+{
+    int32_t oa = ((Entry const *)a)->order, ob = ((Entry const *)b)->order;
+    return oa < ob ? -1 : oa > ob ? 1 : 0;
+}
+
+int BroadPhase::Sort()
+{
+    qsort(m_found, m_found_total, sizeof(Entry), OrderSorter);
+
+    // objects may have been gathered twice
+    int n = 0;
+    for (int i = 0; i < m_found_total; i++)
+        if (!n || m_found[n - 1].order != m_found[i].order)
+            m_found[n++] = m_found[i];
+    m_found_total = n;
+
+    stats.scanned += n;
+    stats.skipped += m_total - n;
+    return n;
+}
+
+int BroadPhase::Find(game_object *first_active, int type)
+{
+    m_found_total = 0;
+    if (!first_active) // to_front() and to_back() empty the active list
+        return 0;
+    if (!m_valid)
+    {
+        for (game_object *o = first_active; o; o = o->next_active)
+            if (o->otype == type)
+                AddFound(o, m_found_total);
+        return m_found_total;
+    }
+
+    // a bucket is already in order, unless retyped objects were added
+    Gather(type);
+    if (m_retyped_total)
+        return Sort();
+
+    stats.scanned += m_found_total;
+    stats.skipped += m_total - m_found_total;
+    return m_found_total;
+}
+
+int BroadPhase::Find(game_object *first_active, void *types)
+{
+    m_found_total = 0;
+    if (!first_active) // to_front() and to_back() empty the active list
+        return 0;
+    if (!m_valid)
+    {
+        for (game_object *o = first_active; o; o = o->next_active)
+        {
+            Cell *v = (Cell *)types;
+            for (; !NILP(v) && lnumber_value(CAR(v)) != o->otype; v = CDR(v));
+            if (!NILP(v))
+                AddFound(o, m_found_total);
+        }
+        return m_found_total;
+    }
+
+    for (Cell *v = (Cell *)types; !NILP(v); v = CDR(v))
+        Gather(lnumber_value(CAR(v)));
+    return Sort();
+}
+
+int BroadPhase::FindHurtable(game_object *first_active)
+{
+    m_found_total = 0;
+    if (!first_active) // to_front() and to_back() empty the active list
+        return 0;
+    if (!m_valid)
+    {
+        for (game_object *o = first_active; o; o = o->next_active)
+            if (o->hurtable())
+                AddFound(o, m_found_total);
+        return m_found_total;
+    }
+
+    for (int i = 0; i < m_hurtable_total; i++)
+        if (m_hurtable[i].o)
+            AddFound(m_hurtable[i].o, m_hurtable[i].order);
+    for (int i = 0; i < m_retyped_total; i++)
+        if (m_retyped[i].o)
+            AddFound(m_retyped[i].o, m_retyped[i].order);
+    return Sort();
+}
+
+void BroadPhase::BuildTargets(game_object **list, int total)
+{
+    if (total > m_target_size)
+    {
+        m_target_size = total;
+        m_targets = (Target *)realloc(m_targets, sizeof(Target) * m_target_size);
+        m_found_targets = (int *)realloc(m_found_targets, sizeof(int) * m_target_size);
+    }
+    m_target_list = list;
+    m_target_total = total;
+    for (int i = 0; i < total; i++)
+        m_targets[i].index = i;
+    SortTargets();
+}
+
+// Refresh every box and insertion sort by left edge: after the first
+// build, the order only changes when a few objects got pushed around.
+void BroadPhase::SortTargets()
+{
+    m_max_width = 0;
+    for (int i = 0; i < m_target_total; i++)
+    {
+        Target &t = m_targets[i];
+        m_target_list[t.index]->picture_space(t.x1, t.y1, t.x2, t.y2);
+        m_max_width = Max(m_max_width, t.x2 - t.x1);
+    }
+
+    for (int i = 1; i < m_target_total; i++)
+    {
+        Target t = m_targets[i];
+        int j = i;
+        for (; j > 0 && m_targets[j - 1].x1 > t.x1; j--)
+            m_targets[j] = m_targets[j - 1];
+        m_targets[j] = t;
+    }
+
+    m_targets_dirty = 0;
+}
+
+static int index_sorter(void const *a, void const *b)
+{
+    return *(int const *)a - *(int const *)b;
+}
+
+// Indices of targets whose picture space overlaps the given box, in
+// target list order
+int BroadPhase::Overlapping(int32_t x1, int32_t y1, int32_t x2, int32_t y2)
+{
+    if (m_targets_dirty)
+        SortTargets();
+
+    // first target whose left edge is not too far left to reach x1
+    int lo = 0, hi = m_target_total;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (m_targets[mid].x1 < x1 - m_max_width)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    int n = 0;
+    for (int i = lo; i < m_target_total && m_targets[i].x1 <= x2; i++)
+    {
+        Target &t = m_targets[i];
+        if (!(x2 < t.x1 || y2 < t.y1 || x1 > t.x2 || y1 > t.y2))
+            m_found_targets[n++] = t.index;
+    }
+    qsort(m_found_targets, n, sizeof(int), index_sorter);
+    return n;
+}
 
 class collide_patch
 {
@@ -164,6 +485,9 @@ void level::check_collisions()
 {
   game_object *target,*rec,*subject;
   int32_t sx1,sy1,sx2,sy2,tx1,ty1,tx2,ty2,hitx=0,hity=0,t_centerx;
+  TraceScope trace(TRACE_COLLIDE);
+
+  broad.BuildTargets(target_list,target_total);
 
   for (int l=0; l<attack_total; l++)
   {
@@ -172,14 +496,27 @@ void level::check_collisions()
     rec=NULL;
 
 
-    for (int j=0; j<target_total && !rec; j++)
+    // the broad phase only hands back targets that may overlap, still
+    // in target list order, so the first one hit is the same as before
+    int total_found=broad.Overlapping(sx1,sy1,sx2,sy2),k=0;
+    broad.stats.pairs+=target_total;
+    while (k<total_found && !rec)
     {
+      int j=broad.FoundTarget(k++);
       target=target_list[j];
       target->picture_space(tx1,ty1,tx2,ty2);
+      broad.stats.tested++;
       if (!(sx2<tx1 || sy2<ty1 || sx1>tx2 || sy1>ty2))  // check to see if picture spaces collide
       {
-
+    int32_t old_sx=subject->x,old_tx=target->x;
     try_pushback(subject,target);
+    if (subject->x!=old_sx || target->x!=old_tx)
+    {
+      // someone moved, look again at the targets we have not seen yet
+      broad.Moved();
+      total_found=broad.Overlapping(sx1,sy1,sx2,sy2);
+      for (k=0; k<total_found && broad.FoundTarget(k)<=j; k++);
+    }
 
     if (subject->can_hurt(target))    // see if we can hurt him before calculating
     {
@@ -235,6 +572,7 @@ void level::check_collisions()
     {
       rec->do_damage((int)subject->current_figure()->hit_damage,subject,hitx,hity,0,0);
       subject->note_attack(rec);
+      broad.Moved();    // damage functions are free to move anybody
     }
   }
 }
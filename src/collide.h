@@ -0,0 +1,99 @@
+/*
+ *  Abuse - dark 2D side-scrolling platform game
+ *  Copyright (c) 1995 Crack dot Com
+ *  Copyright (c) 2005-2011 Sam Hocevar <sam@hocevar.net>
+ *
+ *  This software was released into the Public Domain. As with most public
+ *  domain software, no warranty is made or implied by Crack dot Com, by
+ *  Jonathan Clark, or by Sam Hocevar.
+ */
+
+#ifndef __COLLIDE_H__
+#define __COLLIDE_H__
+
+class game_object;
+
+/*  Broad phase shared by check_collisions() and the find_* queries.
+ *
+ *  Build() is called at the start of level::tick() and indexes the active
+ *  list by object type (and hurtability), keeping the active list order so
+ *  that the queries return exactly what a linear walk would. Objects that
+ *  change type during the tick are kept in a small extra list, and objects
+ *  removed from the level are dropped from the index.
+ *
+ *  The target list used by check_collisions() is additionally sorted by
+ *  picture space left edge, so each attacker only looks at the targets
+ *  whose x interval can overlap its own (sweep and prune). The sort is
+ *  redone lazily whenever an object may have moved since it was built.
+ */
+
+struct BroadPhaseStats
+{
+    int32_t pairs;   // attacker/target pairs a full scan would test
+    int32_t tested;  // pairs that reached the picture space test
+    int32_t scanned; // objects visited by find_* and hurt_radius
+    int32_t skipped; // active objects these did not have to visit
+};
+
+class BroadPhase
+{
+public:
+    BroadPhase();
+    ~BroadPhase();
+
+    void Build(game_object *first_active);
+    void Clear();
+    int Valid() { return m_valid; }
+
+    void Remove(game_object *o);
+    void Retype(game_object *o);
+
+    // Fill the found list with the active objects of a type, of any type
+    // in a Lisp list of types, or that are hurtable, in active list order.
+    // Outside of a tick the given active list is walked instead.
+    int Find(game_object *first_active, int type);
+    int Find(game_object *first_active, void *types);
+    int FindHurtable(game_object *first_active);
+    game_object *Found(int n) { return m_found[n].o; }
+
+    // Sweep and prune over check_collisions() targets
+    void BuildTargets(game_object **list, int total);
+    void Moved() { m_targets_dirty = 1; }
+    int Overlapping(int32_t x1, int32_t y1, int32_t x2, int32_t y2);
+    int FoundTarget(int n) { return m_found_targets[n]; }
+
+    BroadPhaseStats stats, last_stats;
+
+private:
+    struct Entry
+    {
+        game_object *o;
+        int32_t order;
+    };
+    struct Target
+    {
+        int32_t x1, y1, x2, y2;
+        int index;
+    };
+
+    void AddFound(game_object *o, int32_t order);
+    void Gather(int type);
+    int Sort();
+    void SortTargets();
+    static int OrderSorter(void const *a, void const *b);
+
+    int m_valid, m_total;
+    Entry *m_by_type, *m_hurtable, *m_retyped, *m_found;
+    int *m_type_start;
+    int m_size, m_types, m_hurtable_total, m_retyped_total, m_retyped_size;
+    int m_found_size, m_found_total;
+
+    game_object **m_target_list;
+    Target *m_targets;
+    int *m_found_targets;
+    int m_target_total, m_target_size, m_targets_dirty;
+    int32_t m_max_width;
+};
+
+#endif // __COLLIDE_H__
+
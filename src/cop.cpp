@@ -240,7 +240,11 @@ void *top_ai()
     if (o->lvars[fire_delay1])
       o->lvars[fire_delay1]--;
 
-    o->otype=weapon_types[v->current_weapon];  // switch to correct top part
+    if (o->otype!=weapon_types[v->current_weapon])
+    {
+      o->otype=weapon_types[v->current_weapon];  // switch to correct top part
+      current_level->object_retyped(o);
+    }
       }
     }
   }
@@ -63,7 +63,7 @@ int event_waiting()
 { return wm->IsPending(); }
 
 
-int demo_manager::start_recording(char *filename)
+int demo_manager::start_recording(char const *filename)
 {
   if (!current_level) return 0;
 
@@ -152,7 +152,7 @@ void demo_manager::reset_game()
 
 }
 
-int demo_manager::start_playing(char *filename)
+int demo_manager::start_playing(char const *filename)
 {
   uint8_t sig[15];
   record_file=open_file(filename,"rb");
@@ -194,7 +194,7 @@ int demo_manager::start_playing(char *filename)
   return 1;
 }
 
-int demo_manager::set_state(demo_state new_state, char *filename)
+int demo_manager::set_state(demo_state new_state, char const *filename)
 {
   if (new_state==state) return 1;
 
@@ -280,3 +280,7 @@ int demo_manager::get_packet(void *packet, int &packet_size)   // returns non 0
   return 0;
 }
 
+int demo_manager::packets_left()
+{
+  return state==PLAYING && record_file->tell()<record_file->file_size();
+}
@@ -36,6 +36,7 @@
 #include "ability.h"
 #include "cache.h"
 #include "lisp.h"
+#include "lisp_vm.h"
 #include "jrand.h"
 #include "configuration.h"
 #include "light.h"
@@ -60,6 +61,11 @@
 #include "demo.h"
 #include "netcfg.h"
 #include "director.h"
+#include "headless.h"
+#include "bench.h"
+#include "trace.h"
+#include "tilecache.h"
+#include "specache.h"
 
 #ifdef __QNXNTO__
 #include "onlineservice.h"
@@ -92,6 +98,7 @@ extern uint8_t chatting_enabled;
 // Enable TCP/IP driver
 #if HAVE_NETWORK
 #include "tcpip.h"
+#include "fileman.h"
 tcpip_protocol tcpip;
 #endif
 
@@ -698,9 +705,9 @@ static void post_render()
 
 void Game::draw_map(view *v, int interpolate)
 {
-  backtile *bt;
   int x1, y1, x2, y2, x, y, xo, yo, nxoff, nyoff;
   ivec2 caa, cbb;
+  TraceScope trace(TRACE_DRAW_MAP);
   main_screen->GetClip(caa, cbb);
 
   if(!current_level || state == MENU_STATE)
@@ -797,6 +804,15 @@ void Game::draw_map(view *v, int interpolate)
     xinc = btile_width();
     yinc = btile_height();
 
+    TileCache *bg_cache = NULL;
+    if(TileCache::Enabled)
+    {
+      if(!v->m_bg_cache)
+        v->m_bg_cache = new TileCache(0);
+      bg_cache = v->m_bg_cache;
+      bg_cache->Begin(ivec2(xinc, yinc), ivec2(x2 - x1 + 1, y2 - y1 + 1));
+    }
+
     int bh = current_level->background_height(), bw = current_level->background_width();
     uint16_t *bl;
     for(draw_y = yo, y = y1; y <= y2; y++, draw_y += yinc)
@@ -808,18 +824,29 @@ void Game::draw_map(view *v, int interpolate)
 
       for(x = x1, draw_x = xo; x <= x2; x++, draw_x += xinc)
       {
+    int tile = 0;
     if(x < bw && y < bh)
     {
-          bt = get_bg(*bl);
+          tile = *bl;
       bl++;
     }
-    else bt = get_bg(0);
 
-        main_screen->PutImage(bt->im, ivec2(draw_x, draw_y));
+        if(bg_cache)
+        {
+          ivec2 at;
+          image *slot = bg_cache->Slot(ivec2(x, y), tile, at);
+          if(slot)
+            slot->PutImage(get_bg(tile)->im, at);
+        }
+        else
+          main_screen->PutImage(get_bg(tile)->im, ivec2(draw_x, draw_y));
 //        if(!(dev & EDIT_MODE) && bt->next)
 //      current_level->put_bg(x, y, bt->next);
       }
     }
+
+    if(bg_cache)
+      bg_cache->Put(main_screen, ivec2(x1, y1), ivec2(x2, y2), ivec2(xo, yo));
   }
 
 //  if(!(dev & EDIT_MODE))
@@ -918,6 +945,18 @@ void Game::draw_map(view *v, int interpolate)
 
       int fg_h = current_level->foreground_height(), fg_w = current_level->foreground_width();
 
+      // Room for as many tiles as the view can show, whether or not
+      // x1 and y1 were moved to the edge of the map
+      TileCache *fg_cache = NULL;
+      if(TileCache::Enabled)
+      {
+        if(!v->m_fg_cache)
+          v->m_fg_cache = new TileCache(1);
+        fg_cache = v->m_fg_cache;
+        fg_cache->Begin(ivec2(fw, fh), ivec2((v->m_bb.x - v->m_aa.x + fw) / fw + 1,
+                                             (v->m_bb.y - v->m_aa.y + fh) / fh + 1));
+      }
+
       for(y = y1, draw_y = yo; y <= y2; y++, draw_y += yinc)
       {
 
@@ -928,6 +967,7 @@ void Game::draw_map(view *v, int interpolate)
 
     for(x = x1, draw_x = xo; x <= x2; x++, draw_x += xinc, cl++)
     {
+      int tile = TileCache::EMPTY;
       if(x < fg_w && y < fg_h)
       {
         if(above_tile(*cl))
@@ -937,15 +977,28 @@ void Game::draw_map(view *v, int interpolate)
           int fort_num = fgvalue(*cl);
           if(fort_num != BLACK)
           {
-            get_fg(fort_num)->im->PutImage(main_screen, ivec2(draw_x, draw_y));
+            tile = fort_num;
 
         if(!(dev & EDIT_MODE))
             *cl|=0x8000;      // mark as has - been - seen
           }
         }
       }
+
+      if(fg_cache)
+      {
+        ivec2 at;
+        image *slot = fg_cache->Slot(ivec2(x, y), tile, at);
+        if(slot && tile != TileCache::EMPTY)
+          get_fg(tile)->im->PutImage(slot, at);
+      }
+      else if(tile != TileCache::EMPTY)
+        get_fg(tile)->im->PutImage(main_screen, ivec2(draw_x, draw_y));
     }
       }
+
+      if(fg_cache)
+        fg_cache->Put(main_screen, ivec2(x1, y1), ivec2(x2, y2), ivec2(xo, yo));
     }
   }
 
@@ -1364,6 +1417,18 @@ Game::Game(int argc, char **argv)
   }
   else has_multitouch = false;
 
+  light_mode = !flags.light_simd ? LIGHT_SCALAR
+             : flags.light_cache ? LIGHT_CACHED : LIGHT_SIMD;
+  light_set_threads(flags.light_threads);
+  TileCache::Enabled = flags.tile_cache;
+  cache.set_prefetch(flags.cache_prefetch);
+  cache.set_budget((size_t)Max(flags.cache_budget, 0) << 20);
+  sd_cache.index_enabled = flags.spec_index;
+#if HAVE_NETWORK
+  tcpip.use_epoll = flags.net_epoll && tcpip.has_epoll();
+  net_read_ahead = flags.net_read_ahead;
+#endif
+
     // Clean up that old crap
     char *fastpath = (char *)malloc(strlen(get_save_filename_prefix()) + 13);
     sprintf(fastpath, "%sfastload.dat", get_save_filename_prefix());
@@ -1375,6 +1440,9 @@ Game::Game(int argc, char **argv)
 //    ProfilerDump("\pabuse.prof");  //prof
 //    ProfilerTerm();
 
+  if(flags.trace)
+    frame_trace.Start(flags.trace_frames, total_objects);
+
   get_key_bindings();
 
   reset_keymap();                   // we think all the keys are up right now
@@ -1460,7 +1528,7 @@ Game::Game(int argc, char **argv)
   if(main_net_cfg == NULL || (main_net_cfg->state != net_configuration::SERVER &&
                  main_net_cfg->state != net_configuration::CLIENT))
   {
-    if(!start_edit && !net_start())
+    if(!start_edit && !net_start() && !flags.headless && !flags.bench)
     {
       do_title();
       const size_t filenamesize = 255;
@@ -1536,16 +1604,55 @@ void Game::show_time()
     if (!first_view || !fps_on)
         return;
 
-    char str[16];
+    char str[32];
     sprintf(str, "%ld", (long)(10000.0f / avg_ms));
     console_font->PutString(main_screen, first_view->m_aa, str);
 
     sprintf(str, "%d", total_active);
     console_font->PutString(main_screen, first_view->m_aa + ivec2(0, 10), str);
+
+    if (current_level)
+    {
+        // collision pairs tested out of the pairs a full scan would test
+        BroadPhaseStats const &s = current_level->collision_stats();
+        sprintf(str, "%d/%d", (int)s.tested, (int)s.pairs);
+        console_font->PutString(main_screen, first_view->m_aa + ivec2(0, 20), str);
+    }
+
+    if (cache.prefetching())
+    {
+        // prefetch hits/misses, then stalls and how long they took
+        PrefetchStats const &p = cache.prefetch_stats();
+        sprintf(str, "%d/%d %d %dms", (int)p.hits, (int)p.misses,
+                (int)p.stalls, (int)p.stall_ms);
+        console_font->PutString(main_screen, first_view->m_aa + ivec2(0, 30), str);
+    }
+
+    if (cache.budget())
+    {
+        // cached kilobytes out of the budget, and items evicted so far
+        sprintf(str, "%dk/%dk %d", (int)(cache.mem_usage() >> 10),
+                (int)(cache.budget() >> 10), (int)cache.evictions());
+        console_font->PutString(main_screen, first_view->m_aa + ivec2(0, 40), str);
+    }
+
+    if (Lisp::Generational())
+    {
+        // minor/major Lisp collections, then the longest pause
+        LispGcStats const &g = Lisp::GcStats;
+        sprintf(str, "%d/%d %.1fms", (int)g.minor, (int)g.major, g.max_ms);
+        console_font->PutString(main_screen, first_view->m_aa + ivec2(0, 50), str);
+    }
 }
 
 void Game::update_screen()
 {
+  TraceScope trace(TRACE_DRAW);
+
+  // Nothing holds on to cached items between frames, so this is where the
+  // cache goes back under its memory budget.
+  cache.trim();
+
   if(state == HELP_STATE)
     draw_help();
   else if(current_level)
@@ -1988,7 +2095,9 @@ void net_receive()
 
 void Game::step()
 {
+  TraceScope trace(TRACE_STEP);
   LSpace::Tmp.Clear();
+  Lisp::CollectIdle();
   if(current_level)
   {
     current_level->unactivate_all();
@@ -2485,6 +2594,8 @@ int main(int argc, char *argv[])
 
         game_net_init(argc, argv);
         Lisp::Init();
+        Lisp::SetGenerational(flags.lisp_gc_gen, flags.lisp_gc_budget);
+        LispVM::Enabled = flags.lisp_vm;
 
         dev_init(argc, argv);
 
@@ -2519,8 +2630,21 @@ int main(int argc, char *argv[])
             g->update_screen(); // redraw the screen with any changes
         }
 
+        if (flags.headless)
+        {
+            headless_run(g, flags.headless, flags.headless_ticks);
+            g->end_session();
+        }
+
+        if (flags.bench)
+        {
+            bench_run(flags.bench);
+            g->end_session();
+        }
+
         while (!g->done())
         {
+            frame_trace.NextFrame();
             music_check();
 
             if (req_end)
@@ -2563,6 +2687,8 @@ int main(int argc, char *argv[])
             // process all the objects in the world
             g->step();
             server_check();
+            // the previous frame was scaled meanwhile with -present_thread
+            present_sync();
             g->calc_speed();
 
             // see if a request for a level load was made during the last tick
@@ -2586,6 +2712,19 @@ int main(int argc, char *argv[])
             current_song->stop();
         delete current_song; current_song = NULL;
 
+        if (flags.trace)
+            frame_trace.Dump(flags.trace);
+        frame_trace.Stop();
+
+        // Only for measuring runs, not on every exit
+        DirtyStats const &ds = image_descriptor::Stats;
+        if ((flags.trace || flags.headless || flags.bench)
+             && ds.flushes && ds.screen_area)
+            printf("dirty: %lld flushes, %.1f%% of screen area updated, "
+                   "%lld rects\n", (long long)ds.flushes,
+                   100.0 * ds.dirty_area / ds.screen_area,
+                   (long long)ds.rects);
+
         cache.empty();
 
         delete dev_console; dev_console = NULL;
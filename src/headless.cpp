@@ -0,0 +1,134 @@
+/*
+ *  Abuse - dark 2D side-scrolling platform game
+ *  Copyright (c) 1995 Crack dot Com
+ *  Copyright (c) 2005-2011 Sam Hocevar <sam@hocevar.net>
+ *
+ *  This software was released into the Public Domain. As with most public
+ *  domain software, no warranty is made or implied by Crack dot Com, by
+ *  Jonathan Clark, or by Sam Hocevar.
+ */
+
+#if defined HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <stdio.h>
+
+#include "common.h"
+
+#include "headless.h"
+#include "game.h"
+#include "level.h"
+#include "demo.h"
+#include "chars.h"
+#include "jrand.h"
+#include "lisp.h"
+#include "lisp_vm.h"
+#include "trace.h"
+
+// FNV-1a, fed one little endian 32 bit word at a time so that the hash
+// does not depend on the host byte order
+static uint32_t hash_word(uint32_t h, int32_t x)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        h ^= (uint8_t)(x >> (i * 8));
+        h *= 16777619u;
+    }
+    return h;
+}
+
+uint32_t level_state_hash()
+{
+    uint32_t h = 2166136261u;
+
+    if (!current_level)
+        return h;
+
+    h = hash_word(h, current_level->tick_counter());
+    h = hash_word(h, rand_on);
+
+    for (game_object *o = current_level->first_object(); o; o = o->next)
+    {
+        h = hash_word(h, o->otype);
+        h = hash_word(h, o->x);
+        h = hash_word(h, o->y);
+        h = hash_word(h, o->xvel());
+        h = hash_word(h, o->yvel());
+        h = hash_word(h, o->fx() | (o->fy() << 8)
+                         | (o->fxvel() << 16) | (o->fyvel() << 24));
+        h = hash_word(h, o->state);
+        h = hash_word(h, o->current_frame);
+        h = hash_word(h, o->direction);
+        h = hash_word(h, o->hp() | (o->mp() << 16));
+        h = hash_word(h, o->aistate() | (o->aistate_time() << 16));
+        h = hash_word(h, o->flags());
+
+        if (o->otype < total_objects)
+            for (int i = 0; i < figures[o->otype]->tv; i++)
+                h = hash_word(h, o->lvars[i]);
+    }
+
+    return h;
+}
+
+int headless_run(Game *g, char const *filename, int max_ticks)
+{
+    if (!demo_man.set_state(demo_manager::PLAYING, filename)
+         || !current_level)
+    {
+        printf("headless: unable to play demo %s\n", filename);
+        return 0;
+    }
+
+    LispGcStats gc = Lisp::GcStats;
+    LispVMStats vm = LispVM::Stats;
+
+    Timer total;
+    int ticks = 0;
+    while ((max_ticks <= 0 || ticks < max_ticks) && demo_man.packets_left())
+    {
+        frame_trace.NextFrame();
+        demo_man.do_inputs();
+        g->step();
+        ticks++;
+    }
+    float total_ms = total.PollMs();
+
+    TickStats const &s = current_level->tick_stats();
+    int32_t gc_count = Lisp::GcStats.tmp + Lisp::GcStats.minor
+                     + Lisp::GcStats.major - gc.tmp - gc.minor - gc.major;
+    float gc_ms = Lisp::GcStats.total_ms - gc.total_ms;
+    float other_ms = total_ms - s.decide_ms - s.collide_ms;
+    float per_tick = 1.0f / Max(ticks, 1);
+
+    printf("headless: %s, %d ticks%s\n", filename, ticks,
+           demo_man.packets_left() ? "" : " (end of demo)");
+    printf("headless: %.1f ms, %.1f ticks/s\n", total_ms,
+           total_ms > 0.0f ? 1000.0f * ticks / total_ms : 0.0f);
+    printf("headless:   decide     %9.1f ms  %7.3f ms/tick\n",
+           s.decide_ms, s.decide_ms * per_tick);
+    printf("headless:   collisions %9.1f ms  %7.3f ms/tick\n",
+           s.collide_ms, s.collide_ms * per_tick);
+    printf("headless:   other      %9.1f ms  %7.3f ms/tick\n",
+           other_ms, other_ms * per_tick);
+    printf("headless:   lisp gc    %9.1f ms  %d collections, part of the above\n",
+           gc_ms, gc_count);
+    printf("headless:     %d temporary, %d minor (%d idle), %d major, "
+           "%lldk copied, longest pause %.2f ms\n",
+           Lisp::GcStats.tmp - gc.tmp, Lisp::GcStats.minor - gc.minor,
+           Lisp::GcStats.idle - gc.idle, Lisp::GcStats.major - gc.major,
+           (long long)((Lisp::GcStats.copied - gc.copied) >> 10),
+           Lisp::GcStats.max_ms);
+    if (LispVM::Enabled)
+        printf("headless:   lisp vm    %d functions compiled, %d calls, "
+               "%d forms left to eval\n", LispVM::Stats.compiled - vm.compiled,
+               LispVM::Stats.calls - vm.calls,
+               LispVM::Stats.fallbacks - vm.fallbacks);
+    printf("headless: state hash %08x\n", level_state_hash());
+    fflush(stdout);
+
+    demo_man.set_state(demo_manager::NORMAL);
+    return ticks;
+}
+
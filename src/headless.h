@@ -0,0 +1,34 @@
+/*
+ *  Abuse - dark 2D side-scrolling platform game
+ *  Copyright (c) 1995 Crack dot Com
+ *  Copyright (c) 2005-2011 Sam Hocevar <sam@hocevar.net>
+ *
+ *  This software was released into the Public Domain. As with most public
+ *  domain software, no warranty is made or implied by Crack dot Com, by
+ *  Jonathan Clark, or by Sam Hocevar.
+ */
+
+#ifndef __HEADLESS_H__
+#define __HEADLESS_H__
+
+class Game;
+
+/*  Headless simulation run.
+ *
+ *  With -headless <demo>, setup() picks SDL's dummy video and audio drivers
+ *  and the game plays the recorded demo without drawing, without sound and
+ *  without the Game::calc_speed() frame limiter, for at most -ticks ticks
+ *  or until the demo runs out. It then prints the tick rate, the time spent
+ *  in each phase of level::tick() and in Lisp garbage collection, and a
+ *  hash of the level state. The demo resets the random table and the tick
+ *  counter, so the same demo and tick count always give the same hash.
+ */
+
+// Returns the number of ticks run
+int headless_run(Game *g, char const *filename, int max_ticks);
+
+// Hash of the current level's objects, tick counter and random state
+uint32_t level_state_hash();
+
+#endif // __HEADLESS_H__
+
@@ -120,7 +120,7 @@ ColorFilter::ColorFilter(palette *pal, int color_bits)
     int max = pal->pal_size();
     int mul = 1 << (8 - color_bits);
     m_size = 1 << color_bits;
-    m_table = (uint8_t *)malloc(m_size * m_size * m_size);
+    m_table = (uint8_t *)malloc(m_size * m_size * m_size + 3);
 
     /* For each colour in the RGB cube, find the nearest palette element. */
     for (int r = 0; r < m_size; r++)
@@ -152,7 +152,7 @@ ColorFilter::ColorFilter(spec_entry *e, bFILE *fp)
 {
     fp->seek(e->offset, 0);
     m_size = fp->read_uint16();
-    m_table = (uint8_t *)malloc(m_size * m_size * m_size);
+    m_table = (uint8_t *)malloc(m_size * m_size * m_size + 3);
     fp->read(m_table, m_size * m_size * m_size);
 }
 
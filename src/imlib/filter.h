@@ -45,6 +45,9 @@ public:
     {
         return m_table[(r * m_size + g) * m_size + b];
     }
+    // Followed by three spare bytes, for 32-bit gathers
+    uint8_t *Table() { return m_table; }
+    int Size() { return m_size; }
 
 private:
     int m_size;
@@ -15,12 +15,35 @@
 #include <math.h>
 #include <stdlib.h>
 
+#include <SDL.h>
+
 #include "common.h"
 
 #include "image.h"
 
 linked_list image_list; // FIXME: only jwindow.cpp needs this
 
+// images may be created by the cache prefetch thread
+static SDL_mutex *image_list_lock = NULL;
+
+static void image_list_add(image *im)
+{
+    if (image_list_lock)
+        SDL_LockMutex(image_list_lock);
+    image_list.add_end(im);
+    if (image_list_lock)
+        SDL_UnlockMutex(image_list_lock);
+}
+
+void image_list_remove(image *im)
+{
+    if (image_list_lock)
+        SDL_LockMutex(image_list_lock);
+    image_list.unlink(im);
+    if (image_list_lock)
+        SDL_UnlockMutex(image_list_lock);
+}
+
 image_descriptor::image_descriptor(ivec2 size,
                                    int keep_dirties, int static_memory)
 {
@@ -30,6 +53,32 @@ image_descriptor::image_descriptor(ivec2 size,
 
     keep_dirt = keep_dirties;
     static_mem = static_memory;
+
+    m_cells = ivec2(0);
+    m_dirty = NULL;
+    m_dirty_y1 = 0;
+    m_dirty_y2 = -1;
+    m_deleted_count = 0;
+}
+
+image_descriptor::~image_descriptor()
+{
+    free(m_dirty);
+}
+
+void image_descriptor::Resize(ivec2 size)
+{
+    m_size = size;
+    m_aa = ivec2(0);
+    m_bb = size;
+
+    // Reallocated with the new size when next needed
+    free(m_dirty);
+    m_cells = ivec2(0);
+    m_dirty = NULL;
+    m_dirty_y1 = 0;
+    m_dirty_y2 = -1;
+    m_deleted_count = 0;
 }
 
 void image::SetSize(ivec2 new_size, uint8_t *page)
@@ -58,7 +107,7 @@ image::~image()
         Unlock();
     }
 
-    image_list.unlink(this);
+    image_list_remove(this);
     DeletePage();
     delete m_special;
 }
@@ -92,7 +141,7 @@ image::image(ivec2 size, uint8_t *page_buffer, int create_descriptor)
         m_special = new image_descriptor(size, create_descriptor == 2,
                                          (page_buffer != NULL));
     MakePage(size, page_buffer);
-    image_list.add_end(this);
+    image_list_add(this);
     m_locked = false;
 }
 
@@ -106,7 +155,7 @@ image::image(bFILE *fp, spec_entry *e /* = NULL */)
     MakePage(m_size, NULL);
     for (int i = 0; i < m_size.y; i++)
         fp->read(scan_line(i), m_size.x);
-    image_list.add_end(this);
+    image_list_add(this);
     m_locked = false;
 }
 
@@ -141,7 +190,8 @@ void image_uninit()
 
 void image_init()
 {
-    ;
+    if (!image_list_lock)
+        image_list_lock = SDL_CreateMutex();
 }
 
 void image::clear(int16_t color)
@@ -316,7 +366,7 @@ void image::SetClip(ivec2 aa, ivec2 bb)
     // If the image does not already have an Image descriptor, allocate one
     // with no dirty rectangle keeping.
     if (!m_special)
-        m_special = new image_descriptor(m_size.x, m_size.y, 0);
+        m_special = new image_descriptor(m_size, 0);
 
     // set the image descriptor what the clip
     // should be it will adjust to fit within the image.
@@ -350,7 +400,7 @@ void image::SetClip(int x1, int y1, int x2, int y2)
    // If the image does not already have an Image descriptor, allocate one
    // with no dirty rectangle keeping.
    if (!m_special)
-       m_special = new image_descriptor(m_size.x, m_size.y, 0);
+       m_special = new image_descriptor(m_size, 0);
 
    // set the image descriptor what the clip
    // should be it will adjust to fit within the image.
@@ -380,31 +430,11 @@ void image::InClip(int x1, int y1, int x2, int y2)
     SetClip(x1, y1, x2, y2);
 }
 
-//
-// reduce the number of dirty rectanges to 1 by finding the minmum area that
-// can contain all the rectangles and making this the new dirty area
-//
-void image_descriptor::ReduceDirties()
-{
-    ivec2 aa(6000), bb(-1);
-
-    for (dirty_rect *p = (dirty_rect *)dirties.first(); p; )
-    {
-        aa = Min(aa, p->m_aa);
-        bb = Max(bb, p->m_bb);
-        dirty_rect *tmp = (dirty_rect *)p->Next();
-        dirties.unlink(p);
-        delete p;
-        p = tmp;
-    }
-    dirties.add_front(new dirty_rect(aa, bb));
-}
+DirtyStats image_descriptor::Stats;
 
-void image_descriptor::DeleteDirty(ivec2 aa, ivec2 bb)
+// specifies that an area is a dirty
+void image_descriptor::AddDirty(ivec2 aa, ivec2 bb)
 {
-    int ax1, ay1, ax2, ay2;
-    dirty_rect *p, *next;
-
     if (!keep_dirt)
         return;
 
@@ -414,168 +444,160 @@ void image_descriptor::DeleteDirty(ivec2 aa, ivec2 bb)
     if (!(aa < bb))
         return;
 
-    int i = dirties.Count();
-    if (!i)
-        return;
-
-    for (p = (dirty_rect *)dirties.first(); i; i--, p = next)
+    if (!m_dirty)
     {
-        next = (dirty_rect *)p->Next();
-
-        // are the two touching?
-        if (!(bb > p->m_aa && aa <= p->m_bb))
-            continue;
+        m_cells = (m_size + ivec2(DIRTY_CELL - 1)) / DIRTY_CELL;
+        m_dirty = (uint8_t *)calloc(m_cells.x * m_cells.y, 1);
+    }
 
-        // does it take a x slice off? (across)
-        if (bb.x >= p->m_bb.x + 1 && aa.x <= p->m_aa.x)
-        {
-            if (bb.y >= p->m_bb.y + 1 && aa.y <= p->m_aa.y)
-            {
-                dirties.unlink(p);
-                delete p;
-            }
-            else if (bb.y >= p->m_bb.y + 1)
-                p->m_bb.y = aa.y - 1;
-            else if (aa.y <= p->m_aa.y)
-                p->m_aa.y = bb.y;
-            else
-            {
-                dirties.add_front(new dirty_rect(p->m_aa, ivec2(p->m_bb.x, aa.y - 1)));
-                p->m_aa.y = bb.y;
-            }
-        }
-        // does it take a y slice off (down)
-        else if (bb.y - 1 >= p->m_bb.y && aa.y <= p->m_aa.y)
+    // An area deleted earlier must not hide this one
+    for (int i = 0; i < m_deleted_count; )
+        if (aa < m_deleted[i][1] && m_deleted[i][0] < bb)
         {
-            if (bb.x - 1 >= p->m_bb.x)
-                p->m_bb.x = aa.x - 1;
-            else if (aa.x <= p->m_aa.x)
-                p->m_aa.x = bb.x;
-            else
-            {
-                dirties.add_front(new dirty_rect(p->m_aa, ivec2(aa.x - 1, p->m_bb.y)));
-                p->m_aa.x = bb.x;
-            }
+            m_deleted[i][0] = m_deleted[m_deleted_count - 1][0];
+            m_deleted[i][1] = m_deleted[m_deleted_count - 1][1];
+            m_deleted_count--;
         }
-        // otherwise it just takes a little chunk off
         else
-        {
-            if (bb.x - 1 >= p->m_bb.x) { ax1=p->m_aa.x; ax2 = aa.x; }
-            else if (aa.x<=p->m_aa.x) { ax1=bb.x; ax2=p->m_bb.x+1; }
-            else { ax1=p->m_aa.x; ax2=aa.x; }
-
-            if (bb.y - 1>=p->m_bb.y) { ay1=aa.y; ay2=p->m_bb.y+1; }
-            else if (aa.y<=p->m_aa.y) { ay1=p->m_aa.y; ay2=bb.y; }
-            else { ay1=aa.y; ay2=bb.y; }
+            i++;
 
-            dirties.add_front(new dirty_rect(ivec2(ax1, ay1), ivec2(ax2 - 1, ay2 - 1)));
+    ivec2 c1 = aa / DIRTY_CELL, c2 = (bb - ivec2(1)) / DIRTY_CELL;
+    for (int y = c1.y; y <= c2.y; y++)
+        memset(m_dirty + y * m_cells.x + c1.x, 1, c2.x - c1.x + 1);
 
-            if (bb.x - 1>=p->m_bb.x || aa.x<=p->m_aa.x)  { ax1=p->m_aa.x; ax2=p->m_bb.x+1; }
-            else { ax1=bb.x; ax2=p->m_bb.x+1; }
-
-            if (bb.y - 1>=p->m_bb.y)
-            { if (ax1==p->m_aa.x) { ay1=p->m_aa.y; ay2=aa.y; }
-              else { ay1=aa.y; ay2=p->m_bb.y+1;   } }
-            else if (aa.y<=p->m_aa.y) { if (ax1==p->m_aa.x) { ay1=bb.y; ay2=p->m_bb.y+1; }
-                                        else  { ay1=p->m_aa.y; ay2=bb.y; } }
-            else { if (ax1==p->m_aa.x) { ay1=p->m_aa.y; ay2=aa.y; }
-                   else { ay1=aa.y; ay2=bb.y; } }
-            dirties.add_front(new dirty_rect(ivec2(ax1, ay1), ivec2(ax2 - 1, ay2 - 1)));
-
-            if (aa.x > p->m_aa.x && bb.x - 1 < p->m_bb.x)
-            {
-                if (aa.y > p->m_aa.y && bb.y - 1 < p->m_bb.y)
-                {
-                    dirties.add_front(new dirty_rect(p->m_aa, ivec2(p->m_bb.x, aa.y - 1)));
-                    dirties.add_front(new dirty_rect(ivec2(p->m_aa.x, bb.y), p->m_bb));
-                }
-                else if (aa.y <= p->m_aa.y)
-                    dirties.add_front(new dirty_rect(ivec2(p->m_aa.x, bb.y), p->m_bb));
-                else
-                    dirties.add_front(new dirty_rect(p->m_aa, ivec2(p->m_bb.x, aa.y - 1)));
-            }
-            else if (aa.y > p->m_aa.y && bb.y - 1 < p->m_bb.y)
-                dirties.add_front(new dirty_rect(ivec2(p->m_aa.x, bb.y), p->m_bb));
-            dirties.unlink(p);
-            delete p;
-        }
+    if (m_dirty_y1 > m_dirty_y2)
+    {
+        m_dirty_y1 = c1.y;
+        m_dirty_y2 = c2.y;
+    }
+    else
+    {
+        m_dirty_y1 = Min(m_dirty_y1, c1.y);
+        m_dirty_y2 = Max(m_dirty_y2, c2.y);
     }
 }
 
-// specifies that an area is a dirty
-void image_descriptor::AddDirty(ivec2 aa, ivec2 bb)
+void image_descriptor::DeleteDirty(ivec2 aa, ivec2 bb)
 {
-    dirty_rect *p;
-    if (!keep_dirt)
+    if (!keep_dirt || !m_dirty)
         return;
 
     aa = Max(aa, ivec2(0));
     bb = Min(bb, m_size);
 
-    if (!(aa < bb))
+    if (!(aa < bb) || m_dirty_y1 > m_dirty_y2)
         return;
 
-    int i = dirties.Count();
-    if (!i)
-        dirties.add_front(new dirty_rect(aa, bb - ivec2(1)));
-    else if (i >= MAX_DIRTY)
+    // Cells entirely inside the area are no longer dirty; the edge of
+    // the image counts as the edge of its last cells
+    ivec2 c1 = (aa + ivec2(DIRTY_CELL - 1)) / DIRTY_CELL;
+    ivec2 c2 = bb / DIRTY_CELL;
+    if (bb.x == m_size.x)
+        c2.x = m_cells.x;
+    if (bb.y == m_size.y)
+        c2.y = m_cells.y;
+    for (int y = c1.y; y < c2.y; y++)
+        if (c1.x < c2.x)
+            memset(m_dirty + y * m_cells.x + c1.x, 0, c2.x - c1.x);
+
+    // The rest is cut out when flushing. If there are too many areas,
+    // the partly covered cells are simply updated.
+    if (m_deleted_count < MAX_DELETED)
     {
-        dirties.add_front(new dirty_rect(aa, bb - ivec2(1)));
-        ReduceDirties();  // reduce to one dirty rectangle, we have to many
+        m_deleted[m_deleted_count][0] = aa;
+        m_deleted[m_deleted_count][1] = bb;
+        m_deleted_count++;
     }
-    else
+}
+
+void image_descriptor::ClearDirties()
+{
+    if (m_dirty && m_dirty_y1 <= m_dirty_y2)
+        memset(m_dirty + m_dirty_y1 * m_cells.x, 0,
+               (m_dirty_y2 - m_dirty_y1 + 1) * m_cells.x);
+    m_dirty_y1 = 0;
+    m_dirty_y2 = -1;
+    m_deleted_count = 0;
+}
+
+void image_descriptor::Emit(ivec2 aa, ivec2 bb, int deleted,
+                            void (*put)(ivec2 aa, ivec2 bb, void *data),
+                            void *data)
+{
+    for (; deleted < m_deleted_count; deleted++)
     {
-      for (p=(dirty_rect *)dirties.first(); i>0; i--)
-      {
+        ivec2 da = m_deleted[deleted][0], db = m_deleted[deleted][1];
+        if (!(aa < db && da < bb))
+            continue;
 
-        // check to see if this new rectangle completly encloses the check rectangle
-        if (aa.x<=p->m_aa.x && aa.y<=p->m_aa.y && bb.x>=p->m_bb.x+1 && bb.y>=p->m_bb.y+1)
-        {
-          dirty_rect *tmp=(dirty_rect*) p->Next();
-          dirties.unlink(p);
-          delete p;
-          if (!dirties.first())
-              i=0;
-          else p=tmp;
-        }
-        else if (!(bb.x - 1 <p->m_aa.x || bb.y - 1 <p->m_aa.y || aa.x>p->m_bb.x || aa.y>p->m_bb.y))
-        {
+        // What is above and below the deleted area, then left and right
+        int y1 = Max(aa.y, da.y), y2 = Min(bb.y, db.y);
+        if (aa.y < da.y)
+            Emit(aa, ivec2(bb.x, da.y), deleted + 1, put, data);
+        if (db.y < bb.y)
+            Emit(ivec2(aa.x, db.y), bb, deleted + 1, put, data);
+        if (aa.x < da.x)
+            Emit(ivec2(aa.x, y1), ivec2(da.x, y2), deleted + 1, put, data);
+        if (db.x < bb.x)
+            Emit(ivec2(db.x, y1), ivec2(bb.x, y2), deleted + 1, put, data);
+        return;
+    }
 
+    Stats.rects++;
+    Stats.dirty_area += (bb.x - aa.x) * (bb.y - aa.y);
+    put(aa, bb, data);
+}
 
+void image_descriptor::FlushDirties(void (*put)(ivec2 aa, ivec2 bb,
+                                                void *data), void *data)
+{
+    Stats.flushes++;
+    Stats.screen_area += m_size.x * m_size.y;
 
-/*          if (x1<=p->m_aa.x) { a+=p->m_aa.x-x1; ax1=x1; } else ax1=p->m_aa.x;
-          if (y1<=p->m_aa.y) { a+=p->m_aa.y-y1; ay1=y1; } else ay1=p->m_aa.y;
-          if (x2 - 1 >=p->m_bb.x) { a+=x2 - 1 -p->m_bb.x; ax2=x2 - 1; } else ax2=p->m_bb.x;
-          if (y2 - 1 >=p->m_bb.y) { a+=y2 - 1 -p->m_bb.y; ay2=y2 - 1; } else ay2=p->m_bb.y;
+    if (!m_dirty)
+        return;
 
-      if (a<50)
-      { p->m_aa.x=ax1;                         // then expand the dirty
-        p->m_aa.y=ay1;
-        p->m_bb.x=ax2;
-        p->m_bb.y=ay2;
-        return ;
-      }
-      else */
+    // Take each run of dirty cells and the same run on the rows below
+    // for as long as they are all dirty too
+    for (int y = m_dirty_y1; y <= m_dirty_y2; y++)
+    {
+        uint8_t *row = m_dirty + y * m_cells.x;
+
+        for (int x = 0; x < m_cells.x; )
+        {
+            if (!row[x])
             {
-              if (aa.x < p->m_aa.x)
-                AddDirty(ivec2(aa.x, Max(aa.y, p->m_aa.y)),
-                         ivec2(p->m_aa.x, Min(bb.y, p->m_bb.y + 1)));
-              if (bb.x > p->m_bb.x + 1)
-                AddDirty(ivec2(p->m_bb.x + 1, Max(aa.y, p->m_aa.y)),
-                         ivec2(bb.x, Min(bb.y, p->m_bb.y + 1)));
-              if (aa.y < p->m_aa.y)
-                AddDirty(aa, ivec2(bb.x, p->m_aa.y));
-              if (bb.y - 1 > p->m_bb.y)
-                AddDirty(ivec2(aa.x, p->m_bb.y + 1), bb);
-              return ;
+                x++;
+                continue;
             }
-            p = (dirty_rect *)p->Next();
-          } else p = (dirty_rect *)p->Next();
 
-      }
-      CHECK(aa < bb);
-      dirties.add_end(new dirty_rect(aa, bb - ivec2(1)));
+            int x2 = x + 1;
+            while (x2 < m_cells.x && row[x2])
+                x2++;
+
+            int y2 = y + 1;
+            for (; y2 <= m_dirty_y2; y2++)
+            {
+                uint8_t *below = m_dirty + y2 * m_cells.x;
+                int i = x;
+                while (i < x2 && below[i])
+                    i++;
+                if (i < x2)
+                    break;
+            }
+
+            for (int j = y; j < y2; j++)
+                memset(m_dirty + j * m_cells.x + x, 0, x2 - x);
+
+            Emit(ivec2(x, y) * DIRTY_CELL,
+                 Min(ivec2(x2, y2) * DIRTY_CELL, m_size), 0, put, data);
+            x = x2;
+        }
     }
+
+    m_dirty_y1 = 0;
+    m_dirty_y2 = -1;
+    m_deleted_count = 0;
 }
 
 void image::Bar(ivec2 p1, ivec2 p2, uint8_t color)
@@ -683,17 +705,6 @@ void image::dither(palette *pal)
   Unlock();
 }
 
-void image_descriptor::ClearDirties()
-{
-    dirty_rect *dr = (dirty_rect *)dirties.first();
-    while (dr)
-    {
-        dirties.unlink(dr);
-        delete dr;
-        dr = (dirty_rect *)dirties.first();
-    }
-}
-
 void image::Scale(ivec2 new_size)
 {
     ivec2 old_size = m_size;
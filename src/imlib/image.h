@@ -15,28 +15,22 @@
 #include "linked.h"
 #include "palette.h"
 #include "specs.h"
-#define MAX_DIRTY 200
+
+// Dirty areas are kept as a bitmap of squares of this many pixels
+#define DIRTY_CELL 16
+// Deleted areas remembered exactly until the next flush
+#define MAX_DELETED 16
 
 void image_init();
 void image_uninit();
 extern linked_list image_list;
+class image;
+void image_list_remove(image *im);
 
-class dirty_rect : public linked_node
+struct DirtyStats
 {
-public :
-    dirty_rect(ivec2 aa, ivec2 bb)
-    {
-        m_aa = aa;
-        m_bb = bb;
-        if (!(bb >= aa))
-            printf("add incorrect dirty\n");
-    }
-    virtual int compare(void *n1)
-    {
-        return ((dirty_rect *)n1)->m_aa.y > m_aa.y;
-    }
-
-    ivec2 m_aa, m_bb;
+    int64_t flushes, rects;
+    int64_t dirty_area, screen_area; // in pixels, over all flushes
 };
 
 class image_descriptor
@@ -45,10 +39,10 @@ public:
     uint8_t keep_dirt,
             static_mem; // if set, don't free memory on exit
 
-    linked_list dirties;
     void *extended_descriptor;
 
     image_descriptor(ivec2 size, int keep_dirties = 1, int static_memory = 0);
+    ~image_descriptor();
     int bound_x1(int x1) { return Max(x1, m_aa.x); }
     int bound_y1(int y1) { return Max(y1, m_aa.y); }
     int bound_x2(int x2) { return Min(x2, m_bb.x); }
@@ -57,7 +51,6 @@ public:
     inline int y1_clip() { return m_aa.y; }
     inline int x2_clip() { return m_bb.x; }
     inline int y2_clip() { return m_bb.y; }
-    void ClearDirties();
     void GetClip(ivec2 &aa, ivec2 &bb)
     {
         aa = m_aa; bb = m_bb;
@@ -78,18 +71,32 @@ public:
         m_aa.x = Max(x1, 0); m_aa.y = Max(y1, 0);
         m_bb.x = Min(x2, m_size.x); m_bb.y = Min(y2, m_size.y);
     }
-    void ReduceDirties();
+
+    // Areas are marked dirty a cell at a time. Deleted areas clear the
+    // cells they cover and are also cut out of the flushed rectangles.
     void AddDirty(ivec2 aa, ivec2 bb);
     void DeleteDirty(ivec2 aa, ivec2 bb);
-    void Resize(ivec2 size)
-    {
-        m_size = size;
-        m_aa = ivec2(0);
-        m_bb = size;
-    }
+    void ClearDirties();
+    // Calls put() for the dirty areas, in rectangles made of runs of dirty
+    // cells (bb is exclusive), and clears them
+    void FlushDirties(void (*put)(ivec2 aa, ivec2 bb, void *data),
+                      void *data);
+
+    void Resize(ivec2 size);
+
+    static DirtyStats Stats;
 
 private:
+    void Emit(ivec2 aa, ivec2 bb, int deleted,
+              void (*put)(ivec2 aa, ivec2 bb, void *data), void *data);
+
     ivec2 m_size, m_aa, m_bb;
+
+    ivec2 m_cells;           // size of m_dirty, allocated on first use
+    uint8_t *m_dirty;        // one byte per cell
+    int m_dirty_y1, m_dirty_y2; // rows of cells that may be dirty
+    ivec2 m_deleted[MAX_DELETED][2];
+    int m_deleted_count;
 };
 
 class image : public linked_node
@@ -403,7 +403,7 @@ Jwindow::Jwindow(ivec2 pos, ivec2 size, ifield *f, char const *name)
     m_surf = new image(m_size, NULL, 2);
     m_surf->clear(backg);
     // Keep this from getting destroyed when image list is cleared
-    image_list.unlink(m_surf);
+    image_list_remove(m_surf);
     inm->m_surf = m_surf;
 
     next = NULL;
@@ -0,0 +1,178 @@
+/*
+ *  Abuse - dark 2D side-scrolling platform game
+ *  Copyright (c) 1995 Crack dot Com
+ *  Copyright (c) 2005-2011 Sam Hocevar <sam@hocevar.net>
+ *
+ *  This software was released into the Public Domain. As with most public
+ *  domain software, no warranty is made or implied by Crack dot Com, by
+ *  Jonathan Clark, or by Sam Hocevar.
+ */
+
+#if defined HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#if defined __SSE2__
+#   include <emmintrin.h>
+#elif defined __ARM_NEON__ || defined __ARM_NEON
+#   include <arm_neon.h>
+#endif
+
+#include "common.h"
+
+#include "scale.h"
+
+int scale_factor(ivec2 ssize, ivec2 dsize)
+{
+    for (int k = 1; k <= 4; k++)
+        if (dsize == ssize * k)
+            return k;
+    return 0;
+}
+
+// Repeats each of the w pixels of src k times
+static void widen(uint8_t *dst, uint8_t const *src, int w, int k,
+                  uint32_t const *)
+{
+    if (k == 1)
+    {
+        memcpy(dst, src, w);
+        return;
+    }
+
+    int x = 0;
+#if defined __SSE2__
+    if (k == 2 || k == 4)
+        for (; x + 16 <= w; x += 16, dst += 16 * k)
+        {
+            __m128i v = _mm_loadu_si128((__m128i const *)(src + x));
+            __m128i lo = _mm_unpacklo_epi8(v, v);
+            __m128i hi = _mm_unpackhi_epi8(v, v);
+            if (k == 2)
+            {
+                _mm_storeu_si128((__m128i *)dst, lo);
+                _mm_storeu_si128((__m128i *)(dst + 16), hi);
+            }
+            else
+            {
+                _mm_storeu_si128((__m128i *)dst, _mm_unpacklo_epi16(lo, lo));
+                _mm_storeu_si128((__m128i *)(dst + 16), _mm_unpackhi_epi16(lo, lo));
+                _mm_storeu_si128((__m128i *)(dst + 32), _mm_unpacklo_epi16(hi, hi));
+                _mm_storeu_si128((__m128i *)(dst + 48), _mm_unpackhi_epi16(hi, hi));
+            }
+        }
+#elif defined __ARM_NEON__ || defined __ARM_NEON
+    for (; x + 16 <= w; x += 16, dst += 16 * k)
+    {
+        uint8x16_t v = vld1q_u8(src + x);
+        if (k == 2)
+        {
+            uint8x16x2_t r = { { v, v } };
+            vst2q_u8(dst, r);
+        }
+        else if (k == 3)
+        {
+            uint8x16x3_t r = { { v, v, v } };
+            vst3q_u8(dst, r);
+        }
+        else
+        {
+            uint8x16x4_t r = { { v, v, v, v } };
+            vst4q_u8(dst, r);
+        }
+    }
+#endif
+    if (k == 3)
+        for (; x < w; x++, dst += 3)
+            dst[0] = dst[1] = dst[2] = src[x];
+    for (; x < w; x++)
+        for (int i = 0; i < k; i++)
+            *dst++ = src[x];
+}
+
+static void widen(uint32_t *dst, uint8_t const *src, int w, int k,
+                  uint32_t const *pal32)
+{
+    for (int x = 0; x < w; x++)
+    {
+        uint32_t c = pal32[src[x]];
+        for (int i = 0; i < k; i++)
+            *dst++ = c;
+    }
+}
+
+static inline uint8_t lookup(uint8_t *, uint8_t c, uint32_t const *)
+{
+    return c;
+}
+
+static inline uint32_t lookup(uint32_t *, uint8_t c, uint32_t const *pal32)
+{
+    return pal32[c];
+}
+
+template<typename T>
+static void scale(T *dst, int dpitch, ivec2 dsize,
+                  uint8_t const *src, int spitch, ivec2 ssize,
+                  uint32_t const *pal32)
+{
+    static int *cols = NULL, cols_size = 0;
+
+    if (!(dsize > ivec2(0)) || !(ssize > ivec2(0)))
+        return;
+
+    int k = scale_factor(ssize, dsize);
+    if (k)
+    {
+        for (int y = 0; y < ssize.y; y++, src += spitch)
+        {
+            T *row = dst;
+            widen(row, src, ssize.x, k, pal32);
+            dst += dpitch;
+            for (int i = 1; i < k; i++, dst += dpitch)
+                memcpy(dst, row, dsize.x * sizeof(T));
+        }
+        return;
+    }
+
+    if (cols_size < dsize.x)
+    {
+        cols_size = dsize.x;
+        cols = (int *)realloc(cols, sizeof(int) * cols_size);
+    }
+
+    int xstep = (ssize.x << 16) / dsize.x;
+    int ystep = (ssize.y << 16) / dsize.y;
+    for (int x = 0, sx = 0; x < dsize.x; x++, sx += xstep)
+        cols[x] = sx >> 16;
+
+    T *prev = NULL;
+    for (int y = 0, sy = 0; y < dsize.y; y++, sy += ystep, dst += dpitch)
+    {
+        if (prev && (sy >> 16) == ((sy - ystep) >> 16))
+            memcpy(dst, prev, dsize.x * sizeof(T));
+        else
+        {
+            uint8_t const *s = src + (sy >> 16) * spitch;
+            for (int x = 0; x < dsize.x; x++)
+                dst[x] = lookup(dst, s[cols[x]], pal32);
+        }
+        prev = dst;
+    }
+}
+
+void scale_image8(uint8_t *dst, int dpitch, ivec2 dsize,
+                  uint8_t const *src, int spitch, ivec2 ssize)
+{
+    scale(dst, dpitch, dsize, src, spitch, ssize, NULL);
+}
+
+void scale_image32(uint32_t *dst, int dpitch, ivec2 dsize,
+                   uint8_t const *src, int spitch, ivec2 ssize,
+                   uint32_t const *pal32)
+{
+    scale(dst, dpitch, dsize, src, spitch, ssize, pal32);
+}
+
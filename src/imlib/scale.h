@@ -0,0 +1,38 @@
+/*
+ *  Abuse - dark 2D side-scrolling platform game
+ *  Copyright (c) 1995 Crack dot Com
+ *  Copyright (c) 2005-2011 Sam Hocevar <sam@hocevar.net>
+ *
+ *  This software was released into the Public Domain. As with most public
+ *  domain software, no warranty is made or implied by Crack dot Com, by
+ *  Jonathan Clark, or by Sam Hocevar.
+ */
+
+#ifndef __SCALE_H__
+#define __SCALE_H__
+
+/*  Nearest neighbour scaling of 8-bit pixels, for presenting the screen.
+ *
+ *  src is ssize pixels with rows spitch bytes apart, dst is dsize pixels
+ *  with rows dpitch pixels apart. When dsize is ssize times 1, 2, 3 or 4
+ *  every source pixel is repeated exactly that many times: each source row
+ *  is widened once and the result copied to the other rows. Other sizes
+ *  step through the source in 16.16 fixed point like put_part_image()
+ *  always did, with a table of source columns, and a destination row is
+ *  copied from the one above when they come from the same source row.
+ *
+ *  scale_image32() also looks each pixel up in pal32, so that an 8-bit
+ *  image goes to a 32-bit surface in one pass.
+ */
+
+// Returns the integer scale dsize is of ssize, or 0 if there is none
+int scale_factor(ivec2 ssize, ivec2 dsize);
+
+void scale_image8(uint8_t *dst, int dpitch, ivec2 dsize,
+                  uint8_t const *src, int spitch, ivec2 ssize);
+void scale_image32(uint32_t *dst, int dpitch, ivec2 dsize,
+                   uint8_t const *src, int spitch, ivec2 ssize,
+                   uint32_t const *pal32);
+
+#endif // __SCALE_H__
+
@@ -21,6 +21,9 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#if !defined _WIN32
+#   include <sys/mman.h>
+#endif
 
 #include "common.h"
 
@@ -279,6 +282,41 @@ void set_spec_main_file(char const *filename, int Search_order)
   spec_main_sd.startup(&spec_main_jfile);
 }
 
+int spec_file_info(char const *filename, uint32_t *size, uint32_t *mtime)
+{
+  struct stat st;
+  const size_t tmpnamesize = 256;
+  char tmp_name[tmpnamesize];
+  if (spec_prefix && filename[0] != '/')
+    snprintf(tmp_name,tmpnamesize,"%s%s",spec_prefix,filename);
+  else { strncpy(tmp_name,filename,tmpnamesize-1); tmp_name[tmpnamesize-1]=0; }
+
+  int outside=search_order==SPEC_SEARCH_OUTSIDE_INSIDE;
+  if (outside && !stat(tmp_name,&st))
+  {
+    *size=st.st_size;
+    *mtime=st.st_mtime;
+    return 1;
+  }
+
+  // files inside the main file change when it does
+  spec_entry *se=spec_main_fd>=0 ? spec_main_sd.find(filename) : NULL;
+  if (se && !fstat(spec_main_fd,&st))
+  {
+    *size=se->size;
+    *mtime=st.st_mtime;
+    return 1;
+  }
+
+  if (!outside && !stat(tmp_name,&st))
+  {
+    *size=st.st_size;
+    *mtime=st.st_mtime;
+    return 1;
+  }
+  return 0;
+}
+
 jFILE::jFILE(FILE *file_pointer)                       // assumes fp is at begining of file
 {
   access=0;
@@ -502,6 +540,151 @@ int jFILE::unbuffered_seek(long offset, int whence) // whence=SEEK_SET, SEEK_CUR
 }
 
 
+// Map size bytes of the file behind fd from offset on (the whole file if
+// size is 0), read only and shared so that every process reading the same
+// data files uses the same page cache pages. The mapping starts on a page
+// boundary, *skip is where offset is in it.
+static uint8_t *map_fd(int fd, long offset, long size, size_t *map_size, long *skip)
+{
+#if !defined _WIN32
+  struct stat st;
+  if (fstat(fd,&st)<0 || st.st_size<=0)
+    return NULL;
+  if (!size)
+    size=st.st_size-offset;
+  if (offset<0 || size<=0 || offset+size>st.st_size)
+    return NULL;
+  *skip=offset%sysconf(_SC_PAGESIZE);
+  void *p=mmap(NULL,*skip+size,PROT_READ,MAP_SHARED,fd,offset-*skip);
+  if (p==MAP_FAILED)
+    return NULL;
+  *map_size=*skip+size;
+  return (uint8_t *)p;
+#else
+  return NULL;
+#endif
+}
+
+int mFILE::map_external(char const *filename)
+{
+  const size_t tmpnamesize = 256;
+  char tmp_name[tmpnamesize];
+  if (spec_prefix && filename[0] != '/')
+    snprintf(tmp_name,tmpnamesize,"%s%s",spec_prefix,filename);
+  else { strncpy(tmp_name,filename,tmpnamesize-1); tmp_name[tmpnamesize-1]=0; }
+
+  int fd=open(tmp_name,O_RDONLY);
+  if (fd<0)
+    return 0;
+  long skip;
+  map=map_fd(fd,0,0,&map_size,&skip);
+  close(fd);            // the mapping stays valid
+  if (!map)
+    return 0;
+  start=map;
+  file_length=map_size;
+  return 1;
+}
+
+int mFILE::map_internal(char const *filename)
+{
+  if (spec_main_fd<0)
+    return 0;
+  spec_entry *se=spec_main_sd.find(filename);
+  if (!se)
+    return 0;
+  // Map only this file's pages, so the mapping is ours to drop and the
+  // main file can change while we are open
+  long skip;
+  map=map_fd(spec_main_fd,se->offset,se->size,&map_size,&skip);
+  if (!map)
+    return 0;
+  start=map+skip;
+  file_length=se->size;
+  return 1;
+}
+
+mFILE::mFILE(char const *filename)
+{
+  // no buffering, so don't keep the buffers bFILE allocated
+  free(rbuf); free(wbuf);
+  rbuf=wbuf=NULL;
+  rbuf_size=wbuf_size=0;
+
+  map=NULL;
+  map_size=0;
+  start=NULL;
+  file_length=current_offset=0;
+
+  if (search_order==SPEC_SEARCH_OUTSIDE_INSIDE)
+    map_external(filename);
+
+  if (!start)
+    map_internal(filename);
+
+  if (!start && search_order==SPEC_SEARCH_INSIDE_OUTSIDE)
+    map_external(filename);
+}
+
+mFILE::~mFILE()
+{
+#if !defined _WIN32
+  if (map)
+    munmap(map,map_size);
+#endif
+}
+
+int mFILE::unbuffered_read(void *buf, size_t count)
+{
+  if (current_offset>=file_length)
+    return 0;
+  if ((long)count>file_length-current_offset)
+    count=file_length-current_offset;
+  memcpy(buf,start+current_offset,count);
+  current_offset+=count;
+  return count;
+}
+
+int mFILE::unbuffered_seek(long offset, int whence)
+{
+  switch (whence)
+  {
+    case SEEK_SET : break;
+    case SEEK_END : offset=file_length-offset; break;
+    case SEEK_CUR : offset+=current_offset; break;
+    default : return -1;
+  }
+  if (offset<0)
+    return -1;
+  current_offset=offset;
+  return offset;
+}
+
+void const *mFILE::mapped_data(long offset, long count)
+{
+  if (offset<0 || count<0 || offset+count>file_length)
+    return NULL;
+  return start+offset;
+}
+
+bFILE *map_file(char const *filename, int local_only)
+{
+  // Let the usual opener decide whether this file is read locally at all,
+  // files served over the network keep going through it.
+  bFILE *fp=local_only ? new jFILE(filename,"rb") : open_file(filename,"rb");
+  if (fp->open_failure() || !fp->local_file())
+    return fp;
+
+  mFILE *mp=new mFILE(filename);
+  if (mp->open_failure())
+  {
+    delete mp;
+    return fp;
+  }
+  delete fp;
+  return mp;
+}
+
 uint8_t bFILE::read_uint8()
 { uint8_t x;
   read(&x,1);
@@ -685,56 +868,96 @@ void spec_directory::print()
 }
 
 
+// type, name length, name, flags, size and offset
+#define SPEC_ENTRY_MAX (1+1+255+1+4+4)
+
+size_t spec_directory::ParseSize(uint8_t const *buf, size_t len, int count)
+{
+  size_t pos=0;
+  for (int i=0; i<count; i++)
+  {
+    if (pos+2>len)
+      return 0;
+    pos+=2+buf[pos+1]+9;
+    if (pos>len)
+      return 0;
+  }
+  return pos;
+}
+
+void spec_directory::Parse(uint8_t const *buf, size_t len, int count)
+{
+  total=0;
+  size=0;
+
+  // first pass to know how much memory the entries take
+  size_t pos=0;
+  for (int i=0; i<count && pos+2<=len && pos+2+buf[pos+1]+9<=len; i++)
+  {
+    size+=(sizeof(spec_entry)+buf[pos+1]+3)&(~3);
+    pos+=2+buf[pos+1]+9;
+    total++;
+  }
+
+  entries=(spec_entry **)malloc(sizeof(spec_entry *)*total);
+  data=malloc(size);
+  char *dp=(char *)data;
+  pos=0;
+  for (int i=0; i<total; i++)
+  {
+    spec_entry *se=(spec_entry *)dp;
+    entries[i]=se;
+
+    unsigned char name_len=buf[pos+1];
+    se->type=buf[pos];
+    se->name=dp+sizeof(spec_entry);
+    memcpy(se->name,buf+pos+2,name_len);
+    pos+=2+name_len+1; // skip the flags
+
+    uint32_t x;
+    memcpy(&x,buf+pos,4); se->size=lltl(x);
+    memcpy(&x,buf+pos+4,4); se->offset=lltl(x);
+    pos+=8;
+
+    se->data=NULL;
+    dp+=((sizeof(spec_entry)+name_len)+3)&(~3);
+  }
+}
+
 void spec_directory::startup(bFILE *fp)
 {
-  const size_t bufsize = 256;
-  char buf[bufsize];
-  memset(buf,0,bufsize);
+  char buf[10];
+  memset(buf,0,sizeof(buf));
   fp->read(buf,8);
   buf[9]=0;
-  size=0;
   if (!strcmp(buf,SPEC_SIGNATURE))
   {
-    total=fp->read_uint16();
-    entries=(spec_entry **)malloc(sizeof(spec_entry *)*total);
-    long start=fp->tell();
+    int count=fp->read_uint16();
 
-    int i;
-    for (i=0; i<total; i++)
-    {
-      fp->read(buf,2);
-      long entry_size=sizeof(spec_entry)+(unsigned char)buf[1];
-      entry_size=(entry_size+3)&(~3);
-      fp->read(buf,(unsigned char)buf[1]);
-      fp->read(buf,9);
-
-      size+=entry_size;
-    }
-    data=malloc(size);
-    char *dp=(char *)data;
-    fp->seek(start,SEEK_SET);
-    for (i=0; i<total; i++)
+    // Read the whole directory at once: guess from a typical name length
+    // and read more if the guess was short
+    size_t cap=count*32+SPEC_ENTRY_MAX,len=0,dir_size;
+    uint8_t *dir=(uint8_t *)malloc(cap);
+    long start=fp->tell();
+    for (;;)
     {
-      spec_entry *se=(spec_entry *)dp;
-      entries[i]=se;
-
-      unsigned char len,flags,type;
-      fp->read(&type,1);
-      fp->read(&len,1);
-      se->type=type;
-      se->data = NULL;
-      se->name=dp+sizeof(spec_entry);
-      fp->read(se->name,len);
-      fp->read(&flags,1);
-
-      se->size=fp->read_uint32();
-      se->offset=fp->read_uint32();
-      dp+=((sizeof(spec_entry)+len)+3)&(~3);
+      int got=fp->read(dir+len,cap-len);
+      len+=Max(got,0);
+      dir_size=ParseSize(dir,len,count);
+      if (dir_size || !count || len<cap)
+        break;
+      cap*=2;
+      dir=(uint8_t *)realloc(dir,cap);
     }
+    Parse(dir,len,count);
+    free(dir);
+    // leave the file after the directory, as reading it entry by entry did
+    fp->seek(start+dir_size,SEEK_SET);
   }
   else
   {
     total=0;
+    size=0;
     data=NULL;
     entries=NULL;
   }
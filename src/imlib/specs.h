@@ -113,6 +113,8 @@ class bFILE     // base file type which other files should be derived from (jFIL
   int seek(long offset, int whence);        // whence=SEEK_SET, SEEK_CUR, SEEK_END, ret=0=success
   int tell();
   virtual int file_size() = 0;
+  virtual int local_file() { return 1; }      // 0 if the data comes from a remote file server
+  virtual void const *mapped_data(long offset, long count) { return NULL; }  // see mFILE
 
   virtual ~bFILE();
 
@@ -155,6 +157,35 @@ public :
   virtual ~jFILE();
 } ;
 
+// Read only file backed by a memory mapping of the file (or of the main spec
+// file for files found inside of it). Reads are plain copies out of the page
+// cache, with no read buffer and no system calls, and mapped_data() hands out
+// pointers straight into the mapping. Opening fails where mmap is missing or
+// on empty files, so callers should fall back to jFILE (see map_file).
+class mFILE : public bFILE
+{
+  uint8_t *map;           // from the page the file starts on to its end
+  size_t map_size;
+  uint8_t const *start;   // first byte of this file
+  long file_length,current_offset;
+
+  int map_external(char const *filename);
+  int map_internal(char const *filename);
+protected :
+  virtual int unbuffered_read(void *buf, size_t count);
+  virtual int unbuffered_write(void const *buf, size_t count) { return 0; }
+  virtual int unbuffered_seek(long offset, int whence);
+  virtual int unbuffered_tell() { return current_offset; }
+  virtual int allow_read_buffering() { return 0; }
+  virtual int allow_write_buffering() { return 0; }
+public :
+  mFILE(char const *filename);
+  virtual int open_failure() { return start==NULL; }
+  virtual int file_size() { return file_length; }
+  virtual void const *mapped_data(long offset, long count);
+  virtual ~mFILE();
+} ;
+
 class spec_entry
 {
 public:
@@ -182,6 +213,10 @@ public :
 
     void startup(bFILE *fp);
     void FullyLoad(bFILE *fp);
+    // Reads count entries laid out like in a file, after the entry count
+    void Parse(uint8_t const *buf, size_t len, int count);
+    // Size of the count entries at buf, or 0 if len is too short
+    static size_t ParseSize(uint8_t const *buf, size_t len, int count);
 
 //  spec_directory(char *filename);  ; ; not allowed anymore, user must construct file first!
   spec_entry *find(char const *name);
@@ -221,8 +256,12 @@ void write_uint32(FILE *fp, uint32_t x);
 void write_uint8(FILE *fp, uint8_t x);
 
 void set_spec_main_file(char *filename, int Search_order);
+// Size and modification time of a local file, found like jFILE finds it.
+// Returns 0 if there is no such file.
+int spec_file_info(char const *filename, uint32_t *size, uint32_t *mtime);
 void set_file_opener(bFILE *(*open_fun)(char const *, char const *));
 void set_no_space_handler(void (*handle_fun)());
 bFILE *open_file(char const *filename, char const *mode);
+bFILE *map_file(char const *filename, int local_only=0);  // read only, mFILE when the file is local
 #endif
 
@@ -15,10 +15,286 @@
 #include <cstdio>
 #include <cstring>
 
+#if defined __SSE2__
+#   define TRANS_SSE2 1
+#   include <emmintrin.h>
+#endif
+#if defined __GNUC__ && defined __x86_64__
+#   define TRANS_AVX2 1
+#   include <immintrin.h>
+#endif
+
 #include "common.h"
 
 #include "transimage.h"
 
+//
+// Span kernels for the modes that look pixels up in tables. The scalar
+// ones are the reference: every other kernel must give the same bytes.
+//
+
+struct FadeArgs
+{
+    uint8_t const *tint;   // FADE_TINT only
+    uint8_t const *pal;    // 256 RGB triplets
+    uint32_t const *pal32; // the same as 0x00bbggrr, for the SIMD kernels
+    uint8_t const *filter;
+    int fsize, mul;
+};
+
+struct TransKernel
+{
+    char const *name;
+    int (*Supported)();
+    void (*Remap)(uint8_t *dst, uint8_t const *src, int count,
+                  uint8_t const *map);
+    void (*Remap2)(uint8_t *dst, uint8_t const *src, int count,
+                   uint8_t const *map, uint8_t const *map2);
+    // under is the screen itself, or the blend image
+    void (*Fade)(uint8_t *dst, uint8_t const *under, uint8_t const *src,
+                 int count, FadeArgs const &a);
+};
+
+static int always() { return 1; }
+
+static void remap_scalar(uint8_t *dst, uint8_t const *src, int count,
+                         uint8_t const *map)
+{
+    while (count--)
+        *dst++ = map[*src++];
+}
+
+static void remap2_scalar(uint8_t *dst, uint8_t const *src, int count,
+                          uint8_t const *map, uint8_t const *map2)
+{
+    while (count--)
+        *dst++ = map2[map[*src++]];
+}
+
+static inline uint8_t fade_pixel(uint8_t under, uint8_t src,
+                                 FadeArgs const &a)
+{
+    uint8_t const *p1 = a.pal + 3 * under;
+    uint8_t const *p2 = a.pal + 3 * (a.tint ? a.tint[src] : src);
+
+    uint8_t r = ((((int)p1[0] - p2[0]) * a.mul) >> 16) + p2[0];
+    uint8_t g = ((((int)p1[1] - p2[1]) * a.mul) >> 16) + p2[1];
+    uint8_t b = ((((int)p1[2] - p2[2]) * a.mul) >> 16) + p2[2];
+
+    return a.filter[((r >> 3) * a.fsize + (g >> 3)) * a.fsize + (b >> 3)];
+}
+
+static void fade_scalar(uint8_t *dst, uint8_t const *under,
+                        uint8_t const *src, int count, FadeArgs const &a)
+{
+    while (count--)
+        *dst++ = fade_pixel(*under++, *src++, a);
+}
+
+#if TRANS_SSE2
+// One channel of eight pixels in 16-bit lanes. There is no 32-bit multiply,
+// so mul is split in halves: (d * mul) >> 16 is d * hi plus the high word
+// of d * lo, which the signed multiply gets d too low when lo >= 0x8000.
+static inline __m128i fade_channel_sse2(__m128i const c1[2],
+                                        __m128i const c2[2], int shift,
+                                        __m128i hi, __m128i lo, __m128i fix)
+{
+    __m128i const mask = _mm_set1_epi32(0xff);
+    __m128i a = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(c1[0], shift), mask),
+                                _mm_and_si128(_mm_srli_epi32(c1[1], shift), mask));
+    __m128i b = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(c2[0], shift), mask),
+                                _mm_and_si128(_mm_srli_epi32(c2[1], shift), mask));
+    __m128i d = _mm_sub_epi16(a, b);
+    __m128i x = _mm_add_epi16(_mm_mulhi_epi16(d, lo), _mm_and_si128(d, fix));
+    x = _mm_add_epi16(x, _mm_mullo_epi16(d, hi));
+    // Truncate to 8 bits like the scalar code, then keep the top 5
+    return _mm_srli_epi16(_mm_and_si128(_mm_add_epi16(x, b),
+                                        _mm_set1_epi16(0xff)), 3);
+}
+
+// Eight pixels at a time; SSE2 has no gathers, so the palette and filter
+// lookups stay scalar and only the arithmetic is done in vectors
+static void fade_sse2(uint8_t *dst, uint8_t const *under, uint8_t const *src,
+                      int count, FadeArgs const &a)
+{
+    // Filter indices must fit in 16 bits
+    if (a.fsize > 32)
+    {
+        fade_scalar(dst, under, src, count, a);
+        return;
+    }
+
+    __m128i const hi = _mm_set1_epi16((int16_t)(a.mul >> 16));
+    __m128i const lo = _mm_set1_epi16((int16_t)(a.mul & 0xffff));
+    __m128i const fix = _mm_set1_epi16((a.mul & 0x8000) ? -1 : 0);
+    __m128i const fsize = _mm_set1_epi16(a.fsize);
+    uint32_t const *pal32 = a.pal32;
+
+    for (; count >= 8; count -= 8, dst += 8, under += 8, src += 8)
+    {
+        uint8_t s[8];
+        for (int i = 0; i < 8; i++)
+            s[i] = a.tint ? a.tint[src[i]] : src[i];
+
+        __m128i c1[2], c2[2];
+        c1[0] = _mm_setr_epi32(pal32[under[0]], pal32[under[1]],
+                               pal32[under[2]], pal32[under[3]]);
+        c1[1] = _mm_setr_epi32(pal32[under[4]], pal32[under[5]],
+                               pal32[under[6]], pal32[under[7]]);
+        c2[0] = _mm_setr_epi32(pal32[s[0]], pal32[s[1]],
+                               pal32[s[2]], pal32[s[3]]);
+        c2[1] = _mm_setr_epi32(pal32[s[4]], pal32[s[5]],
+                               pal32[s[6]], pal32[s[7]]);
+
+        __m128i r = fade_channel_sse2(c1, c2, 0, hi, lo, fix);
+        __m128i g = fade_channel_sse2(c1, c2, 8, hi, lo, fix);
+        __m128i b = fade_channel_sse2(c1, c2, 16, hi, lo, fix);
+        __m128i idx = _mm_add_epi16(_mm_mullo_epi16(
+                          _mm_add_epi16(_mm_mullo_epi16(r, fsize), g),
+                          fsize), b);
+
+        uint16_t n[8];
+        _mm_storeu_si128((__m128i *)n, idx);
+        for (int i = 0; i < 8; i++)
+            dst[i] = a.filter[n[i]];
+    }
+    fade_scalar(dst, under, src, count, a);
+}
+#endif
+
+#if TRANS_AVX2
+static int avx2_supported()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+static inline __attribute__((target("avx2")))
+__m256i fade_channel(__m256i c1, __m256i c2, int shift, __m256i mul)
+{
+    __m256i const mask = _mm256_set1_epi32(0xff);
+    __m256i a = _mm256_and_si256(_mm256_srli_epi32(c1, shift), mask);
+    __m256i b = _mm256_and_si256(_mm256_srli_epi32(c2, shift), mask);
+    __m256i x = _mm256_srai_epi32(_mm256_mullo_epi32(_mm256_sub_epi32(a, b),
+                                                     mul), 16);
+    // Truncate to 8 bits like the scalar code, then keep the top 5
+    return _mm256_srli_epi32(_mm256_and_si256(_mm256_add_epi32(x, b), mask), 3);
+}
+
+// Eight pixels at a time in 32-bit lanes, with gathers for the palette
+// and filter lookups
+static __attribute__((target("avx2")))
+void fade_avx2(uint8_t *dst, uint8_t const *under, uint8_t const *src,
+               int count, FadeArgs const &a)
+{
+    __m256i const mul = _mm256_set1_epi32(a.mul);
+    __m256i const fsize = _mm256_set1_epi32(a.fsize);
+    __m256i const low_bytes = _mm256_setr_epi8(
+        0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+
+    for (; count >= 8; count -= 8, dst += 8, under += 8, src += 8)
+    {
+        int64_t u, v;
+        memcpy(&u, under, 8);
+        if (a.tint)
+        {
+            uint8_t tinted[8];
+            for (int i = 0; i < 8; i++)
+                tinted[i] = a.tint[src[i]];
+            memcpy(&v, tinted, 8);
+        }
+        else
+            memcpy(&v, src, 8);
+
+        __m256i i1 = _mm256_cvtepu8_epi32(_mm_cvtsi64_si128(u));
+        __m256i i2 = _mm256_cvtepu8_epi32(_mm_cvtsi64_si128(v));
+        __m256i c1 = _mm256_i32gather_epi32((int const *)a.pal32, i1, 4);
+        __m256i c2 = _mm256_i32gather_epi32((int const *)a.pal32, i2, 4);
+
+        __m256i r = fade_channel(c1, c2, 0, mul);
+        __m256i g = fade_channel(c1, c2, 8, mul);
+        __m256i b = fade_channel(c1, c2, 16, mul);
+        __m256i idx = _mm256_add_epi32(_mm256_mullo_epi32(
+                          _mm256_add_epi32(_mm256_mullo_epi32(r, fsize), g),
+                          fsize), b);
+
+        // The filter table is padded so that these never read past it
+        __m256i x = _mm256_i32gather_epi32((int const *)a.filter, idx, 1);
+        x = _mm256_shuffle_epi8(x, low_bytes);
+        __m128i y = _mm_unpacklo_epi32(_mm256_castsi256_si128(x),
+                                       _mm256_extracti128_si256(x, 1));
+        _mm_storel_epi64((__m128i *)dst, y);
+    }
+    fade_scalar(dst, under, src, count, a);
+}
+#endif
+
+// Best first; the last one is the reference
+static TransKernel const trans_kernels[] =
+{
+#if TRANS_AVX2
+    { "avx2", avx2_supported, remap_scalar, remap2_scalar, fade_avx2 },
+#endif
+#if TRANS_SSE2
+    { "sse2", always, remap_scalar, remap2_scalar, fade_sse2 },
+#endif
+    { "scalar", always, remap_scalar, remap2_scalar, fade_scalar },
+};
+
+static int const trans_kernel_count = sizeof(trans_kernels)
+                                       / sizeof(*trans_kernels);
+
+static TransKernel const *pick_kernel()
+{
+    for (int i = 0; ; i++)
+        if (trans_kernels[i].Supported())
+            return trans_kernels + i;
+}
+
+static TransKernel const *trans_kernel = pick_kernel();
+
+char const *TransImage::KernelName(int n)
+{
+    if (n < 0 || n >= trans_kernel_count || !trans_kernels[n].Supported())
+        return NULL;
+    return trans_kernels[n].name;
+}
+
+int TransImage::KernelCount()
+{
+    return trans_kernel_count;
+}
+
+int TransImage::GetKernel()
+{
+    return trans_kernel - trans_kernels;
+}
+
+void TransImage::SetKernel(int n)
+{
+    if (KernelName(n))
+        trans_kernel = trans_kernels + n;
+}
+
+// Palettes as 32-bit entries, cached for as long as the palette is the same
+static uint32_t const *palette32(uint8_t const *pal)
+{
+    static uint8_t last[256 * 3];
+    static uint32_t ret[256];
+    static int valid = 0;
+
+    if (!valid || memcmp(last, pal, sizeof(last)))
+    {
+        memcpy(last, pal, sizeof(last));
+        for (int i = 0; i < 256; i++)
+            ret[i] = pal[3 * i] | (pal[3 * i + 1] << 8)
+                      | (pal[3 * i + 2] << 16);
+        valid = 1;
+    }
+    return ret;
+}
+
 TransImage::TransImage(image *im, char const *name)
 {
     m_size = im->Size();
@@ -52,16 +328,18 @@ TransImage::TransImage(image *im, char const *name)
     }
 
     uint8_t *parser = m_data = (uint8_t *)malloc(bytes);
-    if (!parser)
+    m_rows = (uint32_t *)malloc(sizeof(uint32_t) * Max(m_size.y, 1));
+    if (!parser || !m_rows)
     {
         printf("size = %d %d (%ld bytes)\n", m_size.x, m_size.y, (long)bytes);
-        CONDITION(parser, "malloc error for TransImage::m_data");
+        CONDITION(parser && m_rows, "malloc error for TransImage::m_data");
     }
 
     // Now fill the RLE transparency image
     for (int y = 0; y < m_size.y; y++)
     {
         uint8_t *sl = im->scan_line(y);
+        m_rows[y] = parser - m_data;
 
         for (int x = 0; x < m_size.x; )
         {
@@ -95,6 +373,7 @@ TransImage::TransImage(image *im, char const *name)
 TransImage::~TransImage()
 {
     free(m_data);
+    free(m_rows);
 }
 
 image *TransImage::ToImage()
@@ -118,83 +397,48 @@ uint8_t *TransImage::ClipToLine(image *screen, ivec2 pos1, ivec2 pos2,
          || pos.x >= pos2.x || pos.x + m_size.x <= pos1.x)
         return NULL;
 
-    uint8_t *parser = m_data;
-
     // Number of lines to skip, number of lines to draw, first line to draw
     int skiplines = Max(pos1.y - pos.y, 0);
-    ysteps = Min(pos2.y - pos.y, m_size.y - skiplines);
+    ysteps = Min(pos2.y - pos.y, m_size.y) - skiplines;
     pos.y += skiplines;
 
-    while (skiplines--)
-    {
-        for (int ix = 0; ix < m_size.x; )
-        {
-            ix += *parser++; // skip over empty space
-
-            if (ix >= m_size.x)
-                break;
-
-            ix += *parser;
-            parser += *parser + 1; // skip over data
-        }
-    }
+    uint8_t *parser = m_data + m_rows[skiplines];
 
     screen->AddDirty(ivec2(Max(pos.x, pos1.x), pos.y),
                      ivec2(Min(pos.x + m_size.x, pos2.x), pos.y + m_size.y));
     return parser;
 }
 
-template<int N>
-void TransImage::PutImageGeneric(image *screen, ivec2 pos, uint8_t color,
-                                 image *blend, ivec2 bpos, uint8_t *map,
-                                 uint8_t *map2, int amount, int nframes,
-                                 uint8_t *tint, ColorFilter *f, palette *pal)
+// What PutLines() needs from PutImageGeneric()
+struct TransLines
 {
-    ivec2 pos1, pos2;
-    int ysteps, mul = 0;
-
-    screen->GetClip(pos1, pos2);
-
-    if (N == SCANLINE)
-    {
-        pos1.y = Max(pos1.y, pos.y + amount);
-        pos2.y = Min(pos2.y, pos.y + amount + 1);
-        if (pos1.y >= pos2.y)
-            return;
-    }
-
-    uint8_t *datap = ClipToLine(screen, pos1, pos2, pos, ysteps),
-            *screen_line, *blend_line = NULL, *paddr = NULL;
-    if (!datap)
-        return; // if ClipToLine says nothing to draw, return
-
-    CONDITION(N != BLEND || (pos.y >= bpos.y
-                              && pos.y + ysteps <= bpos.y + blend->Size().y),
-              "Blend doesn't fit on TransImage");
-
-    if (N == FADE || N == FADE_TINT || N == BLEND)
-        paddr = (uint8_t *)pal->addr();
-
-    if (N == FADE || N == FADE_TINT)
-        mul = (amount << 16) / nframes;
-    else if (N == BLEND)
-        mul = ((16 - amount) << 16 / 16);
-
-    if (N == PREDATOR)
-        ysteps = Min(ysteps, pos2.y - 1 - pos.y - 2);
-
-    screen->Lock();
-
-    screen_line = screen->scan_line(pos.y) + pos.x;
-    int sw = screen->Size().x;
-    pos1.x -= pos.x; pos2.x -= pos.x;
+    uint8_t *datap, *screen_line;
+    int width, pitch, ysteps;
+    int left, right;       // clip rectangle, relative to the sprite
+    uint8_t color;
+    uint8_t *map, *map2;
+    image *blend;
+    ivec2 pos, bpos;
+    TransKernel const *k;
+    FadeArgs fade;
+};
+
+// Draws the RLE lines. When CLIP is 0, the caller has checked that the
+// sprite lies within the clip rectangle horizontally, so runs are drawn
+// whole.
+template<int N, int CLIP>
+void TransImage::PutLines(TransLines &p)
+{
+    uint8_t *datap = p.datap, *screen_line = p.screen_line;
+    uint8_t *blend_line = NULL;
+    int const width = p.width;
 
-    for (; ysteps > 0; ysteps--, pos.y++)
+    for (int ysteps = p.ysteps; ysteps > 0; ysteps--, p.pos.y++)
     {
         if (N == BLEND)
-            blend_line = blend->scan_line(pos.y - bpos.y);
+            blend_line = p.blend->scan_line(p.pos.y - p.bpos.y);
 
-        for (int ix = 0; ix < m_size.x; )
+        for (int ix = 0; ix < width; )
         {
             // Handle a run of transparent pixels
             int todo = *datap++;
@@ -203,22 +447,26 @@ void TransImage::PutImageGeneric(image *screen, ivec2 pos, uint8_t color,
             ix += todo;
             screen_line += todo;
 
-            if (ix >= m_size.x)
+            if (ix >= width)
                 break;
 
             // Handle a run of solid pixels
             todo = *datap++;
+            int count = todo;
 
-            // Chop left side if necessary, but no more than todo
-            int tochop = Min(todo, Max(pos1.x - ix, 0));
+            if (CLIP)
+            {
+                // Chop left side if necessary, but no more than todo
+                int tochop = Min(todo, Max(p.left - ix, 0));
 
-            ix += tochop;
-            screen_line += tochop;
-            datap += tochop;
-            todo -= tochop;
+                ix += tochop;
+                screen_line += tochop;
+                datap += tochop;
+                todo -= tochop;
 
-            // Chop right side if necessary and process the remaining pixels
-            int count = Min(todo, Max(pos2.x - ix, 0));
+                // Chop right side if necessary
+                count = Min(todo, Max(p.right - ix, 0));
+            }
 
             if (N == NORMAL || N == SCANLINE)
             {
@@ -226,51 +474,106 @@ void TransImage::PutImageGeneric(image *screen, ivec2 pos, uint8_t color,
             }
             else if (N == COLOR)
             {
-                memset(screen_line, color, count);
+                memset(screen_line, p.color, count);
             }
             else if (N == PREDATOR)
             {
-                memcpy(screen_line, screen_line + 2 * m_size.x, count);
+                memcpy(screen_line, screen_line + 2 * width, count);
             }
             else if (N == REMAP)
             {
-                uint8_t *sl = screen_line, *sl2 = datap;
-                while (count--)
-                    *sl++ = map[*sl2++];
+                p.k->Remap(screen_line, datap, count, p.map);
             }
             else if (N == REMAP2)
             {
-                uint8_t *sl = screen_line, *sl2 = datap;
-                while (count--)
-                    *sl++ = map2[map[*sl2++]];
+                p.k->Remap2(screen_line, datap, count, p.map, p.map2);
             }
             else if (N == FADE || N == FADE_TINT || N == BLEND)
             {
-                uint8_t *sl = screen_line;
-                uint8_t *sl2 = (N == BLEND) ? blend_line + pos.x + ix - bpos.x
-                                            : sl;
-                uint8_t *sl3 = datap;
-
-                while (count--)
-                {
-                    uint8_t *p1 = paddr + 3 * *sl2++;
-                    uint8_t *p2 = paddr + 3 * (N == FADE_TINT ? tint[*sl3++]
-                                                              : *sl3++);
-
-                    uint8_t r = ((((int)p1[0] - p2[0]) * mul) >> 16) + p2[0];
-                    uint8_t g = ((((int)p1[1] - p2[1]) * mul) >> 16) + p2[1];
-                    uint8_t b = ((((int)p1[2] - p2[2]) * mul) >> 16) + p2[2];
-
-                    *sl++ = f->Lookup(r >> 3, g >> 3, b >> 3);
-                }
+                uint8_t *under = (N == BLEND)
+                               ? blend_line + p.pos.x + ix - p.bpos.x
+                               : screen_line;
+                p.k->Fade(screen_line, under, datap, count, p.fade);
             }
 
             datap += todo;
             ix += todo;
             screen_line += todo;
         }
-        screen_line += sw - m_size.x;
+        screen_line += p.pitch - width;
     }
+}
+
+template<int N>
+void TransImage::PutImageGeneric(image *screen, ivec2 pos, uint8_t color,
+                                 image *blend, ivec2 bpos, uint8_t *map,
+                                 uint8_t *map2, int amount, int nframes,
+                                 uint8_t *tint, ColorFilter *f, palette *pal)
+{
+    ivec2 pos1, pos2;
+    int ysteps, mul = 0;
+
+    screen->GetClip(pos1, pos2);
+
+    if (N == SCANLINE)
+    {
+        pos1.y = Max(pos1.y, pos.y + amount);
+        pos2.y = Min(pos2.y, pos.y + amount + 1);
+        if (pos1.y >= pos2.y)
+            return;
+    }
+
+    uint8_t *datap = ClipToLine(screen, pos1, pos2, pos, ysteps);
+    if (!datap)
+        return; // if ClipToLine says nothing to draw, return
+
+    CONDITION(N != BLEND || (pos.y >= bpos.y
+                              && pos.y + ysteps <= bpos.y + blend->Size().y),
+              "Blend doesn't fit on TransImage");
+
+    TransLines p;
+    p.k = trans_kernel;
+
+    if (N == FADE || N == FADE_TINT || N == BLEND)
+    {
+        uint8_t *paddr = (uint8_t *)pal->addr();
+        p.fade.tint = (N == FADE_TINT) ? tint : NULL;
+        p.fade.pal = paddr;
+        p.fade.pal32 = (p.k->Fade != fade_scalar) ? palette32(paddr) : NULL;
+        p.fade.filter = f->Table();
+        p.fade.fsize = f->Size();
+    }
+
+    if (N == FADE || N == FADE_TINT)
+        mul = (amount << 16) / nframes;
+    else if (N == BLEND)
+        mul = ((16 - amount) << 16 / 16);
+    p.fade.mul = mul;
+
+    if (N == PREDATOR)
+        ysteps = Min(ysteps, pos2.y - 1 - pos.y - 2);
+
+    screen->Lock();
+
+    p.datap = datap;
+    p.screen_line = screen->scan_line(pos.y) + pos.x;
+    p.width = m_size.x;
+    p.pitch = screen->Size().x;
+    p.ysteps = ysteps;
+    p.left = pos1.x - pos.x;
+    p.right = pos2.x - pos.x;
+    p.color = color;
+    p.map = map;
+    p.map2 = map2;
+    p.blend = blend;
+    p.pos = pos;
+    p.bpos = bpos;
+
+    if (p.left <= 0 && p.right >= m_size.x)
+        PutLines<N, 0>(p);
+    else
+        PutLines<N, 1>(p);
+
     screen->Unlock();
 }
 
@@ -358,6 +661,11 @@ size_t TransImage::DiskUsage()
             size_t run = *d++; ret += run + 1; d += run; x += run;
         }
     }
-    return ret + sizeof(void *) + sizeof(ivec2);
+    return ret + 2 * sizeof(void *) + sizeof(ivec2) + IndexUsage();
+}
+
+size_t TransImage::IndexUsage()
+{
+    return sizeof(uint32_t) * Max(m_size.y, 1);
 }
 
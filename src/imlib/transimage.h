@@ -15,6 +15,8 @@
 #include "palette.h"
 #include "filter.h"
 
+struct TransLines;
+
 /*  Data is stored in the following format:
  *
  *   uint8_t skip;       // transparent pixel count
@@ -22,6 +24,9 @@
  *   uint8_t data[size]; // solid pixel values
  *   ...
  *   (no scan line wraps allowed, there can be a last skip value)
+ *
+ *  The offset of each line in the data is kept alongside, so that clipped
+ *  draws can start at their first visible line.
  */
 
 class TransImage
@@ -49,7 +54,16 @@ public:
                   int blend_amount, ColorFilter *f, palette *pal);
     void PutScanLine(image *screen, ivec2 pos, int line);
 
-    size_t DiskUsage();
+    size_t DiskUsage();   // includes the line index
+    size_t IndexUsage();  // memory used by the line index
+
+    // The table lookups in PutRemap, PutDoubleRemap, PutFade, PutFadeTint
+    // and PutBlend use SIMD kernels when the CPU has them. The best one is
+    // picked at startup; the last one is the scalar reference.
+    static int KernelCount();
+    static char const *KernelName(int n); // NULL if not supported here
+    static int GetKernel();
+    static void SetKernel(int n);
 
 private:
     uint8_t *ClipToLine(image *screen, ivec2 pos1, ivec2 pos2,
@@ -63,9 +77,12 @@ private:
                          uint8_t *map1, uint8_t *map2, int amount,
                          int nframes, uint8_t *tint,
                          ColorFilter *f, palette *pal);
+    template<int N, int CLIP>
+    static void PutLines(TransLines &p);
 
     ivec2 m_size;
     uint8_t *m_data;
+    uint32_t *m_rows; // offset of each line in m_data
 };
 
 #endif
@@ -19,6 +19,19 @@
 #include "image.h"
 #include "video.h"
 
+struct DirtyTarget
+{
+    image *im;
+    int xoff, yoff;
+};
+
+static void put_dirty(ivec2 aa, ivec2 bb, void *data)
+{
+    DirtyTarget *t = (DirtyTarget *)data;
+    put_part_image(t->im, t->xoff + aa.x, t->yoff + aa.y,
+                   aa.x, aa.y, bb.x, bb.y);
+}
+
 void update_dirty(image *im, int xoff, int yoff)
 {
     // make sure the image has the ability to contain dirty areas
@@ -30,19 +43,8 @@ void update_dirty(image *im, int xoff, int yoff)
     }
     else
     {
-        int count = im->m_special->dirties.Count();
-        dirty_rect *dr = (dirty_rect *)(im->m_special->dirties.first());
-        while (count > 0)
-        {
-            put_part_image(im, xoff + dr->m_aa.x, yoff + dr->m_aa.y,
-                           dr->m_aa.x, dr->m_aa.y,
-                           dr->m_bb.x + 1, dr->m_bb.y + 1);
-            dirty_rect *tmp = dr;
-            dr = (dirty_rect *)(dr->Next());
-            im->m_special->dirties.unlink(tmp);
-            delete tmp;
-            count--;
-        }
+        DirtyTarget t = { im, xoff, yoff };
+        im->m_special->FlushDirties(put_dirty, &t);
     }
 
     update_window_done();
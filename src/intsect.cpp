@@ -14,6 +14,15 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#if defined __SSE2__
+#   include <emmintrin.h>
+#elif defined __ARM_NEON__ || defined __ARM_NEON
+#   include <arm_neon.h>
+#endif
+
+#include "common.h"
+
+#include "intsect.h"
 
 void pushback(int32_t x1,int32_t y1,int32_t &x2,int32_t &y2,
              int32_t xp1, int32_t yp1, int32_t xp2, int32_t yp2, int xdir, int ydir, int inside)
@@ -245,3 +254,160 @@ int setback_intersect(int32_t x1,int32_t y1,int32_t &x2,int32_t &y2,
 
 }
 
+
+EdgeList::EdgeList(unsigned char tot, unsigned char const *data,
+                   unsigned char const *ins, int32_t Tl, int32_t Th)
+{
+  tl=Tl;
+  th=Th;
+  count=tot>1 ? tot-1 : 0;
+  int n=Room(count);
+  c=(int32_t *)malloc(n*EDGE_BYTES);
+  p1=(int16_t *)(c+n);
+  p2=p1+2*n;
+  ab=p2+2*n;
+  inside=(unsigned char *)(ab+2*n);
+
+  for (int j=0; j<n; j++)
+  {
+    int32_t x1=0,y1=0,x2=0,y2=0,r;
+    if (j<count)
+    {
+      // left and top edges out by one, right and bottom edges by two
+      x1=data[j*2]==0 ? -1 : data[j*2]==tl-1 ? tl+1 : data[j*2];
+      y1=data[j*2+1]==0 ? -1 : data[j*2+1]==th-1 ? th+1 : data[j*2+1];
+      x2=data[j*2+2]==0 ? -1 : data[j*2+2]==tl-1 ? tl+1 : data[j*2+2];
+      y2=data[j*2+3]==0 ? -1 : data[j*2+3]==th-1 ? th+1 : data[j*2+3];
+      if (y1<y2 || (y1==y2 && x1>x2))
+      {
+        r=y1; y1=y2; y2=r;
+        r=x1; x1=x2; x2=r;
+      }
+    }
+    p1[j*2]=x1;
+    p1[j*2+1]=y1;
+    p2[j*2]=x2;
+    p2[j*2+1]=y2;
+    ab[j*2]=y2-y1;
+    ab[j*2+1]=x1-x2;
+    c[j]=-x1*y2+x2*y1;
+    inside[j]=j<count ? ins[j] : 0;
+  }
+}
+
+// Whether r1 and r2 pass the sign tests in setback_intersect()
+static inline int signs_differ(int32_t r1, int32_t r2)
+{
+  return (r1^r2)<=0 || r1==0 || r2==0;
+}
+
+#if defined __SSE2__
+static inline int signs_differ4(__m128i r1, __m128i r2)
+{
+  __m128i zero=_mm_setzero_si128();
+  __m128i m=_mm_or_si128(_mm_cmpgt_epi32(_mm_set1_epi32(1),_mm_xor_si128(r1,r2)),
+                         _mm_or_si128(_mm_cmpeq_epi32(r1,zero),
+                                      _mm_cmpeq_epi32(r2,zero)));
+  return _mm_movemask_ps(_mm_castsi128_ps(m));
+}
+
+static inline __m128i pair(int32_t x, int32_t y)
+{
+  return _mm_set1_epi32((uint16_t)x|((uint32_t)y<<16));
+}
+#elif defined __ARM_NEON__ || defined __ARM_NEON
+static inline int signs_differ4(int32x4_t r1, int32x4_t r2)
+{
+  int32x4_t zero=vdupq_n_s32(0);
+  uint32x4_t m=vorrq_u32(vcleq_s32(veorq_s32(r1,r2),zero),
+                         vorrq_u32(vceqq_s32(r1,zero),vceqq_s32(r2,zero)));
+  uint32x4_t bits={1,2,4,8};
+  uint32x2_t t=vmovn_u64(vpaddlq_u32(vandq_u32(m,bits)));
+  return vget_lane_u32(vpadd_u32(t,t),0);
+}
+#endif
+
+// Bit i set if edge j+i passes both sign tests of setback_intersect() for
+// the line x1,y1-x2,y2. The tests hold the same in tile coordinates, where
+// everything fits in 16 bits unless the line is very long or far away.
+static int crossing_edges(EdgeList const *e, int j, int32_t x1, int32_t y1,
+                          int32_t x2, int32_t y2)
+{
+  int32_t a1=y2-y1,b1=x1-x2,c1=-x1*y2+x2*y1;
+  int mask=0;
+
+#if defined __SSE2__ || defined __ARM_NEON__ || defined __ARM_NEON
+  if (Max(Max(abs(a1),abs(b1)),Max(Max(abs(x1),abs(y1)),Max(abs(x2),abs(y2))))<0x8000)
+  {
+#   if defined __SSE2__
+    __m128i l1=pair(a1,b1),c=_mm_set1_epi32(c1);
+    __m128i r1=_mm_add_epi32(_mm_madd_epi16(_mm_loadu_si128((__m128i const *)(e->p1+j*2)),l1),c);
+    __m128i r2=_mm_add_epi32(_mm_madd_epi16(_mm_loadu_si128((__m128i const *)(e->p2+j*2)),l1),c);
+    mask=signs_differ4(r1,r2);
+    if (mask)
+    {
+      __m128i l2=_mm_loadu_si128((__m128i const *)(e->ab+j*2));
+      c=_mm_loadu_si128((__m128i const *)(e->c+j));
+      r1=_mm_add_epi32(_mm_madd_epi16(l2,pair(x1,y1)),c);
+      r2=_mm_add_epi32(_mm_madd_epi16(l2,pair(x2,y2)),c);
+      mask&=signs_differ4(r1,r2);
+    }
+#   else
+    int16x4x2_t p=vld2_s16(e->p1+j*2),q=vld2_s16(e->p2+j*2);
+    int32x4_t c=vdupq_n_s32(c1);
+    int32x4_t r1=vaddq_s32(vmlal_n_s16(vmull_n_s16(p.val[0],a1),p.val[1],b1),c);
+    int32x4_t r2=vaddq_s32(vmlal_n_s16(vmull_n_s16(q.val[0],a1),q.val[1],b1),c);
+    mask=signs_differ4(r1,r2);
+    if (mask)
+    {
+      int16x4x2_t l=vld2_s16(e->ab+j*2);
+      c=vld1q_s32(e->c+j);
+      r1=vaddq_s32(vmlal_n_s16(vmull_n_s16(l.val[0],x1),l.val[1],y1),c);
+      r2=vaddq_s32(vmlal_n_s16(vmull_n_s16(l.val[0],x2),l.val[1],y2),c);
+      mask&=signs_differ4(r1,r2);
+    }
+#   endif
+    return mask;
+  }
+#endif
+
+  for (int i=0; i<4; i++)
+  {
+    int16_t const *p=e->p1+(j+i)*2,*q=e->p2+(j+i)*2,*l=e->ab+(j+i)*2;
+    if (signs_differ(p[0]*a1+p[1]*b1+c1,q[0]*a1+q[1]*b1+c1)
+        && signs_differ(x1*l[0]+y1*l[1]+e->c[j+i],x2*l[0]+y2*l[1]+e->c[j+i]))
+      mask|=1<<i;
+  }
+  return mask;
+}
+
+int setback_intersect_edges(int32_t x1, int32_t y1, int32_t &x2, int32_t &y2,
+                            EdgeList const *e, int32_t xo, int32_t yo)
+{
+  int hits=0;
+  for (int j=0; j<e->count; j+=4)
+  {
+    int valid=e->count-j<4 ? (1<<(e->count-j))-1 : 15;
+    int mask=crossing_edges(e,j,x1-xo,y1-yo,x2-xo,y2-yo)&valid;
+    while (mask)
+    {
+      int i=0;
+      while (!(mask&(1<<i)))
+        i++;
+      valid&=~((2<<i)-1);
+      mask&=valid;
+
+      int16_t const *p=e->p1+(j+i)*2,*q=e->p2+(j+i)*2;
+      int32_t ox2=x2,oy2=y2;
+      setback_intersect(x1,y1,x2,y2,xo+p[0],yo+p[1],xo+q[0],yo+q[1],
+                        e->inside[j+i] ? 1 : -1);
+      if (ox2!=x2 || oy2!=y2)
+      {
+        // the rest of these edges against the shortened line
+        hits++;
+        mask=crossing_edges(e,j,x1-xo,y1-yo,x2-xo,y2-yo)&valid;
+      }
+    }
+  }
+  return hits;
+}
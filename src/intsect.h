@@ -11,9 +11,47 @@
 #ifndef __INTSECT_HPP_
 #define __INTSECT_HPP_
 
+#include <stdlib.h>
+#include <stdint.h>
+
 int setback_intersect(int32_t x1, int32_t y1, int32_t &x2, int32_t &y2,
               int32_t xp1, int32_t yp1, int32_t xp2, int32_t yp2, int32_t inside);
 
+/*  Collision segments of a foreground tile, ready to be checked together.
+ *
+ *  Points on the tile edges are moved out a pixel or two, so that lines
+ *  cannot slip between neighbouring tiles, the endpoints of each segment are in the order
+ *  setback_intersect() sorts them in, and the line through them is kept in
+ *  the a*x+b*y+c=0 form it uses. Coordinates are relative to the tile.
+ */
+
+class EdgeList
+{
+public :
+  EdgeList(unsigned char tot, unsigned char const *data,
+           unsigned char const *inside, int32_t tl, int32_t th);
+  ~EdgeList() { free(c); }
+  size_t MemUsage() { return sizeof(*this)+Room(count)*EDGE_BYTES; }
+
+  int count;
+  int32_t tl,th;                // tile size the edge points were moved for
+  int16_t *p1,*p2;              // x,y of the endpoints, count rounded up to
+  int16_t *ab;                  // a multiple of 4, then a and b of the line
+  int32_t *c;
+  unsigned char *inside;
+
+private :
+  // edges allocated for count, with room for loading 4 from the last one
+  static int Room(int count) { return ((count+3)&~3)+4; }
+  enum { EDGE_BYTES=sizeof(int32_t)+6*sizeof(int16_t)+1 };
+} ;
+
+// Same as calling setback_intersect() with every edge in turn, offset by
+// xo,yo, but only calls it for edges the line can cross, a few at a time.
+// Returns how many calls moved x2,y2.
+int setback_intersect_edges(int32_t x1, int32_t y1, int32_t &x2, int32_t &y2,
+                            EdgeList const *e, int32_t xo, int32_t yo);
+
 #endif
 
 
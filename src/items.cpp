@@ -271,6 +271,21 @@ foretile::foretile(bFILE *fp)
 
   points=new boundary(fp,"foretile boundry");
 
+  empty=points->tot<2;
+  seg_aa=ivec2(255);
+  seg_bb=ivec2(0);
+  for (int i=0; i<points->tot; i++)
+  {
+    ivec2 p(points->data[i*2],points->data[i*2+1]);
+    seg_aa=Min(seg_aa,p);
+    seg_bb=Max(seg_bb,p);
+  }
+  seg_aa-=ivec2(1);
+  seg_bb+=ivec2(2);
+
+  // every tile is normally the size of the map tiles
+  edges=new EdgeList(points->tot,points->data,points->inside,
+                     im->Size().x,im->Size().y);
 
 }
 
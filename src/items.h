@@ -14,6 +14,7 @@
 #include "transimage.h"
 #include "specs.h"
 #include "points.h"
+#include "intsect.h"
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -49,12 +50,29 @@ public :
   uint8_t ylevel;            // for fast intersections, this is the y level offset for the ground
                            // if ground is not level this is 255
   boundary *points;
+  // Box around the points relative to the tile, widened by how far
+  // EdgeList moves points on the tile edges, and
+  // whether there are no segments to intersect at all
+  ivec2 seg_aa, seg_bb;
+  uint8_t empty;
+  // The points as edges for setback_intersect_edges(), for the tile size
+  // they were last needed for
+  EdgeList *edges;
 
   image *micro_image;
 
   foretile(bFILE *fp);
+  EdgeList *get_edges(int32_t tl, int32_t th)
+  {
+    if (edges->tl!=tl || edges->th!=th)
+    {
+      delete edges;
+      edges=new EdgeList(points->tot,points->data,points->inside,tl,th);
+    }
+    return edges;
+  }
   int32_t size() { return im->Size().x*im->Size().y+4+2+1+points->size(); }
-  ~foretile() { delete im; delete points; delete micro_image; }
+  ~foretile() { delete im; delete points; delete edges; delete micro_image; }
 } ;
 
 class figure
@@ -19,6 +19,7 @@
 #endif
 
 #include "lisp.h"
+#include "lisp_gc.h"
 #include "specs.h"
 
 size_t block_size(LObject *level)  // return size needed to recreate this block
@@ -121,20 +122,30 @@ LObject *load_block(bFILE *fp)
                 return NULL;
 
             LList *last = NULL, *first = NULL;
+            PtrRef r1(first), r2(last);
             for (size_t count = abs(t); count--; )
             {
                 LList *c = LList::Create();
                 if (first)
+                {
                     last->m_cdr = c;
+                    Lisp::WriteBarrier(last);
+                }
                 else
                     first = c;
                 last = c;
             }
-            last->m_cdr = (t < 0) ? (LObject *)load_block(fp) : NULL;
+            LObject *tail = (t < 0) ? (LObject *)load_block(fp) : NULL;
+            last->m_cdr = tail;
+            Lisp::WriteBarrier(last);
 
             last = first;
             for (size_t count = abs(t); count--; last = (LList *)last->m_cdr)
-                last->m_car = load_block(fp);
+            {
+                LObject *car = load_block(fp);
+                last->m_car = car;
+                Lisp::WriteBarrier(last);
+            }
             return first;
         }
     case L_CHARACTER:
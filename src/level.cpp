@@ -43,6 +43,7 @@
 #include "cop.h"
 #include "nfserver.h"
 #include "lisp_gc.h"
+#include "trace.h"
 
 level *current_level;
 
@@ -109,6 +110,8 @@ void level::load_fail()
   }
 
   last=NULL;
+  grid.Invalidate();
+  flagged_total=0;
   delete_panims();
   delete_all_lights();
 
@@ -121,6 +124,7 @@ level::~level()
   if (target_list) free(target_list);
   if (block_list) free(block_list);
   if (all_block_list) free(all_block_list);
+  if (flagged_list) free(flagged_list);
   if (first_name) free(first_name);
 }
 
@@ -181,14 +185,34 @@ void level::next_focus()
 void level::unactivate_all()
 {
   first_active=NULL;
-  game_object *o=first;
   attack_total=0;  // reset the attack list
   target_total=0;
   block_total=0;
   all_block_total=0;
 
-  for (; o; o=o->next)
-    o->active=0;
+  reset_flagged();
+}
+
+// clears the active flag on every object that has it set, bringing the
+// grid up to date with the objects that moved while they were active
+void level::reset_flagged()
+{
+  if (grid.Dirty())
+  {
+    game_object *o=first;
+    for (; o; o=o->next)
+      o->active=0;
+    grid.Rebuild(first,fg_width,fg_height);
+  } else
+  {
+    int i=0;
+    for (; i<flagged_total; i++)
+    {
+      flagged_list[i]->active=0;
+      grid.Update(flagged_list[i]);
+    }
+  }
+  flagged_total=0;
 }
 
 
@@ -201,6 +225,7 @@ void level::pull_actives(game_object *o, game_object *&last_active, int &t)
     if (!other->active)
     {
       other->active=1;
+      add_flagged(other);
       if (other->can_block())              // if object can block other player, keep a list for fast testing
       {
     add_block(other);
@@ -223,17 +248,32 @@ int level::add_actives(int32_t x1, int32_t y1, int32_t x2, int32_t y2)
   if (first_active)
     for (last_active=first_active; last_active->next_active; last_active=last_active->next_active);
 
-  game_object *o=first;
-  for (; o; o=o->next)
+  if (grid.Dirty())
+    grid.Rebuild(first,fg_width,fg_height);
+
+  // only look at objects from the grid cells around the area, then put
+  // them back in object list order so the active list stays the same
+  game_object **found=grid.Found();
+  int i,n=grid.Collect(x1,y1,x2,y2),total_found=0;
+  for (i=0; i<n; i++)
   {
+    game_object *o=found[i];
     if (!o->active)
     {
       int32_t xr=figures[o->otype]->rangex,
            yr=figures[o->otype]->rangey;
 
       if (o->x+xr>=x1 && o->x-xr<=x2 && o->y+yr>=y1 && o->y-yr<=y2)
-      {
+        found[total_found++]=o;
+    }
+  }
+  grid.Sort(total_found);
 
+  for (i=0; i<total_found; i++)
+  {
+    game_object *o=found[i];
+    if (!o->active)      // may have been pulled in by a linked object
+    {
     if (o->can_block())              // if object can block other player, keep a list for fast testing
     {
       add_block(o);
@@ -243,6 +283,7 @@ int level::add_actives(int32_t x1, int32_t y1, int32_t x2, int32_t y2)
 
 
     o->active=1;
+    add_flagged(o);
     t++;
     if (!first_active)
       first_active=o;
@@ -251,7 +292,6 @@ int level::add_actives(int32_t x1, int32_t y1, int32_t x2, int32_t y2)
     last_active=o;
 
     pull_actives(o,last_active,t);
-      }
     }
   }
   if (last_active)
@@ -262,23 +302,35 @@ int level::add_actives(int32_t x1, int32_t y1, int32_t x2, int32_t y2)
 
 int level::add_drawables(int32_t x1, int32_t y1, int32_t x2, int32_t y2)
 {
-  int t=0,ft=0;
+  int t=0;
   game_object *last_active=NULL;
   if (first_active)
   {
     for (last_active=first_active; last_active->next_active; last_active=last_active->next_active);
-  } else ft=1;
+  } else reset_flagged();  // if this is the first pass, then objects not in this range are not active
 
-  game_object *o=first;
-  for (; o; o=o->next)
+  if (grid.Dirty())
+    grid.Rebuild(first,fg_width,fg_height);
+
+  game_object **found=grid.Found();
+  int i,n=grid.Collect(x1,y1,x2,y2),total_found=0;
+  for (i=0; i<n; i++)
   {
-    if (ft || !o->active)
+    game_object *o=found[i];
+    if (!o->active)
     {
       int32_t xr=figures[o->otype]->draw_rangex,
       yr=figures[o->otype]->draw_rangey;
 
       if (o->x+xr>=x1 && o->x-xr<=x2 && o->y+yr>=y1 && o->y-yr<=y2)
-      {
+        found[total_found++]=o;
+    }
+  }
+  grid.Sort(total_found);
+
+  for (i=0; i<total_found; i++)
+  {
+    game_object *o=found[i];
     t++;
     if (!first_active)
     first_active=o;
@@ -286,8 +338,7 @@ int level::add_drawables(int32_t x1, int32_t y1, int32_t x2, int32_t y2)
     last_active->next_active=o;
     last_active=o;
     o->active=1;
-      } else if (ft) o->active=0;  // if this is the first pass, then mark objects not in this ranges as not active
-    }
+    add_flagged(o);
   }
   if (last_active)
     last_active->next_active=NULL;
@@ -617,10 +668,14 @@ int level::tick()
   game_object *o,*l=NULL,  // l is last, used for delete
               *cur;        // cur is current object, NULL if object deletes it's self
   int ret=1;
+  TraceScope trace(TRACE_TICK);
 
   if (profiling())
     profile_reset();
 
+  broad.Build(first_active);
+  Timer phase;
+
 /*  // test to see if demo is in sync
   if (current_demo_mode()==DEMO_PLAY)
   {
@@ -757,10 +812,15 @@ int level::tick()
     }
 
   }
+  stats.decide_ms+=phase.GetMs();
+
   tick_panims();
 
   check_collisions();
 //  wall_push();
+  broad.Clear();
+  stats.collide_ms+=phase.GetMs();
+  stats.ticks++;
 
   set_tick_counter(tick_counter()+1);
 
@@ -830,6 +890,8 @@ void level::set_size(int w, int h)
     return ;
   }
 
+  grid.Invalidate();
+
   uint16_t *new_fg,*new_bg;
   new_fg=(uint16_t *)malloc(w*h*sizeof(int16_t));
   memset(new_fg,0,w*h*sizeof(int16_t));
@@ -888,6 +950,8 @@ void level::old_load_objects(spec_directory *sd, bFILE *fp)
   spec_entry *se=sd->find("objects");
   total_objs=0;
   first=last=first_active=NULL;
+  grid.Invalidate();
+  flagged_total=0;
   int i,j;
   if (se)
   {
@@ -1014,6 +1078,8 @@ void level::load_objects(spec_directory *sd, bFILE *fp)
   spec_entry *se=sd->find("object_descripitions");
   total_objs=0;
   first=last=first_active=NULL;
+  grid.Invalidate();
+  flagged_total=0;
   int i,j;
   if (!se)
   {
@@ -1285,6 +1351,11 @@ level::level(spec_directory *sd, bFILE *fp, char const *lev_name)
 
   all_block_list=NULL;
   all_block_list_size=all_block_total=0;
+
+  flagged_list=NULL;
+  flagged_list_size=flagged_total=0;
+
+  memset(&stats,0,sizeof(stats));
   first_name=NULL;
 
   the_game->need_refresh();
@@ -2383,6 +2454,11 @@ level::level(int width, int height, char const *name)
   all_block_list=NULL;
   all_block_list_size=all_block_total=0;
 
+  flagged_list=NULL;
+  flagged_list_size=flagged_total=0;
+
+  memset(&stats,0,sizeof(stats));
+
   Name=NULL;
   first_name=NULL;
 
@@ -2424,6 +2500,7 @@ void level::add_object(game_object *new_guy)
   new_guy->next=NULL;
   if (figures[new_guy->otype]->get_cflag(CFLAG_ADD_FRONT))
   {
+    grid.Order(new_guy,first ? last : NULL,NULL);
     if (!first)
       first=new_guy;
     else
@@ -2431,6 +2508,7 @@ void level::add_object(game_object *new_guy)
     last=new_guy;
   } else
   {
+    grid.Order(new_guy,NULL,first);
     if (!first)
       last=first=new_guy;
     else
@@ -2439,6 +2517,9 @@ void level::add_object(game_object *new_guy)
       first=new_guy;
     }
   }
+  grid.Insert(new_guy);
+  if (new_guy->active)
+    add_flagged(new_guy);
 }
 
 void level::add_object_after(game_object *new_guy,game_object *who)
@@ -2447,9 +2528,13 @@ void level::add_object_after(game_object *new_guy,game_object *who)
   else
   {
     total_objs++;
+    grid.Order(new_guy,who,who->next);
     if (who==last) last=new_guy;
     new_guy->next=who->next;
     who->next=new_guy;
+    grid.Insert(new_guy);
+    if (new_guy->active)
+      add_flagged(new_guy);
   }
 }
 
@@ -2498,6 +2583,9 @@ void level::remove_object(game_object *who)
   if (dev_cont)
     dev_cont->notify_deleted_object(who);
 
+  remove_flagged(who);
+  broad.Remove(who);
+
   if (who==first)
   {
     if (who==last) last=NULL;
@@ -2515,6 +2603,7 @@ void level::remove_object(game_object *who)
     else return ;     // if object is not in level, don't try to do anything else
   }
   total_objs--;
+  grid.Remove(who);
 
 
   if (first_active==who)
@@ -2576,6 +2665,7 @@ void level::to_front(game_object *o)  // move to end of list, so we are drawn la
     w->next=o->next;
   }
 
+  grid.Order(o,last,NULL);
   last->next=o;
   o->next=NULL;
   last=o;
@@ -2592,6 +2682,7 @@ void level::to_back(game_object *o)   // to make the character drawn in back, pu
   if (last==o)
     last=w;
   w->next=o->next;
+  grid.Order(o,NULL,first);
   o->next=first;
   first=o;
 }
@@ -2617,8 +2708,59 @@ game_object *level::find_object(int32_t x, int32_t y)
 
 int32_t last_tile_hit_x,last_tile_hit_y;
 
-#define remapx(x) (x==0 ? -1 : x==tl-1 ? tl+1 : x)
-#define remapy(y) (y==0 ? -1 : y==th-1 ? th+1 : y)
+// Division rounding down, for pixels left of or above the map
+static inline int32_t floor_div(int64_t n, int64_t d)
+{
+  if (d<0) { n=-n; d=-d; }
+  return (int32_t)(n>=0 ? n/d : -((-n+d-1)/d));
+}
+
+// Rows of pixels line x1,y1-x2,y2 covers between columns lo and hi,
+// rounded outwards
+static void line_span(int32_t x1, int32_t y1, int32_t x2, int32_t y2,
+                      int32_t lo, int32_t hi, int32_t &mn, int32_t &mx)
+{
+  int64_t dx=x2-x1,dy=y2-y1;
+  if (!dx)
+  {
+    mn=Min(y1,y2);
+    mx=Max(y1,y2);
+    return;
+  }
+  int64_t n1=(int64_t)y1*dx+(lo-x1)*dy,
+          n2=(int64_t)y1*dx+(hi-x1)*dy;
+  mn=Min(floor_div(n1,dx),floor_div(n2,dx));
+  mx=Max(-floor_div(-n1,dx),-floor_div(-n2,dx));
+}
+
+// Shortens x1,y1-x2,y2 to its first hit with the foreground tile at bx,by
+static void tile_intersect(int32_t bx, int32_t by, int32_t tl, int32_t th,
+                           int32_t x1, int32_t y1, int32_t &x2, int32_t &y2)
+{
+  int block=the_game->GetMapFg(ivec2(bx, by));
+  if (block<=BLACK)        // don't check BLACK, should be no points in it
+    return;
+
+  foretile *f=the_game->get_fg(block);
+  if (f->empty)
+    return;
+
+  // skip the tile if the segment misses the box around its points
+  int32_t xo=bx*tl,yo=by*th;
+  int32_t bx1=Max(xo+f->seg_aa.x,Min(x1,x2)),bx2=Min(xo+f->seg_bb.x,Max(x1,x2));
+  if (bx1>bx2)
+    return;
+  int32_t mn,mx;
+  line_span(x1,y1,x2,y2,bx1,bx2,mn,mx);
+  if (mx<yo+f->seg_aa.y || mn>yo+f->seg_bb.y)
+    return;
+
+  if (setback_intersect_edges(x1,y1,x2,y2,f->get_edges(tl,th),xo,yo))
+  {
+    last_tile_hit_x=bx;
+    last_tile_hit_y=by;
+  }
+}
 
 void level::foreground_intersect(int32_t x1, int32_t y1, int32_t &x2, int32_t &y2)
 {
@@ -2628,12 +2770,8 @@ void level::foreground_intersect(int32_t x1, int32_t y1, int32_t &x2, int32_t &y
   }  */
 
   int32_t tl=the_game->ftile_width(),th=the_game->ftile_height(),
-    j,
-    xp1,yp1,xp2,yp2,    // starting and ending points of block line segment
     swap;               // temp var
-  int32_t blockx1,blocky1,blockx2,blocky2,block,bx,by;
-  point_list *block_list;
-  unsigned char *bdat;
+  int32_t blockx1,blocky1,blockx2,blocky2;
 
   blockx1=x1;
   blocky1=y1;
@@ -2654,47 +2792,37 @@ void level::foreground_intersect(int32_t x1, int32_t y1, int32_t &x2, int32_t &y
 
   if ((blockx1>blockx2) || (blocky1>blocky2)) return ;
 
-  // now check all the map positions this line could intersect
-  for (bx=blockx1; bx<=blockx2; bx++)
-  {
-    for (by=blocky1; by<=blocky2; by++)
-    {
-      block=the_game->GetMapFg(ivec2(bx, by));
-      if (block>BLACK)        // don't check BLACK, should be no points in it
-      {
-        // now check the all the line segments in the block
-        foretile *f=the_game->get_fg(block);
-        block_list=f->points;
-        unsigned char total=block_list->tot;
-        bdat=block_list->data;
-        unsigned char *ins=f->points->inside;
-    int32_t xo=bx*tl,yo=by*th;
-        for (j=0; j<total-1; j++,ins++)
-        {
-          // find the starting and ending points for this segment
-      xp1=xo+remapx(*bdat);
-      bdat++;
-
-      yp1=yo+remapy(*bdat);
-      bdat++;
-
-      xp2=xo+remapx(*bdat);
-      yp2=yo+remapy(bdat[1]);
-
-
-      int32_t ox2=x2,oy2=y2;
-          if (*ins)
-            setback_intersect(x1,y1,x2,y2,xp1,yp1,xp2,yp2,1);
-          else
-            setback_intersect(x1,y1,x2,y2,xp1,yp1,xp2,yp2,-1);
-      if (ox2!=x2 || oy2!=y2)
-      {
-        last_tile_hit_x=bx;
-        last_tile_hit_y=by;
-      }
-
-        }
+  // Of the map positions in that box, only check those the line passes
+  // within two pixels of, as EdgeList moves points on the tile edges out
+  // by up to that much. They are checked in the same order as the whole
+  // box used to be, since where a hit leaves the shortened line depends on
+  // the hits before it, and the scan stops at the first column past its
+  // end.
+  int32_t const pad=2;
+  int32_t c=Max(floor_div(Min(x1,x2)-pad,tl),blockx1);
+  blockx2=Min(blockx2,foreground_width()-1);
+  blocky2=Min(blocky2,foreground_height()-1);
+  for (; c<=blockx2 && c*tl-pad<=Max(x1,x2); c++)
+  {
+    // rows the line passes by in this column, again after every hit
+    int32_t r=blocky1,r2=-1,ox2=x2+1,oy2=y2;
+    for (;; r++)
+    {
+      if (x2!=ox2 || y2!=oy2)
+      {
+        ox2=x2;
+        oy2=y2;
+        int32_t lo=Max(c*tl-pad,Min(x1,x2)),
+                hi=Min(c*tl+tl-1+pad,Max(x1,x2)),mn,mx;
+        if (lo>hi)
+          break;
+        line_span(x1,y1,x2,y2,lo,hi,mn,mx);
+        r=Max(r,floor_div(mn-pad,th));
+        r2=Min(floor_div(mx+pad,th),blocky2);
       }
+      if (r>r2)
+        break;
+      tile_intersect(c,r,tl,th,x1,y1,x2,y2);
     }
   }
 }
@@ -2702,12 +2830,8 @@ void level::foreground_intersect(int32_t x1, int32_t y1, int32_t &x2, int32_t &y
 
 void level::vforeground_intersect(int32_t x1, int32_t y1, int32_t &y2)
 {
-  int32_t tl=f_wid,th=f_hi,
-    j,
-    xp1,yp1,xp2,yp2;    // starting and ending points of block line segment temp var
+  int32_t tl=f_wid,th=f_hi;
   int32_t blocky1,blocky2,block,bx,by,checkx;
-  point_list *block_list;
-  unsigned char *bdat;
 
   int y_addback;
   if (y1>y2)
@@ -2737,36 +2861,12 @@ void level::vforeground_intersect(int32_t x1, int32_t y1, int32_t &y2)
 
     // now check the all the line segments in the block
     foretile *f=the_game->get_fg(block);
-    block_list=f->points;
 
-    unsigned char total=block_list->tot;
-    bdat=block_list->data;
-    unsigned char *ins=f->points->inside;
-
-//    int32_t xo=bx*tl,yo=by*th;
-    for (j=0; j<total-1; j++,ins++)
+    // a vertical line stays vertical, so checkx is not moved
+    if (setback_intersect_edges(checkx,y1,checkx,y2,f->get_edges(tl,th),0,0))
     {
-      // find the starting and ending points for this segment
-      xp1=remapx(*bdat);
-      bdat++;
-
-      yp1=remapy(*bdat);
-      bdat++;
-
-      xp2=remapx(*bdat);
-      yp2=remapy(bdat[1]);
-
-
-      int32_t oy2=y2;
-      if (*ins)
-        setback_intersect(checkx,y1,checkx,y2,xp1,yp1,xp2,yp2,1);
-      else
-        setback_intersect(checkx,y1,checkx,y2,xp1,yp1,xp2,yp2,-1);
-      if (oy2!=y2)
-      {
-    last_tile_hit_x=bx;
-    last_tile_hit_y=by;
-      }
+      last_tile_hit_x=bx;
+      last_tile_hit_y=by;
     }
   }
   y2+=y_addback;
@@ -2905,9 +3005,10 @@ game_object *level::find_xrange(int x, int y, int type, int xd)
 {
   int32_t find_ydist=100000;
   game_object *find=NULL;
-  game_object *o=first_active;
-  for (; o; o=o->next_active)
+  int i=0,n=broad.Find(first_active,type);
+  for (; i<n; i++)
   {
+    game_object *o=broad.Found(i);
     if (o->otype==type)
     {
       int x_dist=abs(x-o->x);
@@ -2928,9 +3029,10 @@ game_object *level::find_xclosest(int x, int y, int type, game_object *who)
 {
   int32_t find_ydist=100000,find_xdist=0xffffff;
   game_object *find=NULL;
-  game_object *o=first_active;
-  for (; o; o=o->next_active)
+  int i=0,n=broad.Find(first_active,type);
+  for (; i<n; i++)
   {
+    game_object *o=broad.Found(i);
     if (o->otype==type && o!=who)
     {
       int x_dist=abs(x-o->x);
@@ -2958,9 +3060,10 @@ game_object *level::find_closest(int x, int y, int type, game_object *who)
 {
   int32_t find_dist=100000;
   game_object *find=NULL;
-  game_object *o=first_active;
-  for (; o; o=o->next_active)
+  int i=0,n=broad.Find(first_active,type);
+  for (; i<n; i++)
   {
+    game_object *o=broad.Found(i);
     if (o->otype==type && o!=who)
     {
       int d=(x-o->x)*(x-o->x)+(y-o->y)*(y-o->y);
@@ -3015,9 +3118,18 @@ void level::hurt_radius(int32_t x, int32_t y,int32_t r, int32_t m, game_object *
             int max_push)
 {
   if (r<1) return ;   // avoid dev vy zero
-  game_object *o=first_active;
-  for (; o; o=o->next_active)
+
+  // do_damage may run Lisp code that queries the broad phase, so work
+  // on our own copy of the candidates
+  int i=0,n=broad.FindHurtable(first_active);
+  if (!n) return ;
+  game_object **list=(game_object **)malloc(sizeof(game_object *)*n);
+  for (; i<n; i++)
+    list[i]=broad.Found(i);
+
+  for (i=0; i<n; i++)
   {
+    game_object *o=list[i];
     if (o!=exclude && o->hurtable())
     {
       int32_t y1=o->y,y2=o->y-o->picture()->Size().y;
@@ -3048,7 +3160,7 @@ void level::hurt_radius(int32_t x, int32_t y,int32_t r, int32_t m, game_object *
 
     }
   }
-
+  free(list);
 }
 
 
@@ -3174,14 +3286,40 @@ void level::add_all_block(game_object *who)
 }
 
 
+void level::add_flagged(game_object *who)
+{
+  if (flagged_total>=flagged_list_size)  // see if we need to grow the list size..
+  {
+    flagged_list_size+=64;
+    flagged_list=(game_object **)realloc(flagged_list,sizeof(game_object *)*flagged_list_size);
+  }
+  flagged_list[flagged_total]=who;
+  flagged_total++;
+}
+
+
+void level::remove_flagged(game_object *who)
+{
+  int i=0;
+  for (; i<flagged_total; i++)
+    if (flagged_list[i]==who)
+    {
+      flagged_list[i]=flagged_list[flagged_total-1];
+      flagged_total--;
+      return ;
+    }
+}
+
+
 game_object *level::find_object_in_area(int32_t x, int32_t y, int32_t x1, int32_t y1, int32_t x2, int32_t y2,
                      Cell *list, game_object *exclude)
 {
   game_object *closest=NULL;
   int32_t closest_distance=0xfffffff,distance,xo,yo;
-  game_object *o=first_active;
-  for (; o; o=o->next_active)
+  int i=0,n=broad.Find(first_active,(void *)list);
+  for (; i<n; i++)
   {
+    game_object *o=broad.Found(i);
     int32_t xp1,yp1,xp2,yp2;
     o->picture_space(xp1,yp1,xp2,yp2);
 
@@ -3215,9 +3353,10 @@ game_object *level::find_object_in_angle(int32_t x, int32_t y, int32_t start_ang
 {
   game_object *closest=NULL;
   int32_t closest_distance=0xfffffff,distance,xo,yo;
-  game_object *o=first_active;
-  for (; o; o=o->next_active)
+  int i=0,n=broad.Find(first_active,list);
+  for (; i<n; i++)
   {
+    game_object *o=broad.Found(i);
     int32_t angle=lisp_atan2(o->y-y,o->x-x);
     if (((start_angle<=end_angle && (angle>=start_angle && angle<=end_angle))
     || (start_angle>end_angle && (angle>=start_angle || angle<=end_angle)))
@@ -16,6 +16,8 @@
 #include "objects.h"
 #include "view.h"
 #include "id.h"
+#include "objgrid.h"
+#include "collide.h"
 
 #include <stdlib.h>
 #define ASPECT 4             // foreground scrolls 4 times faster than background
@@ -42,6 +44,13 @@ class area_controller
   area_controller(int32_t X, int32_t Y, int32_t W, int32_t H, area_controller *Next);
 } ;
 
+struct TickStats
+{
+  int32_t ticks;
+  float decide_ms;    // player moves and object decide functions
+  float collide_ms;   // panims and check_collisions
+} ;
+
 extern int32_t last_tile_hit_x,last_tile_hit_y;
 extern int dev;
 class level        // contain map info and objects
@@ -72,6 +81,16 @@ class level        // contain map info and objects
   game_object **all_block_list;            // list of characters who can block a character or can be hurt
   int all_block_list_size,all_block_total;
   void add_all_block(game_object *who);
+
+  ObjectGrid grid;                          // spatial index used to find actives and drawables
+  game_object **flagged_list;               // objects whose active flag is currently set
+  int flagged_list_size,flagged_total;
+  void add_flagged(game_object *who);
+  void remove_flagged(game_object *who);
+  void reset_flagged();
+
+  BroadPhase broad;                         // shared by check_collisions and the find_* queries
+  TickStats stats;                          // time spent in tick() since the level was made
   uint32_t ctick;
 
 public :
@@ -136,6 +155,10 @@ public :
   void add_object_after(game_object *new_guy, game_object *who);
   void delete_object(game_object *who);
   void remove_object(game_object *who);      // unlinks the object from level, but doesn't delete it
+  void object_moved(game_object *who) { grid.Update(who); }  // for objects moved while inactive
+  void object_retyped(game_object *who) { grid.Update(who); broad.Retype(who); }
+  BroadPhaseStats const &collision_stats() { return broad.last_stats; }
+  TickStats const &tick_stats() { return stats; }
   void load_objects(spec_directory *sd, bFILE *fp);
   void load_cache_info(spec_directory *sd, bFILE *fp);
   void old_load_objects(spec_directory *sd, bFILE *fp);
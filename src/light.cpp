@@ -13,6 +13,14 @@
 #endif
 
 #include <stdlib.h>
+#include <string.h>
+#if defined __SSE2__
+#   include <emmintrin.h>
+#elif defined __ARM_NEON__ || defined __ARM_NEON
+#   include <arm_neon.h>
+#endif
+
+#include <SDL.h>
 
 #include "common.h"
 
@@ -26,6 +34,7 @@
 #include "filter.h"
 #include "status.h"
 #include "dev.h"
+#include "trace.h"
 
 light_source *first_light_source=NULL;
 uint8_t *white_light,*white_light_initial,*green_light,*trans_table;
@@ -63,6 +72,7 @@ light_source *light_source::copy()
 
 void delete_all_lights()
 {
+  light_field_flush();
   while (first_light_source)
   {
     if (dev_cont)
@@ -79,6 +89,7 @@ void delete_light(light_source *which)
   if (dev_cont)
     dev_cont->notify_deleted_light(which);
 
+  light_field_dirty(which->x1,which->y1,which->x2,which->y2);
   if (which==first_light_source)
   {
     first_light_source=first_light_source->next;
@@ -98,6 +109,7 @@ void delete_light(light_source *which)
 
 void light_source::calc_range()
 {
+  light_field_dirty(x1,y1,x2,y2);
   switch (type)
   {
     case 0 :
@@ -148,6 +160,7 @@ void light_source::calc_range()
 
   }
   mul_div=(1<<16)/(outer_radius-inner_radius)*64;
+  light_field_dirty(x1,y1,x2,y2);
 }
 
 light_source::light_source(char Type, int32_t X, int32_t Y, int32_t Inner_radius,
@@ -161,6 +174,8 @@ light_source::light_source(char Type, int32_t X, int32_t Y, int32_t Inner_radius
   known=0;
   xshift=Xshift;
   yshift=Yshift;
+  x1=y1=0;
+  x2=y2=-1;
   calc_range();
 }
 
@@ -749,76 +764,516 @@ inline void put_8line(uint8_t *in_line, uint8_t *out_line, uint8_t *remap, uint8
 }
 
 
-void light_screen(image *sc, int32_t screenx, int32_t screeny, uint8_t *light_lookup, uint16_t ambient)
+/*  Light map passes.
+ *
+ *  The clip rectangle is lit in groups of up to four rows (one light block
+ *  high): each group gets one light value per 8 pixel block, then all its
+ *  rows are remapped through the light table. Groups do not depend on each
+ *  other, so with more than one light thread the rectangle is split into
+ *  bands of whole groups and each band is lit by a different thread.
+ *
+ *  LIGHT_SCALAR is the original code and the reference for the other
+ *  modes, which must produce the same pixels. LIGHT_SIMD finds the owning
+ *  patch once per run of blocks instead of once per block (patches never
+ *  overlap), evaluates the run four blocks at a time with SSE2 or NEON,
+ *  and remaps runs of blocks sharing the same light value with wide
+ *  loads and stores (TBL lookups on AArch64). LIGHT_CACHED uses the same
+ *  kernels but reads block values from the light field below instead of
+ *  splitting patches every frame.
+ */
+
+int light_mode=LIGHT_SCALAR;
+
+struct light_pass
 {
-  int lx_run=0,ly_run;                     // light block x & y run size in pixels ==  (1<<lx_run)
+  uint8_t *in_line,*out_line;    // first clip row, and its doubled row for double_light_screen
+  int in_w,out_w;
+  int32_t screenx,screeny;
+  int y1,y2,width;               // clip rows and clip width
+  int prefix,prefix_x,suffix,suffix_x;
+  int32_t remap_size;
+  light_patch *first;
+  uint8_t *light_lookup;
+};
+
+struct light_job
+{
+  light_pass const *pass;
+  int ystart,yend;
+  uint8_t *remap_line;
+};
 
-  if (shutdown_lighting && !disable_autolight)
-    ambient=shutdown_lighting_value;
+// what calc_light_value adds for one light
+static inline int light_contribution(light_source *fn, int32_t sx, int32_t sy)
+{
+  int dx=abs(fn->x-sx)<<fn->xshift;
+  int dy=abs(fn->y-sy)<<fn->yshift;
+  int r2;
+  if (dx<dy)
+    r2=dx+dy-(dx>>1);
+  else r2=dx+dy-(dy>>1);
+
+  if (r2<fn->outer_radius)
+    return (fn->outer_radius-r2)*fn->mul_div>>16;
+  return 0;
+}
 
-  switch (light_detail)
+// first solid rectangle of a patch, which overrides the other lights
+static light_source *light_solid(light_patch *lp)
+{
+  for (int i=0; i<lp->total; i++)
+    if (lp->lights[i]->type==9)
+      return lp->lights[i];
+  return NULL;
+}
+
+// light values of count blocks of a patch, 8 pixels apart starting at sx,
+// on top of a base light level of lmin
+static void light_run(light_patch *lp, int32_t sx, int32_t sy, int count, uint8_t *rem, int lmin)
+{
+  light_source **l=lp->lights;
+  int i,n=lp->total,done=0;
+
+  light_source *solid=light_solid(lp);
+  if (solid)
   {
-    case HIGH_DETAIL :
-    { lx_run=2; ly_run=1; } break;       // 4 x 2 patches
-    case MEDIUM_DETAIL :
-    { lx_run=3; ly_run=2; } break;       // 8 x 4 patches  (default)
-    case LOW_DETAIL :
-    { lx_run=4; ly_run=3; } break;       // 16 x 8 patches
-    case POOR_DETAIL :                   // poor detail is no lighting
+    memset(rem,(uint8_t)solid->inner_radius,count);
     return ;
   }
-  if ((int)ambient+ambient_ramp<0)
-    min_light_level=0;
-  else if ((int)ambient+ambient_ramp>63)
-    min_light_level=63;
-  else min_light_level=(int)ambient+ambient_ramp;
 
-  if (ambient==63) return ;
-  ivec2 caa, cbb;
-  sc->GetClip(caa, cbb);
+  int32_t lv4[4];
+#if defined __SSE2__
+  __m128i step=_mm_set_epi32(24,16,8,0),lmax=_mm_set1_epi32(63);
+  for (; done+4<=count; done+=4)
+  {
+    __m128i bx=_mm_add_epi32(_mm_set1_epi32(sx+done*8),step);
+    __m128i lv=_mm_set1_epi32(lmin);
+    for (i=0; i<n; i++)
+    {
+      light_source *fn=l[i];
+      __m128i dy=_mm_set1_epi32(abs(fn->y-sy)<<fn->yshift);
+      __m128i dx=_mm_sub_epi32(_mm_set1_epi32(fn->x),bx);
+      __m128i sign=_mm_srai_epi32(dx,31);
+      dx=_mm_sub_epi32(_mm_xor_si128(dx,sign),sign);
+      dx=_mm_sll_epi32(dx,_mm_cvtsi32_si128(fn->xshift));
+
+      __m128i closer=_mm_cmplt_epi32(dx,dy);
+      __m128i half=_mm_or_si128(_mm_and_si128(closer,_mm_srai_epi32(dx,1)),
+                                _mm_andnot_si128(closer,_mm_srai_epi32(dy,1)));
+      __m128i r2=_mm_sub_epi32(_mm_add_epi32(dx,dy),half);
+
+      __m128i outer=_mm_set1_epi32(fn->outer_radius);
+      __m128i inside=_mm_cmplt_epi32(r2,outer);
+      __m128i v=_mm_sub_epi32(outer,r2);
+      __m128i md=_mm_set1_epi32(fn->mul_div);
+      __m128i even=_mm_mul_epu32(v,md);       // SSE2 has no 32 bit mullo, the low
+      __m128i odd=_mm_mul_epu32(_mm_srli_epi64(v,32),md);  // halves are the same
+      __m128i prod=_mm_unpacklo_epi32(_mm_shuffle_epi32(even,_MM_SHUFFLE(0,0,2,0)),
+                                      _mm_shuffle_epi32(odd,_MM_SHUFFLE(0,0,2,0)));
+      lv=_mm_add_epi32(lv,_mm_and_si128(inside,_mm_srai_epi32(prod,16)));
+    }
+    __m128i over=_mm_cmpgt_epi32(lv,lmax);
+    lv=_mm_or_si128(_mm_and_si128(over,lmax),_mm_andnot_si128(over,lv));
+    _mm_storeu_si128((__m128i *)lv4,lv);
+    rem[done]=lv4[0]; rem[done+1]=lv4[1]; rem[done+2]=lv4[2]; rem[done+3]=lv4[3];
+  }
+#elif defined __ARM_NEON__ || defined __ARM_NEON
+  static int32_t const offsets[4]={ 0,8,16,24 };
+  int32x4_t step=vld1q_s32(offsets),lmax=vdupq_n_s32(63);
+  for (; done+4<=count; done+=4)
+  {
+    int32x4_t bx=vaddq_s32(vdupq_n_s32(sx+done*8),step);
+    int32x4_t lv=vdupq_n_s32(lmin);
+    for (i=0; i<n; i++)
+    {
+      light_source *fn=l[i];
+      int32x4_t dy=vdupq_n_s32(abs(fn->y-sy)<<fn->yshift);
+      int32x4_t dx=vabsq_s32(vsubq_s32(vdupq_n_s32(fn->x),bx));
+      dx=vshlq_s32(dx,vdupq_n_s32(fn->xshift));
+
+      uint32x4_t closer=vcltq_s32(dx,dy);
+      int32x4_t half=vbslq_s32(closer,vshrq_n_s32(dx,1),vshrq_n_s32(dy,1));
+      int32x4_t r2=vsubq_s32(vaddq_s32(dx,dy),half);
+
+      int32x4_t outer=vdupq_n_s32(fn->outer_radius);
+      uint32x4_t inside=vcltq_s32(r2,outer);
+      int32x4_t v=vshrq_n_s32(vmulq_n_s32(vsubq_s32(outer,r2),fn->mul_div),16);
+      lv=vaddq_s32(lv,vandq_s32(vreinterpretq_s32_u32(inside),v));
+    }
+    vst1q_s32(lv4,vminq_s32(lv,lmax));
+    rem[done]=lv4[0]; rem[done+1]=lv4[1]; rem[done+2]=lv4[2]; rem[done+3]=lv4[3];
+  }
+#else
+  (void)lv4;
+#endif
+  for (; done<count; done++)
+  {
+    int lv=lmin;
+    for (i=0; i<n; i++)
+      lv+=light_contribution(l[i],sx+done*8,sy);
+    rem[done]=lv>63 ? 63 : lv;
+  }
+}
 
-  light_patch *first = make_patch_list(cbb.x - caa.x, cbb.y - caa.y, screenx, screeny);
+// value of one block straight from the light list: the lights of the patch
+// holding (px,py) are the first MAX_LP lights whose range holds it
+static int light_point(int32_t px, int32_t py, int32_t sx, int32_t sy)
+{
+  int lv=min_light_level,n=0;
+  for (light_source *f=first_light_source; f && n<MAX_LP; f=f->next)
+  {
+    if (px<f->x1 || px>f->x2 || py<f->y1 || py>f->y2)
+      continue;
+    if (f->type==9)
+      return f->inner_radius;
+    lv+=light_contribution(f,sx,sy);
+    n++;
+  }
+  return lv>63 ? 63 : lv;
+}
 
-  int prefix_x=(screenx&7);
-  int prefix=screenx&7;
-  if (prefix)
-    prefix=8-prefix;
-  int suffix_x = cbb.x - 1 - caa.x - (screenx & 7);
+/*  Cached light field for LIGHT_CACHED.
+ *
+ *  Most lights never move, so the light sums of 8x4 pixel blocks are kept
+ *  in tiles of LIGHT_TILE_W x LIGHT_TILE_H blocks, at the same world
+ *  positions light_screen() samples. A tile is filled with the same patch
+ *  splitting as make_patch_list(), restricted to the tile, and dropped
+ *  when a light covering it is added, changed (calc_range() is called
+ *  after every change) or deleted.
+ *
+ *  Blocks hold their sum without the ambient level, which is added when
+ *  sampling: min(63,ambient+min(63,sum)) is min(63,ambient+sum). Tiles are
+ *  direct mapped by position; blocks whose tile is not resident are worked
+ *  out from the light list instead.
+ */
 
-  int suffix = (cbb.x - caa.x - prefix) & 7;
+#define LIGHT_TILE_W  32   // in blocks, power of two
+#define LIGHT_TILE_H  32
+#define LIGHT_TILES   16   // resident tiles, in each direction
+#define LIGHT_SOLID   0x100
 
-  int32_t remap_size=((cbb.x - caa.x - prefix - suffix)>>lx_run);
+struct light_tile
+{
+  int32_t tx,ty;
+  int valid;
+  uint16_t block[LIGHT_TILE_W*LIGHT_TILE_H];
+};
 
-  uint8_t *remap_line=(uint8_t *)malloc(remap_size);
+static light_tile *light_field=NULL;
+static int light_field_phase=0;   // sample rows are 4*n+phase
 
-  light_patch *f=first;
+static inline light_tile *light_field_slot(int32_t tx, int32_t ty)
+{
+  return light_field+(tx&(LIGHT_TILES-1))+(ty&(LIGHT_TILES-1))*LIGHT_TILES;
+}
 
-  main_screen->Lock();
+void light_field_flush()
+{
+  if (light_field)
+    for (int i=0; i<LIGHT_TILES*LIGHT_TILES; i++)
+      light_field[i].valid=0;
+}
+
+void light_field_dirty(int32_t x1, int32_t y1, int32_t x2, int32_t y2)
+{
+  if (!light_field || x1>x2 || y1>y2)
+    return ;
+
+  for (int i=0; i<LIGHT_TILES*LIGHT_TILES; i++)
+  {
+    light_tile *t=light_field+i;
+    int32_t tx1=t->tx*LIGHT_TILE_W*8,ty1=t->ty*LIGHT_TILE_H*4+light_field_phase;
+    if (t->valid && x2>=tx1 && x1<tx1+LIGHT_TILE_W*8 && y2>=ty1 && y1<ty1+LIGHT_TILE_H*4)
+      t->valid=0;
+  }
+}
+
+static void light_tile_fill(light_tile *t, int32_t tx, int32_t ty)
+{
+  int32_t x1=tx*LIGHT_TILE_W*8,y1=ty*LIGHT_TILE_H*4+light_field_phase;
+  int32_t x2=x1+LIGHT_TILE_W*8-1,y2=y1+LIGHT_TILE_H*4-1;
+
+  light_patch *first=new light_patch(x1,y1,x2,y2,NULL);
+  for (light_source *f=first_light_source; f; f=f->next)
+  {
+    int32_t lx1=Max(f->x1,x1),ly1=Max(f->y1,y1),
+            lx2=Min(f->x2,x2),ly2=Min(f->y2,y2);
+    if (lx1<=lx2 && ly1<=ly2)
+      add_light(first,lx1,ly1,lx2,ly2,f);
+  }
+
+  uint8_t sums[LIGHT_TILE_W];
+  for (int row=0; row<LIGHT_TILE_H; row++)
+  {
+    uint16_t *b=t->block+row*LIGHT_TILE_W;
+    int32_t sy=y1+row*4;
+    for (int count=0; count<LIGHT_TILE_W; )
+    {
+      int32_t sx=x1+count*8;
+      light_patch *lp=find_patch(sx,sy,first);
+      int run=Min((int)(lp->x2-sx)/8+1,LIGHT_TILE_W-count);
+      light_source *solid=light_solid(lp);
+      if (solid)
+        for (int i=0; i<run; i++)
+          b[count+i]=LIGHT_SOLID|(uint8_t)solid->inner_radius;
+      else
+      {
+        light_run(lp,sx,sy,run,sums,0);
+        for (int i=0; i<run; i++)
+          b[count+i]=sums[i];
+      }
+      count+=run;
+    }
+  }
+  delete_patch_list(first);
+
+  t->tx=tx;
+  t->ty=ty;
+  t->valid=1;
+}
+
+// fill the tiles a pass will sample, before the bands start reading them
+static void light_field_prepare(light_pass const *p)
+{
+  if (!light_field)
+    light_field=(light_tile *)calloc(LIGHT_TILES*LIGHT_TILES,sizeof(light_tile));
+
+  int phase=(-p->y1)&3;
+  if (phase!=light_field_phase)
+  {
+    light_field_flush();
+    light_field_phase=phase;
+  }
+
+  int32_t bx1=(p->prefix+p->screenx)>>3,bx2=bx1+Max((int)p->remap_size,1)-1;
+  int32_t by1=(p->screeny-phase)>>2,by2=(p->screeny+p->y2-p->y1-phase)>>2;
+  int32_t tx1=bx1>>5,tx2=bx2>>5,ty1=by1>>5,ty2=by2>>5;
+
+  for (int32_t ty=ty1; ty<=ty2; ty++)
+    for (int32_t tx=tx1; tx<=tx2; tx++)
+    {
+      light_tile *t=light_field_slot(tx,ty);
+      if (t->valid && t->tx==tx && t->ty==ty)
+        continue;
+      // do not evict a tile this pass needs, the bands compute the
+      // blocks of tiles that did not fit directly
+      if (t->valid && t->tx>=tx1 && t->tx<=tx2 && t->ty>=ty1 && t->ty<=ty2)
+        continue;
+      light_tile_fill(t,tx,ty);
+    }
+}
+
+static void light_values_cached(light_pass const *p, int32_t sy, uint8_t *rem)
+{
+  int32_t by=(sy-light_field_phase)>>2;
+  int32_t ty=by>>5;
+  uint16_t *row=NULL;
+  int32_t sx=p->prefix+p->screenx;
+
+  for (int count=0; count<p->remap_size; count++,sx+=8)
+  {
+    int32_t bx=sx>>3;
+    if (!row || !(bx&(LIGHT_TILE_W-1)))
+    {
+      light_tile *t=light_field_slot(bx>>5,ty);
+      if (t->valid && t->tx==bx>>5 && t->ty==ty)
+        row=t->block+(by&(LIGHT_TILE_H-1))*LIGHT_TILE_W;
+      else
+        row=NULL;
+    }
+    if (!row)
+    {
+      rem[count]=light_point(sx,sy,sx,sy);
+      continue;
+    }
+    int v=row[bx&(LIGHT_TILE_W-1)];
+    if (v&LIGHT_SOLID)
+      rem[count]=v;
+    else
+      rem[count]=Min(63,min_light_level+v);
+  }
+}
+
+// value of the prefix or suffix block of a group
+static int light_edge_value(light_pass const *p, int xrel, int yrel, int calcy)
+{
+  if (!p->first)
+    return light_point(xrel+p->screenx,yrel+p->screeny,xrel+p->screenx,calcy);
+
+  light_patch *lp=p->first;
+  for (; (lp->y1>yrel || lp->y2<yrel || lp->x1>xrel || lp->x2<xrel); lp=lp->next);
+  return calc_light_value(lp,xrel+p->screenx,calcy);
+}
+
+// same values as the per block patch search of the scalar passes
+static void light_values(light_pass const *p, int yrel, int calcy, uint8_t *rem)
+{
+  if (!p->first)
+  {
+    // only the first group can start unaligned, and then looks its
+    // patches up at another row than it samples
+    if (yrel+p->screeny==calcy)
+      light_values_cached(p,calcy,rem);
+    else
+      for (int count=0; count<p->remap_size; count++)
+      {
+        int32_t sx=p->prefix+p->screenx+count*8;
+        rem[count]=light_point(sx,yrel+p->screeny,sx,calcy);
+      }
+    return ;
+  }
+
+  int x=p->prefix,count=0;
+  while (count<p->remap_size)
+  {
+    light_patch *lp=find_patch(x,yrel,p->first);
+    int run=Min((int)(lp->x2-x)/8+1,(int)(p->remap_size-count));
+    light_run(lp,x+p->screenx,calcy,run,rem+count,min_light_level);
+    count+=run;
+    x+=run*8;
+  }
+}
+
+static inline uint64_t light_remap8(uint8_t *in, uint8_t *off)
+{
+  uint64_t v;
+  memcpy(&v,in,8);
+  return (uint64_t)off[v&0xff] | (uint64_t)off[(v>>8)&0xff]<<8
+       | (uint64_t)off[(v>>16)&0xff]<<16 | (uint64_t)off[(v>>24)&0xff]<<24
+       | (uint64_t)off[(v>>32)&0xff]<<32 | (uint64_t)off[(v>>40)&0xff]<<40
+       | (uint64_t)off[(v>>48)&0xff]<<48 | (uint64_t)off[v>>56]<<56;
+}
+
+#if defined __aarch64__
+#define LIGHT_TBL_RUN 4    // blocks sharing one table before loading it in registers pays off
+
+struct light_tbl { uint8x16x4_t t[4]; };
+
+static inline void light_tbl_load(light_tbl &tbl, uint8_t *off)
+{
+  for (int i=0; i<4; i++)
+  {
+    tbl.t[i].val[0]=vld1q_u8(off+i*64);
+    tbl.t[i].val[1]=vld1q_u8(off+i*64+16);
+    tbl.t[i].val[2]=vld1q_u8(off+i*64+32);
+    tbl.t[i].val[3]=vld1q_u8(off+i*64+48);
+  }
+}
+
+static inline uint8x16_t light_tbl_remap(light_tbl const &tbl, uint8x16_t idx)
+{
+  uint8x16_t k64=vdupq_n_u8(64);
+  uint8x16_t r=vqtbl4q_u8(tbl.t[0],idx);   // indices past the table give 0,
+  idx=vsubq_u8(idx,k64);                   // and leave r alone with TBX
+  r=vqtbx4q_u8(r,tbl.t[1],idx);
+  idx=vsubq_u8(idx,k64);
+  r=vqtbx4q_u8(r,tbl.t[2],idx);
+  idx=vsubq_u8(idx,k64);
+  return vqtbx4q_u8(r,tbl.t[3],idx);
+}
+#endif
+
+// LIGHT_SIMD version of remap_line_asm2
+static void light_remap_line(uint8_t *addr, uint8_t *light_lookup, uint8_t *remap_line, int count)
+{
+  while (count)
+  {
+    uint8_t *off=light_lookup+(((int32_t)*remap_line)<<8);
+    int run=1;
+    while (run<count && remap_line[run]==*remap_line)
+      run++;
+    remap_line+=run;
+    count-=run;
+
+    int n=run*8;
+#if defined __aarch64__
+    if (run>=LIGHT_TBL_RUN)
+    {
+      light_tbl tbl;
+      light_tbl_load(tbl,off);
+      for (; n>=16; n-=16,addr+=16)
+        vst1q_u8(addr,light_tbl_remap(tbl,vld1q_u8(addr)));
+    }
+#endif
+    for (; n; n-=8,addr+=8)
+    {
+      uint64_t v=light_remap8(addr,off);
+      memcpy(addr,&v,8);
+    }
+  }
+}
 
-  int scr_w=main_screen->Size().x;
-  uint8_t *screen_line=main_screen->scan_line(caa.y)+caa.x;
+// LIGHT_SIMD version of put_8line
+static void light_double_line(uint8_t *in_line, uint8_t *out_line, uint8_t *remap, uint8_t *light_lookup, int count)
+{
+  while (count)
+  {
+    uint8_t *off=light_lookup+(((int32_t)*remap)<<8);
+    int run=1;
+    while (run<count && remap[run]==*remap)
+      run++;
+    remap+=run;
+    count-=run;
+
+    int n=run*8;
+#if defined __aarch64__
+    if (run>=LIGHT_TBL_RUN)
+    {
+      light_tbl tbl;
+      light_tbl_load(tbl,off);
+      for (; n>=16; n-=16,in_line+=16,out_line+=32)
+      {
+        uint8x16_t v=light_tbl_remap(tbl,vld1q_u8(in_line));
+        uint8x16x2_t d={ { v,v } };
+        vst2q_u8(out_line,d);
+      }
+    }
+#endif
+    for (; n; n-=8,in_line+=8,out_line+=16)
+    {
+      uint64_t v=light_remap8(in_line,off);
+#if defined __SSE2__
+      __m128i d=_mm_loadl_epi64((__m128i *)&v);
+      _mm_storeu_si128((__m128i *)out_line,_mm_unpacklo_epi8(d,d));
+#elif defined __ARM_NEON__ || defined __ARM_NEON
+      uint8x8_t d=vld1_u8((uint8_t *)&v);
+      uint8x8x2_t dd={ { d,d } };
+      vst2_u8(out_line,dd);
+#else
+      uint8_t b[8];
+      memcpy(b,&v,8);
+      for (int i=0; i<8; i++)
+        out_line[i*2]=out_line[i*2+1]=b[i];
+#endif
+    }
+  }
+}
 
-  for (int y = caa.y; y < cbb.y; )
+static void light_band(light_pass const *p, int ystart, int yend, uint8_t *remap_line)
+{
+  int x,count;
+  int scr_w=p->in_w;
+  int prefix=p->prefix,suffix=p->suffix;
+  uint8_t *light_lookup=p->light_lookup;
+  uint8_t *screen_line=p->in_line+(ystart-p->y1)*scr_w;
+  void (*remap)(uint8_t *,uint8_t *,uint8_t *,int)=
+      light_mode!=LIGHT_SCALAR ? light_remap_line : remap_line_asm2;
+
+  for (int y = ystart; y < yend; )
   {
-    int x,count;
-//    while (f->next && f->y2<y)
-//      f=f->next;
     uint8_t *rem=remap_line;
 
-    int todoy=4-((screeny+y)&3);
-    if (y + todoy >= cbb.y)
-      todoy = cbb.y - y;
+    int todoy=4-((p->screeny+y)&3);
+    if (y + todoy >= yend)
+      todoy = yend - y;
 
-    int calcy=((y+screeny)&(~3))-caa.y;
+    int calcy=((y+p->screeny)&(~3))-p->y1;
 
 
     if (suffix)
     {
-      light_patch *lp=f;
-      for (; (lp->y1>y-caa.y || lp->y2<y-caa.y ||
-                  lp->x1>suffix_x || lp->x2<suffix_x); lp=lp->next);
-      uint8_t * caddr=(uint8_t *)screen_line + cbb.x - caa.x - suffix;
-      uint8_t *r=light_lookup+(((int32_t)calc_light_value(lp,suffix_x+screenx,calcy)<<8));
+      uint8_t * caddr=(uint8_t *)screen_line + p->width - suffix;
+      uint8_t *r=light_lookup+(((int32_t)light_edge_value(p,p->suffix_x,y-p->y1,calcy)<<8));
       switch (todoy)
       {
     case 4 :
@@ -838,11 +1293,8 @@ void light_screen(image *sc, int32_t screenx, int32_t screeny, uint8_t *light_lo
 
     if (prefix)
     {
-      light_patch *lp=f;
-      for (; (lp->y1>y-caa.y || lp->y2<y-caa.y ||
-                  lp->x1>prefix_x || lp->x2<prefix_x); lp=lp->next);
 
-      uint8_t *r=light_lookup+(((int32_t)calc_light_value(lp,prefix_x+screenx,calcy)<<8));
+      uint8_t *r=light_lookup+(((int32_t)light_edge_value(p,p->prefix_x,y-p->y1,calcy)<<8));
       uint8_t * caddr=(uint8_t *)screen_line;
       switch (todoy)
       {
@@ -863,139 +1315,64 @@ void light_screen(image *sc, int32_t screenx, int32_t screeny, uint8_t *light_lo
 
 
 
-
-    for (x=prefix,count=0; count<remap_size; count++,x+=8,rem++)
+    if (light_mode!=LIGHT_SCALAR)
+    {
+      light_values(p,y-p->y1,calcy,remap_line);
+      count=p->remap_size;
+    }
+    else
+    for (x=prefix,count=0; count<p->remap_size; count++,x+=8,rem++)
     {
-      light_patch *lp=f;
-      for (; (lp->y1>y-caa.y || lp->y2<y-caa.y || lp->x1>x || lp->x2<x); lp=lp->next);
-      *rem=calc_light_value(lp,x+screenx,calcy);
+      light_patch *lp=p->first;
+      for (; (lp->y1>y-p->y1 || lp->y2<y-p->y1 || lp->x1>x || lp->x2<x); lp=lp->next);
+      *rem=calc_light_value(lp,x+p->screenx,calcy);
     }
 
     switch (todoy)
     {
       case 4 :
-      remap_line_asm2(screen_line,light_lookup,remap_line,count);  y++; todoy--;  screen_line+=scr_w;
+      remap(screen_line,light_lookup,remap_line,count);  y++; todoy--;  screen_line+=scr_w;
       case 3 :
-      remap_line_asm2(screen_line,light_lookup,remap_line,count);  y++; todoy--;  screen_line+=scr_w;
+      remap(screen_line,light_lookup,remap_line,count);  y++; todoy--;  screen_line+=scr_w;
       case 2 :
-      remap_line_asm2(screen_line,light_lookup,remap_line,count);  y++; todoy--;  screen_line+=scr_w;
+      remap(screen_line,light_lookup,remap_line,count);  y++; todoy--;  screen_line+=scr_w;
       case 1 :
-      remap_line_asm2(screen_line,light_lookup,remap_line,count);  y++; todoy--;  screen_line+=scr_w;
+      remap(screen_line,light_lookup,remap_line,count);  y++; todoy--;  screen_line+=scr_w;
     }
 
 
     screen_line-=prefix;
   }
-  main_screen->Unlock();
-
-  while (first)
-  {
-    light_patch *p=first;
-    first=first->next;
-    delete p;
-  }
-  free(remap_line);
 }
 
-
-void double_light_screen(image *sc, int32_t screenx, int32_t screeny, uint8_t *light_lookup, uint16_t ambient,
-             image *out, int32_t out_x, int32_t out_y)
+static void double_light_band(light_pass const *p, int ystart, int yend, uint8_t *remap_line)
 {
-  if (sc->Size().x*2+out_x>out->Size().x ||
-      sc->Size().y*2+out_y>out->Size().y)
-    return ;   // screen was resized and small_render has not changed size yet
-
-
-  int lx_run=0,ly_run;                     // light block x & y run size in pixels ==  (1<<lx_run)
-  switch (light_detail)
-  {
-    case HIGH_DETAIL :
-    { lx_run=2; ly_run=1; } break;       // 4 x 2 patches
-    case MEDIUM_DETAIL :
-    { lx_run=3; ly_run=2; } break;       // 8 x 4 patches  (default)
-    case LOW_DETAIL :
-    { lx_run=4; ly_run=3; } break;       // 16 x 8 patches
-    case POOR_DETAIL :                   // poor detail is no lighting
-    return ;
-  }
-  if ((int)ambient+ambient_ramp<0)
-    min_light_level=0;
-  else if ((int)ambient+ambient_ramp>63)
-    min_light_level=63;
-  else min_light_level=(int)ambient+ambient_ramp;
-
-  ivec2 caa, cbb;
-  sc->GetClip(caa, cbb);
-
-
-  if (ambient==63)      // lights off, just double the pixels
-  {
-    uint8_t *src=sc->scan_line(0);
-    uint8_t *dst=out->scan_line(out_y+caa.y*2)+caa.x*2+out_x;
-    int d_skip=out->Size().x-sc->Size().x*2;
-    int x,y;
-    uint16_t v;
-    for (y=sc->Size().y; y; y--)
-    {
-      for (x=sc->Size().x; x; x--)
-      {
-    v=*(src++);
-    *(dst++)=v;
-    *(dst++)=v;
-      }
-      dst=dst+d_skip;
-      memcpy(dst,dst-out->Size().x,sc->Size().x*2);
-      dst+=out->Size().x;
-    }
-
-    return ;
-  }
-
-  light_patch *first = make_patch_list(cbb.x - caa.x, cbb.y - caa.y, screenx, screeny);
-
-  int scr_w=sc->Size().x;
-  int dscr_w=out->Size().x;
-
-  int prefix_x=(screenx&7);
-  int prefix=screenx&7;
-  if (prefix)
-    prefix=8-prefix;
-  int suffix_x = cbb.x - 1 - caa.x - (screenx & 7);
-
-  int suffix = (cbb.x - caa.x - prefix) & 7;
-
-  int32_t remap_size = ((cbb.x - caa.x - prefix - suffix)>>lx_run);
-
-  uint8_t *remap_line=(uint8_t *)malloc(remap_size);
-
-  light_patch *f=first;
-  uint8_t *in_line=sc->scan_line(caa.y)+caa.x;
-  uint8_t *out_line=out->scan_line(caa.y*2+out_y)+caa.x*2+out_x;
-
-
-  for (int y = caa.y; y < cbb.y; )
+  int x,count;
+  int scr_w=p->in_w,dscr_w=p->out_w;
+  int prefix=p->prefix,suffix=p->suffix;
+  uint8_t *light_lookup=p->light_lookup;
+  uint8_t *in_line=p->in_line+(ystart-p->y1)*scr_w;
+  uint8_t *out_line=p->out_line+(ystart-p->y1)*2*dscr_w;
+  void (*put)(uint8_t *,uint8_t *,uint8_t *,uint8_t *,int)=
+      light_mode!=LIGHT_SCALAR ? light_double_line : put_8line;
+
+  for (int y = ystart; y < yend; )
   {
-    int x,count;
-//    while (f->next && f->y2<y)
-//      f=f->next;
     uint8_t *rem=remap_line;
 
-    int todoy=4-((screeny+y)&3);
-    if (y + todoy >= cbb.y)
-      todoy = cbb.y - y;
+    int todoy=4-((p->screeny+y)&3);
+    if (y + todoy >= yend)
+      todoy = yend - y;
 
-    int calcy=((y+screeny)&(~3))-caa.y;
+    int calcy=((y+p->screeny)&(~3))-p->y1;
 
 
     if (suffix)
     {
-      light_patch *lp=f;
-      for (; (lp->y1>y-caa.y || lp->y2<y-caa.y ||
-                  lp->x1>suffix_x || lp->x2<suffix_x); lp=lp->next);
-      uint8_t * caddr=(uint8_t *)in_line + cbb.x - caa.x - suffix;
-      uint8_t * daddr=(uint8_t *)out_line+(cbb.x - caa.x - suffix)*2;
+      uint8_t * caddr=(uint8_t *)in_line + p->width - suffix;
+      uint8_t * daddr=(uint8_t *)out_line+(p->width - suffix)*2;
 
-      uint8_t *r=light_lookup+(((int32_t)calc_light_value(lp,suffix_x+screenx,calcy)<<8));
+      uint8_t *r=light_lookup+(((int32_t)light_edge_value(p,p->suffix_x,y-p->y1,calcy)<<8));
       switch (todoy)
       {
     case 4 :
@@ -1023,11 +1400,8 @@ void double_light_screen(image *sc, int32_t screenx, int32_t screeny, uint8_t *l
 
     if (prefix)
     {
-      light_patch *lp=f;
-      for (; (lp->y1>y-caa.y || lp->y2<y-caa.y ||
-                  lp->x1>prefix_x || lp->x2<prefix_x); lp=lp->next);
 
-      uint8_t *r=light_lookup+(((int32_t)calc_light_value(lp,prefix_x+screenx,calcy)<<8));
+      uint8_t *r=light_lookup+(((int32_t)light_edge_value(p,p->prefix_x,y-p->y1,calcy)<<8));
       uint8_t * caddr=(uint8_t *)in_line;
       uint8_t * daddr=(uint8_t *)out_line;
       switch (todoy)
@@ -1059,53 +1433,281 @@ void double_light_screen(image *sc, int32_t screenx, int32_t screeny, uint8_t *l
 
 
 
-
-    for (x=prefix,count=0; count<remap_size; count++,x+=8,rem++)
+    if (light_mode!=LIGHT_SCALAR)
+    {
+      light_values(p,y-p->y1,calcy,remap_line);
+      count=p->remap_size;
+    }
+    else
+    for (x=prefix,count=0; count<p->remap_size; count++,x+=8,rem++)
     {
-      light_patch *lp=f;
-      for (; (lp->y1>y-caa.y || lp->y2<y-caa.y || lp->x1>x || lp->x2<x); lp=lp->next);
-      *rem=calc_light_value(lp,x+screenx,calcy);
+      light_patch *lp=p->first;
+      for (; (lp->y1>y-p->y1 || lp->y2<y-p->y1 || lp->x1>x || lp->x2<x); lp=lp->next);
+      *rem=calc_light_value(lp,x+p->screenx,calcy);
     }
 
     rem=remap_line;
 
-    put_8line(in_line,out_line,rem,light_lookup,count);
-    memcpy(out_line+dscr_w,out_line,count*16);
-    out_line+=dscr_w;
-    in_line+=scr_w; out_line+=dscr_w; y++; todoy--;
-    if (todoy)
+    while (todoy)
     {
-      put_8line(in_line,out_line,rem,light_lookup,count);
+      put(in_line,out_line,rem,light_lookup,count);
       memcpy(out_line+dscr_w,out_line,count*16);
       out_line+=dscr_w;
       in_line+=scr_w; out_line+=dscr_w; y++; todoy--;
-      if (todoy)
-      {
-    put_8line(in_line,out_line,rem,light_lookup,count);
-    memcpy(out_line+dscr_w,out_line,count*16);
-    out_line+=dscr_w;
-    in_line+=scr_w; out_line+=dscr_w; y++; todoy--;
-    if (todoy)
-    {
-      put_8line(in_line,out_line,rem,light_lookup,count);
-      memcpy(out_line+dscr_w,out_line,count*16);
-      out_line+=dscr_w;
-      in_line+=scr_w; out_line+=dscr_w; y++;
-    }
-      }
     }
     in_line-=prefix;
     out_line-=prefix*2;
   }
+}
 
+static void light_job_run(light_job *job)
+{
+  if (job->ystart>=job->yend)
+    return ;
+  if (job->pass->out_line)
+    double_light_band(job->pass,job->ystart,job->yend,job->remap_line);
+  else
+    light_band(job->pass,job->ystart,job->yend,job->remap_line);
+}
 
-  while (first)
+#define LIGHT_MAX_THREADS 8
+
+static int light_thread_count=1;
+static int light_quit=0;
+static light_job light_jobs[LIGHT_MAX_THREADS];
+static SDL_Thread *light_workers[LIGHT_MAX_THREADS];
+static SDL_sem *light_start[LIGHT_MAX_THREADS],*light_done=NULL;
+
+static int light_worker(void *arg)
+{
+  int n=(int)(intptr_t)arg;
+  for (;;)
   {
-    light_patch *p=first;
-    first=first->next;
-    delete p;
+    SDL_SemWait(light_start[n]);
+    if (light_quit)
+      break;
+    light_job_run(&light_jobs[n]);
+    SDL_SemPost(light_done);
+  }
+  return 0;
+}
+
+void light_set_threads(int count)
+{
+  count=Max(1,Min(count,LIGHT_MAX_THREADS));
+  if (count==light_thread_count)
+    return ;
+
+  light_quit=1;
+  for (int i=1; i<light_thread_count; i++)
+  {
+    SDL_SemPost(light_start[i]);
+    SDL_WaitThread(light_workers[i],NULL);
+    SDL_DestroySemaphore(light_start[i]);
+  }
+  light_quit=0;
+  light_thread_count=1;
+
+  if (!light_done)
+    light_done=SDL_CreateSemaphore(0);
+  for (int i=1; i<count && light_done; i++)
+  {
+    light_start[i]=SDL_CreateSemaphore(0);
+    light_workers[i]=light_start[i] ? SDL_CreateThread(light_worker,(void *)(intptr_t)i) : NULL;
+    if (!light_workers[i])
+    {
+      if (light_start[i])
+        SDL_DestroySemaphore(light_start[i]);
+      dprintf("Unable to start light thread, using %d\n",light_thread_count);
+      break;
+    }
+    light_thread_count++;
+  }
+}
+
+// split the clip rows into bands of whole light groups and light them
+static void light_pass_run(light_pass *p)
+{
+  int bands=light_thread_count,rows=p->y2-p->y1;
+  if (rows<bands*8)
+    bands=1;
+  if (!p->first)
+    light_field_prepare(p);
+
+  uint8_t *remap_lines=(uint8_t *)malloc(Max(p->remap_size,1)*bands);
+
+  int ystart=p->y1;
+  for (int i=0; i<bands; i++)
+  {
+    int yend=p->y2;
+    if (i<bands-1)
+    {
+      yend=p->y1+rows*(i+1)/bands;
+      yend=((yend+p->screeny+3)&(~3))-p->screeny;
+      yend=Max(ystart,Min(yend,p->y2));
+    }
+    light_jobs[i].pass=p;
+    light_jobs[i].ystart=ystart;
+    light_jobs[i].yend=yend;
+    light_jobs[i].remap_line=remap_lines+p->remap_size*i;
+    ystart=yend;
+  }
+
+  for (int i=1; i<bands; i++)
+    SDL_SemPost(light_start[i]);
+  light_job_run(&light_jobs[0]);
+  for (int i=1; i<bands; i++)
+    SDL_SemWait(light_done);
+
+  free(remap_lines);
+}
+
+void light_screen(image *sc, int32_t screenx, int32_t screeny, uint8_t *light_lookup, uint16_t ambient)
+{
+  int lx_run=0,ly_run;                     // light block x & y run size in pixels ==  (1<<lx_run)
+  TraceScope trace(TRACE_LIGHT);
+
+  if (shutdown_lighting && !disable_autolight)
+    ambient=shutdown_lighting_value;
+
+  switch (light_detail)
+  {
+    case HIGH_DETAIL :
+    { lx_run=2; ly_run=1; } break;       // 4 x 2 patches
+    case MEDIUM_DETAIL :
+    { lx_run=3; ly_run=2; } break;       // 8 x 4 patches  (default)
+    case LOW_DETAIL :
+    { lx_run=4; ly_run=3; } break;       // 16 x 8 patches
+    case POOR_DETAIL :                   // poor detail is no lighting
+    return ;
+  }
+  if ((int)ambient+ambient_ramp<0)
+    min_light_level=0;
+  else if ((int)ambient+ambient_ramp>63)
+    min_light_level=63;
+  else min_light_level=(int)ambient+ambient_ramp;
+
+  if (ambient==63) return ;
+  ivec2 caa, cbb;
+  sc->GetClip(caa, cbb);
+
+  light_pass p;
+  p.first = light_mode==LIGHT_CACHED ? NULL
+          : make_patch_list(cbb.x - caa.x, cbb.y - caa.y, screenx, screeny);
+  p.screenx=screenx;
+  p.screeny=screeny;
+  p.y1=caa.y;
+  p.y2=cbb.y;
+  p.width=cbb.x - caa.x;
+  p.light_lookup=light_lookup;
+
+  p.prefix_x=(screenx&7);
+  p.prefix=screenx&7;
+  if (p.prefix)
+    p.prefix=8-p.prefix;
+  p.suffix_x = cbb.x - 1 - caa.x - (screenx & 7);
+
+  p.suffix = (cbb.x - caa.x - p.prefix) & 7;
+
+  p.remap_size=((cbb.x - caa.x - p.prefix - p.suffix)>>lx_run);
+
+  main_screen->Lock();
+
+  p.in_w=main_screen->Size().x;
+  p.in_line=main_screen->scan_line(caa.y)+caa.x;
+  p.out_w=0;
+  p.out_line=NULL;
+
+  light_pass_run(&p);
+
+  main_screen->Unlock();
+
+  delete_patch_list(p.first);
+}
+
+
+void double_light_screen(image *sc, int32_t screenx, int32_t screeny, uint8_t *light_lookup, uint16_t ambient,
+             image *out, int32_t out_x, int32_t out_y)
+{
+  if (sc->Size().x*2+out_x>out->Size().x ||
+      sc->Size().y*2+out_y>out->Size().y)
+    return ;   // screen was resized and small_render has not changed size yet
+
+
+  int lx_run=0,ly_run;                     // light block x & y run size in pixels ==  (1<<lx_run)
+  switch (light_detail)
+  {
+    case HIGH_DETAIL :
+    { lx_run=2; ly_run=1; } break;       // 4 x 2 patches
+    case MEDIUM_DETAIL :
+    { lx_run=3; ly_run=2; } break;       // 8 x 4 patches  (default)
+    case LOW_DETAIL :
+    { lx_run=4; ly_run=3; } break;       // 16 x 8 patches
+    case POOR_DETAIL :                   // poor detail is no lighting
+    return ;
+  }
+  if ((int)ambient+ambient_ramp<0)
+    min_light_level=0;
+  else if ((int)ambient+ambient_ramp>63)
+    min_light_level=63;
+  else min_light_level=(int)ambient+ambient_ramp;
+
+  ivec2 caa, cbb;
+  sc->GetClip(caa, cbb);
+
+
+  if (ambient==63)      // lights off, just double the pixels
+  {
+    uint8_t *src=sc->scan_line(0);
+    uint8_t *dst=out->scan_line(out_y+caa.y*2)+caa.x*2+out_x;
+    int d_skip=out->Size().x-sc->Size().x*2;
+    int x,y;
+    uint16_t v;
+    for (y=sc->Size().y; y; y--)
+    {
+      for (x=sc->Size().x; x; x--)
+      {
+    v=*(src++);
+    *(dst++)=v;
+    *(dst++)=v;
+      }
+      dst=dst+d_skip;
+      memcpy(dst,dst-out->Size().x,sc->Size().x*2);
+      dst+=out->Size().x;
+    }
+
+    return ;
   }
-  free(remap_line);
+
+  light_pass p;
+  p.first = light_mode==LIGHT_CACHED ? NULL
+          : make_patch_list(cbb.x - caa.x, cbb.y - caa.y, screenx, screeny);
+  p.screenx=screenx;
+  p.screeny=screeny;
+  p.y1=caa.y;
+  p.y2=cbb.y;
+  p.width=cbb.x - caa.x;
+  p.light_lookup=light_lookup;
+
+  p.in_w=sc->Size().x;
+  p.out_w=out->Size().x;
+
+  p.prefix_x=(screenx&7);
+  p.prefix=screenx&7;
+  if (p.prefix)
+    p.prefix=8-p.prefix;
+  p.suffix_x = cbb.x - 1 - caa.x - (screenx & 7);
+
+  p.suffix = (cbb.x - caa.x - p.prefix) & 7;
+
+  p.remap_size = ((cbb.x - caa.x - p.prefix - p.suffix)>>lx_run);
+
+  p.in_line=sc->scan_line(caa.y)+caa.x;
+  p.out_line=out->scan_line(caa.y*2+out_y)+caa.x*2+out_x;
+
+  light_pass_run(&p);
+
+  delete_patch_list(p.first);
 }
 
 
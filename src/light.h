@@ -76,6 +76,14 @@ void light_screen(image *sc, int32_t screenx, int32_t screeny, uint8_t *light_lo
 void double_light_screen(image *sc, int32_t screenx, int32_t screeny, uint8_t *light_lookup, uint16_t ambient,
              image *out, int32_t out_x, int32_t out_y);
 
+enum { LIGHT_SCALAR,   // reference light map passes
+       LIGHT_SIMD,     // same output, vectorized
+       LIGHT_CACHED }; // same output, vectorized and reading the light field
+extern int light_mode;
+void light_set_threads(int count);  // threads lighting the screen in bands
+void light_field_dirty(int32_t x1, int32_t y1, int32_t x2, int32_t y2);
+void light_field_flush();
+
 void calc_light_table(palette *pal);
 extern light_source *first_light_source;
 extern int light_detail;
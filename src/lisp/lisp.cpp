@@ -25,7 +25,9 @@
 
 #include "lisp.h"
 #include "lisp_gc.h"
+#include "lisp_vm.h"
 #include "symbols.h"
+#include "trace.h"
 
 #ifdef NO_LIBS
 #   include "fakelib.h"
@@ -42,15 +44,19 @@
  * variables will reside in permanant space.  Eveything else will reside in
  * tmp space which gets thrown away after completion of eval.  system
  * functions reside in permant space. */
-LSpace LSpace::Tmp, LSpace::Perm, LSpace::Gc;
+LSpace LSpace::Tmp, LSpace::Perm, LSpace::Gc, LSpace::Nursery;
 
 /* Normally set to Tmp, unless compiling or other needs. */
 LSpace *LSpace::Current;
 
 bFILE *current_print_file = NULL;
 
-LSymbol *LSymbol::root = NULL;
+LSymbol *LSymbol::first = NULL;
 size_t LSymbol::count = 0;
+int32_t LSymbol::function_epoch = 1;
+
+lisp_c_function *c_table = NULL;
+static int c_table_size = 0;
 
 int print_level = 0, trace_level = 0, trace_print_level = 1000;
 int total_user_functions;
@@ -189,6 +195,14 @@ void *LSpace::Alloc(size_t size)
     // Align allocation
     size = (size + sizeof(intptr_t) - 1) & ~(sizeof(intptr_t) - 1);
 
+    // New permanent objects start in the nursery in generational mode
+    if (this == &LSpace::Perm && LSpace::Nursery.m_data)
+    {
+        if (size > LSpace::Nursery.GetFree())
+            Lisp::CollectNursery(size);
+        return LSpace::Nursery.Alloc(size);
+    }
+
     // Collect garbage if necessary
     if (size > GetFree())
     {
@@ -273,6 +287,7 @@ LArray *LArray::Create(size_t len, void *rest)
             lbreak("Bad option argument to make-array\n");
             exit(0);
         }
+        Lisp::WriteBarrier(p);
     }
 
     return p;
@@ -355,6 +370,7 @@ LUserFunction *new_lisp_user_function(LList *arg_list, LList *block_list)
     lu->m_type = L_USER_FUNCTION;
     lu->arg_list = arg_list;
     lu->block_list = block_list;
+    lu->code = NULL;
     return lu;
 }
 
@@ -787,31 +803,95 @@ LSymbol *make_find_symbol(char const *name)    // find a symbol, if it doesn't e
 
 */
 
-LSymbol *LSymbol::Find(char const *name)
+/* Symbols are looked up by name in an open addressing hash table, which
+ * keeps each name's hash and a copy of the name out of the Lisp spaces.
+ * They are also linked into a list, for the collector and the profiler,
+ * which walk all of them. */
+struct SymbolSlot
 {
-    LSymbol *p = root;
-    while (p)
+    uint32_t hash;
+    char const *name;
+    LSymbol *sym;
+};
+
+static SymbolSlot *symbol_table = NULL;
+static size_t symbol_table_size = 0; // a power of two
+static char *symbol_blocks = NULL;   // blocks of interned names
+static char *symbol_names = NULL;    // free space in the last block
+static size_t symbol_names_left = 0;
+
+static uint32_t symbol_hash(char const *name)
+{
+    uint32_t h = 2166136261u;
+    for (; *name; name++)
+        h = (h ^ (uint8_t)*name) * 16777619u;
+    return h;
+}
+
+// Returns the slot holding name, or the free slot where it would go
+static SymbolSlot *symbol_slot(char const *name, uint32_t hash)
+{
+    size_t mask = symbol_table_size - 1;
+    for (size_t i = hash & mask; ; i = (i + 1) & mask)
     {
-        int cmp = strcmp(name, p->m_name->GetString());
-        if (cmp == 0)
-            return p;
-        p = (cmp < 0) ? p->m_left : p->m_right;
+        SymbolSlot *slot = symbol_table + i;
+        if (!slot->sym || (slot->hash == hash && !strcmp(slot->name, name)))
+            return slot;
     }
-    return NULL;
 }
 
-LSymbol *LSymbol::FindOrCreate(char const *name)
+static void symbol_table_grow()
+{
+    SymbolSlot *old = symbol_table;
+    size_t old_size = symbol_table_size;
+
+    symbol_table_size = Max(old_size * 2, (size_t)1024);
+    symbol_table = (SymbolSlot *)calloc(symbol_table_size, sizeof(SymbolSlot));
+    for (size_t i = 0; i < old_size; i++)
+        if (old[i].sym)
+            *symbol_slot(old[i].name, old[i].hash) = old[i];
+    free(old);
+}
+
+// Name blocks are chained through their first bytes so they can be freed
+static char const *symbol_intern(char const *name)
 {
-    LSymbol *p = root;
-    LSymbol **parent = &root;
-    while (p)
+    size_t len = strlen(name) + 1;
+    if (len > symbol_names_left)
     {
-        int cmp = strcmp(name, p->m_name->GetString());
-        if (cmp == 0)
-            return p;
-        parent = (cmp < 0) ? &p->m_left : &p->m_right;
-        p = *parent;
+        size_t size = Max(len + sizeof(char *), (size_t)0x4000);
+        char *block = (char *)malloc(size);
+        *(char **)block = symbol_blocks;
+        symbol_blocks = block;
+        symbol_names = block + sizeof(char *);
+        symbol_names_left = size - sizeof(char *);
     }
+    char *ret = symbol_names;
+    memcpy(ret, name, len);
+    symbol_names += len;
+    symbol_names_left -= len;
+    return ret;
+}
+
+LSymbol *LSymbol::Find(char const *name)
+{
+    if (!symbol_table)
+        return NULL;
+    return symbol_slot(name, symbol_hash(name))->sym;
+}
+
+LSymbol *LSymbol::FindOrCreate(char const *name)
+{
+    if ((count + 1) * 2 > symbol_table_size)
+        symbol_table_grow();
+
+    uint32_t hash = symbol_hash(name);
+    SymbolSlot *slot = symbol_slot(name, hash);
+    if (slot->sym)
+        return slot->sym;
+
+    // The name may be in a Lisp string, which can move once we allocate
+    name = symbol_intern(name);
 
     // Make sure all symbols get defined in permanant space
     LSpace *sp = LSpace::Current;
@@ -819,31 +899,36 @@ LSymbol *LSymbol::FindOrCreate(char const *name)
         LSpace::Current = &LSpace::Perm;
 
     // These permanent objects cannot be GCed, so malloc() them
-    p = (LSymbol *)malloc(sizeof(LSymbol));
+    LSymbol *p = (LSymbol *)malloc(sizeof(LSymbol));
     p->m_type = L_SYMBOL;
     p->m_name = LString::Create(name);
 
     // If constant, set the value to ourself
     p->m_value = (name[0] == ':') ? p : l_undefined;
     p->m_function = l_undefined;
+    Lisp::RememberSymbol(p);
 #ifdef L_PROFILE
     p->time_taken = 0;
 #endif
-    p->m_left = p->m_right = NULL;
-    *parent = p;
+    p->m_next = first;
+    first = p;
+
+    slot->hash = hash;
+    slot->name = name;
+    slot->sym = p;
     count++;
 
     LSpace::Current = sp;
     return p;
 }
 
-static void DeleteAllSymbols(LSymbol *root)
+static void DeleteAllSymbols(LSymbol *first)
 {
-    if (root)
+    while (first)
     {
-        DeleteAllSymbols(root->m_left);
-        DeleteAllSymbols(root->m_right);
-        free(root);
+        LSymbol *next = first->m_next;
+        free(first);
+        first = next;
     }
 }
 
@@ -900,13 +985,17 @@ void *pairlis(void *list1, void *list2, void *list3)
     LList *first = NULL, *last = NULL, *cur = NULL;
     LObject *tmp;
     PtrRef r1(first), r2(last), r3(cur);
+    PtrRef r4(list1), r5(list2), r6(list3);
     while (list1)
     {
       cur = LList::Create();
       if (!first)
         first = cur;
       if (last)
+      {
         last->m_cdr = cur;
+        Lisp::WriteBarrier(last);
+      }
       last = cur;
 
       LList *cell = LList::Create();
@@ -915,6 +1004,7 @@ void *pairlis(void *list1, void *list2, void *list3)
       tmp = (LObject *)lcar(list2);
       cell->m_cdr = tmp;
       cur->m_car = cell;
+      Lisp::WriteBarrier(cur);
 
       list1 = ((LList *)list1)->m_cdr;
       list2 = ((LList *)list2)->m_cdr;
@@ -927,7 +1017,11 @@ void *pairlis(void *list1, void *list2, void *list3)
 
 void LSymbol::SetFunction(LObject *function)
 {
+    if (m_function != function && item_type(m_function) == L_USER_FUNCTION)
+        LispVM::Release((LUserFunction *)m_function);
     m_function = function;
+    function_epoch++;
+    Lisp::RememberSymbol(this);
 }
 
 LSymbol *add_sys_function(char const *name, short min_args, short max_args, short number)
@@ -939,7 +1033,7 @@ LSymbol *add_sys_function(char const *name, short min_args, short max_args, shor
     lbreak("add_sys_fucntion -> symbol %s already has a function\n", name);
     exit(0);
   }
-  else s->m_function=new_lisp_sys_function(min_args, max_args, number);
+  else s->SetFunction(new_lisp_sys_function(min_args, max_args, number));
   return s;
 }
 
@@ -952,7 +1046,7 @@ LSymbol *add_c_object(void *symbol, int index)
     lbreak("add_c_object -> symbol %s already has a value\n", lstring_value(s->GetName()));
     exit(0);
   }
-  else s->m_value=LObjectVar::Create(index);
+  else s->SetValue(LObjectVar::Create(index));
   return NULL;
 }
 
@@ -966,7 +1060,7 @@ LSymbol *add_c_function(char const *name, short min_args, short max_args, short
     lbreak("add_sys_fucntion -> symbol %s already has a function\n", name);
     exit(0);
   }
-  else s->m_function=new_lisp_c_function(min_args, max_args, number);
+  else s->SetFunction(new_lisp_c_function(min_args, max_args, number));
   return s;
 }
 
@@ -980,11 +1074,33 @@ LSymbol *add_c_bool_fun(char const *name, short min_args, short max_args, short
     lbreak("add_sys_fucntion -> symbol %s already has a function\n", name);
     exit(0);
   }
-  else s->m_function=new_lisp_c_bool(min_args, max_args, number);
+  else s->SetFunction(new_lisp_c_bool(min_args, max_args, number));
   return s;
 }
 
 
+static short add_c_table(lisp_c_function fun)
+{
+  if (C_TABLE_FIRST + c_table_size > 0x7fff)
+  {
+    lbreak("add_c_table -> too many C functions\n");
+    exit(0);
+  }
+  c_table = (lisp_c_function *)realloc(c_table, sizeof(lisp_c_function) * (c_table_size + 1));
+  c_table[c_table_size] = fun;
+  return C_TABLE_FIRST + c_table_size++;
+}
+
+LSymbol *add_c_function(char const *name, short min_args, short max_args, lisp_c_function fun)
+{
+  return add_c_function(name, min_args, max_args, add_c_table(fun));
+}
+
+LSymbol *add_c_bool_fun(char const *name, short min_args, short max_args, lisp_c_function fun)
+{
+  return add_c_bool_fun(name, min_args, max_args, add_c_table(fun));
+}
+
 LSymbol *add_lisp_function(char const *name, short min_args, short max_args, short number)
 {
   total_user_functions++;
@@ -995,7 +1111,7 @@ LSymbol *add_lisp_function(char const *name, short min_args, short max_args, sho
     lbreak("add_sys_fucntion -> symbol %s already has a function\n", name);
     exit(0);
   }
-  else s->m_function=new_user_lisp_function(min_args, max_args, number);
+  else s->SetFunction(new_user_lisp_function(min_args, max_args, number));
   return s;
 }
 
@@ -1104,6 +1220,8 @@ LObject *LObject::Compile(char const *&code)
     ((LList *)c2)->m_car = (LObject *)tmp;
     ((LList *)c2)->m_cdr=NULL;
     ((LList *)cs)->m_cdr = (LObject *)c2;
+    Lisp::WriteBarrier(c2);
+    Lisp::WriteBarrier(cs);
     ret=cs;
   }
   else if (n[0]=='`')                    // short hand for backquote function
@@ -1117,6 +1235,8 @@ LObject *LObject::Compile(char const *&code)
     ((LList *)c2)->m_car = (LObject *)tmp;
     ((LList *)c2)->m_cdr=NULL;
     ((LList *)cs)->m_cdr = (LObject *)c2;
+    Lisp::WriteBarrier(c2);
+    Lisp::WriteBarrier(cs);
     ret=cs;
   }  else if (n[0]==',')              // short hand for comma function
   {
@@ -1129,6 +1249,8 @@ LObject *LObject::Compile(char const *&code)
     ((LList *)c2)->m_car = (LObject *)tmp;
     ((LList *)c2)->m_cdr=NULL;
     ((LList *)cs)->m_cdr = (LObject *)c2;
+    Lisp::WriteBarrier(c2);
+    Lisp::WriteBarrier(cs);
     ret=cs;
   }
   else if (n[0]=='(')                     // make a list of everything in ()
@@ -1158,6 +1280,7 @@ LObject *LObject::Compile(char const *&code)
                     read_ltoken(code, n);              // skip the '.'
                     tmp=Compile(code);
                     ((LList *)last)->m_cdr = (LObject *)tmp;          // link the last cdr to
+                    Lisp::WriteBarrier(last);
                     last=NULL;
                   }
                 } else if (!last && first)
@@ -1170,8 +1293,12 @@ LObject *LObject::Compile(char const *&code)
                   if (!first) first=cur;
                   tmp=Compile(code);
                   ((LList *)cur)->m_car = (LObject *)tmp;
+                  Lisp::WriteBarrier(cur);
                   if (last)
+                  {
                     ((LList *)last)->m_cdr = (LObject *)cur;
+                    Lisp::WriteBarrier(last);
+                  }
                   last=cur;
                 }
       }
@@ -1225,6 +1352,8 @@ LObject *LObject::Compile(char const *&code)
       tmp=Compile(code);
       ((LList *)c2)->m_car = (LObject *)tmp;
       ((LList *)cs)->m_cdr = (LObject *)c2;
+      Lisp::WriteBarrier(c2);
+      Lisp::WriteBarrier(cs);
       ret=cs;
     }
     else
@@ -1401,6 +1530,7 @@ LObject *LSymbol::EvalFunction(void *arg_list)
     }
 #endif
 
+    TraceScope trace(TRACE_EVAL);
     LObject *fun = m_function;
     PtrRef ref2(fun);
     PtrRef ref3(arg_list);
@@ -1475,18 +1605,22 @@ LObject *LSymbol::EvalFunction(void *arg_list)
         {
             LList *tmp = LList::Create();
             if (first)
+            {
                 cur->m_cdr = tmp;
+                Lisp::WriteBarrier(cur);
+            }
             else
                 first = tmp;
             cur = tmp;
 
             LObject *val = CAR(arg_list)->Eval();
             ((LList *)cur)->m_car = val;
+            Lisp::WriteBarrier(cur);
             arg_list = lcdr(arg_list);
         }
         if (t == L_C_FUNCTION)
-            ret = LNumber::Create(c_caller(((LSysFunction *)fun)->fun_number, first));
-        else if (c_caller(((LSysFunction *)fun)->fun_number, first))
+            ret = LNumber::Create(c_call(((LSysFunction *)fun)->fun_number, first));
+        else if (c_call(((LSysFunction *)fun)->fun_number, first))
             ret = true_symbol;
         else
             ret = NULL;
@@ -1506,25 +1640,35 @@ LObject *LSymbol::EvalFunction(void *arg_list)
 }
 
 #ifdef L_PROFILE
-void pro_print(bFILE *out, LSymbol *p)
+static int pro_compare(void const *a, void const *b)
+{
+  // by name, last first
+  return strcmp(lstring_value((*(LSymbol * const *)b)->GetName()),
+                lstring_value((*(LSymbol * const *)a)->GetName()));
+}
+
+void pro_print(bFILE *out)
 {
-  if (p)
+  LSymbol **syms=(LSymbol **)malloc(sizeof(LSymbol *)*(LSymbol::count+1));
+  size_t n=0;
+  for (LSymbol *p=LSymbol::first; p; p=p->m_next)
+    syms[n++]=p;
+  qsort(syms,n,sizeof(LSymbol *),pro_compare);
+
+  for (size_t i=0; i<n; i++)
   {
-    pro_print(out, p->m_right);
-    {
-      const size_t stsize = 100;
-      char st[stsize];
-      snprintf(st, stsize, "%20s %f\n", lstring_value(p->GetName()), p->time_taken);
-      out->write(st, strlen(st));
-    }
-    pro_print(out, p->m_left);
+    const size_t stsize = 100;
+    char st[stsize];
+    snprintf(st, stsize, "%20s %f\n", lstring_value(syms[i]->GetName()), syms[i]->time_taken);
+    out->write(st, strlen(st));
   }
+  free(syms);
 }
 
 void preport(char *fn)
 {
   bFILE *fp=open_file("preport.out", "wb");
-  pro_print(fp, LSymbol::root);
+  pro_print(fp);
   delete fp;
 }
 #endif
@@ -1551,6 +1695,9 @@ void *mapcar(void *arg_list)
 
   void **arg_on=(void **)malloc(sizeof(void *)*num_args);
   LList *list_on=(LList *)CDR(arg_list);
+  LList *na_list=NULL, *first=NULL, *return_list=NULL, *last_return=NULL;
+  PtrRef r1(sym), r2(list_on), r3(na_list), r4(first);
+  PtrRef r5(return_list), r6(last_return);
   long old_ptr_son=PtrRef::stack.m_size;
 
   for (i=0; i<num_args; i++)
@@ -1568,37 +1715,43 @@ void *mapcar(void *arg_list)
     return NULL;
   }
 
-  LList *na_list=NULL, *return_list=NULL, *last_return=NULL;
-
   do
   {
     na_list=NULL;          // create a cons list with all of the parameters for the function
 
-    LList *first=NULL;                       // save the start of the list
+    first=NULL;                       // save the start of the list
     for (i=0; !stop &&i<num_args; i++)
     {
       if (!na_list)
         first=na_list = LList::Create();
       else
       {
-        na_list->m_cdr = (LObject *)LList::Create();
-                na_list=(LList *)CDR(na_list);
+        LList *tmp = LList::Create();
+        na_list->m_cdr = (LObject *)tmp;
+        Lisp::WriteBarrier(na_list);
+        na_list=tmp;
       }
 
 
       if (arg_on[i])
       {
                 na_list->m_car = (LObject *)CAR(arg_on[i]);
+                Lisp::WriteBarrier(na_list);
                 arg_on[i]=(LList *)CDR(arg_on[i]);
       }
       else stop=1;
     }
     if (!stop)
     {
+      LObject *val = ((LSymbol *)sym)->EvalFunction(first);
+      PtrRef r7(val);
       LList *c = LList::Create();
-      c->m_car = ((LSymbol *)sym)->EvalFunction(first);
+      c->m_car = val;
       if (return_list)
+      {
         last_return->m_cdr=c;
+        Lisp::WriteBarrier(last_return);
+      }
       else
         return_list=c;
       last_return=c;
@@ -1723,24 +1876,30 @@ void *backquote_eval(void *args)
     {
       tmp = CAR(CDR(args))->Eval();
       ((LList *)last)->m_cdr = (LObject *)tmp;
+      Lisp::WriteBarrier(last);
       args=NULL;
     }
     else
     {
       cur = LList::Create();
       if (first)
+      {
         ((LList *)last)->m_cdr = (LObject *)cur;
+        Lisp::WriteBarrier(last);
+      }
       else
             first=cur;
       last=cur;
           tmp=backquote_eval(CAR(args));
           ((LList *)cur)->m_car = (LObject *)tmp;
+          Lisp::WriteBarrier(cur);
        args=CDR(args);
     }
       } else
       {
     tmp=backquote_eval(args);
     ((LList *)last)->m_cdr = (LObject *)tmp;
+    Lisp::WriteBarrier(last);
     args=NULL;
       }
 
@@ -1800,8 +1959,12 @@ LObject *LSysFunction::EvalFunction(LList *arg_list)
             cur = LList::Create();
             LObject *val = CAR(arg_list)->Eval();
             cur->m_car = val;
+            Lisp::WriteBarrier(cur);
             if (last)
+            {
                 last->m_cdr = cur;
+                Lisp::WriteBarrier(last);
+            }
             else
                 first = cur;
             last = cur;
@@ -1818,6 +1981,7 @@ LObject *LSysFunction::EvalFunction(LList *arg_list)
         c->m_car = val;
         val = CAR(CDR(arg_list))->Eval();
         c->m_cdr = val;
+        Lisp::WriteBarrier(c);
         ret = c;
         break;
     }
@@ -1965,6 +2129,7 @@ LObject *LSysFunction::EvalFunction(LList *arg_list)
                     exit(0);
                 }
                 ((LList *)car)->m_car = set_to;
+                Lisp::WriteBarrier(car);
             }
             else if (car == cdr_symbol)
             {
@@ -1976,6 +2141,7 @@ LObject *LSysFunction::EvalFunction(LList *arg_list)
                     exit(0);
                 }
                 ((LList *)car)->m_cdr = set_to;
+                Lisp::WriteBarrier(car);
             }
             else if (car != aref_symbol)
             {
@@ -2004,6 +2170,7 @@ LObject *LSysFunction::EvalFunction(LList *arg_list)
                 }
 #endif
                 a->GetData()[num] = set_to;
+                Lisp::WriteBarrier(a);
 #ifdef TYPE_CHECKING
             }
 #endif
@@ -2495,7 +2662,7 @@ LObject *LSysFunction::EvalFunction(LList *arg_list)
             case L_SYMBOL:
             {
                 LObject *tmp = LNumber::Create(x);
-                ((LSymbol *)sym)->m_value = tmp;
+                ((LSymbol *)sym)->SetValue(tmp);
                 break;
             }
             case L_CONS_CELL:
@@ -2512,7 +2679,7 @@ LObject *LSysFunction::EvalFunction(LList *arg_list)
 #endif
                 x = lnumber_value(CAR(CDR(sym))->Eval());
                 LObject *tmp = LNumber::Create(x);
-                ((LSymbol *)sym)->m_value = tmp;
+                ((LSymbol *)sym)->SetValue(tmp);
                 break;
             }
             default:
@@ -2879,6 +3046,7 @@ LObject *LSysFunction::EvalFunction(LList *arg_list)
             }
             LObject *tmp = CAR(arg_list)->Eval();
             ((LList *)l1)->m_cdr = tmp;
+            Lisp::WriteBarrier(l1);
             arg_list = (LList *)CDR(arg_list);
         } while (arg_list);
         ret = first;
@@ -2944,6 +3112,7 @@ LObject *LSysFunction::EvalFunction(LList *arg_list)
             while (r && CDR(r))
                 r = CDR(r);
             CDR(r) = q;
+            Lisp::WriteBarrier(r);
             arg_list = (LList *)CDR(arg_list);
         }
         ret = rstart;
@@ -2972,6 +3141,7 @@ LObject *LSymbol::EvalUserFunction(LList *arg_list)
 {
     LObject *ret = NULL;
     PtrRef ref1(ret);
+    TraceScope trace(TRACE_EVAL);
 
 #ifdef TYPE_CHECKING
     if (item_type(this) != L_SYMBOL)
@@ -2997,7 +3167,7 @@ LObject *LSymbol::EvalUserFunction(LList *arg_list)
 
     LList *fun_arg_list = fun->arg_list;
     LList *block_list = fun->block_list;
-    PtrRef r9(block_list), r10(fun_arg_list);
+    PtrRef r9(block_list), r10(fun_arg_list), r11(fun);
 
     // mark the start start, so we can restore when done
     long stack_start = l_user_stack.m_size;
@@ -3044,8 +3214,13 @@ LObject *LSymbol::EvalUserFunction(LList *arg_list)
         exit(0);
     }
 
-    // now evaluate the function block
-    while (block_list)
+    // now evaluate the function block, compiled if the VM is enabled and
+    // the function was not redefined while evaluating the arguments
+    if (LispVM::Enabled && !fun->code && fun == m_function)
+        fun->code = LispVM::Compile(fun);
+    if (LispVM::Enabled && fun->code)
+        ret = LispVM::Run(fun->code);
+    else while (block_list)
     {
         ret = CAR(block_list)->Eval();
         block_list = (LList *)CDR(block_list);
@@ -3069,6 +3244,7 @@ LObject *LSymbol::EvalUserFunction(LList *arg_list)
 LObject *LObject::Eval()
 {
     PtrRef ref1(this);
+    TraceScope trace(TRACE_EVAL);
 
     maxevaldepth = Max(maxevaldepth, ++evaldepth);
 
@@ -3144,7 +3320,7 @@ LObject *LObject::Eval()
 
 void Lisp::Init()
 {
-    LSymbol::root = NULL;
+    LSymbol::first = NULL;
     total_user_functions = 0;
 
     LSpace::Tmp.m_free = LSpace::Tmp.m_data = (uint8_t *)malloc(0x1000);
@@ -3173,11 +3349,27 @@ void Lisp::Init()
 
 void Lisp::Uninit()
 {
+    SetGenerational(0, 0.0f);
+    LispVM::FreeAll();
     free(LSpace::Tmp.m_data);
     free(LSpace::Perm.m_data);
-    DeleteAllSymbols(LSymbol::root);
-    LSymbol::root = NULL;
+    DeleteAllSymbols(LSymbol::first);
+    LSymbol::first = NULL;
     LSymbol::count = 0;
+    free(symbol_table);
+    symbol_table = NULL;
+    symbol_table_size = 0;
+    while (symbol_blocks)
+    {
+        char *next = *(char **)symbol_blocks;
+        free(symbol_blocks);
+        symbol_blocks = next;
+    }
+    symbol_names = NULL;
+    symbol_names_left = 0;
+    free(c_table);
+    c_table = NULL;
+    c_table_size = 0;
 }
 
 void LSpace::Clear()
@@ -3211,7 +3403,10 @@ void LSymbol::SetNumber(long num)
     if (m_value != l_undefined && item_type(m_value) == L_NUMBER)
         ((LNumber *)m_value)->m_num = num;
     else
+    {
         m_value = LNumber::Create(num);
+        Lisp::RememberSymbol(this);
+    }
 }
 
 void LSymbol::SetValue(LObject *val)
@@ -3225,6 +3420,7 @@ void LSymbol::SetValue(LObject *val)
     }
 #endif
     m_value = val;
+    Lisp::RememberSymbol(this);
 }
 
 LObject *LSymbol::GetFunction()
@@ -65,7 +65,7 @@ struct LSpace
     void Restore(void *val);
     void Clear();
 
-    static LSpace Tmp, Perm, Gc;
+    static LSpace Tmp, Perm, Gc, Nursery;
     static LSpace *Current;
 
     uint8_t *m_data;
@@ -164,11 +164,12 @@ struct LSymbol : LObject
     LObject *m_value;
     LObject *m_function;
     LString *m_name;
-    LSymbol *m_left, *m_right; // tree structure
+    LSymbol *m_next; // list of all symbols
 
     /* Static members */
-    static LSymbol *root;
+    static LSymbol *first;
     static size_t count;
+    static int32_t function_epoch; // changes whenever SetFunction() is called
 };
 
 struct LSysFunction : LObject
@@ -184,6 +185,7 @@ struct LSysFunction : LObject
 struct LUserFunction : LObject
 {
     LList *arg_list, *block_list;
+    struct LispCode *code; // set once compiled by LispVM
 };
 
 struct LArray : LObject
@@ -232,6 +234,15 @@ struct LFixedPoint : LObject
     int32_t m_fixed;
 };
 
+struct LispGcStats
+{
+    int32_t tmp, minor, major; // collections of each kind
+    int32_t idle;              // minor collections run between frames
+    int64_t copied;            // bytes copied
+    float total_ms, max_ms;    // pause times
+    int32_t remembered;        // remembered set entries
+};
+
 class Lisp
 {
 public:
@@ -243,11 +254,37 @@ public:
     // Collect temporary or permanent spaces
     static void CollectSpace(LSpace *which_space, int grow);
 
+    // Generational mode: objects allocated in the permanent space start
+    // in the nursery, and the ones still alive when it is collected are
+    // moved to the end of the permanent space. Collections are run
+    // between frames when they fit in budget_ms.
+    static void SetGenerational(int on, float budget_ms);
+    static int Generational() { return LSpace::Nursery.m_data != NULL; }
+    static void CollectNursery(size_t need);
+    static void CollectIdle();
+
+    // Must follow every store of an object pointer into a cons cell,
+    // array, user function or symbol that may be older than the stored
+    // object. Symbols are malloc'ed and use RememberSymbol().
+    static inline void WriteBarrier(void *x)
+    {
+        if ((uintptr_t)x - (uintptr_t)MatureStart < MatureSize)
+            Remember(x);
+    }
+    static void RememberSymbol(LSymbol *s);
+
+    static LispGcStats GcStats;
+
 private:
+    static uint8_t *MatureStart;
+    static size_t MatureSize;
+    static void Remember(void *x);
+    static void CollectRemembered();
+
     static LArray *CollectArray(LArray *x);
     static LList *CollectList(LList *x);
     static LObject *CollectObject(LObject *x);
-    static void CollectSymbols(LSymbol *root);
+    static void CollectSymbols();
     static void CollectStacks();
 };
 
@@ -274,6 +311,13 @@ LSymbol *add_c_object(void *symbol, int index);
 LSymbol *add_c_function(char const *name, short min_args, short max_args, short number);
 LSymbol *add_c_bool_fun(char const *name, short min_args, short max_args, short number);
 LSymbol *add_lisp_function(char const *name, short min_args, short max_args, short number);
+
+// C functions can also be given as a function pointer instead of a number
+// for c_caller(). They get numbers from C_TABLE_FIRST on and are called
+// through c_table without going through the switch.
+typedef long (*lisp_c_function)(void *args);
+LSymbol *add_c_function(char const *name, short min_args, short max_args, lisp_c_function fun);
+LSymbol *add_c_bool_fun(char const *name, short min_args, short max_args, lisp_c_function fun);
 int read_ltoken(char *&s, char *buffer);
 void print_trace_stack(int max_levels);
 
@@ -301,6 +345,15 @@ extern void clisp_init();                      // external initalizer call by li
 extern long c_caller(long number, void *arg);  // exten c function switches on number
 extern void *l_caller(long number, void *arg);  // exten lisp function switches on number
 
+#define C_TABLE_FIRST 0x4000
+extern lisp_c_function *c_table;
+static inline long c_call(long number, void *arg)
+{
+    if (number >= C_TABLE_FIRST)
+        return c_table[number - C_TABLE_FIRST](arg);
+    return c_caller(number, arg);
+}
+
 extern void *l_obj_get(long number);  // exten lisp function switches on number
 extern void l_obj_set(long number, void *arg);  // exten lisp function switches on number
 extern void l_obj_print(long number);  // exten lisp function switches on number
@@ -19,8 +19,10 @@
 
 #include "lisp.h"
 #include "lisp_gc.h"
+#include "lisp_vm.h"
 
 #include "stack.h"
+#include "trace.h"
 
 /*  Lisp garbage collection: uses copy/free algorithm
     Places to check:
@@ -29,6 +31,13 @@
     functions
     names
       stack
+
+    In generational mode, new permanent objects are allocated in the
+    nursery. A minor collection copies the live ones to the end of the
+    permanent space, using the stacks and the remembered set as roots:
+    the permanent objects and the symbols that were given a pointer since
+    the last collection (see Lisp::WriteBarrier). A major collection copies
+    the permanent space and the nursery together.
 */
 
 // Stack where user programs can push data and have it GCed
@@ -40,9 +49,24 @@ GrowStack<void *> PtrRef::stack(1500);
 static size_t reg_ptr_total = 0;
 static void ***reg_ptr_list = NULL;
 
-static uint8_t *cstart, *cend, *collected_start, *collected_end;
+static uint8_t *cstart, *cend, *nstart, *nend;
+static uint8_t *collected_start, *collected_end;
 static int gcdepth, maxgcdepth;
 
+// Generational mode
+#define NURSERY_MIN 0x4000
+#define NURSERY_MAX 0x100000
+#define REMEMBER_FILTER 256
+
+uint8_t *Lisp::MatureStart = NULL;
+size_t Lisp::MatureSize = 0;
+LispGcStats Lisp::GcStats;
+
+static float gc_budget_ms = 1.0f;
+static void **remembered = NULL;
+static size_t remembered_total = 0, remembered_size = 0;
+static void *remember_filter[REMEMBER_FILTER];
+
 LArray *Lisp::CollectArray(LArray *x)
 {
     size_t s = x->m_len;
@@ -88,7 +112,8 @@ LObject *Lisp::CollectObject(LObject *x)
 
     maxgcdepth = Max(maxgcdepth, ++gcdepth);
 
-    if ((uint8_t *)x >= cstart && (uint8_t *)x < cend)
+    if (((uint8_t *)x >= cstart && (uint8_t *)x < cend)
+         || ((uint8_t *)x >= nstart && (uint8_t *)x < nend))
     {
         switch (item_type(x))
         {
@@ -108,7 +133,9 @@ LObject *Lisp::CollectObject(LObject *x)
             LUserFunction *fun = (LUserFunction *)x;
             LList *arg = (LList *)CollectObject(fun->arg_list);
             LList *block = (LList *)CollectObject(fun->block_list);
+            LispCode *code = fun->code;
             ret = new_lisp_user_function(arg, block);
+            ((LUserFunction *)ret)->code = code;
             break;
         }
         case L_STRING:
@@ -177,16 +204,14 @@ LObject *Lisp::CollectObject(LObject *x)
     return ret;
 }
 
-void Lisp::CollectSymbols(LSymbol *root)
+void Lisp::CollectSymbols()
 {
-    if (!root)
-        return;
-
-    root->m_value = CollectObject(root->m_value);
-    root->m_function = CollectObject(root->m_function);
-    root->m_name = (LString *)CollectObject(root->m_name);
-    CollectSymbols(root->m_left);
-    CollectSymbols(root->m_right);
+    for (LSymbol *p = LSymbol::first; p; p = p->m_next)
+    {
+        p->m_value = CollectObject(p->m_value);
+        p->m_function = CollectObject(p->m_function);
+        p->m_name = (LString *)CollectObject(p->m_name);
+    }
 }
 
 void Lisp::CollectStacks()
@@ -202,6 +227,14 @@ void Lisp::CollectStacks()
         *ptr = CollectObject((LObject *)*ptr);
     }
 
+    d = LispVM::Stack.sdata;
+    for (size_t i = 0; i < LispVM::Stack.m_size; i++, d++)
+        *d = CollectObject((LObject *)*d);
+
+    for (LispCode *code = LispVM::List; code; code = code->m_next)
+        for (int i = 0; i < code->m_pool_size; i++)
+            code->m_pool[i] = CollectObject(code->m_pool[i]);
+
     void ***d3 = reg_ptr_list;
     for (size_t i = 0; i < reg_ptr_total; i++, d3++)
     {
@@ -210,15 +243,37 @@ void Lisp::CollectStacks()
     }
 }
 
+static void note_collection(float ms, size_t copied)
+{
+    Lisp::GcStats.copied += copied;
+    Lisp::GcStats.total_ms += ms;
+    Lisp::GcStats.max_ms = Max(Lisp::GcStats.max_ms, ms);
+}
+
 void Lisp::CollectSpace(LSpace *which_space, int grow)
 {
+    Timer t;
+    TraceScope trace(TRACE_GC);
     LSpace *sp = LSpace::Current;
 
+    // In generational mode the nursery is collected with the permanent
+    // space, and enough room is left behind for it to be emptied again.
+    int major = which_space == &LSpace::Perm && Generational();
+
     maxgcdepth = gcdepth = 0;
 
     cstart = which_space->m_data;
     cend = which_space->m_free;
+    nstart = nend = NULL;
     LSpace::Gc.m_size = which_space->m_size;
+    if (major)
+    {
+        nstart = LSpace::Nursery.m_data;
+        nend = LSpace::Nursery.m_free;
+        LSpace::Gc.m_size = Max(LSpace::Gc.m_size,
+                                (size_t)(cend - cstart) + (nend - nstart)
+                                  + LSpace::Nursery.m_size);
+    }
     if (grow)
     {
         LSpace::Gc.m_size += which_space->m_size >> 1;
@@ -231,7 +286,7 @@ void Lisp::CollectSpace(LSpace *which_space, int grow)
     collected_start = new_data;
     collected_end = new_data + LSpace::Gc.m_size;
 
-    CollectSymbols(LSymbol::root);
+    CollectSymbols();
     CollectStacks();
 
     free(which_space->m_data);
@@ -240,5 +295,210 @@ void Lisp::CollectSpace(LSpace *which_space, int grow)
     which_space->m_free = new_data + (LSpace::Gc.m_free - LSpace::Gc.m_data);
 
     LSpace::Current = sp;
+
+    if (major)
+    {
+        LSpace::Nursery.m_free = LSpace::Nursery.m_data;
+        remembered_total = 0;
+        memset(remember_filter, 0, sizeof(remember_filter));
+        MatureStart = LSpace::Perm.m_data;
+        MatureSize = LSpace::Perm.m_size;
+        nstart = nend = NULL;
+    }
+
+    if (which_space == &LSpace::Tmp)
+        GcStats.tmp++;
+    else
+        GcStats.major++;
+    note_collection(t.PollMs(), which_space->m_free - which_space->m_data);
+}
+
+void Lisp::Remember(void *x)
+{
+    // Cheap filter for the common case of one object being written to
+    // over and over
+    void **slot = remember_filter
+                + ((uintptr_t)x / sizeof(intptr_t)) % REMEMBER_FILTER;
+    if (*slot == x)
+        return;
+    *slot = x;
+
+    if (remembered_total == remembered_size)
+    {
+        remembered_size = Max(remembered_size * 2, (size_t)1024);
+        remembered = (void **)realloc(remembered,
+                                      sizeof(void *) * remembered_size);
+    }
+    remembered[remembered_total++] = x;
+    GcStats.remembered++;
+}
+
+void Lisp::RememberSymbol(LSymbol *s)
+{
+    // Symbols are malloc'ed, except for the uninterned ones which are
+    // scanned anyway when they live in the nursery or the temporary space
+    if (!MatureSize)
+        return;
+    if ((uint8_t *)s >= LSpace::Nursery.m_data
+         && (uint8_t *)s < LSpace::Nursery.m_data + LSpace::Nursery.m_size)
+        return;
+    if ((uint8_t *)s >= LSpace::Tmp.m_data
+         && (uint8_t *)s < LSpace::Tmp.m_data + LSpace::Tmp.m_size)
+        return;
+    Remember(s);
+}
+
+void Lisp::CollectRemembered()
+{
+    for (size_t i = 0; i < remembered_total; i++)
+    {
+        LObject *x = (LObject *)remembered[i];
+        switch (item_type(x))
+        {
+        case L_CONS_CELL:
+            CAR(x) = CollectObject(CAR(x));
+            CDR(x) = CollectObject(CDR(x));
+            break;
+        case L_1D_ARRAY:
+        {
+            LObject **data = ((LArray *)x)->GetData();
+            for (size_t j = 0; j < ((LArray *)x)->m_len; j++)
+                data[j] = CollectObject(data[j]);
+            break;
+        }
+        case L_USER_FUNCTION:
+        {
+            LUserFunction *fun = (LUserFunction *)x;
+            fun->arg_list = (LList *)CollectObject(fun->arg_list);
+            fun->block_list = (LList *)CollectObject(fun->block_list);
+            break;
+        }
+        case L_SYMBOL:
+        {
+            LSymbol *sym = (LSymbol *)x;
+            sym->m_value = CollectObject(sym->m_value);
+            sym->m_function = CollectObject(sym->m_function);
+            sym->m_name = (LString *)CollectObject(sym->m_name);
+            break;
+        }
+        default:
+            break;
+        }
+    }
+    remembered_total = 0;
+    memset(remember_filter, 0, sizeof(remember_filter));
+}
+
+void Lisp::CollectNursery(size_t need)
+{
+    LSpace *n = &LSpace::Nursery, *p = &LSpace::Perm;
+    size_t used = n->m_free - n->m_data;
+
+    // Everything in the nursery may still be alive: when that does not
+    // fit at the end of the permanent space, collect it all.
+    if (p->GetFree() < used)
+    {
+        CollectSpace(p, 0);
+        if (p->GetFree() < n->m_size)
+            CollectSpace(p, 1);
+    }
+    else if (used)
+    {
+        Timer t;
+        TraceScope trace(TRACE_GC);
+        LSpace *sp = LSpace::Current;
+
+        maxgcdepth = gcdepth = 0;
+
+        cstart = n->m_data;
+        cend = n->m_free;
+        nstart = nend = NULL;
+
+        // Survivors are copied straight to the free end of the permanent
+        // space, which is never scanned itself
+        LSpace::Gc.m_data = LSpace::Gc.m_free = p->m_free;
+        LSpace::Gc.m_size = p->GetFree();
+        collected_start = p->m_data;
+        collected_end = p->m_data + p->m_size;
+        LSpace::Current = &LSpace::Gc;
+
+        CollectStacks();
+        CollectRemembered();
+
+        size_t copied = LSpace::Gc.m_free - LSpace::Gc.m_data;
+        p->m_free = LSpace::Gc.m_free;
+        LSpace::Gc.m_data = LSpace::Gc.m_free = NULL;
+        LSpace::Gc.m_size = 0;
+        n->m_free = n->m_data;
+
+        LSpace::Current = sp;
+
+        float ms = t.PollMs();
+        GcStats.minor++;
+        note_collection(ms, copied);
+
+        // Keep the pauses around the budget
+        size_t size = n->m_size;
+        if (ms > gc_budget_ms && size > NURSERY_MIN)
+            size >>= 1;
+        else if (ms < gc_budget_ms * 0.25f && size < NURSERY_MAX
+                  && copied < size / 4)
+            size <<= 1;
+        if (size != n->m_size)
+        {
+            free(n->m_data);
+            n->m_size = size;
+            n->m_data = n->m_free = (uint8_t *)malloc(size);
+        }
+    }
+
+    // The nursery is empty now, it can be grown for large objects
+    if (need > n->m_size)
+    {
+        free(n->m_data);
+        n->m_size = need * 2;
+        n->m_data = n->m_free = (uint8_t *)malloc(n->m_size);
+    }
+
+    MatureStart = p->m_data;
+    MatureSize = p->m_size;
+}
+
+void Lisp::CollectIdle()
+{
+    LSpace *n = &LSpace::Nursery;
+    if (!n->m_data || (size_t)(n->m_free - n->m_data) < n->m_size / 2)
+        return;
+
+    GcStats.idle++;
+    CollectNursery(0);
+}
+
+void Lisp::SetGenerational(int on, float budget_ms)
+{
+    LSpace *n = &LSpace::Nursery;
+    gc_budget_ms = budget_ms > 0.0f ? budget_ms : 1.0f;
+
+    if (on && !n->m_data)
+    {
+        n->m_name = "nursery";
+        n->m_size = NURSERY_MIN * 4;
+        n->m_data = n->m_free = (uint8_t *)malloc(n->m_size);
+        MatureStart = LSpace::Perm.m_data;
+        MatureSize = LSpace::Perm.m_size;
+    }
+    else if (!on && n->m_data)
+    {
+        // Move everything still in the nursery to the permanent space
+        CollectSpace(&LSpace::Perm, 0);
+        free(n->m_data);
+        n->m_data = n->m_free = NULL;
+        n->m_size = 0;
+        MatureStart = NULL;
+        MatureSize = 0;
+        free(remembered);
+        remembered = NULL;
+        remembered_total = remembered_size = 0;
+    }
 }
 
@@ -0,0 +1,948 @@
+/*
+ *  Abuse - dark 2D side-scrolling platform game
+ *  Copyright (c) 1995 Crack dot Com
+ *  Copyright (c) 2005-2011 Sam Hocevar <sam@hocevar.net>
+ *
+ *  This software was released into the Public Domain. As with most public
+ *  domain software, no warranty is made or implied by Crack dot Com, by
+ *  Jonathan Clark, or by Sam Hocevar.
+ */
+
+#if defined HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+
+#include "lisp.h"
+#include "lisp_gc.h"
+#include "lisp_vm.h"
+#include "symbols.h"
+#include "trace.h"
+
+// GCC and clang can jump straight from one opcode to the next
+#if defined __GNUC__
+#   define VM_THREADED 1
+#endif
+
+// Opcodes and the number of operands that follow them. LET_RESTORE is
+// followed by a count and that many symbols.
+#define VM_OPS(X) \
+    X(NIL, 0) X(CONST, 1) X(VAR, 1) X(SETQ, 1) X(POP, 0) \
+    X(JUMP, 1) X(JNIL, 1) X(JNOTNIL, 1) \
+    X(NOT, 0) X(CAR, 0) X(CDR, 0) X(EQ, 0) X(EQ0, 0) X(CONS, 0) \
+    X(INT, 0) X(PLUS, 1) X(MINUS, 1) X(GT, 0) X(LT, 0) X(GE, 0) X(LE, 0) \
+    X(AREF, 0) X(REPLACE, 0) \
+    X(LET_SAVE, 1) X(LET_SET, 1) X(LET_RESTORE, -1) \
+    X(ENTER, 4) X(CALL, 2) X(EVAL, 1) X(RETURN, 0)
+
+#define VM_ENUM(name, args) OP_##name,
+enum { VM_OPS(VM_ENUM) OP_COUNT };
+#undef VM_ENUM
+
+#define VM_ARGS(name, args) args,
+static int const op_args[OP_COUNT] = { VM_OPS(VM_ARGS) };
+#undef VM_ARGS
+
+int LispVM::Enabled = 0;
+int LispVM::CallCache = 1;
+LispCode *LispVM::List = NULL;
+GrowStack<void> LispVM::Stack(4096);
+LispVMStats LispVM::Stats;
+
+// Integers waiting for an arithmetic opcode; not scanned by the collector
+static int32_t *vm_ints = NULL;
+static size_t vm_int_total = 0, vm_int_size = 0;
+
+static LObject *vm_run(LispCode *code, void *const **labels);
+
+static int list_length(LObject *l)
+{
+    int n = 0;
+    for (; l; l = CDR(l), n++)
+        if (item_type(l) != L_CONS_CELL)
+            return -1;
+    return n;
+}
+
+class VMCompiler
+{
+public:
+    VMCompiler()
+    {
+        m_ops = NULL;
+        m_pool = NULL;
+        m_ops_total = m_ops_size = m_pool_total = m_pool_size = 0;
+        m_depth = m_max_depth = m_ints = m_max_ints = 0;
+        m_calls = 0;
+    }
+
+    void Emit(intptr_t x)
+    {
+        if (m_ops_total == m_ops_size)
+        {
+            m_ops_size = Max(m_ops_size * 2, 64);
+            m_ops = (intptr_t *)realloc(m_ops, sizeof(intptr_t) * m_ops_size);
+        }
+        m_ops[m_ops_total++] = x;
+    }
+
+    // Emit a jump and return the location of its target
+    int EmitJump(int op)
+    {
+        Emit(op);
+        Emit(0);
+        return m_ops_total - 1;
+    }
+
+    void Patch(int at) { m_ops[at] = m_ops_total; }
+
+    int Pool(LObject *x)
+    {
+        for (int i = 0; i < m_pool_total; i++)
+            if (m_pool[i] == x)
+                return i;
+        if (m_pool_total == m_pool_size)
+        {
+            m_pool_size = Max(m_pool_size * 2, 16);
+            m_pool = (LObject **)realloc(m_pool,
+                                         sizeof(LObject *) * m_pool_size);
+        }
+        m_pool[m_pool_total] = x;
+        return m_pool_total++;
+    }
+
+    void Push(int n = 1)
+    {
+        m_depth += n;
+        m_max_depth = Max(m_max_depth, m_depth);
+    }
+    void PushInt()
+    {
+        m_ints++;
+        m_max_ints = Max(m_max_ints, m_ints);
+    }
+
+    void Expr(LObject *form);
+    void Block(LObject *list);
+    int Special(LObject *form, int number);
+    void Call(LObject *form, LObject *fun, int len);
+    void Fallback(LObject *form);
+
+    intptr_t *m_ops;
+    LObject **m_pool;
+    int m_ops_total, m_ops_size, m_pool_total, m_pool_size;
+    int m_depth, m_max_depth, m_ints, m_max_ints;
+    int m_calls;
+};
+
+void VMCompiler::Fallback(LObject *form)
+{
+    Emit(OP_EVAL);
+    Emit(Pool(form));
+    Push();
+}
+
+// Leaves the value of the forms in list on the stack, like eval_block()
+void VMCompiler::Block(LObject *list)
+{
+    if (!list)
+    {
+        Emit(OP_NIL);
+        Push();
+        return;
+    }
+
+    for (; list; list = CDR(list))
+    {
+        Expr(CAR(list));
+        if (CDR(list))
+        {
+            Emit(OP_POP);
+            m_depth--;
+        }
+    }
+}
+
+// Compiles the system functions that have an opcode. Returns 0 without
+// emitting anything when the form has to go to the tree-walker.
+int VMCompiler::Special(LObject *form, int number)
+{
+    LObject *args = CDR(form);
+    int len = list_length(args);
+    if (len < 0)
+        return 0;
+
+    switch (number)
+    {
+    case SYS_FUNC_QUOTE:
+        if (len < 1)
+            return 0;
+        if (CAR(args))
+        {
+            Emit(OP_CONST);
+            Emit(Pool(CAR(args)));
+        }
+        else
+            Emit(OP_NIL);
+        Push();
+        return 1;
+    case SYS_FUNC_IF:
+    case SYS_FUNC_IF_1PROGN:
+    case SYS_FUNC_IF_2PROGN:
+    case SYS_FUNC_IF_12PROGN:
+    {
+        int then_block = number == SYS_FUNC_IF_1PROGN
+                          || number == SYS_FUNC_IF_12PROGN;
+        int else_block = number == SYS_FUNC_IF_2PROGN
+                          || number == SYS_FUNC_IF_12PROGN;
+        if (len < (number == SYS_FUNC_IF ? 2 : 3))
+            return 0;
+        if ((then_block && list_length(CAR(CDR(args))) < 0)
+             || (else_block && list_length(CAR(CDR(CDR(args)))) < 0))
+            return 0;
+
+        Expr(CAR(args));
+        int skip_then = EmitJump(OP_JNIL);
+        m_depth--;
+        if (then_block)
+            Block(CAR(CDR(args)));
+        else
+            Expr(CAR(CDR(args)));
+        int skip_else = EmitJump(OP_JUMP);
+        m_depth--;
+        Patch(skip_then);
+        if (else_block)
+            Block(CAR(CDR(CDR(args))));
+        else if (len >= 3)
+            Expr(CAR(CDR(CDR(args))));
+        else
+        {
+            Emit(OP_NIL);
+            Push();
+        }
+        Patch(skip_else);
+        return 1;
+    }
+    case SYS_FUNC_PROGN:
+        Block(args);
+        return 1;
+    case SYS_FUNC_AND:
+    case SYS_FUNC_OR:
+    {
+        // Both return t or nil, not the value of the last form
+        int and_form = number == SYS_FUNC_AND;
+        int *exits = (int *)malloc(sizeof(int) * (len + 1));
+        int i = 0;
+        for (LObject *l = args; l; l = CDR(l))
+        {
+            Expr(CAR(l));
+            exits[i++] = EmitJump(and_form ? OP_JNIL : OP_JNOTNIL);
+            m_depth--;
+        }
+        if (and_form)
+        {
+            Emit(OP_CONST);
+            Emit(Pool(true_symbol));
+        }
+        else
+            Emit(OP_NIL);
+        int done = EmitJump(OP_JUMP);
+        while (i--)
+            Patch(exits[i]);
+        free(exits);
+        if (and_form)
+            Emit(OP_NIL);
+        else
+        {
+            Emit(OP_CONST);
+            Emit(Pool(true_symbol));
+        }
+        Patch(done);
+        Push();
+        return 1;
+    }
+    case SYS_FUNC_NOT:
+    case SYS_FUNC_NULL:
+    case SYS_FUNC_CAR:
+    case SYS_FUNC_CDR:
+    case SYS_FUNC_EQ0:
+        if (len < 1)
+            return 0;
+        Expr(CAR(args));
+        Emit(number == SYS_FUNC_CAR ? OP_CAR : number == SYS_FUNC_CDR
+              ? OP_CDR : number == SYS_FUNC_EQ0 ? OP_EQ0 : OP_NOT);
+        return 1;
+    case SYS_FUNC_EQ:
+    case SYS_FUNC_CONS:
+        if (len < 2)
+            return 0;
+        Expr(CAR(args));
+        Expr(CAR(CDR(args)));
+        Emit(number == SYS_FUNC_EQ ? OP_EQ : OP_CONS);
+        m_depth--;
+        return 1;
+    case SYS_FUNC_PLUS:
+    case SYS_FUNC_MINUS:
+        if (number == SYS_FUNC_MINUS && len < 1)
+            return 0;
+        // Each value is read as soon as it is evaluated, as the following
+        // arguments may change it in place with setq
+        for (LObject *l = args; l; l = CDR(l))
+        {
+            Expr(CAR(l));
+            Emit(OP_INT);
+            m_depth--;
+            PushInt();
+        }
+        Emit(number == SYS_FUNC_PLUS ? OP_PLUS : OP_MINUS);
+        Emit(len);
+        m_ints -= len;
+        Push();
+        return 1;
+    case SYS_FUNC_GT:
+    case SYS_FUNC_LT:
+    case SYS_FUNC_GE:
+    case SYS_FUNC_LE:
+        if (len < 2)
+            return 0;
+        Expr(CAR(args));
+        Emit(OP_INT);
+        m_depth--;
+        PushInt();
+        Expr(CAR(CDR(args)));
+        Emit(OP_INT);
+        m_depth--;
+        PushInt();
+        Emit(number == SYS_FUNC_GT ? OP_GT : number == SYS_FUNC_LT ? OP_LT
+              : number == SYS_FUNC_GE ? OP_GE : OP_LE);
+        m_ints -= 2;
+        Push();
+        return 1;
+    case SYS_FUNC_AREF:
+        if (len < 2)
+            return 0;
+        // The index is evaluated first
+        Expr(CAR(CDR(args)));
+        Emit(OP_INT);
+        m_depth--;
+        PushInt();
+        Expr(CAR(args));
+        Emit(OP_AREF);
+        m_ints--;
+        return 1;
+    case SYS_FUNC_SETQ:
+    case SYS_FUNC_SETF:
+        if (len < 2 || item_type(CAR(args)) != L_SYMBOL || !CAR(args))
+            return 0;
+        Expr(CAR(CDR(args)));
+        Emit(OP_SETQ);
+        Emit(Pool(CAR(args)));
+        return 1;
+    case SYS_FUNC_COND:
+    {
+        // Every test is evaluated, and the last match gives the value
+        LObject *clauses = CAR(args);
+        if (len < 1 || list_length(clauses) < 0)
+            return 0;
+        for (LObject *l = clauses; l; l = CDR(l))
+            if (!CAR(l) || list_length(CAR(l)) < 1)
+                return 0;
+
+        Emit(OP_NIL);
+        Push();
+        for (LObject *l = clauses; l; l = CDR(l))
+        {
+            Expr(CAR(CAR(l)));
+            int skip = EmitJump(OP_JNIL);
+            m_depth--;
+            Expr(CAR(CDR(CAR(l))) ? CAR(CDR(CAR(l))) : NULL);
+            Emit(OP_REPLACE);
+            m_depth--;
+            Patch(skip);
+        }
+        return 1;
+    }
+    case SYS_FUNC_LET:
+    {
+        LObject *vars = CAR(args);
+        int count = list_length(vars);
+        if (len < 1 || count < 0)
+            return 0;
+        for (LObject *l = vars; l; l = CDR(l))
+            if (list_length(CAR(l)) < 1 || !CAR(CAR(l))
+                 || item_type(CAR(CAR(l))) != L_SYMBOL)
+                return 0;
+
+        for (LObject *l = vars; l; l = CDR(l))
+        {
+            int sym = Pool(CAR(CAR(l)));
+            Emit(OP_LET_SAVE);
+            Emit(sym);
+            Expr(CAR(CDR(CAR(l))));
+            Emit(OP_LET_SET);
+            Emit(sym);
+            m_depth--;
+        }
+        Block(CDR(args));
+        Emit(OP_LET_RESTORE);
+        Emit(count);
+        for (LObject *l = vars; l; l = CDR(l))
+            Emit(Pool(CAR(CAR(l))));
+        return 1;
+    }
+    }
+    return 0;
+}
+
+void VMCompiler::Expr(LObject *form)
+{
+    switch (item_type(form))
+    {
+    case L_CONS_CELL:
+        break;
+    case L_SYMBOL:
+        if (form == true_symbol)
+        {
+            Emit(OP_CONST);
+            Emit(Pool(form));
+        }
+        else
+        {
+            Emit(OP_VAR);
+            Emit(Pool(form));
+        }
+        Push();
+        return;
+    default:
+        Emit(OP_CONST);
+        Emit(Pool(form));
+        Push();
+        return;
+    }
+
+    if (!form)
+    {
+        Emit(OP_NIL);
+        Push();
+        return;
+    }
+
+    LSymbol *sym = (LSymbol *)CAR(form);
+    int len = list_length(CDR(form));
+    if (!sym || item_type(sym) != L_SYMBOL || len < 0)
+    {
+        Fallback(form);
+        return;
+    }
+
+    LObject *fun = sym->m_function;
+    switch (item_type(fun))
+    {
+    case L_SYS_FUNCTION:
+        if (!Special(form, ((LSysFunction *)fun)->fun_number))
+            Fallback(form);
+        return;
+    case L_L_FUNCTION:
+        // These get their arguments unevaluated
+        Fallback(form);
+        return;
+    default:
+        Call(form, fun, len);
+        return;
+    }
+}
+
+// User and C functions, or functions that are not defined yet. ENTER
+// checks that the function still takes the arguments compiled here, or
+// hands the whole form to the tree-walker and jumps past CALL, and saves
+// the values of the parameters before the arguments are evaluated, like
+// EvalUserFunction() does. It leaves the function on the stack for CALL.
+void VMCompiler::Call(LObject *form, LObject *fun, int len)
+{
+    // User functions only evaluate as many arguments as they have
+    // parameters
+    int count = len;
+    if (item_type(fun) == L_USER_FUNCTION)
+    {
+        count = list_length(((LUserFunction *)fun)->arg_list);
+        if (count < 0 || count > len)
+        {
+            Fallback(form);
+            return;
+        }
+    }
+
+    int call = m_calls++;
+    Emit(OP_ENTER);
+    Emit(Pool(form));
+    Emit(count);
+    Emit(call);
+    Emit(0);
+    int skip = m_ops_total - 1;
+    Push();
+
+    LObject *l = CDR(form);
+    for (int i = 0; i < count; i++, l = CDR(l))
+        Expr(CAR(l));
+    Emit(OP_CALL);
+    Emit(count);
+    Emit(call);
+    m_depth -= count + 1;
+    Push();
+    Patch(skip);
+}
+
+LispCode *LispVM::Compile(LUserFunction *fun)
+{
+    // Functions in the temporary space do not live long enough
+    if ((uint8_t *)fun >= LSpace::Tmp.m_data
+         && (uint8_t *)fun < LSpace::Tmp.m_data + LSpace::Tmp.m_size)
+        return NULL;
+    if (list_length(fun->block_list) < 0)
+        return NULL;
+
+    VMCompiler c;
+    c.Block(fun->block_list);
+    c.Emit(OP_RETURN);
+
+#if VM_THREADED
+    void *const *labels;
+    vm_run(NULL, &labels);
+    for (int i = 0; i < c.m_ops_total; )
+    {
+        int op = (int)c.m_ops[i];
+        int args = op_args[op] >= 0 ? op_args[op] : 1 + (int)c.m_ops[i + 1];
+        c.m_ops[i] = (intptr_t)labels[op];
+        i += 1 + args;
+    }
+#endif
+
+    LispCode *code = (LispCode *)malloc(sizeof(LispCode));
+    code->m_ops = c.m_ops;
+    code->m_pool = c.m_pool;
+    code->m_ops_size = c.m_ops_total;
+    code->m_pool_size = c.m_pool_total;
+    code->m_stack_size = c.m_max_depth;
+    code->m_int_size = c.m_max_ints;
+    code->m_calls = (LispCallCache *)calloc(Max(c.m_calls, 1),
+                                            sizeof(LispCallCache));
+    code->m_calls_size = c.m_calls;
+    code->m_running = 0;
+    code->m_dead = 0;
+    code->m_next = List;
+    List = code;
+
+    Stats.compiled++;
+    return code;
+}
+
+static void vm_free(LispCode *code)
+{
+    free(code->m_ops);
+    free(code->m_pool);
+    free(code->m_calls);
+    free(code);
+}
+
+// Unlinks and frees the code of a function that was redefined
+static void vm_release(LispCode *code)
+{
+    for (LispCode **l = &LispVM::List; *l; l = &(*l)->m_next)
+        if (*l == code)
+        {
+            *l = code->m_next;
+            break;
+        }
+    vm_free(code);
+    LispVM::Stats.released++;
+}
+
+void LispVM::Release(LUserFunction *fun)
+{
+    LispCode *code = fun->code;
+    if (!code)
+        return;
+
+    fun->code = NULL;
+    code->m_dead = 1;
+    // When it is still running, vm_run() frees it once the last call
+    // returns
+    if (!code->m_running)
+        vm_release(code);
+}
+
+void LispVM::FreeAll()
+{
+    while (List)
+    {
+        LispCode *next = List->m_next;
+        vm_free(List);
+        List = next;
+    }
+    free(vm_ints);
+    vm_ints = NULL;
+    vm_int_total = vm_int_size = 0;
+}
+
+LObject *LispVM::Run(LispCode *code)
+{
+    return vm_run(code, NULL);
+}
+
+// Looks up what the function of form is now, and whether it can be called
+// with the count arguments compiled for it. Anything else, including the
+// errors, is left to the tree-walker.
+static void vm_resolve(LObject *form, int count, LispCallCache *cache)
+{
+    LObject *fun = ((LSymbol *)CAR(form))->m_function;
+
+    cache->type = item_type(fun);
+    cache->ok = 0;
+
+    switch (cache->type)
+    {
+    case L_USER_FUNCTION:
+        cache->ok = list_length(((LUserFunction *)fun)->arg_list) == count;
+        break;
+    case L_C_FUNCTION:
+    case L_C_BOOL:
+    {
+        LSysFunction *cfun = (LSysFunction *)fun;
+        cache->ok = count == list_length(CDR(form))
+                     && count >= cfun->min_args
+                     && (cfun->max_args == -1 || count <= cfun->max_args);
+        cache->number = cfun->fun_number;
+        cache->direct = cache->number >= C_TABLE_FIRST
+                      ? c_table[cache->number - C_TABLE_FIRST] : NULL;
+        break;
+    }
+    default:
+        break;
+    }
+
+    cache->epoch = LSymbol::function_epoch;
+}
+
+// Calls the function ENTER left on the stack with the top count values of
+// the stack as its arguments
+static LObject *vm_call(int count, LispCallCache *cache)
+{
+    GrowStack<void> &stack = LispVM::Stack;
+    size_t args = stack.m_size - count;
+    LObject *fun = (LObject *)stack.sdata[args - 1];
+    LObject *ret = NULL;
+
+    switch (item_type(fun))
+    {
+    case L_USER_FUNCTION:
+    {
+        TraceScope trace(TRACE_EVAL);
+        LUserFunction *ufun = (LUserFunction *)fun;
+        LList *fun_arg_list = ufun->arg_list;
+        PtrRef r1(fun_arg_list);
+
+        // ENTER saved the old values
+        long stack_start = l_user_stack.m_size - count;
+        int i = 0;
+        for (LObject *f = fun_arg_list; f; f = CDR(f))
+            ((LSymbol *)CAR(f))->SetValue((LObject *)stack.sdata[args + i++]);
+
+        // Only compile it if it was not redefined in the meantime
+        if (!ufun->code && cache->epoch == LSymbol::function_epoch)
+            ufun->code = LispVM::Compile(ufun);
+        if (ufun->code)
+            ret = vm_run(ufun->code, NULL);
+        else
+            ret = (LObject *)eval_block(ufun->block_list);
+
+        long cur_stack = stack_start;
+        for (LObject *f = fun_arg_list; f; f = CDR(f))
+            ((LSymbol *)CAR(f))->SetValue((LObject *)l_user_stack.sdata[cur_stack++]);
+        l_user_stack.m_size = stack_start;
+        break;
+    }
+    default:
+    {
+        // The cache still describes fun unless something was redefined
+        // while the arguments were evaluated
+        ltype t = item_type(fun);
+        int number = cache->number;
+        lisp_c_function direct = cache->direct;
+        if (cache->epoch != LSymbol::function_epoch)
+        {
+            number = ((LSysFunction *)fun)->fun_number;
+            direct = number >= C_TABLE_FIRST ? c_table[number - C_TABLE_FIRST]
+                                             : NULL;
+        }
+
+        LList *first = NULL;
+        PtrRef r1(first);
+        for (int i = count; i--; )
+        {
+            LList *c = LList::Create();
+            c->m_car = (LObject *)stack.sdata[args + i];
+            c->m_cdr = first;
+            first = c;
+        }
+        long x = direct ? direct(first) : c_caller(number, first);
+        if (t == L_C_FUNCTION)
+            ret = LNumber::Create(x);
+        else if (x)
+            ret = true_symbol;
+        break;
+    }
+    }
+
+    return ret;
+}
+
+static LObject *vm_run(LispCode *code, void *const **labels)
+{
+#if VM_THREADED
+#   define VM_LABEL(name, args) &&op_##name,
+    static void *const op_labels[OP_COUNT] = { VM_OPS(VM_LABEL) };
+#   undef VM_LABEL
+    if (labels)
+    {
+        *labels = op_labels;
+        return NULL;
+    }
+#   define VM_START() goto *(void *)*pc++;
+#   define VM_CASE(name) op_##name:
+#   define VM_NEXT() goto *(void *)*pc++
+#   define VM_END()
+#else
+    if (labels)
+        return NULL;
+#   define VM_START() for (;;) switch (*pc++) {
+#   define VM_CASE(name) case OP_##name:
+#   define VM_NEXT() break
+#   define VM_END() }
+#endif
+
+    GrowStack<void> &stack = LispVM::Stack;
+    if (stack.m_size + code->m_stack_size > 4096)
+    {
+        lbreak("error: lisp vm stack overflow\n");
+        exit(1);
+    }
+    if (vm_int_total + code->m_int_size > vm_int_size)
+    {
+        vm_int_size = Max(vm_int_size * 2, vm_int_total + code->m_int_size + 64);
+        vm_ints = (int32_t *)realloc(vm_ints, sizeof(int32_t) * vm_int_size);
+    }
+
+    LispVM::Stats.calls++;
+    code->m_running++;
+
+    // The collector updates the pool and the stack in place, so objects
+    // are always read from there after anything that may allocate.
+    LObject **pool = code->m_pool;
+    void **sp = stack.sdata;
+    intptr_t *pc = code->m_ops;
+    LObject *tmp;
+    int32_t n1, n2;
+
+#define PUSH(x) (sp[stack.m_size++] = (void *)(x))
+#define POP() ((LObject *)sp[--stack.m_size])
+#define TOP() (sp[stack.m_size - 1])
+
+    VM_START()
+
+    VM_CASE(NIL)
+        PUSH(NULL);
+        VM_NEXT();
+    VM_CASE(CONST)
+        PUSH(pool[*pc++]);
+        VM_NEXT();
+    VM_CASE(VAR)
+        tmp = ((LSymbol *)pool[*pc++])->m_value;
+        if (item_type(tmp) == L_OBJECT_VAR)
+            tmp = (LObject *)l_obj_get(((LObjectVar *)tmp)->m_index);
+        PUSH(tmp);
+        VM_NEXT();
+    VM_CASE(SETQ)
+    {
+        LSymbol *sym = (LSymbol *)pool[*pc++];
+        tmp = (LObject *)TOP();
+        switch (item_type(sym->m_value))
+        {
+        case L_NUMBER:
+            if (item_type(tmp) == L_NUMBER && sym->m_value != l_undefined)
+                sym->SetNumber(lnumber_value(tmp));
+            else
+                sym->SetValue(tmp);
+            break;
+        case L_OBJECT_VAR:
+            l_obj_set(((LObjectVar *)sym->m_value)->m_index, tmp);
+            break;
+        default:
+            sym->SetValue(tmp);
+        }
+        TOP() = sym->m_value;
+        VM_NEXT();
+    }
+    VM_CASE(POP)
+        stack.m_size--;
+        VM_NEXT();
+    VM_CASE(JUMP)
+        pc = code->m_ops + *pc;
+        VM_NEXT();
+    VM_CASE(JNIL)
+        if (POP())
+            pc++;
+        else
+            pc = code->m_ops + *pc;
+        VM_NEXT();
+    VM_CASE(JNOTNIL)
+        if (POP())
+            pc = code->m_ops + *pc;
+        else
+            pc++;
+        VM_NEXT();
+    VM_CASE(NOT)
+        TOP() = TOP() ? NULL : true_symbol;
+        VM_NEXT();
+    VM_CASE(CAR)
+        TOP() = lcar(TOP());
+        VM_NEXT();
+    VM_CASE(CDR)
+        TOP() = lcdr(TOP());
+        VM_NEXT();
+    VM_CASE(EQ)
+        tmp = POP();
+        TOP() = lisp_eq(TOP(), tmp);
+        VM_NEXT();
+    VM_CASE(EQ0)
+        tmp = (LObject *)TOP();
+        TOP() = item_type(tmp) == L_NUMBER && !((LNumber *)tmp)->m_num
+              ? true_symbol : NULL;
+        VM_NEXT();
+    VM_CASE(CONS)
+    {
+        LList *c = LList::Create();
+        c->m_cdr = POP();
+        c->m_car = (LObject *)TOP();
+        TOP() = c;
+        VM_NEXT();
+    }
+    VM_CASE(INT)
+        vm_ints[vm_int_total++] = lnumber_value(POP());
+        VM_NEXT();
+    VM_CASE(PLUS)
+        n2 = (int32_t)*pc++;
+        vm_int_total -= n2;
+        for (n1 = 0; n2--; )
+            n1 += vm_ints[vm_int_total + n2];
+        PUSH(LNumber::Create(n1));
+        VM_NEXT();
+    VM_CASE(MINUS)
+        n2 = (int32_t)*pc++;
+        vm_int_total -= n2;
+        n1 = vm_ints[vm_int_total];
+        for (int32_t i = 1; i < n2; i++)
+            n1 -= vm_ints[vm_int_total + i];
+        PUSH(LNumber::Create(n1));
+        VM_NEXT();
+    VM_CASE(GT)
+        vm_int_total -= 2;
+        PUSH(vm_ints[vm_int_total] > vm_ints[vm_int_total + 1]
+             ? true_symbol : NULL);
+        VM_NEXT();
+    VM_CASE(LT)
+        vm_int_total -= 2;
+        PUSH(vm_ints[vm_int_total] < vm_ints[vm_int_total + 1]
+             ? true_symbol : NULL);
+        VM_NEXT();
+    VM_CASE(GE)
+        vm_int_total -= 2;
+        PUSH(vm_ints[vm_int_total] >= vm_ints[vm_int_total + 1]
+             ? true_symbol : NULL);
+        VM_NEXT();
+    VM_CASE(LE)
+        vm_int_total -= 2;
+        PUSH(vm_ints[vm_int_total] <= vm_ints[vm_int_total + 1]
+             ? true_symbol : NULL);
+        VM_NEXT();
+    VM_CASE(AREF)
+        TOP() = ((LArray *)TOP())->Get(vm_ints[--vm_int_total]);
+        VM_NEXT();
+    VM_CASE(REPLACE)
+        tmp = POP();
+        TOP() = tmp;
+        VM_NEXT();
+    VM_CASE(LET_SAVE)
+        l_user_stack.push(((LSymbol *)pool[*pc++])->m_value);
+        VM_NEXT();
+    VM_CASE(LET_SET)
+        ((LSymbol *)pool[*pc++])->SetValue(POP());
+        VM_NEXT();
+    VM_CASE(LET_RESTORE)
+    {
+        int count = (int)*pc++;
+        size_t cur_stack = l_user_stack.m_size - count;
+        for (int i = 0; i < count; i++)
+            ((LSymbol *)pool[*pc++])->SetValue((LObject *)l_user_stack.sdata[cur_stack++]);
+        l_user_stack.m_size -= count;
+        VM_NEXT();
+    }
+    VM_CASE(ENTER)
+    {
+        int count = (int)pc[1];
+        LispCallCache *cache = code->m_calls + pc[2];
+        if (cache->epoch != LSymbol::function_epoch || !LispVM::CallCache)
+            vm_resolve(pool[pc[0]], count, cache);
+        if (!cache->ok)
+        {
+            LispVM::Stats.fallbacks++;
+            tmp = pool[pc[0]]->Eval();
+            PUSH(tmp);
+            pc = code->m_ops + pc[3];
+            VM_NEXT();
+        }
+
+        tmp = ((LSymbol *)CAR(pool[pc[0]]))->m_function;
+        if (cache->type == L_USER_FUNCTION)
+            for (LObject *f = ((LUserFunction *)tmp)->arg_list; f; f = CDR(f))
+                l_user_stack.push(((LSymbol *)CAR(f))->m_value);
+        PUSH(tmp);
+        pc += 4;
+        VM_NEXT();
+    }
+    VM_CASE(CALL)
+    {
+        int count = (int)*pc++;
+        tmp = vm_call(count, code->m_calls + *pc++);
+        stack.m_size -= count + 1;
+        PUSH(tmp);
+        VM_NEXT();
+    }
+    VM_CASE(EVAL)
+        LispVM::Stats.fallbacks++;
+        tmp = pool[*pc++]->Eval();
+        PUSH(tmp);
+        VM_NEXT();
+    VM_CASE(RETURN)
+        tmp = POP();
+        if (!--code->m_running && code->m_dead)
+            vm_release(code);
+        return tmp;
+
+    VM_END()
+
+#undef PUSH
+#undef POP
+#undef TOP
+#undef VM_START
+#undef VM_CASE
+#undef VM_NEXT
+#undef VM_END
+
+#if !VM_THREADED
+    return NULL;
+#endif
+}
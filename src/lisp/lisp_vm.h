@@ -0,0 +1,94 @@
+/*
+ *  Abuse - dark 2D side-scrolling platform game
+ *  Copyright (c) 1995 Crack dot Com
+ *  Copyright (c) 2005-2011 Sam Hocevar <sam@hocevar.net>
+ *
+ *  This software was released into the Public Domain. As with most public
+ *  domain software, no warranty is made or implied by Crack dot Com, by
+ *  Jonathan Clark, or by Sam Hocevar.
+ */
+
+#ifndef __LISP_VM_HPP_
+#define __LISP_VM_HPP_
+
+#include "lisp.h"
+#include "stack.h"
+
+/*  Bytecode for user functions.
+ *
+ *  When enabled, a user function is compiled on its first call into a
+ *  stack machine program: variables and called functions are resolved to
+ *  their symbols, the common special forms (if, progn, and, or, cond, let,
+ *  setq of a symbol, arithmetic and comparisons) become jumps and opcodes,
+ *  and calls to user and C functions evaluate their arguments in place.
+ *  Anything else is kept as a form handed to the tree-walking LObject::Eval.
+ *
+ *  A call to a user function only evaluates as many arguments as the
+ *  function had parameters when it was compiled. Each call site caches
+ *  whether its function still takes the compiled arguments, and the number
+ *  or table entry of a C function. The caches are dropped whenever
+ *  LSymbol::SetFunction() is called; a call site whose function no longer
+ *  fits goes to the tree-walker. The code of the function that was
+ *  replaced is freed.
+ *
+ *  Variables are dynamically scoped, so arguments and let variables are
+ *  still bound by saving and setting their symbol values, exactly like
+ *  EvalUserFunction() does. The results are the same in both modes; the
+ *  -headless state hash can be used to check that on a demo.
+ */
+
+struct LispCallCache
+{
+    int32_t epoch;         // LSymbol::function_epoch when filled
+    ltype type;
+    int ok;                // the function takes the compiled arguments
+    short number;          // C functions
+    lisp_c_function direct; // C functions registered with a pointer
+};
+
+struct LispCode
+{
+    intptr_t *m_ops;       // opcodes (or their labels) and operands
+    LObject **m_pool;      // constants, symbols and fallback forms
+    int m_ops_size, m_pool_size;
+    int m_stack_size;      // deepest use of LispVM::stack
+    int m_int_size;        // deepest use of the integer stack
+    LispCallCache *m_calls;
+    int m_calls_size;
+    int m_running;         // calls in progress
+    int m_dead;            // the function was redefined, free when done
+    LispCode *m_next;
+};
+
+struct LispVMStats
+{
+    int32_t compiled;      // functions compiled
+    int32_t calls;         // compiled function calls
+    int32_t fallbacks;     // forms handed to the tree-walker
+    int32_t released;      // code of redefined functions freed
+};
+
+class LispVM
+{
+public:
+    // Compile user functions when they are first called
+    static int Enabled;
+    // Cache function lookups at call sites (only off to measure them)
+    static int CallCache;
+
+    static LispCode *Compile(LUserFunction *fun);
+    static LObject *Run(LispCode *code);
+    // Free the code of a function that is being replaced
+    static void Release(LUserFunction *fun);
+
+    // Every compiled function, so that the collector can update the
+    // pools and Uninit can free them
+    static LispCode *List;
+    static GrowStack<void> Stack;
+
+    static void FreeAll();
+
+    static LispVMStats Stats;
+};
+
+#endif
@@ -37,6 +37,7 @@
 #include "loadgame.h"
 #include "nfserver.h"
 #include "specache.h"
+#include "tilecache.h"
 
 extern int past_startup;
 
@@ -183,6 +184,8 @@ void load_tiles(Cell *file_list)
   int old_fsize=nforetiles,
       old_bsize=nbacktiles;
 
+  TileCache::Generation++;  // tile numbers may get new images
+
   for (fl=file_list; !NILP(fl); fl=lcdr(fl))
   {
     fp=open_file(lstring_value(lcar(fl)),"rb");
@@ -295,24 +298,12 @@ void load_data(int argc, char **argv)
     pal=NULL;
     color_table=NULL;
 
-# if 0
-    int should_save_sd_cache = 0;
-
-    char *cachepath;
-    cachepath = (char *)malloc( strlen( get_save_filename_prefix() ) + 12 + 1 );
-    sprintf( cachepath, "%ssd_cache.tmp", get_save_filename_prefix() );
+    char *indexpath = (char *)malloc(strlen(get_save_filename_prefix()) + 14 + 1);
+    sprintf(indexpath, "%sspec_index.bin", get_save_filename_prefix());
 
-    bFILE *load = open_file( cachepath, "rb" );
-    if( !load->open_failure() )
-    {
-        sd_cache.load( load );
-    }
-    else
-    {
-        should_save_sd_cache = 1;
-    }
-    delete load;
-#endif
+    Timer spec_timer;
+    int have_index = sd_cache.index_enabled && sd_cache.load_index(indexpath);
+    sd_cache.index_hits = sd_cache.index_misses = 0;
 
   // don't let them specify a startup file we are connect elsewhere
   if (!net_start())
@@ -462,23 +453,17 @@ void load_data(int argc, char **argv)
   b_wid=cache.backt(backtiles[0])->im->Size().x;
   b_hi=cache.backt(backtiles[0])->im->Size().y;
 
-#if 0
-    if( should_save_sd_cache )
+    if (sd_cache.index_enabled)
     {
-        bFILE *save = open_file( cachepath, "wb" );
-        if( !save->open_failure() )
-        {
-            sd_cache.save( save );
-        }
-        delete save;
+        dprintf("Specs : %d directories from the index, %d read, data loaded in %.1f ms\n",
+                sd_cache.index_hits, sd_cache.index_misses, spec_timer.PollMs());
+        if (!have_index || sd_cache.index_misses)
+            sd_cache.save_index(indexpath);
     }
-#endif
+    free(indexpath);
 
     sd_cache.clear();
     past_startup = 1;
-#if 0
-    free( cachepath );
-#endif
 }
 
 
@@ -20,6 +20,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <signal.h>
+#include <poll.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
@@ -34,6 +35,7 @@ extern net_protocol *prot;
 
 
 file_manager *fman=NULL;
+int net_read_ahead=0;
 
 file_manager::file_manager(int argc, char **argv, net_protocol *proto) : proto(proto)
 {
@@ -52,6 +54,29 @@ file_manager::file_manager(int argc, char **argv, net_protocol *proto) : proto(p
 
 
 
+// ready_to_read() only knows about the last select()
+static int more_commands(net_socket *sock)
+{
+  struct pollfd p;
+  p.fd=sock->get_fd();
+  p.events=POLLIN;
+  p.revents=0;
+  return poll(&p,1,0)>0;
+}
+
+// the socket is blocking, so this only stops short if it went bad
+static int read_all(net_socket *sock, void *buf, int size)
+{
+  int total=0;
+  while (total<size)
+  {
+    int ret=sock->read((char *)buf+total,size-total);
+    if (ret<=0) return total;
+    total+=ret;
+  }
+  return total;
+}
+
 void file_manager::process_net()
 {
   nfs_client *nc,*last=NULL;
@@ -68,7 +93,14 @@ void file_manager::process_net()
     else if (nc->size_to_read && nc->sock->ready_to_write())
       ok=nc->send_read();
     else if (nc->sock->ready_to_read())
-      ok=process_nfs_command(nc);    // if we couldn't process the packet, delete the connection
+    {
+      // NFCMD_READ_AT requests wait behind each other, answer all of them
+      // that fit in the socket instead of one per call
+      int i=0;
+      do
+        ok=process_nfs_command(nc);    // if we couldn't process the packet, delete the connection
+      while (ok && !nc->size_to_read && ++i<NF_MAX_COMMANDS && more_commands(nc->sock));
+    }
 
     if (ok)
     {
@@ -101,6 +133,23 @@ int file_manager::process_nfs_command(nfs_client *c)
       c->size_to_read=size;
       return c->send_read();
     } break;
+    case NFCMD_READ_AT :
+    {
+      int32_t req[2];
+      if (c->sock->read(req,sizeof(req))!=sizeof(req)) return 0;
+      int32_t offset=lltl(req[0]),size=lltl(req[1]);
+
+      struct stat st;
+      if (fstat(c->file_fd,&st)<0) return 0;
+      if (offset<0 || offset>st.st_size) offset=st.st_size;
+      if (size<0 || size>st.st_size-offset) size=st.st_size-offset;
+
+      int32_t avail=lltl(size);
+      if (c->sock->write(&avail,sizeof(avail))!=sizeof(avail)) return 0;
+      c->read_offset=offset;
+      c->size_to_read=size;
+      return c->send_read();
+    } break;
     case NFCMD_CLOSE :
     {
       return 0;
@@ -132,7 +181,33 @@ int file_manager::process_nfs_command(nfs_client *c)
 
 int file_manager::nfs_client::send_read()   // return 0 if failure on socket, not failure to read
 {
-  if (file_fd>=0 && sock)
+  if (file_fd>=0 && sock && read_offset>=0)    // NFCMD_READ_AT, the data goes as it is
+  {
+    while (size_to_read && sock->ready_to_write())
+    {
+      int sent=sock->write_file(file_fd,read_offset,Min(size_to_read,(int32_t)NF_BLOCK_SIZE));
+      if (sent<=0)
+      {
+        fprintf(stderr,"write failed\n");
+        return 0;
+      }
+      read_offset+=sent;
+      size_to_read-=sent;
+    }
+
+    if (size_to_read)
+    {
+      sock->read_unselectable();
+      sock->write_selectable();
+    } else
+    {
+      sock->read_selectable();
+      sock->write_unselectable();
+      read_offset=-1;
+    }
+    return 1;
+  }
+  else if (file_fd>=0 && sock)
   {
     // first make sure the socket isn't 'full'
     if (sock->ready_to_write())
@@ -224,7 +299,7 @@ void file_manager::secure_filename(char *filename, const size_t filenamesize, ch
 
 
 file_manager::nfs_client::nfs_client(net_socket *sock, int file_fd, nfs_client *next) :
-  sock(sock),file_fd(file_fd),next(next),size_to_read(0)
+  sock(sock),file_fd(file_fd),next(next),size_to_read(0),read_offset(-1)
 {
   sock->read_selectable();
 }
@@ -298,6 +373,8 @@ void file_manager::remote_file::r_close(char const *reason)
 
   if (sock)
   {
+    // read what is on its way, or the server could get a broken pipe
+    while (num_requests && receive()) ;
     delete sock;
     sock=NULL;
   }
@@ -308,6 +385,19 @@ file_manager::remote_file::remote_file(net_socket *sock, char const *filename, c
 {
   next=Next;
   open_local=0;
+  read_ahead=Min(net_read_ahead,NF_CACHE_BLOCKS/2);
+  window=1;
+  pos=0;
+  last_block=-1;
+  clock=0;
+  first_request=num_requests=0;
+  for (int i=0; i<NF_CACHE_BLOCKS; i++)
+  {
+    blocks[i].offset=-1;
+    blocks[i].pending=0;
+    blocks[i].last_used=0;
+    blocks[i].data=NULL;
+  }
 
   uint8_t sizes[3]={ CLIENT_NFS,strlen(filename)+1,strlen(mode)+1};
   if (sock->write(sizes,3)!=3) { r_close("could not send open info"); return ; }
@@ -325,9 +415,123 @@ file_manager::remote_file::remote_file(net_socket *sock, char const *filename, c
   size=lltl(size);
 }
 
+file_manager::remote_file::block *file_manager::remote_file::find_block(int32_t offset)
+{
+  for (int i=0; i<NF_CACHE_BLOCKS; i++)
+    if (blocks[i].offset==offset) return blocks+i;
+  return NULL;
+}
+
+file_manager::remote_file::block *file_manager::remote_file::request(int32_t offset)
+{
+  // reuse the block used longest ago that is not on its way or being read,
+  // waiting for the oldest request if they all are
+  int i,best=-1;
+  while (best<0)
+  {
+    for (i=0; i<NF_CACHE_BLOCKS; i++)
+      if (!blocks[i].pending && blocks[i].offset!=last_block &&
+          (best<0 || blocks[i].offset<0 || blocks[i].last_used<blocks[best].last_used))
+      {
+        best=i;
+        if (blocks[i].offset<0) break;
+      }
+    if (best<0 && (!num_requests || !receive())) return NULL;
+  }
+  block *b=blocks+best;
+
+  uint8_t msg[9];
+  int32_t tmp;
+  msg[0]=NFCMD_READ_AT;
+  tmp=lltl(offset);             memcpy(msg+1,&tmp,4);
+  tmp=lltl(NF_BLOCK_SIZE);      memcpy(msg+5,&tmp,4);
+  if (sock->write(msg,9)!=9) { r_close("read : could not send request"); return NULL; }
+
+  if (!b->data) b->data=(uint8_t *)malloc(NF_BLOCK_SIZE);
+  b->offset=offset;
+  b->size=0;
+  b->pending=1;
+  b->last_used=++clock;
+  requests[(first_request+num_requests)%NF_CACHE_BLOCKS]=best;
+  num_requests++;
+  return b;
+}
+
+int file_manager::remote_file::receive()
+{
+  block *b=blocks+requests[first_request];
+  first_request=(first_request+1)%NF_CACHE_BLOCKS;
+  num_requests--;
+  b->pending=0;
+
+  int32_t avail;
+  if (read_all(sock,&avail,sizeof(avail))!=sizeof(avail))
+  {
+    b->offset=-1;
+    return 0;
+  }
+  avail=lltl(avail);
+  if (avail<0 || avail>NF_BLOCK_SIZE || read_all(sock,b->data,avail)!=avail)
+  {
+    fprintf(stderr,"incomplete packet\n");
+    b->offset=-1;
+    return 0;
+  }
+  b->size=avail;
+  return 1;
+}
+
+file_manager::remote_file::block *file_manager::remote_file::get_block(int32_t offset)
+{
+  // reading on widens the window, going anywhere else starts it over
+  if (offset==last_block+NF_BLOCK_SIZE)
+    window=Min(window*2,read_ahead);
+  else if (offset!=last_block)
+    window=1;
+  last_block=offset;
+
+  block *b=find_block(offset);
+  if (!b) b=request(offset);
+  if (!b) return NULL;
+  b->last_used=++clock;
+
+  for (int i=1; i<=window; i++)
+  {
+    int32_t next=offset+i*NF_BLOCK_SIZE;
+    if (next>=size) break;
+    if (!find_block(next) && !request(next)) return NULL;
+  }
+
+  while (b->pending)
+    if (!receive())
+    {
+      r_close("read : could not read data");
+      return NULL;
+    }
+  return b->offset==offset ? b : NULL;
+}
+
 int file_manager::remote_file::unbuffered_read(void *buffer, size_t count)
 {
-  if (sock && count)
+  if (sock && count && read_ahead>0)
+  {
+    int total_read=0;
+    while (count && pos<size)
+    {
+      int32_t start=pos-pos%NF_BLOCK_SIZE;
+      block *b=get_block(start);
+      if (!b || pos-start>=b->size) break;
+
+      int n=Min((int32_t)count,b->size-(pos-start));
+      memcpy(buffer,b->data+(pos-start),n);
+      buffer=(void *)(((char *)buffer)+n);
+      pos+=n;
+      count-=n;
+      total_read+=n;
+    }
+    return total_read;
+  }
+  else if (sock && count)
   {
     uint8_t cmd=NFCMD_READ;
     if (sock->write(&cmd,sizeof(cmd))!=sizeof(cmd)) { r_close("read : could not send command"); return 0; }
@@ -373,6 +577,7 @@ int file_manager::remote_file::unbuffered_read(void *buffer, size_t count)
 
 int32_t file_manager::remote_file::unbuffered_tell()   // ask server where the offset of the file pointer is
 {
+  if (read_ahead>0) return pos;
   if (sock)
   {
     uint8_t cmd=NFCMD_TELL;
@@ -387,6 +592,12 @@ int32_t file_manager::remote_file::unbuffered_tell()   // ask server where the o
 
 int32_t file_manager::remote_file::unbuffered_seek(int32_t offset)  // tell server to seek to a spot in a file
 {
+  if (read_ahead>0)     // the next request says where
+  {
+    if (!sock) return 0;
+    pos=Max(offset,(int32_t)0);
+    return pos;
+  }
   if (sock)
   {
     uint8_t cmd=NFCMD_SEEK;
@@ -403,7 +614,11 @@ int32_t file_manager::remote_file::unbuffered_seek(int32_t offset)  // tell serv
 
 
 file_manager::remote_file::~remote_file()
-{ r_close(NULL); }
+{
+  r_close(NULL);
+  for (int i=0; i<NF_CACHE_BLOCKS; i++)
+    free(blocks[i].data);
+}
 
 int file_manager::rf_open_file(char const *&filename, char const *mode)
 {
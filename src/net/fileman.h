@@ -6,6 +6,33 @@
 #include <stdlib.h>
 #include <string.h>
 
+/*  Remote file reads.
+ *
+ *  With net_read_ahead above 0 a remote file is read in blocks of
+ *  NF_BLOCK_SIZE bytes, each asked for with NFCMD_READ_AT. Requests go out
+ *  without waiting for the replies before them, and while the engine reads
+ *  on through a file the number of blocks asked for ahead of it doubles up
+ *  to net_read_ahead, so a load takes a round trip per window instead of
+ *  one per bFILE buffer. Blocks stay in a cache kept with the file until it
+ *  is closed, and seek and tell never go to the server: the position is
+ *  kept here and sent with the next request.
+ *
+ *  Servers from before NFCMD_READ_AT drop the connection when they get
+ *  one, and nothing in the open reply says which kind a server is, so
+ *  read ahead is off unless asked for.
+ *
+ *  The server answers requests in order, as many as are waiting each time
+ *  it is called, and has the system send the data straight from the file
+ *  where it can (see net_socket::write_file). TCP sockets are set not to
+ *  wait for acks before sending small writes, or each request would.
+ */
+
+#define NF_BLOCK_SIZE   16384   // bytes per NFCMD_READ_AT request
+#define NF_CACHE_BLOCKS 32      // blocks kept per remote file
+#define NF_MAX_COMMANDS 64      // requests a server answers per process_net()
+
+extern int net_read_ahead;      // most blocks asked for ahead (at most NF_CACHE_BLOCKS / 2), 0 for one NFCMD_READ at a time
+
 
 class file_manager
 {
@@ -20,6 +47,7 @@ class file_manager
 
     nfs_client *next;
     int32_t size_to_read;
+    int32_t read_offset;  // where NFCMD_READ_AT data comes from, -1 for NFCMD_READ
     int32_t size;
     nfs_client(net_socket *sock, int file_fd, nfs_client *next);
     int send_read();     // flushes as much of size_to_read as possible
@@ -35,6 +63,25 @@ class file_manager
     int32_t size;   // server tells us the size of the file when we open it
     int open_local;
     remote_file *next;
+
+    struct block
+    {
+      int32_t offset;       // -1 if empty
+      int size, pending;    // pending if asked for and not read yet
+      uint32_t last_used;
+      uint8_t *data;
+    } blocks[NF_CACHE_BLOCKS];
+    int read_ahead;       // most blocks to ask for ahead, 0 for the old protocol
+    int window;           // blocks asked for ahead now
+    int32_t pos, last_block;
+    uint32_t clock;
+    int requests[NF_CACHE_BLOCKS],first_request,num_requests;   // pending blocks, in order asked
+
+    block *find_block(int32_t offset);
+    block *request(int32_t offset);
+    int receive();        // reads the reply to the oldest request
+    block *get_block(int32_t offset);
+
     remote_file(net_socket *sock, char const *filename, char const *mode, remote_file *Next);
 
     int unbuffered_read(void *buffer, size_t count);
@@ -240,7 +240,7 @@ int net_driver::check_commands()
       {
     char *cmds[]={ "open","close","read","write","seek","size","tell","setfs","crc_calced","process_lsf","request_lfs",
              "equest_entry","become_server","block","reload_start","reload_end","send_input","input_missing",
-              "kill_slackers","die"};
+              "kill_slackers","read_at","die"};
     fprintf(stderr,"engine cmd : %s\n",cmds[cmd]);
       }
     }
@@ -13,6 +13,7 @@
 #endif
 
 #include <stdlib.h>
+#include <unistd.h>
 
 #include "sock.h"
 
@@ -36,3 +37,18 @@ net_socket *net_protocol::connect_to_server(char const *&server_name, int port,
 }
 #endif
 
+// copies the file through a buffer, protocols that can have the system
+// send it straight from the file do so instead
+int net_socket::write_file(int file_fd, long offset, int size)
+{
+#if HAVE_NETWORK
+  char buf[8192];
+  if (size>(int)sizeof(buf)) size=sizeof(buf);
+  size=pread(file_fd,buf,size,offset);
+  if (size<=0) return size;
+  return write(buf,size);
+#else
+  return -1;
+#endif
+}
+
@@ -38,6 +38,8 @@ public:
   virtual void write_unselectable()  { ; }
   virtual int listen(int port)       { return 0; }
   virtual net_socket *accept(net_address *&from) { from=0; return 0; }
+  // sends at most size bytes of a file from offset, returns how many or -1
+  virtual int write_file(int file_fd, long offset, int size);
 };
 
 class net_protocol
@@ -18,6 +18,7 @@
 #include <strings.h>
 #endif
 #include <ctype.h>
+#include <errno.h>
 
 #if (defined(__APPLE__) && !defined(__MACH__))
 #   include "GUSI.h"
@@ -33,6 +34,8 @@ extern tcpip_protocol tcpip;
 FILE *log_file=NULL;
 extern int net_start();
 
+#define NET_LOG_MAX 64   // bytes shown of each read or write, file data can be big
+
 static void net_log(char const *st, void *buf, long size)
 {
 
@@ -46,17 +49,18 @@ static void net_log(char const *st, void *buf, long size)
 
 
     fprintf(log_file,"%s%ld - ",st,size);
+    long shown=size<NET_LOG_MAX ? size : NET_LOG_MAX;
     int i;
-    for (i=0; i<size; i++)
+    for (i=0; i<shown; i++)
       if (isprint(*((unsigned char *)buf+i)))
         fprintf(log_file,"%c",*((unsigned char *)buf+i));
       else fprintf(log_file,"~");
 
     fprintf(log_file," : ");
 
-    for (i=0; i<size; i++)
+    for (i=0; i<shown; i++)
     fprintf(log_file,"%02x, ",*((unsigned char *)buf+i));
-    fprintf(log_file,"\n");
+    fprintf(log_file,shown<size ? "...\n" : "\n");
     fflush(log_file);
 
 }
@@ -71,6 +75,7 @@ int unix_fd::read(void *buf, int size, net_address **addr)
 //{{{
 {
   int tr=::read(fd,(char*)buf,size);
+  mark_stale();
 
   net_log("tcpip.cpp: unix_fd::read:", (char *) buf, (long) size);
 
@@ -85,10 +90,25 @@ int unix_fd::write(void const *buf, int size, net_address *addr)
   net_log("tcpip.cpp: unix_fd::write:", (char *) buf, (long) size);
 
   if (addr) fprintf(stderr,"Cannot change address for this socket type\n");
+  mark_stale();
   return ::write(fd,(char*)buf,size);
 }
 //}}}///////////////////////////////////
 
+#if defined HAVE_SYS_SENDFILE_H
+int unix_fd::write_file(int file_fd, long offset, int size)
+//{{{
+{
+  off_t off=offset;
+  mark_stale();
+  int ret=sendfile(fd,file_fd,&off,size);
+  if (ret<0 && (errno==EINVAL || errno==ENOSYS))   // not a file sendfile() can do
+    return net_socket::write_file(file_fd,offset,size);
+  return ret;
+}
+//}}}///////////////////////////////////
+#endif
+
 void unix_fd::broadcastable()
 //{{{
 {
@@ -101,6 +121,98 @@ void unix_fd::broadcastable()
 }
 //}}}///////////////////////////////////
 
+#if defined HAVE_SYS_EPOLL_H
+void unix_fd::check_ready()
+//{{{
+{
+  struct pollfd p;
+  p.fd=fd;
+  p.events=POLLIN|((selectable&READY_WRITE) ? POLLOUT : 0);
+  p.revents=0;
+  ready=0;
+  if (poll(&p,1,0)>0)
+  {
+    if (p.revents&(POLLIN|POLLHUP)) ready|=READY_READ;
+    if (p.revents&POLLOUT) ready|=READY_WRITE;
+    if (p.revents&POLLERR) ready|=READY_ERROR;
+  }
+  stale=0;
+}
+//}}}///////////////////////////////////
+
+int unix_fd::error()
+//{{{
+{
+  if (!tcpip.use_epoll)
+    return FD_ISSET(fd,&tcpip.exception_set);
+  if (stale && is_pending) check_ready();
+  return (ready&READY_ERROR) && (selectable&READY_READ);
+}
+//}}}///////////////////////////////////
+
+int unix_fd::ready_to_read()
+//{{{
+{
+  if (!tcpip.use_epoll)
+    return FD_ISSET(fd,&tcpip.read_set);
+  if (stale && is_pending) check_ready();
+  return (ready&READY_READ) && (selectable&READY_READ);
+}
+//}}}///////////////////////////////////
+
+int unix_fd::ready_to_write()
+//{{{
+{
+  struct pollfd p;     // don't wait
+  p.fd=fd;
+  p.events=POLLOUT;
+  p.revents=0;
+  return poll(&p,1,0)>0 && (p.revents&POLLOUT);
+}
+//}}}///////////////////////////////////
+
+void unix_fd::read_selectable()
+//{{{
+{
+  FD_SET(fd,&tcpip.master_set);
+  selectable|=READY_READ;
+}
+//}}}///////////////////////////////////
+
+void unix_fd::read_unselectable()
+//{{{
+{
+  FD_CLR(fd,&tcpip.master_set);
+  selectable&=~READY_READ;
+}
+//}}}///////////////////////////////////
+
+void unix_fd::write_selectable()
+//{{{
+{
+  FD_SET(fd,&tcpip.master_write_set);
+  if (!(selectable&READY_WRITE))
+  {
+    selectable|=READY_WRITE;
+    tcpip.watch_write(this,1);
+  }
+}
+//}}}///////////////////////////////////
+
+void unix_fd::write_unselectable()
+//{{{
+{
+  FD_CLR(fd,&tcpip.master_write_set);
+  if (selectable&READY_WRITE)
+  {
+    selectable&=~READY_WRITE;
+    ready&=~READY_WRITE;
+    tcpip.watch_write(this,0);
+  }
+}
+//}}}///////////////////////////////////
+#endif
+
 /*int tcp_socket::listen(int port)
 {
 	sockaddr_in host;
@@ -697,14 +809,130 @@ tcpip_protocol::tcpip_protocol()
   FD_ZERO(&read_set);
   FD_ZERO(&exception_set);
   FD_ZERO(&write_set);
+#if defined HAVE_SYS_EPOLL_H
+  epoll_fd=epoll_create(64);
+  pending=NULL;
+  use_epoll=epoll_fd>=0;
+#else
+  use_epoll=0;
+#endif
+}
+//}}}///////////////////////////////////
+
+#if defined HAVE_SYS_EPOLL_H
+void tcpip_protocol::watch(unix_fd *s)
+//{{{
+{
+  if (epoll_fd<0)
+    return;
+  epoll_event ev;
+  ev.events=EPOLLIN|EPOLLET;
+  ev.data.ptr=s;
+  epoll_ctl(epoll_fd,EPOLL_CTL_ADD,s->get_fd(),&ev);
 }
 //}}}///////////////////////////////////
 
+void tcpip_protocol::unwatch(unix_fd *s)
+//{{{
+{
+  // closing the socket takes it out of the epoll set
+  for (unix_fd **p=&pending; *p; p=&(*p)->next_pending)
+    if (*p==s)
+    {
+      *p=s->next_pending;
+      break;
+    }
+}
+//}}}///////////////////////////////////
+
+void tcpip_protocol::watch_write(unix_fd *s, int x)
+//{{{
+{
+  if (epoll_fd<0)
+    return;
+  epoll_event ev;
+  ev.events=EPOLLIN|EPOLLET|(x ? EPOLLOUT : 0);
+  ev.data.ptr=s;
+  epoll_ctl(epoll_fd,EPOLL_CTL_MOD,s->get_fd(),&ev);
+}
+//}}}///////////////////////////////////
+
+void tcpip_protocol::add_pending(unix_fd *s)
+//{{{
+{
+  if (!s->is_pending)
+  {
+    s->is_pending=1;
+    s->next_pending=pending;
+    pending=s;
+  }
+}
+//}}}///////////////////////////////////
+
+int tcpip_protocol::select_epoll(int block)
+//{{{
+{
+  int timeout=0;
+  for (;;)
+  {
+    int ret=0,n;
+    do
+    {
+      epoll_event ev[64];
+      n=epoll_wait(epoll_fd,ev,64,timeout);
+      for (int i=0; i<n; i++)
+      {
+        unix_fd *s=(unix_fd *)ev[i].data.ptr;
+        if (ev[i].events&(EPOLLIN|EPOLLHUP)) s->ready|=unix_fd::READY_READ;
+        if (ev[i].events&EPOLLOUT) s->ready|=unix_fd::READY_WRITE;
+        if (ev[i].events&EPOLLERR) s->ready|=unix_fd::READY_ERROR;
+        add_pending(s);
+      }
+      timeout=0;
+    } while (n==64);
+
+    // count what is ready like ::select would, and drop the sockets that
+    // have been emptied since they became ready
+    for (unix_fd **p=&pending; *p; )
+    {
+      unix_fd *s=*p;
+      if (s->stale) s->check_ready();
+      if (!s->ready)
+      {
+        s->is_pending=0;
+        *p=s->next_pending;
+        continue;
+      }
+      if (s->selectable&unix_fd::READY_READ)
+        ret+=((s->ready&unix_fd::READY_READ)!=0)+((s->ready&unix_fd::READY_ERROR)!=0);
+      if (s->selectable&unix_fd::READY_WRITE)
+        ret+=(s->ready&unix_fd::READY_WRITE)!=0;
+      p=&s->next_pending;
+    }
+
+    // remove notifier & responder events from the count of sockets selected
+    if (handle_notification())
+      ret--;
+    if (handle_responder())
+      ret--;
+    if (ret || !block)
+      return ret;
+    timeout=-1;
+  }
+}
+//}}}///////////////////////////////////
+#endif
+
 int tcpip_protocol::select(int block)
 //{{{
 {
   int ret;
 
+#if defined HAVE_SYS_EPOLL_H
+  if (use_epoll)
+    return select_epoll(block);
+#endif
+
   memcpy(&read_set,&master_set,sizeof(master_set));
   memcpy(&exception_set,&master_set,sizeof(master_set));
   memcpy(&write_set,&master_write_set,sizeof(master_set));
@@ -23,6 +23,7 @@
 #elif defined HAVE_NETINET_IN_H
 #   include <netdb.h>
 #   include <netinet/in.h>
+#   include <netinet/tcp.h>
 #   include <stdio.h>
 #   include <string.h>
 #   include <sys/time.h>
@@ -39,6 +40,14 @@
 
 #   include <sys/socket.h>
 
+#if defined HAVE_SYS_EPOLL_H
+#   include <sys/epoll.h>
+#   include <poll.h>
+#endif
+#if defined HAVE_SYS_SENDFILE_H
+#   include <sys/sendfile.h>
+#endif
+
 #include "sock.h"
 #include "isllist.h"
 
@@ -84,6 +93,19 @@ public:
   //}}}
 } ;
 
+class unix_fd;
+
+/*  With epoll, every socket is added to the epoll set once, when it is
+ *  created, and select() only hears about the sockets that became ready
+ *  since the last call instead of going through FD_SETSIZE descriptors.
+ *  Readiness is edge triggered: a socket that became ready stays on the
+ *  pending list until a poll() of that one socket after it was read or
+ *  written says there is nothing left, so a socket that is not read from
+ *  during a tick (game_sock while the engine runs) does not wake every
+ *  call up again. Sockets set unselectable stay in the set and are only
+ *  left out of what select() and ready_to_read() report, like before.
+ */
+
 class tcpip_protocol : public net_protocol
 {
 protected:
@@ -106,8 +128,24 @@ protected:
 
   int handle_notification();
   int handle_responder();
+#if defined HAVE_SYS_EPOLL_H
+  int epoll_fd;
+  unix_fd *pending;              // sockets that became ready and were not emptied yet
+  int select_epoll(int block);
+#endif
 public :
   fd_set master_set,master_write_set,read_set,exception_set,write_set;
+  int use_epoll;                 // select() with epoll instead of ::select
+
+#if defined HAVE_SYS_EPOLL_H
+  int has_epoll() { return epoll_fd>=0; }
+  void watch(unix_fd *s);
+  void unwatch(unix_fd *s);
+  void watch_write(unix_fd *s, int x);
+  void add_pending(unix_fd *s);
+#else
+  int has_epoll() { return 0; }
+#endif
 
   tcpip_protocol();
   net_address *get_local_address();
@@ -137,6 +175,24 @@ class unix_fd : public net_socket
   protected :
   int fd;
   public :
+#if defined HAVE_SYS_EPOLL_H
+  enum { READY_READ=1, READY_WRITE=2, READY_ERROR=4 };
+  int ready, selectable;      // READY_* flags
+  int stale;                  // read or written since ready was checked
+  int is_pending;
+  unix_fd *next_pending;
+  void check_ready();
+  void mark_stale() { stale=1; }
+  unix_fd(int fd) : fd(fd) { ready=selectable=stale=is_pending=0; next_pending=NULL; tcpip.watch(this); }
+  virtual int error();
+  virtual int ready_to_read();
+  virtual int ready_to_write();
+  virtual void read_selectable();
+  virtual void read_unselectable();
+  virtual void write_selectable();
+  virtual void write_unselectable();
+  virtual ~unix_fd()                            { read_unselectable();  write_unselectable(); tcpip.unwatch(this); close(fd); }
+#else
   unix_fd(int fd) : fd(fd) { };
   virtual int error()                             { return FD_ISSET(fd,&tcpip.exception_set); }
   virtual int ready_to_read()                     { return FD_ISSET(fd,&tcpip.read_set); }
@@ -149,14 +205,18 @@ class unix_fd : public net_socket
     select(FD_SETSIZE,NULL,&write_check,NULL,&tv);
     return FD_ISSET(fd,&write_check);
   }
-  virtual int write(void const *buf, int size, net_address *addr=NULL);
-  virtual int read(void *buf, int size, net_address **addr);
-
   virtual ~unix_fd()                            { read_unselectable();  write_unselectable(); close(fd); }
   virtual void read_selectable()                   { FD_SET(fd,&tcpip.master_set); }
   virtual void read_unselectable()                 { FD_CLR(fd,&tcpip.master_set); }
   virtual void write_selectable()                  { FD_SET(fd,&tcpip.master_write_set); }
   virtual void write_unselectable()                { FD_CLR(fd,&tcpip.master_write_set); }
+  void mark_stale() { }
+#endif
+  virtual int write(void const *buf, int size, net_address *addr=NULL);
+  virtual int read(void *buf, int size, net_address **addr);
+#if defined HAVE_SYS_SENDFILE_H
+  virtual int write_file(int file_fd, long offset, int size);
+#endif
   int get_fd() { return fd; }
 
   void broadcastable();
@@ -166,7 +226,12 @@ class tcp_socket : public unix_fd
 {
   int listening;
   public :
-  tcp_socket(int fd) : unix_fd(fd) { listening=0; };
+  tcp_socket(int fd) : unix_fd(fd)
+  {
+    listening=0;
+    int one=1;    // don't hold small writes back waiting for acks, see fileman.h
+    setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,(char *)&one,sizeof(one));
+  }
   virtual int listen(int port)
   {
     sockaddr_in host;
@@ -194,6 +259,7 @@ class tcp_socket : public unix_fd
       struct sockaddr_in from;
       socklen_t addr_len=sizeof(from);
       int new_fd=::accept(fd,(sockaddr *)&from,&addr_len);
+      mark_stale();
       if (new_fd>=0)
       {
         addr=new ip_address(&from);
@@ -213,6 +279,7 @@ class udp_socket : public unix_fd
   virtual int read(void *buf, int size, net_address **addr)
   {
     int tr;
+    mark_stale();
     if (addr)
     {
       *addr=new ip_address;
@@ -224,6 +291,7 @@ class udp_socket : public unix_fd
   }
   virtual int write(void const *buf, int size, net_address *addr=NULL)
   {
+    mark_stale();
     if (addr)
       return sendto(fd,buf,size,0,(sockaddr *)(&((ip_address *)addr)->addr),sizeof(((ip_address *)addr)->addr));
     else
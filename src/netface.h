@@ -44,6 +44,7 @@ enum { NFCMD_OPEN,
        NFCMD_SEND_INPUT,
        NFCMD_INPUT_MISSING,     // when engine is waiting for input and suspects packets are missing
        NFCMD_KILL_SLACKERS,     // when the user decides the clients are taking too long to respond
+       NFCMD_READ_AT,           // nfs client sends offset and size, gets the size available and that much data
        EGCMD_DIE
      };
 
@@ -50,6 +50,7 @@ class nfs_file : public bFILE
   virtual int unbuffered_seek(long offset, int whence);  // whence=SEEK_SET, SEEK_CUR, SEEK_END, ret=0=success
   virtual int unbuffered_tell();
   virtual int file_size();
+  virtual int local_file() { return local!=NULL; }
   virtual ~nfs_file();
 } ;
 
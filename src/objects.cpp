@@ -372,6 +372,8 @@ void game_object::morph_into(int type, void (*stat_fun)(int), int anneal, int fr
 {
   set_morph_status(new morph_char(this,type,stat_fun,anneal,frames));
   otype=type;
+  if (current_level)
+    current_level->object_retyped(this);
   set_state(stopped);
 }
 
@@ -489,32 +491,45 @@ void game_object::do_damage(int amount, game_object *from, int32_t hitx, int32_t
     am = LList::Create();
     PtrRef r1(am);
     am->m_car = LNumber::Create(amount);
+    Lisp::WriteBarrier(am);
 
     frm = LList::Create();
     PtrRef r2(frm);
     frm->m_car = LPointer::Create(from);
+    Lisp::WriteBarrier(frm);
 
     hx = LList::Create();
     PtrRef r3(hx);
     hx->m_car = LNumber::Create(hitx);
+    Lisp::WriteBarrier(hx);
 
     hy = LList::Create();
     PtrRef r4(hy);
     hy->m_car = LNumber::Create(hity);
+    Lisp::WriteBarrier(hy);
 
     px = LList::Create();
     PtrRef r5(px);
     px->m_car = LNumber::Create(push_xvel);
+    Lisp::WriteBarrier(px);
 
     py = LList::Create();
     PtrRef r6(py);
     py->m_car = LNumber::Create(push_yvel);
+    Lisp::WriteBarrier(py);
 
+    // Any of the allocations above may have moved the cells out of the
+    // nursery, so these stores need barriers too
     px->m_cdr = py;
+    Lisp::WriteBarrier(px);
     hy->m_cdr = px;
+    Lisp::WriteBarrier(hy);
     hx->m_cdr = hy;
+    Lisp::WriteBarrier(hx);
     frm->m_cdr = hx;
+    Lisp::WriteBarrier(frm);
     am->m_cdr = frm;
+    Lisp::WriteBarrier(am);
 
     time_marker *prof1 = NULL;
     if (profiling())
@@ -1204,17 +1219,22 @@ int game_object::move(int cx, int cy, int button)
     lcx = LList::Create();
     PtrRef r1(lcx);
     lcx->m_car = LNumber::Create(cx);
+    Lisp::WriteBarrier(lcx);
 
     lcy = LList::Create();
     PtrRef r2(lcy);
     lcy->m_car = LNumber::Create(cy);
+    Lisp::WriteBarrier(lcy);
 
     lb = LList::Create();
     PtrRef r3(lb);
     lb->m_car = LNumber::Create(button);
+    Lisp::WriteBarrier(lb);
 
     lcx->m_cdr = lcy;
+    Lisp::WriteBarrier(lcx);
     lcy->m_cdr = lb;
+    Lisp::WriteBarrier(lcy);
 
     void *m = LSpace::Tmp.Mark();
 
@@ -1538,6 +1558,9 @@ int32_t object_list_length(object_node *list)
 game_object::game_object(int Type, int load)
 {
   lvars = NULL;
+  next_grid = prev_grid = NULL;
+  grid_cell = -1;
+  grid_order = 0;
 
   if (Type<0xffff)
   {
@@ -1614,6 +1637,8 @@ void game_object::change_type(int new_type)
   }
   else return;
   otype=new_type;
+  if (current_level)
+    current_level->object_retyped(this);
 
   if (figures[new_type]->get_fun(OFUN_CONSTRUCTOR))
   {
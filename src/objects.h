@@ -57,6 +57,8 @@ class game_object : public simple_object
   sequence *current_sequence() { return figures[otype]->get_sequence(state); }
 public :
   game_object *next,*next_active;
+  game_object *next_grid,*prev_grid;   // maintained by the level's ObjectGrid
+  int32_t grid_cell,grid_order;
   int32_t *lvars;
 
   int size();
@@ -0,0 +1,212 @@
+/*
+ *  Abuse - dark 2D side-scrolling platform game
+ *  Copyright (c) 1995 Crack dot Com
+ *  Copyright (c) 2005-2011 Sam Hocevar <sam@hocevar.net>
+ *
+ *  This software was released into the Public Domain. As with most public
+ *  domain software, no warranty is made or implied by Crack dot Com, by
+ *  Jonathan Clark, or by Sam Hocevar.
+ */
+
+#if defined HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <limits.h>
+
+#include "common.h"
+
+#include "objgrid.h"
+#include "objects.h"
+#include "loader2.h"
+
+ObjectGrid::ObjectGrid()
+{
+    m_dirty = 1;
+    m_width = m_height = 0;
+    m_cellw = m_cellh = 1;
+    m_cells = NULL;
+    m_found = NULL;
+    m_found_size = m_found_total = 0;
+}
+
+ObjectGrid::~ObjectGrid()
+{
+    free(m_cells);
+    free(m_found);
+}
+
+int ObjectGrid::CellOf(game_object *o)
+{
+    int wide = m_width * m_height;
+
+    if (o->otype >= total_objects)
+        return wide;
+
+    CharacterType *t = figures[o->otype];
+    if (Max(t->rangex, t->draw_rangex) > GRID_MAX_RANGE
+         || Max(t->rangey, t->draw_rangey) > GRID_MAX_RANGE)
+        return wide;
+
+    int cx = Min(Max(o->x / m_cellw, 0), m_width - 1);
+    int cy = Min(Max(o->y / m_cellh, 0), m_height - 1);
+    return cx + cy * m_width;
+}
+
+void ObjectGrid::Link(game_object *o, int cell)
+{
+    o->grid_cell = cell;
+    o->prev_grid = NULL;
+    o->next_grid = m_cells[cell];
+    if (m_cells[cell])
+        m_cells[cell]->prev_grid = o;
+    m_cells[cell] = o;
+}
+
+void ObjectGrid::Unlink(game_object *o)
+{
+    if (o->prev_grid)
+        o->prev_grid->next_grid = o->next_grid;
+    else
+        m_cells[o->grid_cell] = o->next_grid;
+    if (o->next_grid)
+        o->next_grid->prev_grid = o->prev_grid;
+    o->grid_cell = -1;
+}
+
+void ObjectGrid::Rebuild(game_object *first, int map_w, int map_h)
+{
+    m_cellw = Max(f_wid, 1) * GRID_CELL_TILES;
+    m_cellh = Max(f_hi, 1) * GRID_CELL_TILES;
+    m_width = Max((map_w + GRID_CELL_TILES - 1) / GRID_CELL_TILES, 1);
+    m_height = Max((map_h + GRID_CELL_TILES - 1) / GRID_CELL_TILES, 1);
+
+    int total = m_width * m_height + 1;
+    m_cells = (game_object **)realloc(m_cells, sizeof(game_object *) * total);
+    for (int i = 0; i < total; i++)
+        m_cells[i] = NULL;
+
+    int32_t order = 0;
+    for (game_object *o = first; o; o = o->next)
+    {
+        o->grid_order = order;
+        order += GRID_ORDER_STEP;
+        Link(o, CellOf(o));
+    }
+
+    m_dirty = 0;
+}
+
+void ObjectGrid::Insert(game_object *o)
+{
+    o->grid_cell = -1;
+    if (!m_dirty)
+        Link(o, CellOf(o));
+}
+
+void ObjectGrid::Remove(game_object *o)
+{
+    if (!m_dirty && o->grid_cell >= 0)
+        Unlink(o);
+    o->grid_cell = -1;
+}
+
+void ObjectGrid::Update(game_object *o)
+{
+    if (m_dirty || o->grid_cell < 0)
+        return;
+
+    int cell = CellOf(o);
+    if (cell != o->grid_cell)
+    {
+        Unlink(o);
+        Link(o, cell);
+    }
+}
+
+// o was just linked between prev and next in the level's object list
+void ObjectGrid::Order(game_object *o, game_object *prev, game_object *next)
+{
+    if (m_dirty)
+        return;
+
+    if (prev && next)
+    {
+        if (next->grid_order - prev->grid_order < 2)
+            m_dirty = 1;
+        else
+            o->grid_order = prev->grid_order
+                          + (next->grid_order - prev->grid_order) / 2;
+    }
+    else if (prev)
+    {
+        if (prev->grid_order > INT_MAX - GRID_ORDER_STEP)
+            m_dirty = 1;
+        else
+            o->grid_order = prev->grid_order + GRID_ORDER_STEP;
+    }
+    else if (next)
+    {
+        if (next->grid_order < INT_MIN + GRID_ORDER_STEP)
+            m_dirty = 1;
+        else
+            o->grid_order = next->grid_order - GRID_ORDER_STEP;
+    }
+    else
+        o->grid_order = 0;
+}
+
+void ObjectGrid::AddFound(game_object *o)
+{
+    if (m_found_total >= m_found_size)
+    {
+        m_found_size = m_found_size * 2 + 64;
+        m_found = (game_object **)realloc(m_found, sizeof(game_object *) * m_found_size);
+    }
+    m_found[m_found_total++] = o;
+}
+
+int ObjectGrid::Collect(int32_t x1, int32_t y1, int32_t x2, int32_t y2)
+{
+    m_found_total = 0;
+
+    int cx1 = Max((x1 - GRID_MAX_RANGE) / m_cellw, 0);
+    int cy1 = Max((y1 - GRID_MAX_RANGE) / m_cellh, 0);
+    int cx2 = Min((x2 + GRID_MAX_RANGE) / m_cellw, m_width - 1);
+    int cy2 = Min((y2 + GRID_MAX_RANGE) / m_cellh, m_height - 1);
+
+    // Objects outside the map are clamped to the border cells, so the
+    // border must be visited whenever the window reaches past it.
+    if (x2 + GRID_MAX_RANGE < 0)
+        cx2 = 0;
+    if (y2 + GRID_MAX_RANGE < 0)
+        cy2 = 0;
+    if (x1 - GRID_MAX_RANGE >= m_width * m_cellw)
+        cx1 = m_width - 1;
+    if (y1 - GRID_MAX_RANGE >= m_height * m_cellh)
+        cy1 = m_height - 1;
+
+    for (int cy = cy1; cy <= cy2; cy++)
+        for (int cx = cx1; cx <= cx2; cx++)
+            for (game_object *o = m_cells[cx + cy * m_width]; o; o = o->next_grid)
+                AddFound(o);
+
+    for (game_object *o = m_cells[m_width * m_height]; o; o = o->next_grid)
+        AddFound(o);
+
+    return m_found_total;
+}
+
+static int order_sorter(void const *a, void const *b)
+{
+    int32_t oa = (*(game_object * const *)a)->grid_order;
+    int32_t ob = (*(game_object * const *)b)->grid_order;
+    return oa < ob ? -1 : oa > ob ? 1 : 0;
+}
+
+void ObjectGrid::Sort(int count)
+{
+    qsort(m_found, count, sizeof(game_object *), order_sorter);
+}
+
@@ -0,0 +1,73 @@
+/*
+ *  Abuse - dark 2D side-scrolling platform game
+ *  Copyright (c) 1995 Crack dot Com
+ *  Copyright (c) 2005-2011 Sam Hocevar <sam@hocevar.net>
+ *
+ *  This software was released into the Public Domain. As with most public
+ *  domain software, no warranty is made or implied by Crack dot Com, by
+ *  Jonathan Clark, or by Sam Hocevar.
+ */
+
+#ifndef __OBJGRID_H__
+#define __OBJGRID_H__
+
+class game_object;
+
+/*  Bucketed spatial index over the level's object list.
+ *
+ *  Cells are GRID_CELL_TILES x GRID_CELL_TILES foreground tiles; objects
+ *  are linked into the cell containing their (x,y) through the intrusive
+ *  next_grid/prev_grid fields. Objects whose activity range is larger than
+ *  GRID_MAX_RANGE live in one extra bucket that every query visits, so a
+ *  query only needs to grow its window by GRID_MAX_RANGE.
+ *
+ *  Each object also carries a grid_order key that follows the order of the
+ *  level's first->next list, so that query results can be handed back in
+ *  exactly the order the old linear scans produced.
+ *
+ *  When the grid cannot be maintained incrementally (level load, resize,
+ *  no room left between two order keys) it is marked dirty and rebuilt
+ *  from the object list on the next query.
+ */
+
+#define GRID_CELL_TILES 8
+#define GRID_MAX_RANGE 320
+#define GRID_ORDER_STEP 1024
+
+class ObjectGrid
+{
+public:
+    ObjectGrid();
+    ~ObjectGrid();
+
+    void Invalidate() { m_dirty = 1; }
+    int Dirty() { return m_dirty; }
+    void Rebuild(game_object *first, int map_w, int map_h);
+
+    void Insert(game_object *o);
+    void Remove(game_object *o);
+    void Update(game_object *o); // call after o->x, o->y or o->otype change
+    void Order(game_object *o, game_object *prev, game_object *next);
+
+    // Gather every object that may have its range box intersecting the
+    // given area. Results are unordered; see Sort().
+    int Collect(int32_t x1, int32_t y1, int32_t x2, int32_t y2);
+    game_object **Found() { return m_found; }
+    void Sort(int count); // sort the first count found objects by list order
+
+private:
+    int CellOf(game_object *o);
+    void Link(game_object *o, int cell);
+    void Unlink(game_object *o);
+    void AddFound(game_object *o);
+
+    int m_dirty;
+    int m_width, m_height;     // grid size, in cells
+    int m_cellw, m_cellh;      // cell size, in pixels
+    game_object **m_cells;     // m_width * m_height buckets + the wide one
+    game_object **m_found;
+    int m_found_size, m_found_total;
+};
+
+#endif // __OBJGRID_H__
+
@@ -0,0 +1,279 @@
+/*
+ *  Abuse - dark 2D side-scrolling platform game
+ *  Copyright (c) 1995 Crack dot Com
+ *  Copyright (c) 2005-2011 Sam Hocevar <sam@hocevar.net>
+ *
+ *  This software was released into the Public Domain. As with most public
+ *  domain software, no warranty is made or implied by Crack dot Com, by
+ *  Jonathan Clark, or by Sam Hocevar.
+ */
+
+#if defined HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <SDL.h>
+
+#include "common.h"
+
+#include "prefetch.h"
+#include "cache.h"
+
+CachePrefetch::CachePrefetch()
+{
+    memset(&stats, 0, sizeof(stats));
+    for (int i = 0; i < PREFETCH_SLOTS; i++)
+        m_slots[i].state = SLOT_FREE;
+    m_queued = m_quit = 0;
+    m_files = NULL;
+    m_tried = NULL;
+    m_files_size = 0;
+    m_lock = NULL;
+    m_work = m_done = NULL;
+    m_thread = NULL;
+}
+
+CachePrefetch::~CachePrefetch()
+{
+    // The thread is stopped by CacheList::empty(), nothing is left to
+    // wait for at exit.
+    free(m_files);
+    free(m_tried);
+}
+
+int CachePrefetch::Start()
+{
+    if (m_thread)
+        return 1;
+
+    if (!m_lock)
+    {
+        m_lock = SDL_CreateMutex();
+        m_work = SDL_CreateCond();
+        m_done = SDL_CreateCond();
+    }
+    if (!m_lock || !m_work || !m_done)
+        return 0;
+
+    m_quit = 0;
+    m_thread = SDL_CreateThread(Worker, this);
+    return m_thread != NULL;
+}
+
+void CachePrefetch::Stop()
+{
+    if (!m_thread)
+        return;
+
+    Flush();
+
+    SDL_LockMutex(m_lock);
+    m_quit = 1;
+    SDL_CondSignal(m_work);
+    SDL_UnlockMutex(m_lock);
+    SDL_WaitThread(m_thread, NULL);
+    m_thread = NULL;
+}
+
+int CachePrefetch::Worker(void *arg)
+{
+    ((CachePrefetch *)arg)->Run();
+    return 0;
+}
+
+void CachePrefetch::Run()
+{
+    SDL_LockMutex(m_lock);
+    while (!m_quit)
+    {
+        Slot *s = NULL;
+        for (int i = 0; i < PREFETCH_SLOTS && m_queued; i++)
+        {
+            Slot *t = m_slots + i;
+            if (t->state == SLOT_QUEUED
+                 && (!s || t->file_number < s->file_number
+                      || (t->file_number == s->file_number
+                           && t->offset < s->offset)))
+                s = t;
+        }
+
+        if (!s)
+        {
+            SDL_CondWait(m_work, m_lock);
+            continue;
+        }
+
+        s->state = SLOT_LOADING;
+        m_queued--;
+        SDL_UnlockMutex(m_lock);
+
+        // Nobody else touches a slot while it is loading
+        s->fp->seek(s->offset, SEEK_SET);
+        void *data = cache_load_item(s->fp, s->type, NULL);
+
+        SDL_LockMutex(m_lock);
+        s->data = data;
+        s->state = SLOT_DONE;
+        SDL_CondBroadcast(m_done);
+    }
+    SDL_UnlockMutex(m_lock);
+}
+
+bFILE *CachePrefetch::File(int file_number, char const *filename)
+{
+    if (file_number >= m_files_size)
+    {
+        int size = file_number + 16;
+        m_files = (bFILE **)realloc(m_files, sizeof(bFILE *) * size);
+        m_tried = (uint8_t *)realloc(m_tried, size);
+        for (int i = m_files_size; i < size; i++)
+        {
+            m_files[i] = NULL;
+            m_tried[i] = 0;
+        }
+        m_files_size = size;
+    }
+
+    if (!m_tried[file_number])
+    {
+        m_tried[file_number] = 1;
+        bFILE *fp = map_file(filename);
+        if (!fp->open_failure() && fp->mapped_data(0, 0))
+            m_files[file_number] = fp;
+        else
+            delete fp;
+    }
+    return m_files[file_number];
+}
+
+int CachePrefetch::Queue(int id, int file_number, char const *filename,
+                         int32_t offset, int type)
+{
+    if (!m_thread)
+        return -1;
+
+    bFILE *fp = NULL;
+    switch (type)
+    {
+    // Sounds are not queued: sound_effect opens its file through jFILE,
+    // which shares the open file count and the main spec file with the
+    // main thread.
+    case SPEC_BACKTILE: case SPEC_FORETILE: case SPEC_CHARACTER:
+    case SPEC_CHARACTER2: case SPEC_IMAGE: case SPEC_PARTICLE:
+    case SPEC_PALETTE:
+        fp = File(file_number, filename);
+        if (!fp)
+            return -1;
+        break;
+    default:
+        return -1;
+    }
+
+    SDL_LockMutex(m_lock);
+    int slot = -1;
+    for (int i = 0; i < PREFETCH_SLOTS && slot < 0; i++)
+        if (m_slots[i].state == SLOT_FREE)
+            slot = i;
+
+    if (slot >= 0)
+    {
+        Slot *s = m_slots + slot;
+        s->id = id;
+        s->type = type;
+        s->file_number = file_number;
+        s->offset = offset;
+        s->fp = fp;
+        s->data = NULL;
+        s->state = SLOT_QUEUED;
+        m_queued++;
+        stats.queued++;
+        SDL_CondSignal(m_work);
+    }
+    SDL_UnlockMutex(m_lock);
+    return slot;
+}
+
+void *CachePrefetch::Release(int slot, int access)
+{
+    Slot *s = m_slots + slot;
+    void *data = NULL;
+
+    SDL_LockMutex(m_lock);
+    if (s->state == SLOT_LOADING)
+    {
+        Timer t;
+        while (s->state == SLOT_LOADING)
+            SDL_CondWait(m_done, m_lock);
+        if (access)
+        {
+            stats.stalls++;
+            stats.stall_ms += t.PollMs();
+        }
+    }
+
+    if (s->state == SLOT_DONE)
+        data = s->data;
+    else if (s->state == SLOT_QUEUED)
+        m_queued--;
+
+    if (access)
+    {
+        if (data)
+            stats.hits++;
+        else
+            stats.misses++;
+    }
+    s->state = SLOT_FREE;
+    SDL_UnlockMutex(m_lock);
+
+    return data;
+}
+
+int CachePrefetch::Finished(int *id, void **data)
+{
+    if (!m_lock)
+        return 0;
+
+    int found = 0;
+    SDL_LockMutex(m_lock);
+    for (int i = 0; i < PREFETCH_SLOTS && !found; i++)
+    {
+        Slot *s = m_slots + i;
+        if (s->state == SLOT_DONE)
+        {
+            *id = s->id;
+            *data = s->data;
+            s->state = SLOT_FREE;
+            found = 1;
+        }
+    }
+    SDL_UnlockMutex(m_lock);
+    return found;
+}
+
+void CachePrefetch::Flush()
+{
+    if (!m_lock)
+        return;
+
+    SDL_LockMutex(m_lock);
+    for (int i = 0; i < PREFETCH_SLOTS; i++)
+        if (m_slots[i].state == SLOT_QUEUED)
+            m_slots[i].state = SLOT_FREE;
+    m_queued = 0;
+    for (int i = 0; i < PREFETCH_SLOTS; i++)
+        while (m_slots[i].state == SLOT_LOADING)
+            SDL_CondWait(m_done, m_lock);
+    SDL_UnlockMutex(m_lock);
+
+    for (int i = 0; i < m_files_size; i++)
+    {
+        delete m_files[i];
+        m_files[i] = NULL;
+        m_tried[i] = 0;
+    }
+}
+
@@ -0,0 +1,99 @@
+/*
+ *  Abuse - dark 2D side-scrolling platform game
+ *  Copyright (c) 1995 Crack dot Com
+ *  Copyright (c) 2005-2011 Sam Hocevar <sam@hocevar.net>
+ *
+ *  This software was released into the Public Domain. As with most public
+ *  domain software, no warranty is made or implied by Crack dot Com, by
+ *  Jonathan Clark, or by Sam Hocevar.
+ */
+
+#ifndef __PREFETCH_H__
+#define __PREFETCH_H__
+
+class bFILE;
+struct SDL_mutex;
+struct SDL_cond;
+struct SDL_Thread;
+
+/*  Background loader for CacheList.
+ *
+ *  Items are queued with the file and offset they live at, and a worker
+ *  thread decodes them into a fixed table of slots, lowest file and offset
+ *  first so that reads go forward through each data file. The cache takes
+ *  the result back when the item is first accessed: a finished slot is a
+ *  hit, a slot still waiting in the queue is dropped and the caller loads
+ *  the item itself (a miss), and only a slot the worker is busy with makes
+ *  the caller wait (a stall).
+ *
+ *  The worker only reads files the main thread opened for it with
+ *  map_file(), and only when they are local memory mapped files, so the
+ *  network file code is never entered from the worker thread.
+ */
+
+#define PREFETCH_SLOTS 256
+
+struct PrefetchStats
+{
+    int32_t queued;  // items handed to the worker
+    int32_t hits;    // accesses served by a finished prefetch
+    int32_t misses;  // accesses that had to load the item themselves
+    int32_t stalls;  // accesses that had to wait for the worker
+    float stall_ms;  // time spent waiting
+};
+
+class CachePrefetch
+{
+public:
+    CachePrefetch();
+    ~CachePrefetch();
+
+    int Start(); // returns 0 if the thread could not be started
+    void Stop();
+    int Running() { return m_thread != NULL; }
+
+    // Returns the slot the item was queued in, or -1 if the queue is full,
+    // the item is a sound or the worker cannot read the item's file.
+    int Queue(int id, int file_number, char const *filename,
+              int32_t offset, int type);
+    // Take a slot back: the loaded data, waiting for the worker if it is
+    // busy with it, or NULL if the worker did not get to it yet.
+    void *Take(int slot) { return Release(slot, 1); }
+    void *Cancel(int slot) { return Release(slot, 0); }
+    // Take back a finished slot nobody asked for, returns 0 if none.
+    int Finished(int *id, void **data);
+    // Drop the queue, wait for the worker and close its files. Finished
+    // slots are kept for Finished().
+    void Flush();
+
+    PrefetchStats stats;
+
+private:
+    enum { SLOT_FREE, SLOT_QUEUED, SLOT_LOADING, SLOT_DONE };
+    struct Slot
+    {
+        int state, id, type;
+        int16_t file_number;
+        int32_t offset;
+        bFILE *fp;
+        void *data;
+    };
+
+    static int Worker(void *arg);
+    void Run();
+    void *Release(int slot, int access);
+    bFILE *File(int file_number, char const *filename);
+
+    Slot m_slots[PREFETCH_SLOTS];
+    int m_queued, m_quit;
+    bFILE **m_files;
+    uint8_t *m_tried;
+    int m_files_size;
+
+    SDL_mutex *m_lock;
+    SDL_cond *m_work, *m_done;
+    SDL_Thread *m_thread;
+};
+
+#endif // __PREFETCH_H__
+
@@ -20,6 +20,7 @@
 #include "jwindow.h"
 #include "property.h"
 #include "objects.h"
+#include "trace.h"
 
 
 Jwindow *prof_win=NULL;
@@ -35,7 +36,8 @@ struct prof_info
 prof_info *prof_list=NULL;
 
 
-int profiling() { return prof_list!=NULL; }
+// object functions are also timed for the frame trace
+int profiling() { return prof_list!=NULL || frame_trace.Active(); }
 
 void profile_toggle()
 {
@@ -69,6 +71,7 @@ void profile_init()
 void profile_reset()
 {
   int i;
+  if (!prof_list) return;
   for (i=0; i<total_objects; i++)
   {
     prof_list[i].otype=i;
@@ -88,6 +91,7 @@ void profile_uninit()
 
 void profile_add_time(int type, float amount)
 {
+  frame_trace.AddTypeTime(type,amount*1000.0f);
   if (prof_list)
   { prof_list[type].total_time+=amount; }
 }
@@ -109,6 +113,7 @@ static void profile_sort()
 
 void profile_update()
 {
+  if (!prof_list) return;
   profile_sort();
   if (prof_list[0].total_time<=0.0) return ;     // nothing took any time!
 
@@ -50,6 +50,7 @@
 #include "specs.h"
 #include "keys.h"
 #include "setup.h"
+#include "trace.h"
 
 flags_struct flags;
 keys_struct keys;
@@ -73,6 +74,27 @@ void showHelp()
     printf( "  -f <arg>          Load map file named <arg>\n" );
     printf( "  -lisp             Startup in lisp interpreter mode\n" );
     printf( "  -nodelay          Run at maximum speed\n" );
+    printf( "  -light_scalar     Use the reference lighting code\n" );
+    printf( "  -light_nocache    Do not cache light values between frames\n" );
+    printf( "  -light_threads <arg> Light the screen with <arg> threads\n" );
+    printf( "  -tile_nocache     Draw every map tile every frame\n" );
+    printf( "  -present_slow     Use the reference code to scale the screen\n" );
+    printf( "  -present_thread   Scale the screen while the next frame is simulated\n" );
+    printf( "  -prefetch         Load cached data from a background thread\n" );
+    printf( "  -cache_budget <arg> Keep at most <arg> MB of cached data\n" );
+    printf( "  -spec_noindex     Read every data file directory at startup\n" );
+    printf( "  -headless <arg>   Play demo <arg> without display or sound, as fast\n" );
+    printf( "                    as possible, and print timings and a state hash\n" );
+    printf( "  -ticks <arg>      Stop a headless run after <arg> ticks\n" );
+    printf( "  -bench <arg>      Run microbenchmark <arg> (or all) and quit\n" );
+    printf( "  -trace <arg>      Time each frame and write the last ones to <arg>\n" );
+    printf( "                    at exit, as CSV if it ends in .csv, else as JSON\n" );
+    printf( "  -trace_frames <arg> Keep the last <arg> frames (default %d)\n", TRACE_DEFAULT_FRAMES );
+    printf( "  -lisp_gc_gen      Collect new permanent Lisp objects separately\n" );
+    printf( "  -lisp_gc_budget <arg> Keep Lisp collections under <arg> ms (with\n" );
+    printf( "                    -lisp_gc_gen only)\n" );
+    printf( "  -lisp_vm          Compile Lisp functions to bytecode (compare the\n" );
+    printf( "                    -headless state hash with and without it)\n" );
     printf( "\n" );
     printf( "** Abuse-SDL Options **\n" );
     printf( "  -datadir <arg>    Set the location of the game data to <arg>\n" );
@@ -92,6 +114,8 @@ void showHelp()
     printf( "  -nosound          Disable sound\n" );
     printf( "  -hidemouse        Hide the mouse cursor\n" );
     printf( "  -scale <arg>      Scale to <arg>\n" );
+    printf( "  -net_select       Wait for net sockets with select() instead of epoll\n" );
+    printf( "  -net_read_ahead <arg> Read remote files <arg> blocks ahead, if the server can\n" );
     printf( "  -touch_scale <x> <y> Touch-screen controls scale <x> <y>\n" );
 //    printf( "  -x <arg>          Set the width to <arg>\n" );
 //    printf( "  -y <arg>          Set the height to <arg>\n" );
@@ -123,6 +147,20 @@ void createRCFile(char *rcfile) {
         fprintf(fd, "; Set the scale factor\nscale=%i\n\n", scale);
         fprintf(fd, "; Use anti-aliasing (with gl=1 only)\nantialias=%i\n\n", flags.antialias);
         fprintf(fd, "; Hide the mouse cursor\nhidemouse=%i\n\n", flags.hidemouse);
+        fprintf(fd, "; Use the vectorized lighting code\nlight_simd=%i\n\n", flags.light_simd);
+        fprintf(fd, "; Cache light values between frames (with light_simd=1 only)\nlight_cache=%i\n\n", flags.light_cache);
+        fprintf(fd, "; Number of threads lighting the screen\nlight_threads=%i\n\n", flags.light_threads);
+        fprintf(fd, "; Keep drawn map tiles between frames\ntile_cache=%i\n\n", flags.tile_cache);
+        fprintf(fd, "; Scale the screen with the fast kernels\nfast_present=%i\n\n", flags.fast_present);
+        fprintf(fd, "; Scale the screen on a thread while the next frame is simulated\npresent_thread=%i\n\n", flags.present_thread);
+        fprintf(fd, "; Load cached data from a background thread\ncache_prefetch=%i\n\n", flags.cache_prefetch);
+        fprintf(fd, "; Megabytes of cached data to keep, 0 for no limit\ncache_budget=%i\n\n", flags.cache_budget);
+        fprintf(fd, "; Keep the data file directories in an index between runs\nspec_index=%i\n\n", flags.spec_index);
+        fprintf(fd, "; Wait for net sockets with epoll where available\nnet_epoll=%i\n\n", flags.net_epoll);
+        fprintf(fd, "; Remote file blocks to read ahead, only for servers that have read ahead too\nnet_read_ahead=%i\n\n", flags.net_read_ahead);
+        fprintf(fd, "; Collect new permanent Lisp objects separately\nlisp_gc_gen=%i\n\n", flags.lisp_gc_gen);
+        fprintf(fd, "; Milliseconds Lisp collections should take (with lisp_gc_gen=1 only)\nlisp_gc_budget=%f\n\n", flags.lisp_gc_budget);
+        fprintf(fd, "; Compile Lisp functions to bytecode\nlisp_vm=%i\n\n", flags.lisp_vm);
         fprintf(fd, "; Hide the mouse cursor\nuse_multitouch=%i\n\n", flags.use_multitouch);
         fprintf(fd, "; Touch-screen controls horizontal scale\ntouch_scale_x=%f\n\n", flags.touch_scale_x);
         fprintf(fd, "; Touch-screen controls vertical scale\ntouch_scale_y=%f\n\n", flags.touch_scale_y);
@@ -235,6 +273,76 @@ void readRCFile()
                 result = strtok( NULL, "\n" );
                 flags.hidemouse = atoi( result );
             }
+            else if( strcasecmp( result, "light_simd" ) == 0 )
+            {
+                result = strtok( NULL, "\n" );
+                flags.light_simd = atoi( result );
+            }
+            else if( strcasecmp( result, "light_cache" ) == 0 )
+            {
+                result = strtok( NULL, "\n" );
+                flags.light_cache = atoi( result );
+            }
+            else if( strcasecmp( result, "light_threads" ) == 0 )
+            {
+                result = strtok( NULL, "\n" );
+                flags.light_threads = atoi( result );
+            }
+            else if( strcasecmp( result, "tile_cache" ) == 0 )
+            {
+                result = strtok( NULL, "\n" );
+                flags.tile_cache = atoi( result );
+            }
+            else if( strcasecmp( result, "fast_present" ) == 0 )
+            {
+                result = strtok( NULL, "\n" );
+                flags.fast_present = atoi( result );
+            }
+            else if( strcasecmp( result, "present_thread" ) == 0 )
+            {
+                result = strtok( NULL, "\n" );
+                flags.present_thread = atoi( result );
+            }
+            else if( strcasecmp( result, "spec_index" ) == 0 )
+            {
+                result = strtok( NULL, "\n" );
+                flags.spec_index = atoi( result );
+            }
+            else if( strcasecmp( result, "net_epoll" ) == 0 )
+            {
+                result = strtok( NULL, "\n" );
+                flags.net_epoll = atoi( result );
+            }
+            else if( strcasecmp( result, "net_read_ahead" ) == 0 )
+            {
+                result = strtok( NULL, "\n" );
+                flags.net_read_ahead = atoi( result );
+            }
+            else if( strcasecmp( result, "cache_prefetch" ) == 0 )
+            {
+                result = strtok( NULL, "\n" );
+                flags.cache_prefetch = atoi( result );
+            }
+            else if( strcasecmp( result, "cache_budget" ) == 0 )
+            {
+                result = strtok( NULL, "\n" );
+                flags.cache_budget = atoi( result );
+            }
+            else if( strcasecmp( result, "lisp_gc_gen" ) == 0 )
+            {
+                result = strtok( NULL, "\n" );
+                flags.lisp_gc_gen = atoi( result );
+            }
+            else if( strcasecmp( result, "lisp_gc_budget" ) == 0 )
+            {
+                result = strtok( NULL, "\n" );
+                flags.lisp_gc_budget = (float)atof( result );
+            }
+            else if( strcasecmp( result, "lisp_vm" ) == 0 )
+            {
+                result = strtok( NULL, "\n" );
+                flags.lisp_vm = atoi( result );
+            }
             else if ( strcasecmp(result, "use_multitouch" ) == 0 )
             {
                 result = strtok( NULL, "\n" );
@@ -401,6 +509,123 @@ void parseCommandLine( int argc, char **argv )
         {
             flags.hidemouse = 1;
         }
+        else if( !strcasecmp( argv[ii], "-light_scalar" ) )
+        {
+            flags.light_simd = 0;
+        }
+        else if( !strcasecmp( argv[ii], "-light_nocache" ) )
+        {
+            flags.light_cache = 0;
+        }
+        else if( !strcasecmp( argv[ii], "-light_threads" ) )
+        {
+            int result;
+            if( ii + 1 < argc && sscanf( argv[++ii], "%d", &result ) )
+            {
+                flags.light_threads = result;
+            }
+        }
+        else if( !strcasecmp( argv[ii], "-tile_nocache" ) )
+        {
+            flags.tile_cache = 0;
+        }
+        else if( !strcasecmp( argv[ii], "-present_slow" ) )
+        {
+            flags.fast_present = 0;
+        }
+        else if( !strcasecmp( argv[ii], "-present_thread" ) )
+        {
+            flags.present_thread = 1;
+        }
+        else if( !strcasecmp( argv[ii], "-spec_noindex" ) )
+        {
+            flags.spec_index = 0;
+        }
+        else if( !strcasecmp( argv[ii], "-net_select" ) )
+        {
+            flags.net_epoll = 0;
+        }
+        else if( !strcasecmp( argv[ii], "-net_read_ahead" ) )
+        {
+            int result;
+            if( ii + 1 < argc && sscanf( argv[++ii], "%d", &result ) )
+            {
+                flags.net_read_ahead = result;
+            }
+        }
+        else if( !strcasecmp( argv[ii], "-prefetch" ) )
+        {
+            flags.cache_prefetch = 1;
+        }
+        else if( !strcasecmp( argv[ii], "-cache_budget" ) )
+        {
+            int result;
+            if( ii + 1 < argc && sscanf( argv[++ii], "%d", &result ) )
+            {
+                flags.cache_budget = result;
+            }
+        }
+        else if( !strcasecmp( argv[ii], "-headless" ) )
+        {
+            if( ii + 1 < argc )
+            {
+                flags.headless = argv[++ii];
+                flags.nosound = 1;
+                flags.fullscreen = 0;
+                flags.gl = 0;
+                flags.gles1 = 0;
+            }
+        }
+        else if( !strcasecmp( argv[ii], "-ticks" ) )
+        {
+            int result;
+            if( ii + 1 < argc && sscanf( argv[++ii], "%d", &result ) )
+            {
+                flags.headless_ticks = result;
+            }
+        }
+        else if( !strcasecmp( argv[ii], "-bench" ) )
+        {
+            if( ii + 1 < argc )
+            {
+                flags.bench = argv[++ii];
+                flags.nosound = 1;
+                flags.fullscreen = 0;
+                flags.gl = 0;
+                flags.gles1 = 0;
+            }
+        }
+        else if( !strcasecmp( argv[ii], "-trace" ) )
+        {
+            if( ii + 1 < argc )
+            {
+                flags.trace = argv[++ii];
+            }
+        }
+        else if( !strcasecmp( argv[ii], "-trace_frames" ) )
+        {
+            int result;
+            if( ii + 1 < argc && sscanf( argv[++ii], "%d", &result ) )
+            {
+                flags.trace_frames = result;
+            }
+        }
+        else if( !strcasecmp( argv[ii], "-lisp_gc_gen" ) )
+        {
+            flags.lisp_gc_gen = 1;
+        }
+        else if( !strcasecmp( argv[ii], "-lisp_gc_budget" ) )
+        {
+            float result;
+            if( ii + 1 < argc && sscanf( argv[++ii], "%f", &result ) )
+            {
+                flags.lisp_gc_budget = result;
+            }
+        }
+        else if( !strcasecmp( argv[ii], "-lisp_vm" ) )
+        {
+            flags.lisp_vm = 1;
+        }
         else if( !strcasecmp(argv[ii], "-use_multitouch" ) )
         {
             flags.use_multitouch = 1;
@@ -453,6 +678,25 @@ void setup(int argc, char **argv) {
     flags.nosdlparachute = 0; // SDL error handling
     flags.xres = xwinres = xres = 320; // Default window width
     flags.yres = ywinres = yres = 200; // Default window height
+    flags.light_simd = 1; // Vectorized lighting
+    flags.light_cache = 1; // Keep light values between frames
+    flags.light_threads = 1; // Light the screen from the main thread
+    flags.tile_cache = 1; // Keep drawn map tiles between frames
+    flags.fast_present = 1; // Scale the screen with the fast kernels
+    flags.present_thread = 0; // Scale the screen from the main thread
+    flags.cache_prefetch = 0; // Load cached data when it is first used
+    flags.cache_budget = 0; // No limit on cached data
+    flags.spec_index = 1; // Read data file directories from the index
+    flags.net_epoll = 1; // Wait for net sockets with epoll where available
+    flags.net_read_ahead = 0; // Read remote files one NFCMD_READ at a time
+    flags.headless = NULL; // Play normally
+    flags.headless_ticks = 0; // Play the whole demo
+    flags.bench = NULL;
+    flags.trace = NULL; // No frame trace
+    flags.trace_frames = TRACE_DEFAULT_FRAMES;
+    flags.lisp_gc_gen = 0; // Collect the whole permanent space when it is full
+    flags.lisp_gc_budget = 1.0f;
+    flags.lisp_vm = 0; // Evaluate Lisp functions with the tree-walker
 #if defined(__APPLE__)
     flags.fullscreen = 0; // Start in a window
     flags.gl = 1; // Use opengl
@@ -496,6 +740,20 @@ void setup(int argc, char **argv) {
     // Display our name and version
     //printf( "%s %s\n", PACKAGE_NAME, PACKAGE_VERSION );
 
+    // A headless run must work without a display or a sound device
+    for (int ii = 1; ii < argc; ii++)
+    {
+        if (!strcasecmp(argv[ii], "-headless")
+             || !strcasecmp(argv[ii], "-bench"))
+        {
+            // putenv() keeps the strings, so they must be writable and stay
+            static char video[] = "SDL_VIDEODRIVER=dummy";
+            static char audio[] = "SDL_AUDIODRIVER=dummy";
+            putenv(video);
+            putenv(audio);
+        }
+    }
+
     // Initialize SDL with video and audio support
     if( SDL_Init( SDL_INIT_VIDEO | SDL_INIT_AUDIO ) < 0 )
     {
@@ -583,6 +841,25 @@ void setup(int argc, char **argv) {
     printf("flags.gles1 %d\n", flags.gles1);
     printf("flags.antialias %s\n", flags.antialias == GL_NEAREST ? "NEAREST" : flags.antialias == GL_LINEAR ? "LINEAR" : "<unknown>");
     printf("flags.hidemouse %d\n", flags.hidemouse);
+    printf("flags.light_simd %d\n", flags.light_simd);
+    printf("flags.light_cache %d\n", flags.light_cache);
+    printf("flags.light_threads %d\n", flags.light_threads);
+    printf("flags.tile_cache %d\n", flags.tile_cache);
+    printf("flags.fast_present %d\n", flags.fast_present);
+    printf("flags.present_thread %d\n", flags.present_thread);
+    printf("flags.cache_prefetch %d\n", flags.cache_prefetch);
+    printf("flags.cache_budget %d\n", flags.cache_budget);
+    printf("flags.spec_index %d\n", flags.spec_index);
+    printf("flags.net_epoll %d\n", flags.net_epoll);
+    printf("flags.net_read_ahead %d\n", flags.net_read_ahead);
+    printf("flags.headless %s\n", flags.headless ? flags.headless : "<none>");
+    printf("flags.headless_ticks %d\n", flags.headless_ticks);
+    printf("flags.bench %s\n", flags.bench ? flags.bench : "<none>");
+    printf("flags.trace %s\n", flags.trace ? flags.trace : "<none>");
+    printf("flags.trace_frames %d\n", flags.trace_frames);
+    printf("flags.lisp_gc_gen %d\n", flags.lisp_gc_gen);
+    printf("flags.lisp_gc_budget %f\n", flags.lisp_gc_budget);
+    printf("flags.lisp_vm %d\n", flags.lisp_vm);
     printf("flags.use_multitouch %d\n", flags.use_multitouch);
     printf("flags.language %s\n", flags.language);
     printf("scale %d\n", scale);
@@ -29,6 +29,25 @@ struct flags_struct
     float touch_scale_x;
     float touch_scale_y;
     int antialias;
+    short light_simd;
+    short light_cache;
+    short light_threads;
+    short tile_cache;
+    short fast_present;
+    short present_thread;
+    short cache_prefetch;
+    int cache_budget; // in megabytes
+    short spec_index;
+    short net_epoll;
+    short net_read_ahead; // remote file blocks to ask for ahead
+    const char *headless; // demo to play without display or sound
+    int headless_ticks;
+    const char *bench; // microbenchmark to run
+    const char *trace; // file the frame trace is written to at exit
+    int trace_frames;
+    short lisp_gc_gen;
+    float lisp_gc_budget; // in milliseconds
+    short lisp_vm;
     const char *language;
 };
 
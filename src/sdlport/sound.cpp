@@ -100,18 +100,31 @@ sound_effect::sound_effect(char const *filename)
     if (!sound_enabled)
         return;
 
-    jFILE fp(filename, "rb");
-    if (fp.open_failure())
+    bFILE *fp = map_file(filename, 1);
+    if (fp->open_failure())
     {
-    	m_chunk=NULL;
+        delete fp;
+        m_chunk=NULL;
         return;
     }
 
-    void *temp_data = malloc(fp.file_size());
-    fp.read(temp_data, fp.file_size());
-    SDL_RWops *rw = SDL_RWFromMem(temp_data, fp.file_size());
-    m_chunk = Mix_LoadWAV_RW(rw, 1);
-    free(temp_data);
+    // Decode straight from the file mapping when there is one
+    int size = fp->file_size();
+    void const *mapped = fp->mapped_data(0, size);
+    if (mapped)
+    {
+        SDL_RWops *rw = SDL_RWFromConstMem(mapped, size);
+        m_chunk = Mix_LoadWAV_RW(rw, 1);
+    }
+    else
+    {
+        void *temp_data = malloc(size);
+        fp->read(temp_data, size);
+        SDL_RWops *rw = SDL_RWFromMem(temp_data, size);
+        m_chunk = Mix_LoadWAV_RW(rw, 1);
+        free(temp_data);
+    }
+    delete fp;
 }
 
 //
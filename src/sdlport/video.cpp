@@ -42,9 +42,11 @@
 #include "filter.h"
 #include "video.h"
 #include "image.h"
+#include "scale.h"
 #include "setup.h"
 #include "game.h"
 #include "joy.h"
+#include "trace.h"
 
 SDL_Surface *window = NULL, *surface = NULL;
 image *main_screen = NULL;
@@ -61,11 +63,20 @@ GLfloat texcoord[4];
 GLuint texid;
 GLuint touchoverlayid;
 SDL_Surface *texture = NULL;
+// With flags.fast_present, dirty parts are converted straight into the
+// texture, which only needs a complete blit after a palette change
+static uint32_t texture_pal32[256];
+static int texture_stale = 1;
 #endif /* HAVE_OPENGL || HAVE_OPENGLES1 */
 
 extern int has_multitouch;
 
 static void update_window_part(SDL_Rect *rect);
+static void update_window_flip();
+static void present_start();
+static void present_stop();
+static void present_queue(image *im, int x, int y, SDL_Rect *srcrect);
+static void present_kick();
 
 //
 // power_of_two()
@@ -337,6 +348,9 @@ void set_mode(int mode, int argc, char **argv)
     if(flags.grabmouse)
         SDL_WM_GrabInput(SDL_GRAB_ON);
 
+    if(flags.present_thread)
+        present_start();
+
     update_dirty(main_screen);
 }
 
@@ -346,6 +360,8 @@ void set_mode(int mode, int argc, char **argv)
 //
 void close_graphics()
 {
+    present_stop();
+
     if(lastl)
         delete lastl;
     lastl = NULL;
@@ -360,6 +376,196 @@ void close_graphics()
     delete main_screen;
 }
 
+// ---- pipelined present ----
+//
+// With flags.present_thread, scaling a frame into the 8-bit surface (and
+// the texture) happens on a worker thread while the main thread simulates
+// the next frame. put_part_image() copies the dirty parts into
+// present_copy, which holds what the window shows, and queues them.
+// update_window_done() hands the queue to the worker. present_sync(),
+// called by the main loop after Game::step() and before anything else
+// touches the surface, waits for the worker and updates the window. Every
+// SDL call stays on the main thread.
+//
+// Drawing itself cannot overlap the simulation: draw_map(), object draw
+// functions and the status bar run Lisp code and read the level the
+// simulation is changing. The finished 8-bit frame is the snapshot.
+//
+
+#define PRESENT_MAX_JOBS 256
+
+struct present_job
+{
+    SDL_Rect src, dst; // area of present_copy, and where it goes
+};
+
+static SDL_Thread *present_worker = NULL;
+static SDL_sem *present_go = NULL, *present_done = NULL;
+static int present_quit = 0;
+static image *present_copy = NULL;
+static present_job present_jobs[2][PRESENT_MAX_JOBS];
+static int present_count[2] = { 0, 0 };
+static int present_queued = 0; // index of the jobs being queued
+static int present_busy = 0;   // the other jobs are with the worker
+static int64_t present_enter, present_leave;
+
+static struct
+{
+    int frames;
+    double work_ms, wait_ms;
+} present_stats;
+
+static void present_job_run(present_job *job)
+{
+    Uint8 *src = present_copy->scan_line(job->src.y) + job->src.x;
+    ivec2 ssize(job->src.w, job->src.h), dsize(job->dst.w, job->dst.h);
+
+    scale_image8((Uint8 *)surface->pixels + job->dst.x
+                     + job->dst.y * surface->pitch, surface->pitch,
+                 dsize, src, present_copy->Size().x, ssize);
+
+#if defined(HAVE_OPENGL) || defined(HAVE_OPENGLES1)
+    if(texture && (flags.gl || flags.gles1) && !texture_stale)
+        scale_image32((Uint32 *)texture->pixels + job->dst.x
+                          + job->dst.y * (texture->pitch / 4),
+                      texture->pitch / 4, dsize, src,
+                      present_copy->Size().x, ssize, texture_pal32);
+#endif
+}
+
+static int present_thread(void *)
+{
+    for(;;)
+    {
+        SDL_SemWait(present_go);
+        if(present_quit)
+            break;
+
+        present_enter = FrameTrace::Now();
+        int n = !present_queued;
+        for(int i = 0; i < present_count[n]; i++)
+            present_job_run(&present_jobs[n][i]);
+        present_leave = FrameTrace::Now();
+
+        SDL_SemPost(present_done);
+    }
+    return 0;
+}
+
+static void present_start()
+{
+    memset(&present_stats, 0, sizeof(present_stats));
+    present_go = SDL_CreateSemaphore(0);
+    present_done = SDL_CreateSemaphore(0);
+    present_copy = new image(ivec2(xres, yres), NULL, 0);
+    present_copy->clear(0);
+    present_worker = present_go && present_done
+                   ? SDL_CreateThread(present_thread, NULL) : NULL;
+    if(!present_worker)
+    {
+        printf("Video : Unable to start the present thread\n");
+        present_stop();
+    }
+}
+
+static void present_stop()
+{
+    if(present_worker)
+    {
+        present_sync();
+        present_quit = 1;
+        SDL_SemPost(present_go);
+        SDL_WaitThread(present_worker, NULL);
+        present_worker = NULL;
+        present_quit = 0;
+
+        // Whatever the main thread did not wait for ran in parallel
+        float work = present_stats.work_ms, wait = present_stats.wait_ms;
+        if(present_stats.frames)
+            printf("present: %d frames, %.3f ms/frame scaling on the present "
+                   "thread, %.3f ms/frame waiting for it (%.0f%% overlapped)\n",
+                   present_stats.frames, work / present_stats.frames,
+                   wait / present_stats.frames,
+                   work > 0.0f ? 100.0f * Max(0.0f, 1.0f - wait / work)
+                               : 100.0f);
+    }
+
+    if(present_go)
+        SDL_DestroySemaphore(present_go);
+    if(present_done)
+        SDL_DestroySemaphore(present_done);
+    present_go = present_done = NULL;
+    delete present_copy;
+    present_copy = NULL;
+}
+
+static void present_queue(image *im, int x, int y, SDL_Rect *srcrect)
+{
+    // The worker reads present_copy
+    present_sync();
+
+    for(int i = 0; i < srcrect->h; i++)
+        memcpy(present_copy->scan_line(y + i) + x,
+               im->scan_line(srcrect->y + i) + srcrect->x, srcrect->w);
+
+    present_job *jobs = present_jobs[present_queued];
+    int &count = present_count[present_queued];
+    SDL_Rect r = { (Sint16)x, (Sint16)y, (Uint16)srcrect->w, (Uint16)srcrect->h };
+
+    // When the queue is full, the last job grows to cover the new area:
+    // present_copy is up to date everywhere
+    if(count == PRESENT_MAX_JOBS)
+    {
+        SDL_Rect &last = jobs[--count].src;
+        int x2 = Max(last.x + last.w, r.x + r.w);
+        int y2 = Max(last.y + last.h, r.y + r.h);
+        r.x = Min(last.x, r.x);
+        r.y = Min(last.y, r.y);
+        r.w = x2 - r.x;
+        r.h = y2 - r.y;
+    }
+
+    present_job *job = jobs + count++;
+    job->src = r;
+    job->dst.x = ((r.x * win_xscale) >> 16);
+    job->dst.y = ((r.y * win_yscale) >> 16);
+    job->dst.w = ((r.w * win_xscale) >> 16);
+    job->dst.h = ((r.h * win_yscale) >> 16);
+}
+
+static void present_kick()
+{
+    present_sync();
+
+    present_queued = !present_queued;
+    present_count[present_queued] = 0;
+    present_busy = 1;
+    SDL_SemPost(present_go);
+}
+
+void present_sync()
+{
+    if(!present_busy)
+        return;
+
+    Timer wait;
+    {
+        TraceScope trace(TRACE_PRESENT_WAIT);
+        SDL_SemWait(present_done);
+    }
+    present_busy = 0;
+
+    present_stats.frames++;
+    present_stats.work_ms += 1e-6 * (present_leave - present_enter);
+    present_stats.wait_ms += wait.PollMs();
+    frame_trace.Record(TRACE_PRESENT, present_enter, present_leave);
+
+    int n = !present_queued;
+    for(int i = 0; i < present_count[n]; i++)
+        update_window_part(&present_jobs[n][i].dst);
+    update_window_flip();
+}
+
 // put_part_image()
 // Draw only dirty parts of the image
 //
@@ -403,6 +609,14 @@ void put_part_image(image *im, int x, int y, int x1, int y1, int x2, int y2)
     if(srcrect.x >= xe || srcrect.y >= ye)
         return;
 
+    if(present_worker)
+    {
+        srcrect.w = xe - srcrect.x;
+        srcrect.h = ye - srcrect.y;
+        present_queue(im, x, y, &srcrect);
+        return;
+    }
+
     // Scale the image onto the surface
     srcrect.w = xe - srcrect.x;
     srcrect.h = ye - srcrect.y;
@@ -425,7 +639,28 @@ void put_part_image(image *im, int x, int y, int x1, int y1, int x2, int y2)
     dpixel += (dstrect.x + ((dstrect.y) * surface->w)) * surface->format->BytesPerPixel;
 
     // Update surface part
-    if ((win_xscale==1<<16) && (win_yscale==1<<16)) // no scaling or hw scaling
+    if (flags.fast_present)
+    {
+        Uint8 *src = im->scan_line(srcrect.y) + srcrect.x;
+        ivec2 ssize(srcrect.w, srcrect.h);
+
+        dpixel = (Uint8 *)surface->pixels + dstrect.x + dstrect.y * surface->pitch;
+        scale_image8(dpixel, surface->pitch, ivec2(dstrect.w, dstrect.h),
+                     src, im->Size().x, ssize);
+
+#if defined(HAVE_OPENGL) || defined(HAVE_OPENGLES1)
+        // The textured modes never scale here
+        if (texture && (flags.gl || flags.gles1) && !texture_stale)
+        {
+            Uint32 *tpixel = (Uint32 *)texture->pixels
+                           + dstrect.x + dstrect.y * (texture->pitch / 4);
+            scale_image32(tpixel, texture->pitch / 4,
+                          ivec2(dstrect.w, dstrect.h), src, im->Size().x,
+                          ssize, texture_pal32);
+        }
+#endif
+    }
+    else if ((win_xscale==1<<16) && (win_yscale==1<<16)) // no scaling or hw scaling
     {
         srcy = srcrect.y;
         dpixel = ((Uint8 *)surface->pixels) + y * surface->w + x ;
@@ -476,6 +711,8 @@ void put_part_image(image *im, int x, int y, int x1, int y1, int x2, int y2)
 //
 void palette::load()
 {
+    present_sync();
+
     if(lastl)
         delete lastl;
     lastl = copy();
@@ -496,9 +733,19 @@ void palette::load()
     if(window->format->BitsPerPixel == 8)
         SDL_SetColors(window, colors, 0, ncolors);
 
+#if defined(HAVE_OPENGL) || defined(HAVE_OPENGLES1)
+    if(texture)
+    {
+        for(int ii = 0; ii < ncolors; ii++)
+            texture_pal32[ii] = SDL_MapRGBA(texture->format, colors[ii].r,
+                                            colors[ii].g, colors[ii].b, 255);
+        texture_stale = 1;
+    }
+#endif
+
     // Now redraw the surface
     update_window_part(NULL);
-    update_window_done();
+    update_window_flip();
 }
 
 //
@@ -513,12 +760,28 @@ void palette::load_nice()
 
 void update_window_done()
 {
+    // The worker scales the frame, the window is updated by present_sync()
+    if(present_worker)
+    {
+        present_kick();
+        return;
+    }
+
+    update_window_flip();
+}
+
+static void update_window_flip()
+{
+    TraceScope trace(TRACE_UPDATE);
+
 #ifdef HAVE_OPENGL
     // opengl blit complete surface to window
     if(flags.gl)
     {
         // convert color-indexed surface to RGB texture
-        SDL_BlitSurface(surface, NULL, texture, NULL);
+        if(!flags.fast_present || texture_stale)
+            SDL_BlitSurface(surface, NULL, texture, NULL);
+        texture_stale = 0;
 
         // Texturemap complete texture to surface so we have free scaling
         // and antialiasing
@@ -542,7 +805,9 @@ void update_window_done()
     if(flags.gles1)
     {
         // convert color-indexed surface to RGB texture
-        SDL_BlitSurface(surface, NULL, texture, NULL);
+        if(!flags.fast_present || texture_stale)
+            SDL_BlitSurface(surface, NULL, texture, NULL);
+        texture_stale = 0;
 
         float x1 = xwinres / 2 - flags.xres / 2;
         float x2 = xwinres / 2 + flags.xres / 2;
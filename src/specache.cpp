@@ -12,10 +12,58 @@
 #   include "config.h"
 #endif
 
+#include <stdlib.h>
+
+#include "common.h"
+
 #include "specache.h"
 
+#define SPEC_INDEX_MAGIC "SPECIDX"
+#define SPEC_INDEX_VERSION 1
+#define SPEC_INDEX_HEADER 24 // magic, version, records, payload size, hash
+
+class CrcManager;
+extern CrcManager *net_crcs;
+
 spec_directory_cache sd_cache;
 
+spec_directory_cache::spec_directory_cache()
+{
+  fn_root=fn_list=0;
+  size=0;
+  index_data=NULL;
+  index=NULL;
+  index_total=0;
+  index_enabled=1;
+  index_hits=index_misses=0;
+}
+
+// FNV-1a
+static uint32_t index_hash(uint8_t const *buf, size_t len)
+{
+  uint32_t h=2166136261u;
+  for (size_t i=0; i<len; i++)
+  {
+    h^=buf[i];
+    h*=16777619u;
+  }
+  return h;
+}
+
+static uint32_t get_uint32(uint8_t const *p)
+{
+  uint32_t x;
+  memcpy(&x,p,4);
+  return lltl(x);
+}
+
+static uint8_t *put_uint32(uint8_t *p, uint32_t x)
+{
+  x=lltl(x);
+  memcpy(p,&x,4);
+  return p+4;
+}
+
 void spec_directory_cache::load(bFILE *fp)
 {
   short tfn=fp->read_uint16();
@@ -48,6 +96,23 @@ void spec_directory_cache::save(bFILE *fp)
 }
 
 
+spec_directory_cache::index_record *spec_directory_cache::find_index(char const *filename)
+{
+  int lo=0,hi=index_total-1;
+  while (lo<=hi)
+  {
+    int mid=(lo+hi)/2;
+    int cmp=strcmp(index[mid].name,filename);
+    if (cmp==0)
+      return index+mid;
+    if (cmp<0)
+      lo=mid+1;
+    else
+      hi=mid-1;
+  }
+  return NULL;
+}
+
 spec_directory *spec_directory_cache::get_spec_directory(char const *filename, bFILE *fp)
 {
   filename_node **parent=0,*p=fn_root;
@@ -63,19 +128,43 @@ spec_directory *spec_directory_cache::get_spec_directory(char const *filename, b
     p=*parent;
   }
 
-  int need_close=0;
-  if (!fp)
+  spec_directory *sd=NULL;
+
+  // Files may come from the server when connected to one
+  if (!fp && index_enabled && !net_crcs)
   {
-    fp=open_file(filename,"rb");
-    if (fp->open_failure())
+    index_record *r=find_index(filename);
+    uint32_t file_size,mtime;
+    if (r && spec_file_info(filename,&file_size,&mtime)
+        && file_size==r->file_size && mtime==r->mtime)
     {
-      delete fp;
-      return 0;
+      sd=new spec_directory();
+      sd->Parse(r->dir,r->dir_size,r->total);
+      index_hits++;
     }
-    need_close=1;
+    else
+      index_misses++;
   }
 
-  filename_node *f=new filename_node(filename,new spec_directory(fp));
+  if (!sd)
+  {
+    int need_close=0;
+    if (!fp)
+    {
+      fp=open_file(filename,"rb");
+      if (fp->open_failure())
+      {
+        delete fp;
+        return 0;
+      }
+      need_close=1;
+    }
+    sd=new spec_directory(fp);
+    if (need_close)
+      delete fp;
+  }
+
+  filename_node *f=new filename_node(filename,sd);
   f->next=fn_list;
   fn_list=f;
 
@@ -85,31 +174,169 @@ spec_directory *spec_directory_cache::get_spec_directory(char const *filename, b
   else
     fn_root=f;
 
-  if (need_close)
-    delete fp;
   return f->sd;
 }
 
 void spec_directory_cache::clear()
 {
+  filename_node *f=fn_list,*next;
+  for (; f; f=next)
+  {
+    next=f->next;
+    free(f->fn);
+    delete f->sd;
+    delete f;
+  }
+  fn_root=fn_list=0;
   size=0;
-  clear(fn_root);
-  fn_root=0;
 }
 
-void spec_directory_cache::clear(filename_node *f)
+int spec_directory_cache::load_index(char const *filename)
 {
-  if (f)
+  free_index();
+
+  bFILE *fp=open_file(filename,"rb");
+  if (fp->open_failure())
   {
-    if (f->left)
-    {
-      clear(f->left);
-      delete f->left;
-    }
-    if (f->right)
+    delete fp;
+    return 0;
+  }
+  long len=fp->file_size();
+  uint8_t *buf=(uint8_t *)malloc(Max(len,1L));
+  long got=fp->read(buf,len);
+  delete fp;
+
+  uint32_t count=0,payload=0;
+  if (got==len && len>=SPEC_INDEX_HEADER)
+  {
+    count=get_uint32(buf+12);
+    payload=get_uint32(buf+16);
+  }
+  if (got!=len || len<SPEC_INDEX_HEADER
+      || memcmp(buf,SPEC_INDEX_MAGIC,8)
+      || get_uint32(buf+8)!=SPEC_INDEX_VERSION
+      || payload!=len-SPEC_INDEX_HEADER
+      || get_uint32(buf+20)!=index_hash(buf+SPEC_INDEX_HEADER,payload))
+  {
+    free(buf);
+    return 0;
+  }
+
+  index=(index_record *)malloc(sizeof(index_record)*Max(count,1u));
+  uint8_t const *p=buf+SPEC_INDEX_HEADER,*end=buf+len;
+  for (index_total=0; index_total<(int)count; index_total++)
+  {
+    index_record *r=index+index_total;
+    if (p>=end || p+1+p[0]+14>end || p[p[0]]!=0)
+      break;
+    r->name=(char const *)p+1;
+    p+=1+p[0];
+    r->file_size=get_uint32(p);
+    r->mtime=get_uint32(p+4);
+    r->total=p[8]|(p[9]<<8);
+    r->dir_size=get_uint32(p+10);
+    r->dir=p+14;
+    p+=14+r->dir_size;
+    if (p>end || spec_directory::ParseSize(r->dir,r->dir_size,r->total)!=r->dir_size)
+      break;
+  }
+
+  if (index_total!=(int)count)
+  {
+    free(buf);
+    free(index);
+    index=NULL;
+    index_total=0;
+    return 0;
+  }
+  index_data=buf;
+  return 1;
+}
+
+int spec_directory_cache::compare_nodes(void const *a, void const *b)
+{
+  return strcmp((*(filename_node * const *)a)->fn,(*(filename_node * const *)b)->fn);
+}
+
+int spec_directory_cache::save_index(char const *filename)
+{
+  int count=0;
+  size_t len=SPEC_INDEX_HEADER;
+  filename_node *f;
+  for (f=fn_list; f; f=f->next)
+  {
+    count++;
+    len+=1+strlen(f->fn)+1+14;
+    for (int i=0; i<f->sd->total; i++)
+      len+=2+strlen(f->sd->entries[i]->name)+1+9;
+  }
+
+  // Sorted by file name so that lookups can bisect
+  filename_node **nodes=(filename_node **)malloc(sizeof(filename_node *)*Max(count,1));
+  int n=0;
+  for (f=fn_list; f; f=f->next)
+    nodes[n++]=f;
+  qsort(nodes,count,sizeof(filename_node *),compare_nodes);
+
+  uint8_t *buf=(uint8_t *)malloc(len),*p=buf+SPEC_INDEX_HEADER;
+  int written=0;
+  for (int k=0; k<count; k++)
+  {
+    f=nodes[k];
+    uint32_t file_size,mtime;
+    size_t name_len=strlen(f->fn)+1;
+    if (name_len>255 || !spec_file_info(f->fn,&file_size,&mtime))
+      continue;
+
+    *p++=name_len;
+    memcpy(p,f->fn,name_len);
+    p+=name_len;
+    p=put_uint32(p,file_size);
+    p=put_uint32(p,mtime);
+    *p++=f->sd->total&0xff;
+    *p++=f->sd->total>>8;
+    uint8_t *dir_size=p;
+    p+=4;
+
+    uint8_t *dir=p;
+    for (int i=0; i<f->sd->total; i++)
     {
-      clear(f->right);
-      delete f->right;
+      spec_entry *se=f->sd->entries[i];
+      size_t l=strlen(se->name)+1;
+      *p++=se->type;
+      *p++=l;
+      memcpy(p,se->name,l);
+      p+=l;
+      *p++=0; // flags
+      p=put_uint32(p,se->size);
+      p=put_uint32(p,se->offset);
     }
+    put_uint32(dir_size,p-dir);
+    written++;
   }
+  free(nodes);
+
+  size_t payload=p-buf-SPEC_INDEX_HEADER;
+  memcpy(buf,SPEC_INDEX_MAGIC,8);
+  put_uint32(buf+8,SPEC_INDEX_VERSION);
+  put_uint32(buf+12,written);
+  put_uint32(buf+16,payload);
+  put_uint32(buf+20,index_hash(buf+SPEC_INDEX_HEADER,payload));
+
+  int ret=0;
+  bFILE *fp=open_file(filename,"wb");
+  if (!fp->open_failure())
+    ret=fp->write(buf,p-buf)==p-buf;
+  delete fp;
+  free(buf);
+  return ret;
+}
+
+void spec_directory_cache::free_index()
+{
+  free(index_data);
+  free(index);
+  index_data=NULL;
+  index=NULL;
+  index_total=0;
 }
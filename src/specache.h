@@ -15,6 +15,16 @@
 
 #include <string.h>
 
+/*  Spec directories of the files the cache reads from.
+ *
+ *  The directories read at startup are saved in an index file, which is
+ *  read back in one go on the next startup. A directory is taken from the
+ *  index instead of its file when the file still has the same size and
+ *  modification time. The index starts with a 24 byte header: a magic
+ *  string, a version number, the record count, the size of the records
+ *  and a hash of them. It is ignored if any of these is wrong.
+ */
+
 class spec_directory_cache
 {
   class filename_node
@@ -32,15 +42,37 @@ class spec_directory_cache
     }
     long size;
   } *fn_root,*fn_list;
-  void clear(filename_node *f); // private recursive member
   long size;
+
+  struct index_record
+  {
+    char const *name;
+    uint32_t file_size, mtime;
+    int total;
+    uint8_t const *dir;
+    uint32_t dir_size;
+  };
+  uint8_t *index_data;
+  index_record *index;
+  int index_total;
+  index_record *find_index(char const *filename);
+  static int compare_nodes(void const *a, void const *b);
+
   public :
   spec_directory *get_spec_directory(char const *filename, bFILE *fp=NULL);
-  spec_directory_cache() { fn_root=0; size=0; }
+  spec_directory_cache();
   void clear();                             // frees up all allocated memory
   void load(bFILE *fp);
   void save(bFILE *fp);
-  ~spec_directory_cache() { clear(); }
+
+  // Returns 0 if there is no valid index in the file
+  int load_index(char const *filename);
+  int save_index(char const *filename);
+  void free_index();
+  int index_enabled;
+  int index_hits, index_misses;             // directories taken from it or not
+
+  ~spec_directory_cache() { clear(); free_index(); }
 } ;
 
 extern spec_directory_cache sd_cache;
@@ -0,0 +1,161 @@
+/*
+ *  Abuse - dark 2D side-scrolling platform game
+ *  Copyright (c) 1995 Crack dot Com
+ *  Copyright (c) 2005-2011 Sam Hocevar <sam@hocevar.net>
+ *
+ *  This software was released into the Public Domain. As with most public
+ *  domain software, no warranty is made or implied by Crack dot Com, by
+ *  Jonathan Clark, or by Sam Hocevar.
+ */
+
+#if defined HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#if defined __SSE2__
+#   include <emmintrin.h>
+#elif defined __ARM_NEON__ || defined __ARM_NEON
+#   include <arm_neon.h>
+#endif
+
+#include "common.h"
+
+#include "tilecache.h"
+
+int TileCache::Enabled = 1;
+int TileCache::Generation = 0;
+
+// Never a tile number, so that every slot is drawn after Begin() clears
+static uint16_t const INVALID = 0xfffe;
+
+static inline int wrap(int x, int n)
+{
+    x %= n;
+    return x < 0 ? x + n : x;
+}
+
+// Copies the non-zero bytes of src over dst
+static void put_transparent(uint8_t *dst, uint8_t const *src, int count)
+{
+#if defined __SSE2__
+    __m128i const zero = _mm_setzero_si128();
+    for (; count >= 16; count -= 16, dst += 16, src += 16)
+    {
+        __m128i s = _mm_loadu_si128((__m128i const *)src);
+        __m128i d = _mm_loadu_si128((__m128i const *)dst);
+        __m128i keep = _mm_cmpeq_epi8(s, zero);
+        _mm_storeu_si128((__m128i *)dst, _mm_or_si128(_mm_and_si128(keep, d),
+                                                      _mm_andnot_si128(keep, s)));
+    }
+#elif defined __ARM_NEON__ || defined __ARM_NEON
+    for (; count >= 16; count -= 16, dst += 16, src += 16)
+    {
+        uint8x16_t s = vld1q_u8(src);
+        uint8x16_t keep = vceqq_u8(s, vdupq_n_u8(0));
+        vst1q_u8(dst, vbslq_u8(keep, vld1q_u8(dst), s));
+    }
+#endif
+    for (; count > 0; count--, dst++, src++)
+        if (*src)
+            *dst = *src;
+}
+
+TileCache::TileCache(int transparent)
+{
+    m_transparent = transparent;
+    m_generation = Generation;
+    m_tile_size = m_count = ivec2(0);
+    m_im = NULL;
+    m_tiles = NULL;
+}
+
+TileCache::~TileCache()
+{
+    delete m_im;
+    free(m_tiles);
+}
+
+void TileCache::Begin(ivec2 tile_size, ivec2 count)
+{
+    if (m_im && tile_size == m_tile_size && count == m_count
+         && m_generation == Generation)
+        return;
+
+    delete m_im;
+    free(m_tiles);
+
+    m_tile_size = tile_size;
+    m_count = Max(count, ivec2(1));
+    m_generation = Generation;
+    m_im = new image(m_tile_size * m_count);
+    m_tiles = (uint16_t *)malloc(sizeof(uint16_t) * m_count.x * m_count.y);
+    for (int i = 0; i < m_count.x * m_count.y; i++)
+        m_tiles[i] = INVALID;
+}
+
+image *TileCache::Slot(ivec2 pos, int tile, ivec2 &at)
+{
+    ivec2 slot(wrap(pos.x, m_count.x), wrap(pos.y, m_count.y));
+    uint16_t &drawn = m_tiles[slot.y * m_count.x + slot.x];
+
+    if (drawn == tile)
+        return NULL;
+    drawn = tile;
+
+    at = slot * m_tile_size;
+    m_im->SetClip(at, at + m_tile_size);
+    m_im->Lock();
+    for (int y = 0; y < m_tile_size.y; y++)
+        memset(m_im->scan_line(at.y + y) + at.x, 0, m_tile_size.x);
+    m_im->Unlock();
+
+    return m_im;
+}
+
+void TileCache::Put(image *screen, ivec2 first, ivec2 last, ivec2 origin)
+{
+    if (!m_im)
+        return;
+
+    ivec2 caa, cbb;
+    screen->GetClip(caa, cbb);
+
+    // Screen area covered by the tiles, and where it starts in the cache
+    last = Min(last, first + m_count - ivec2(1));
+    ivec2 aa = Max(origin, caa);
+    ivec2 bb = Min(origin + (last - first + ivec2(1)) * m_tile_size, cbb);
+    if (!(aa < bb))
+        return;
+
+    ivec2 size = m_tile_size * m_count;
+    ivec2 src = first * m_tile_size + aa - origin;
+    src = ivec2(wrap(src.x, size.x), wrap(src.y, size.y));
+
+    // The part before the cache wraps around horizontally, then the rest
+    int w1 = Min(bb.x - aa.x, size.x - src.x), w2 = bb.x - aa.x - w1;
+
+    screen->Lock();
+    m_im->Lock();
+    for (int y = aa.y, sy = src.y; y < bb.y; y++, sy = (sy + 1) % size.y)
+    {
+        uint8_t *dst = screen->scan_line(y) + aa.x;
+        uint8_t *s1 = m_im->scan_line(sy) + src.x;
+        uint8_t *s2 = m_im->scan_line(sy);
+
+        if (m_transparent)
+        {
+            put_transparent(dst, s1, w1);
+            put_transparent(dst + w1, s2, w2);
+        }
+        else
+        {
+            memcpy(dst, s1, w1);
+            memcpy(dst + w1, s2, w2);
+        }
+    }
+    m_im->Unlock();
+    screen->Unlock();
+}
+
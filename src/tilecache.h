@@ -0,0 +1,66 @@
+/*
+ *  Abuse - dark 2D side-scrolling platform game
+ *  Copyright (c) 1995 Crack dot Com
+ *  Copyright (c) 2005-2011 Sam Hocevar <sam@hocevar.net>
+ *
+ *  This software was released into the Public Domain. As with most public
+ *  domain software, no warranty is made or implied by Crack dot Com, by
+ *  Jonathan Clark, or by Sam Hocevar.
+ */
+
+#ifndef __TILECACHE_H__
+#define __TILECACHE_H__
+
+#include "image.h"
+
+/*  Tile layer cache.
+ *
+ *  draw_map() keeps one of these per view for the background layer and one
+ *  for the foreground layer. Each holds the tiles currently in view in an
+ *  image, at their tile coordinates modulo its size in tiles. When the view
+ *  scrolls, the tiles that stay in view stay where they are: only the ones
+ *  coming into view are drawn, and the image is copied to the screen in up
+ *  to four pieces where it wraps around.
+ *
+ *  Every slot remembers the tile number drawn in it and draw_map() hands
+ *  the tile numbers of the map to Slot() every frame, so a tile changed by
+ *  Game::PutFg(), PutBg(), Lisp or the animation code is redrawn on the
+ *  next frame. Generation must be bumped when tile images are reloaded.
+ *
+ *  In a transparent cache, colour 0 is left out when copying to the screen,
+ *  like the transparent pixels of a TransImage.
+ */
+
+class TileCache
+{
+public:
+    TileCache(int transparent);
+    ~TileCache();
+
+    // Tile number for slots where nothing is drawn
+    enum { EMPTY = 0xffff };
+
+    // Starts a frame showing at most count tiles of the given size. The
+    // cache is emptied if these or Generation changed.
+    void Begin(ivec2 tile_size, ivec2 count);
+
+    // Returns NULL if tile is already drawn for map position pos, or the
+    // cleared image to draw it in, clipped to its slot at position at
+    image *Slot(ivec2 pos, int tile, ivec2 &at);
+
+    // Copies tiles first to last, the first of which goes at origin on
+    // screen, within the screen's clip rectangle
+    void Put(image *screen, ivec2 first, ivec2 last, ivec2 origin);
+
+    static int Enabled;
+    static int Generation;
+
+private:
+    int m_transparent, m_generation;
+    ivec2 m_tile_size, m_count;
+    image *m_im;
+    uint16_t *m_tiles;
+};
+
+#endif // __TILECACHE_H__
+
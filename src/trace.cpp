@@ -0,0 +1,301 @@
+/*
+ *  Abuse - dark 2D side-scrolling platform game
+ *  Copyright (c) 1995 Crack dot Com
+ *  Copyright (c) 2005-2011 Sam Hocevar <sam@hocevar.net>
+ *
+ *  This software was released into the Public Domain. As with most public
+ *  domain software, no warranty is made or implied by Crack dot Com, by
+ *  Jonathan Clark, or by Sam Hocevar.
+ */
+
+#if defined HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined __linux__
+#   include <time.h>
+#elif defined __APPLE__
+#   include <sys/time.h>
+#elif defined _WIN32
+#   define WIN32_LEAN_AND_MEAN
+#   include <windows.h>
+#else
+#   include <SDL.h>
+#endif
+
+#include "common.h"
+
+#include "trace.h"
+#include "objects.h"
+
+FrameTrace frame_trace;
+
+static char const *scope_names[TRACE_SCOPES] =
+{
+    "tick", "collisions", "draw_map", "light_screen", "update_window_done",
+    "lisp_eval", "lisp_gc", "step", "draw", "present", "present_wait"
+};
+
+FrameTrace::FrameTrace()
+{
+    m_active = 0;
+    m_frames = NULL;
+    m_type_ms = m_current_type_ms = NULL;
+    m_size = m_types = m_total = 0;
+    m_origin = 0;
+}
+
+FrameTrace::~FrameTrace()
+{
+    Stop();
+}
+
+int64_t FrameTrace::Now()
+{
+#if defined __linux__
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#elif defined __APPLE__
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000000000 + (int64_t)tv.tv_usec * 1000;
+#elif defined _WIN32
+    static double ns_per_count = 0.0;
+    LARGE_INTEGER t;
+    if (ns_per_count == 0.0)
+    {
+        QueryPerformanceFrequency(&t);
+        ns_per_count = 1e9 / t.QuadPart;
+    }
+    QueryPerformanceCounter(&t);
+    return (int64_t)(t.QuadPart * ns_per_count);
+#else
+    return (int64_t)SDL_GetTicks() * 1000000;
+#endif
+}
+
+void FrameTrace::Start(int frames, int types)
+{
+    Stop();
+
+    m_size = Max(frames, 1);
+    m_types = Max(types, 0);
+    m_frames = (Frame *)malloc(sizeof(Frame) * m_size);
+    m_type_ms = (float *)calloc((size_t)m_size * m_types + 1, sizeof(float));
+    m_current_type_ms = (float *)calloc(m_types + 1, sizeof(float));
+    m_total = 0;
+
+    for (int i = 0; i < TRACE_SCOPES; i++)
+        m_depth[i] = 0;
+    m_origin = Now();
+
+    memset(&m_current, 0, sizeof(m_current));
+    for (int i = 0; i < TRACE_SCOPES; i++)
+        m_current.first[i] = -1;
+
+    m_active = 1;
+}
+
+void FrameTrace::Stop()
+{
+    m_active = 0;
+    free(m_frames);
+    free(m_type_ms);
+    free(m_current_type_ms);
+    m_frames = NULL;
+    m_type_ms = m_current_type_ms = NULL;
+    m_size = m_types = m_total = 0;
+}
+
+void FrameTrace::NextFrame()
+{
+    if (!m_active)
+        return;
+
+    int64_t now = Now() - m_origin;
+    int slot = m_total % m_size;
+
+    m_current.length = now - m_current.start;
+    m_frames[slot] = m_current;
+    memcpy(m_type_ms + (size_t)slot * m_types, m_current_type_ms,
+           sizeof(float) * m_types);
+    m_total++;
+
+    memset(&m_current, 0, sizeof(m_current));
+    for (int i = 0; i < TRACE_SCOPES; i++)
+        m_current.first[i] = -1;
+    m_current.start = now;
+    memset(m_current_type_ms, 0, sizeof(float) * m_types);
+}
+
+void FrameTrace::Add(int scope, int64_t enter, int64_t leave)
+{
+    if (m_current.first[scope] < 0)
+        m_current.first[scope] = enter - m_origin;
+    m_current.time[scope] += leave - enter;
+    m_current.calls[scope]++;
+}
+
+void FrameTrace::AddTypeTime(int type, float ms)
+{
+    if (m_active && type >= 0 && type < m_types)
+        m_current_type_ms[type] += ms;
+}
+
+int FrameTrace::Dump(char const *filename)
+{
+    if (!m_active || !m_total)
+        return 0;
+
+    FILE *fp = fopen(filename, "w");
+    if (!fp)
+    {
+        fprintf(stderr, "trace: unable to write %s\n", filename);
+        return 0;
+    }
+
+    size_t len = strlen(filename);
+    int ret = len > 4 && !strcasecmp(filename + len - 4, ".csv")
+            ? DumpCsv(fp) : DumpJson(fp);
+    fclose(fp);
+
+    int first = Max(m_total - m_size, 0), worst = first;
+    for (int i = first; i < m_total; i++)
+        if (m_frames[i % m_size].length > m_frames[worst % m_size].length)
+            worst = i;
+    printf("trace: %d frames written to %s, slowest frame %d took %.2f ms\n",
+           m_total - first, filename, worst,
+           1e-6 * m_frames[worst % m_size].length);
+
+    return ret;
+}
+
+struct TypeTotal
+{
+    int type;
+    float ms;
+};
+
+static int type_total_sorter(void const *a, void const *b)
+{
+    float ma = ((TypeTotal const *)a)->ms, mb = ((TypeTotal const *)b)->ms;
+    return ma < mb ? 1 : ma > mb ? -1 : 0;
+}
+
+int FrameTrace::DumpCsv(FILE *fp)
+{
+    int first = Max(m_total - m_size, 0);
+
+    fprintf(fp, "frame,start_ms,frame_ms");
+    for (int s = 0; s < TRACE_SCOPES; s++)
+        fprintf(fp, ",%s_ms,%s_calls", scope_names[s], scope_names[s]);
+    fprintf(fp, "\n");
+
+    for (int i = first; i < m_total; i++)
+    {
+        Frame *f = m_frames + i % m_size;
+        fprintf(fp, "%d,%.3f,%.3f", i, 1e-6 * f->start, 1e-6 * f->length);
+        for (int s = 0; s < TRACE_SCOPES; s++)
+            fprintf(fp, ",%.3f,%d", 1e-6 * f->time[s], f->calls[s]);
+        fprintf(fp, "\n");
+    }
+
+    // Second table: object types by Lisp time over the recorded frames
+    TypeTotal *totals = (TypeTotal *)malloc(sizeof(TypeTotal) * (m_types + 1));
+    for (int t = 0; t < m_types; t++)
+    {
+        totals[t].type = t;
+        totals[t].ms = 0.0f;
+        for (int i = first; i < m_total; i++)
+            totals[t].ms += m_type_ms[(size_t)(i % m_size) * m_types + t];
+    }
+    qsort(totals, m_types, sizeof(TypeTotal), type_total_sorter);
+
+    fprintf(fp, "\ntype,total_ms\n");
+    for (int t = 0; t < m_types && totals[t].ms > 0.0f; t++)
+        fprintf(fp, "%s,%.3f\n", object_names[totals[t].type], totals[t].ms);
+    free(totals);
+
+    return !ferror(fp);
+}
+
+static void write_json_string(FILE *fp, char const *s)
+{
+    fputc('"', fp);
+    for (; *s; s++)
+    {
+        if (*s == '"' || *s == '\\')
+            fputc('\\', fp);
+        if ((unsigned char)*s >= ' ')
+            fputc(*s, fp);
+    }
+    fputc('"', fp);
+}
+
+int FrameTrace::DumpJson(FILE *fp)
+{
+    int first = Max(m_total - m_size, 0);
+
+    // One row for the frames and one per scope, so that the per frame
+    // totals of nested scopes never overlap
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(fp, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,"
+                "\"args\":{\"name\":\"frame\"}}");
+    for (int s = 0; s < TRACE_SCOPES; s++)
+        fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                    "\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                s + 1, scope_names[s]);
+
+    // Counters keep their last value until they are given a new one, so
+    // every type that shows up at all is written for every frame
+    uint8_t *used = (uint8_t *)calloc(m_types + 1, 1);
+    for (int i = first; i < m_total; i++)
+        for (int t = 0; t < m_types; t++)
+            if (m_type_ms[(size_t)(i % m_size) * m_types + t] > 0.0f)
+                used[t] = 1;
+
+    for (int i = first; i < m_total; i++)
+    {
+        Frame *f = m_frames + i % m_size;
+        fprintf(fp, ",\n{\"name\":\"frame\",\"ph\":\"X\",\"pid\":1,\"tid\":0,"
+                    "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"frame\":%d}}",
+                1e-3 * f->start, 1e-3 * f->length, i);
+
+        for (int s = 0; s < TRACE_SCOPES; s++)
+            if (f->calls[s])
+                fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,"
+                            "\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+                            "\"args\":{\"calls\":%d}}",
+                        scope_names[s], s + 1, 1e-3 * f->first[s],
+                        1e-3 * f->time[s], f->calls[s]);
+
+        float *type_ms = m_type_ms + (size_t)(i % m_size) * m_types;
+        int any = 0;
+        for (int t = 0; t < m_types; t++)
+        {
+            if (!used[t])
+                continue;
+            if (!any)
+                fprintf(fp, ",\n{\"name\":\"lisp ms by type\",\"ph\":\"C\","
+                            "\"pid\":1,\"ts\":%.3f,\"args\":{",
+                        1e-3 * f->start);
+            else
+                fputc(',', fp);
+            write_json_string(fp, object_names[t]);
+            fprintf(fp, ":%.3f", type_ms[t]);
+            any = 1;
+        }
+        if (any)
+            fprintf(fp, "}}");
+    }
+    fprintf(fp, "\n]}\n");
+    free(used);
+
+    return !ferror(fp);
+}
+
@@ -0,0 +1,131 @@
+/*
+ *  Abuse - dark 2D side-scrolling platform game
+ *  Copyright (c) 1995 Crack dot Com
+ *  Copyright (c) 2005-2011 Sam Hocevar <sam@hocevar.net>
+ *
+ *  This software was released into the Public Domain. As with most public
+ *  domain software, no warranty is made or implied by Crack dot Com, by
+ *  Jonathan Clark, or by Sam Hocevar.
+ */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+/*  Frame trace.
+ *
+ *  When started (-trace <file>), the main loop marks the start of every
+ *  frame and TraceScope objects placed around the expensive phases add up
+ *  the time spent in them. Nested or recursive entries into a scope are
+ *  only counted once, from the outermost entry, so Lisp eval can be timed
+ *  from every eval entry point. The time objects spend in their Lisp
+ *  functions is also added up per object type, through profile_add_time().
+ *
+ *  The last frames are kept in a ring buffer and written at exit, as CSV if
+ *  the file name ends in .csv and as Chrome trace event JSON otherwise
+ *  (load it in chrome://tracing). When not started, a TraceScope costs one
+ *  test.
+ */
+
+enum
+{
+    TRACE_TICK,
+    TRACE_COLLIDE,
+    TRACE_DRAW_MAP,
+    TRACE_LIGHT,
+    TRACE_UPDATE,
+    TRACE_EVAL,
+    TRACE_GC,
+    TRACE_STEP,
+    TRACE_DRAW,
+    TRACE_PRESENT,      // on the present thread, see sdlport/video.cpp
+    TRACE_PRESENT_WAIT,
+
+    TRACE_SCOPES
+};
+
+#define TRACE_DEFAULT_FRAMES 1000
+
+class FrameTrace
+{
+public:
+    FrameTrace();
+    ~FrameTrace();
+
+    void Start(int frames, int types);
+    void Stop();
+    int Active() { return m_active; }
+
+    void NextFrame();
+
+    void Enter(int scope)
+    {
+        if (m_depth[scope]++ == 0)
+            m_enter[scope] = Now();
+    }
+    void Leave(int scope)
+    {
+        if (--m_depth[scope] == 0)
+            Add(scope, m_enter[scope], Now());
+    }
+    void AddTypeTime(int type, float ms);
+    // Adds time spent in a scope on another thread, timed with Now()
+    void Record(int scope, int64_t enter, int64_t leave)
+    {
+        if (m_active)
+            Add(scope, enter, leave);
+    }
+
+    static int64_t Now();
+
+    // Returns 0 if the file could not be written
+    int Dump(char const *filename);
+
+private:
+    struct Frame
+    {
+        int64_t start, length;           // in nanoseconds since Start()
+        int64_t first[TRACE_SCOPES];     // first entry into each scope
+        int64_t time[TRACE_SCOPES];      // total time spent in each scope
+        int32_t calls[TRACE_SCOPES];     // outermost entries into each scope
+    };
+
+    void Add(int scope, int64_t enter, int64_t leave);
+    int DumpCsv(FILE *fp);
+    int DumpJson(FILE *fp);
+
+    int m_active;
+    int m_depth[TRACE_SCOPES];
+    int64_t m_enter[TRACE_SCOPES];
+    int64_t m_origin;
+
+    Frame *m_frames;
+    float *m_type_ms;                    // m_size * m_types, by frame
+    int m_size, m_types;
+    int m_total;                         // frames recorded so far
+    Frame m_current;
+    float *m_current_type_ms;
+};
+
+extern FrameTrace frame_trace;
+
+class TraceScope
+{
+public:
+    TraceScope(int scope)
+    {
+        m_scope = frame_trace.Active() ? scope : -1;
+        if (m_scope >= 0)
+            frame_trace.Enter(m_scope);
+    }
+    ~TraceScope()
+    {
+        if (m_scope >= 0)
+            frame_trace.Leave(m_scope);
+    }
+
+private:
+    int m_scope;
+};
+
+#endif // __TRACE_H__
+
@@ -33,6 +33,7 @@
 #include "sbar.h"
 #include "nfserver.h"
 #include "chat.h"
+#include "tilecache.h"
 
 extern int get_key_binding( char const *dir, int i );
 view *player_list=NULL;
@@ -48,6 +49,9 @@ view::~view()
         free(weapons);
         free(last_weapons);
     }
+
+    delete m_bg_cache;
+    delete m_fg_cache;
 }
 
 
@@ -216,6 +220,7 @@ view::view(game_object *focus, view *Next, int number)
     m_aa = ivec2(0);
     m_bb = ivec2(100);
     m_focus = focus;
+    m_bg_cache = m_fg_cache = NULL;
   next=Next;
     m_shift = ivec2(SHIFT_RIGHT_DEFAULT, SHIFT_DOWN_DEFAULT);
   x_suggestion=0;
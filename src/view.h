@@ -31,6 +31,7 @@ struct suggest_struct
 
 
 class view;
+class TileCache;
 
 
 class view
@@ -131,6 +132,9 @@ public:
 
     game_object *m_focus; // object we are focusing on (player)
 
+    // Background and foreground tiles drawn by draw_map()
+    TileCache *m_bg_cache, *m_fg_cache;
+
 private:
     uint8_t m_keymap[512 / 8];
     char m_chat_buf[60];